@@ -40,10 +40,37 @@
 
 
 #include <fstream>
+#include <algorithm>
 
 // #include "wx/html/htmlpars.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
 #include <stdio.h> // for vsscanf
 #include <stdarg.h>
+#include <errno.h>
+
+#include "wx/file.h"
+#include "wx/thread.h"
+#include "wx/stopwatch.h"
+#include "wx/fontenum.h"
+
+#if defined(__UNIX__)
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define MUNK_HAVE_MMAP 1
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MUNK_USE_SSE2 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
 
 
 
@@ -79,6 +106,90 @@ std::string getMunkAttribute(const MunkAttributeMap& attrs, const std::string& k
 }
 
 
+MunkAttributeMap::MunkAttributeMap(const MunkAttributeMap& other)
+	: m_slots(other.begin(), other.end()),
+	  m_nCount(other.m_nCount)
+{
+}
+
+
+MunkAttributeMap& MunkAttributeMap::operator=(const MunkAttributeMap& other)
+{
+	if (this != &other) {
+		clear();
+		const_iterator ci = other.begin();
+		while (ci != other.end()) {
+			newSlot(ci->first).second = ci->second;
+			++ci;
+		}
+	}
+	return *this;
+}
+
+
+MunkAttributeMap::const_iterator MunkAttributeMap::find(const std::string& key) const
+{
+	for (size_t i = 0; i < m_nCount; ++i) {
+		if (m_slots[i].first == key) {
+			return &m_slots[i];
+		}
+	}
+	return end();
+}
+
+
+MunkAttributeMap::const_iterator MunkAttributeMap::findNoCase(const char *key) const
+{
+	for (size_t i = 0; i < m_nCount; ++i) {
+		const std::string& name = m_slots[i].first;
+		size_t j = 0;
+		for (; j < name.length(); ++j) {
+			if (key[j] == '\0'
+			    || tolower((unsigned char) name[j]) != tolower((unsigned char) key[j])) {
+				break;
+			}
+		}
+		if (j == name.length() && key[j] == '\0') {
+			return &m_slots[i];
+		}
+	}
+	return end();
+}
+
+
+void MunkAttributeMap::insert(const std::string& key, const std::string& value)
+{
+	if (find(key) == end()) {
+		newSlot(key).second = value;
+	}
+}
+
+
+std::string& MunkAttributeMap::operator[](const std::string& key)
+{
+	for (size_t i = 0; i < m_nCount; ++i) {
+		if (m_slots[i].first == key) {
+			return m_slots[i].second;
+		}
+	}
+	value_type& slot = newSlot(key);
+	slot.second.erase();
+	return slot.second;
+}
+
+
+MunkAttributeMap::value_type& MunkAttributeMap::newSlot(const std::string& key)
+{
+	if (m_nCount == m_slots.size()) {
+		m_slots.push_back(value_type());
+	}
+	value_type& slot = m_slots[m_nCount++];
+	// Assigning into a recycled slot reuses its buffer.
+	slot.first = key;
+	return slot;
+}
+
+
 /** Split a string into a list of strings, based on a string of
  * characters to split on.
  *
@@ -250,6 +361,116 @@ bool IsNewLine(wxChar c)
 }
 
 
+static void munk_push_text_token(MunkTextTokenVector& tokens, size_t nStart, size_t nEnd, bool bLineBreakAfter)
+{
+	MunkTextToken token;
+	token.m_nStart = nStart;
+	token.m_nLength = nEnd - nStart;
+	token.m_bLineBreakAfter = bLineBreakAfter;
+	tokens.push_back(token);
+}
+
+void munk_normalize_white_space(const char *pUTF8, size_t nLength, eWhiteSpaceKind kind, bool bStripLeading, std::string& text, MunkTextTokenVector& tokens)
+{
+	text.erase();
+	tokens.clear();
+
+	bool bByLines = kind == kWSKPre || kind == kWSKPreWrap || kind == kWSKPreLine;
+	bool bCollapse = kind == kWSKNormal || kind == kWSKNowrap || kind == kWSKPreLine;
+	bool bNewlineIsSpace = kind == kWSKNormal || kind == kWSKNowrap;
+
+	// Spaces in 'pre' and 'pre-wrap' ought to be non-breaking,
+	// but MunkHtmlWordCell does not break inside a word anyway,
+	// so we keep them as they are.
+
+	size_t nTokenStart = 0;
+	bool bLineOpen = false;    // By lines: something since the last newline
+	bool bTokenIsWhite = false; // Otherwise: the kind of the current token
+	char last = '\0';
+	const char *p = pUTF8;
+	const char *end = pUTF8 + nLength;
+	while (p != end) {
+		char c = *p++;
+		if (bCollapse) {
+			// 1. Each tab, carriage return, or space
+			//    surrounding a linefeed is removed.
+			if (c == '\n'
+			    || ((c == '\t' || c == '\r' || c == ' ')
+				&& p != end && *p == '\n')) {
+				if (c != '\n') {
+					++p;
+				}
+				if (p != end && (*p == '\t' || *p == '\r' || *p == ' ')) {
+					++p;
+				}
+				c = '\n';
+			}
+
+			// 2. For 'normal' and 'nowrap', a linefeed
+			//    becomes a space (we never use a zero
+			//    width space or nothing).
+			if (c == '\n' && bNewlineIsSpace) {
+				c = ' ';
+			}
+
+			// 3. Every tab becomes a space, and any space
+			//    following another space is removed.
+			if (c == '\t') {
+				c = ' ';
+			}
+			if (c == ' ' && last == ' ') {
+				continue;
+			}
+			last = c;
+		}
+
+		if (bByLines) {
+			if (c == '\n') {
+				if (kind == kWSKPreLine) {
+					while (text.length() > nTokenStart && text[text.length() - 1] == ' ') {
+						text.erase(text.length() - 1);
+					}
+				}
+				munk_push_text_token(tokens, nTokenStart, text.length(), true);
+				nTokenStart = text.length();
+				bLineOpen = false;
+			} else {
+				bLineOpen = true;
+				// 'pre-line' trims the spaces at both
+				// ends of each line.
+				if (kind != kWSKPreLine || c != ' ' || text.length() > nTokenStart) {
+					text += c;
+				}
+			}
+		} else {
+			bool bIsWhite = c == ' ' || c == '\n' || c == '\t' || c == '\r';
+			if (bIsWhite && bStripLeading && text.empty()) {
+				continue;
+			}
+			if (bIsWhite != bTokenIsWhite && text.length() > nTokenStart) {
+				munk_push_text_token(tokens, nTokenStart, text.length(), false);
+				nTokenStart = text.length();
+			}
+			bTokenIsWhite = bIsWhite;
+			text += c;
+		}
+	}
+
+	if (bByLines) {
+		if (bLineOpen) {
+			if (kind == kWSKPreLine) {
+				while (text.length() > nTokenStart && text[text.length() - 1] == ' ') {
+					text.erase(text.length() - 1);
+				}
+			}
+			munk_push_text_token(tokens, nTokenStart, text.length(), false);
+		}
+	} else if (text.length() > nTokenStart) {
+		munk_push_text_token(tokens, nTokenStart, text.length(), false);
+	}
+}
+
+
 
 
 
@@ -288,6 +509,20 @@ long munk_string2long(const std::string& str)
 }
 
 
+// Bitmaps, widgets and shared fonts belong to the GUI thread.  A parse
+// without a DC may run on another thread (see
+// MunkHtmlParsingStructure::PrepareDeferredMetrics()), and then puts
+// off making them until the cells are drawn or the page is shown.
+static bool munk_is_gui_thread()
+{
+#if wxUSE_THREADS
+	return wxThread::IsMain();
+#else
+	return true;
+#endif
+}
+
+
 /** Check whether a string is a hexadecimal string.
  *
  * This just checks whether the string only contains [0-9A-Fa-f].
@@ -524,6 +759,139 @@ bool munk_string2charset(const std::string& input, eMunkCharsets& charset)
 
 const std::string MunkQDParser::NOTAG = "<>";
 
+
+#ifdef MUNK_USE_SSE2
+static inline int munk_ctz16(int mask)
+{
+#if defined(__GNUC__)
+	return __builtin_ctz((unsigned int) mask);
+#elif defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, (unsigned long) mask);
+	return (int) index;
+#else
+	int n = 0;
+	while ((mask & 1) == 0) {
+		mask >>= 1;
+		++n;
+	}
+	return n;
+#endif
+}
+
+static inline int munk_popcount16(int mask)
+{
+	int n = 0;
+	while (mask) {
+		mask &= mask - 1;
+		++n;
+	}
+	return n;
+}
+#endif
+
+
+/** Find the first of c1, c2, or c3 in [p, end).  If
+ * bStopAtControl is true, also stop at any byte below 0x20 (which
+ * covers \t, \n, and \r).
+ *
+ * @return A pointer to the byte found, or end if there was none.
+ */
+static const char *munk_scan_until(const char *p, const char *end, char c1, char c2, char c3, bool bStopAtControl)
+{
+#ifdef MUNK_USE_SSE2
+	const __m128i v1 = _mm_set1_epi8(c1);
+	const __m128i v2 = _mm_set1_epi8(c2);
+	const __m128i v3 = _mm_set1_epi8(c3);
+	const __m128i vControl = _mm_set1_epi8(0x1f);
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*) p);
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, v1),
+						      _mm_cmpeq_epi8(chunk, v2)),
+					 _mm_cmpeq_epi8(chunk, v3));
+		if (bStopAtControl) {
+			// Unsigned chunk <= 0x1f iff max(chunk, 0x1f) == 0x1f
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(chunk, vControl), vControl));
+		}
+		int mask = _mm_movemask_epi8(m);
+		if (mask != 0) {
+			return p + munk_ctz16(mask);
+		}
+		p += 16;
+	}
+#endif
+	while (p != end) {
+		char c = *p;
+		if (c == c1 || c == c2 || c == c3
+		    || (bStopAtControl && ((unsigned char) c) < 0x20)) {
+			return p;
+		}
+		++p;
+	}
+	return end;
+}
+
+
+/** Count the '\n' bytes in [p, end).
+ */
+static long munk_count_newlines(const char *p, const char *end)
+{
+	long count = 0;
+#ifdef MUNK_USE_SSE2
+	const __m128i vNewline = _mm_set1_epi8('\n');
+	while (end - p >= 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i*) p);
+		count += munk_popcount16(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, vNewline)));
+		p += 16;
+	}
+#endif
+	while (p != end) {
+		if (*p == '\n') {
+			++count;
+		}
+		++p;
+	}
+	return count;
+}
+
+
+/** Append to dest the run of bytes starting at cur which contains
+ * none of c1, c2, c3 (nor any control character if bStopAtControl
+ * is true), and move cur past it.  Line and column are updated as
+ * getNextChar() would have done.
+ *
+ * '\r' must always be among the stop characters (or be covered by
+ * bStopAtControl), since it needs getNextChar()'s translation.
+ */
+void MunkQDParser::appendSpan(std::string& dest, char c1, char c2, char c3, bool bStopAtControl)
+{
+	if (m_end_of_line) {
+		// Let getNextChar() deal with a possible \n after \r.
+		return;
+	}
+	const char *start = cur;
+	const char *stop = munk_scan_until(start, lim, c1, c2, c3, bStopAtControl);
+	if (stop == start) {
+		return;
+	}
+	dest.append(start, stop - start);
+
+	long newlines = bStopAtControl ? 0 : munk_count_newlines(start, stop);
+	if (newlines == 0) {
+		m_column += (int) (stop - start);
+	} else {
+		m_line += (int) newlines;
+		const char *last_newline = stop - 1;
+		while (*last_newline != '\n') {
+			--last_newline;
+		}
+		m_column = (int) (stop - (last_newline + 1));
+	}
+
+	cur = const_cast<char*>(stop);
+}
+
+
 std::string MunkQDParser::state2string(eMunkQDStates e)
 {
 	if (e == TEXT) {
@@ -576,14 +944,155 @@ void MunkQDParser::parse(MunkQDDocHandler *pDH, std::istream *pStream)
 	bot = tok = ptr = cur = pos = lim = top = eof = 0;
 	m_pInStream = pStream;
 	m_pDH = pDH;
+	doParse();
+}
+
+void MunkQDParser::parse(MunkQDDocHandler *pDH, const char *pBuffer, size_t nLength)
+{
+	bot = tok = ptr = cur = pos = lim = top = eof = 0;
+
+	// We only ever read through cur, so it is safe to
+	// point it straight at the caller's (const) bytes.
+	cur = const_cast<char*>(pBuffer);
+	lim = cur + nLength;
+	eof = lim;
+	m_pInStream = 0;
+	m_pDH = pDH;
+	doParse();
+}
+
+void MunkQDParser::parseSegment(MunkQDDocHandler *pDH, const char *pBuffer, size_t nLength, bool bFirst, bool bLast, int nTagDepth, eMunkCharsets encoding, int nLine)
+{
+	bot = tok = ptr = cur = pos = lim = top = eof = 0;
+	cur = const_cast<char*>(pBuffer);
+	lim = cur + nLength;
+	eof = lim;
+	m_pInStream = 0;
+	m_pDH = pDH;
+
+	if (bFirst) {
+		beginParse();
+	} else {
+		// Pick up where the previous segment left off: Between
+		// two elements, collecting text.
+		m_bDone = false;
+		m_tag_depth = nTagDepth;
+		m_state = TEXT;
+		while (!m_stack.empty()) {
+			m_stack.pop();
+		}
+		m_encoding = encoding;
+		m_tag_name = NOTAG;
+		m_text = "";
+		m_line = nLine;
+		m_column = 0;
+		m_end_of_line = false;
+	}
+
+	tokenize();
+
+	if (bLast) {
+		endParse();
+	} else {
+		if (m_bDone
+		    || m_state != TEXT
+		    || !m_stack.empty()
+		    || m_tag_depth != nTagDepth) {
+			except("Segment does not end between two elements");
+		}
+		// The text would otherwise be emitted at the '<' which
+		// starts the next segment.
+		if (m_text.length() > 0) {
+			m_pDH->text(m_text);
+			m_text = "";
+		}
+		eraseAttributes();
+		cleanUp();
+	}
+}
+
+void MunkQDParser::doParse(void)
+{
+	beginParse();
+	tokenize();
+	endParse();
+}
+
+void MunkQDParser::beginPush(MunkQDDocHandler *pDH)
+{
+	bot = tok = ptr = cur = pos = lim = top = eof = 0;
+	m_pInStream = 0;
+	m_pDH = pDH;
+	m_push_buffer = "";
+	beginParse();
+}
+
+void MunkQDParser::push(const char *pData, size_t nLength)
+{
+	// Keep only what has not been consumed yet, and add the new
+	// chunk after it.
+	if (cur != 0) {
+		m_push_buffer.erase(0, cur - m_push_buffer.data());
+	}
+	m_push_buffer.append(pData, nLength);
+	cur = const_cast<char*>(m_push_buffer.data());
+	lim = cur + m_push_buffer.length();
+	eof = lim;
+
+	// The XML declaration is tokenized with look-ahead, so we
+	// wait until all of it has arrived.
+	if (m_state == BEFORE_XMLDECLARATION
+	    && m_push_buffer.find("?>") == std::string::npos) {
+		return;
+	}
+
+	tokenize();
+}
+
+void MunkQDParser::endPush(void)
+{
+	tokenize();
+	endParse();
+	m_push_buffer = "";
+}
+
+void MunkQDParser::beginParse(void)
+{
+	m_bDone = false;
 	m_tag_depth = 0;
-	eMunkQDStates state = BEFORE_XMLDECLARATION;
+	m_state = BEFORE_XMLDECLARATION;
+	while (!m_stack.empty()) {
+		m_stack.pop();
+	}
 	m_encoding = kMCSUTF8; // This is the default for XML
 	m_tag_name = NOTAG;
+	m_text = "";
 	m_line = 1;
 	m_column = 0;
 	m_pDH->startDocument();
 	m_end_of_line = false;
+}
+
+void MunkQDParser::endParse(void)
+{
+	if (!m_bDone) {
+		except("missing end tag");
+	}
+	eraseAttributes();
+	cleanUp();
+}
+
+// Runs the state machine over all the input which is available
+// right now.  All state lives in members, so when pushing, this
+// simply picks up where the previous chunk left off.
+void MunkQDParser::tokenize(void)
+{
+	if (m_bDone) {
+		return;
+	}
+
+	m_bEndOfInput = false;
+	eMunkQDStates state = m_state;
 
 	char c = getNextChar();
 
@@ -606,6 +1115,7 @@ void MunkQDParser::parse(MunkQDDocHandler *pDH, std::istream *pStream)
 				m_tag_name = "";
 			} else {
 				m_text += c;
+				appendSpan(m_text, '<', '&', '\r', false);
 			}
 		} else if (state == BEFORE_XMLDECLARATION) {
 			if (c == '<') {
@@ -699,10 +1209,11 @@ void MunkQDParser::parse(MunkQDDocHandler *pDH, std::istream *pStream)
 				state = ENTITY;
 				m_entity = "";
 			} else if (c == m_quote_char) {
-				m_attributes.insert(MunkAttributeMap::value_type(m_lvalue, m_rvalue));
+				m_attributes.insert(m_lvalue, m_rvalue);
 				state = popState();
 			} else {
 				m_rvalue += c;
+				appendSpan(m_rvalue, m_quote_char, '&', '&', true);
 			}
 		} else if (state == ENTITY) {
 			if (c == ';') {
@@ -761,15 +1272,14 @@ void MunkQDParser::parse(MunkQDDocHandler *pDH, std::istream *pStream)
 				state = IN_TAG;
 			} else {
 				m_tag_name += c;
+				// The state to return to was pushed when we
+				// saw the '<'.
 				if (c == '-' && m_tag_name == "!--") {
-					pushState(TEXT);
 					state = COMMENT;
 				} else if (c == '[' && m_tag_name == "![CDATA[") {
 					m_text = "";
-					pushState(TEXT);
 					state = CDATA;
 				} else if (c == 'E' && m_tag_name == "!DOCTYPE") {
-					pushState(TEXT);
 					state = DOCTYPE;
 					m_text = "";
 					m_tag_name = "";
@@ -788,6 +1298,7 @@ void MunkQDParser::parse(MunkQDDocHandler *pDH, std::istream *pStream)
 				}
 			} else {
 				m_text += c;
+				appendSpan(m_text, '>', '\r', '\r', false);
 			}
 		} else if (state == CDATA) {
 			if (c == '>') {
@@ -850,26 +1361,24 @@ void MunkQDParser::parse(MunkQDDocHandler *pDH, std::istream *pStream)
 					eraseAttributes();
 				}
 			}
-		} else if (state == DONE) {
+		} else {
+			except(std::string("Error: Unknown state: ") + state2string(state));
+		}
+
+		if (state == DONE) {
+			// Anything after the root element is ignored.
+			m_state = state;
+			m_bDone = true;
 			eraseAttributes();
 			m_pDH->endDocument();
-			cleanUp();
 			return;
-		} else {
-			except(std::string("Error: Unknown state: ") + state2string(state));
 		}
 
 		// Read next char
 		c = getNextChar();	
 	}
-	
-	if (state == DONE) {
-		m_pDH->endDocument();
-	} else {
-		except("missing end tag");
-	}
-	eraseAttributes();
-	cleanUp();
+
+	m_state = state;
 }
 	
 void MunkQDParser::except(const std::string& s)
@@ -948,7 +1457,15 @@ void MunkQDParser::handle_entity(eMunkQDStates state)
 char MunkQDParser::getNextChar(void)
 {
 	char c;
-	if ((lim - cur) < 1) fillBuffer();
+	if (cur == lim) {
+		if (m_pInStream != 0) {
+			fillBuffer();
+		}
+		if (cur == lim) {
+			m_bEndOfInput = true;
+			return '\0';
+		}
+	}
 	c = *cur;
 	++cur;
 	if (c == '\r') {
@@ -961,9 +1478,13 @@ char MunkQDParser::getNextChar(void)
 		// \r returned \n, since we need to translate
 		// all of \r\n, \r, and \n to \n 
 		// (see Section 2.11 of the XML spec)
-		// So now we return the next character
-		m_pInStream->get(c);
+		// So now we return the next character.
+		//
+		// NOTE: This must come from the buffer, not from
+		// m_pInStream, or we would skip ahead of what has
+		// been buffered (and crash when parsing a span).
 		m_end_of_line = false;
+		return getNextChar();
 	} else if (c == '\n') {
 		m_column = 0;
 		++m_line;
@@ -981,21 +1502,15 @@ void MunkQDParser::fillBuffer()
 {
         if(!eof)
         {
+		// Everything before cur has already been consumed,
+		// so we only need to keep the unread tail.  This
+		// keeps the buffer at about BSIZE, rather than
+		// growing to the size of the document.
+		tok = cur;
                 unsigned int cnt = tok - bot;
-		/*
-		std::cerr << "UP205: "
-			  << " cnt = " << cnt 
-			  << " tok = " << (void*) tok
-			  << " bot = " << (void*) bot 
-			  << " cur = " << (void*) cur
-			  << " eof = " << (void*) eof 
-			  << " ptr = " << (void*) ptr
-			  << " lim = " << (void*) lim
-			  << std::endl;
-		*/
                 if(cnt)
                 {
-                        memcpy(bot, tok, lim - tok);
+                        memmove(bot, tok, lim - tok);
                         tok = bot;
                         ptr -= cnt;
                         cur -= cnt;
@@ -1018,7 +1533,7 @@ void MunkQDParser::fillBuffer()
                 m_pInStream->read(lim, BSIZE);
                 if ((cnt = m_pInStream->gcount()) != BSIZE )
                 {
-                        eof = &lim[cnt]; *eof++ = '\0';
+                        eof = &lim[cnt];
                 }
                 lim += cnt;
         }
@@ -1027,6 +1542,10 @@ void MunkQDParser::fillBuffer()
 MunkQDParser::MunkQDParser()
 {
 	bot = tok = ptr = cur = pos = lim = top = eof = 0;
+	m_pInStream = 0;
+	m_bEndOfInput = false;
+	m_bDone = false;
+	m_state = BEFORE_XMLDECLARATION;
 }
 
 MunkQDParser::~MunkQDParser()
@@ -1036,344 +1555,1495 @@ MunkQDParser::~MunkQDParser()
 
 
 
+///////////////////////////////////////////////////////////////
+//
+// MunkQDEventRecorder, MunkQDEventReplayer
+//
+///////////////////////////////////////////////////////////////
 
+static const char MUNK_COMPILED_PAGE_MAGIC[8] = { 'M', 'U', 'N', 'K', 'Q', 'D', 'E', 'V' };
 
+enum eMunkCompiledPageOpcodes {
+	kCPString = 1,       // varint length, bytes: next string table entry
+	kCPStartElement = 2, // tag index, attribute count, (name index, value)*
+	kCPEndElement = 3,   // tag index
+	kCPText = 4,         // varint length, bytes
+	kCPComment = 5,      // varint length, bytes
+	kCPEndDocument = 6   // must be the last opcode
+};
 
 
-MunkHtmlParsingStructure::MunkHtmlParsingStructure(MunkHtmlWindow *pParent)
+wxUint64 munk_hash_bytes(const char *pData, size_t nLength)
 {
-	m_pParentMunkHtmlWindow = pParent;
-	m_Cell = 0;
-	m_pFS = 0;
-	m_pDC = 0;
-	m_pForms = 0;
-	m_nMagnification = pParent->GetMagnification();
+	wxUint64 hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < nLength; ++i) {
+		hash ^= (unsigned char) pData[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
 }
 
 
-MunkHtmlParsingStructure::~MunkHtmlParsingStructure()
+static void munk_put_le(std::string& dest, wxUint64 value, int nBytes)
 {
-	clear();
+	for (int i = 0; i < nBytes; ++i) {
+		dest += (char) (value & 0xFF);
+		value >>= 8;
+	}
 }
 
-void MunkHtmlParsingStructure::clear()
-{
-	delete m_Cell;
-	m_Cell = 0;
-	delete m_pForms;
-	m_pForms = 0;
 
-	// Clear the m_HTML_font_map
-	String2PFontMap::iterator it 
-		= m_HTML_font_map.begin();
-	while (it != m_HTML_font_map.end()) {
-		delete it->second;
-		++it;
+static wxUint64 munk_get_le(const char *p, int nBytes)
+{
+	wxUint64 value = 0;
+	for (int i = nBytes - 1; i >= 0; --i) {
+		value = (value << 8) | (unsigned char) p[i];
 	}
-	m_HTML_font_map.clear();
+	return value;
+}
 
 
-	// Clear the m_MunkStringMetricsCacheCache
-	clearMunkStringMetricsCacheCache();
+MunkQDEventRecorder::MunkQDEventRecorder(MunkQDDocHandler *pForward)
+	: m_pForward(pForward),
+	  m_bComplete(false)
+{
 }
 
-void MunkHtmlParsingStructure::clearMunkStringMetricsCacheCache()
+
+MunkQDEventRecorder::~MunkQDEventRecorder()
 {
-	CharacteristicString2MunkStringMetricsCacheMap::iterator it = m_MunkStringMetricsCacheCache.begin();
-	CharacteristicString2MunkStringMetricsCacheMap::iterator itend = m_MunkStringMetricsCacheCache.end();
-	while (it != itend) {
-		delete it->second;
-		++it;
-	}
-	m_MunkStringMetricsCacheCache.clear();
 }
 
 
-wxFont *MunkHtmlParsingStructure::getFontFromMunkHTMLFontAttributes(const MunkHTMLFontAttributes& font_attributes, bool bUseCacheMap, const std::string& characteristic_string)
+void MunkQDEventRecorder::putVarint(unsigned long value)
 {
-	wxFont *pResult = 0;
-
-	if (bUseCacheMap) {
-		String2PFontMap::iterator it = m_HTML_font_map.find(characteristic_string);
-		if (it != m_HTML_font_map.end()) {
-			pResult = it->second;
-		}
+	while (value >= 0x80) {
+		m_payload += (char) ((value & 0x7F) | 0x80);
+		value >>= 7;
 	}
+	m_payload += (char) value;
+}
 
-	if (pResult == 0) {
-		int nPointSize = ((int)(((m_nMagnification * DEFAULT_FONT_SIZE * font_attributes.m_sizeFactor)))) / 10000;
-		/*
-		int nFontStyle = (font_attributes.m_bItalic) ? wxFONTSTYLE_ITALIC : wxFONTSTYLE_NORMAL;
-
-		wxFontWeight fontWeight = (font_attributes.m_bBold) ? wxFONTWEIGHT_BOLD : wxFONTWEIGHT_NORMAL;
-		
-		wxFont *pNewFont = new wxFont(nPointSize,
-					      wxFONTFAMILY_ROMAN,
-					      nFontStyle,
-					      fontWeight,
-					      false,
-					      wxT("Arial"),
-					      wxFONTENCODING_DEFAULT);
-		*/
 
-		wxFontInfo fontInfo(nPointSize);
+void MunkQDEventRecorder::putBytes(const std::string& str)
+{
+	putVarint(str.length());
+	m_payload += str;
+}
 
-		/*
-		int nFontFlags = 0;
-		if (font_attributes.m_bItalic) {
 
-			nFontFlags |= wxFONTFLAG_ITALIC;
-		}
-		if (font_attributes.m_bBold) {
-			nFontFlags |= wxFONTFLAG_BOLD;
-		}
-		nFontFlags |= wxFONTFLAG_ANTIALIASED;
+void MunkQDEventRecorder::internString(const std::string& str)
+{
+	if (m_string_indexes.find(str) == m_string_indexes.end()) {
+		putOpcode(kCPString);
+		putBytes(str);
+		m_string_indexes.insert(String2IndexMap::value_type(str, m_string_indexes.size()));
+	}
+}
 
-		wxFont *pNewFont = wxFont::New(nPointSize,
-					       wxFONTFAMILY_ROMAN,
-					       nFontFlags,
-					       font_attributes.m_face,
-					       wxFONTENCODING_DEFAULT);
-		*/
-		if (font_attributes.m_bItalic) {
-			fontInfo.Italic(true);
-		}
-		if (font_attributes.m_bBold) {
-			fontInfo.Bold(true);
-		}
-		fontInfo.FaceName(font_attributes.m_face);
 
-		wxFont *pNewFont = new wxFont(fontInfo);
+void MunkQDEventRecorder::putStringRef(const std::string& str)
+{
+	String2IndexMap::const_iterator ci = m_string_indexes.find(str);
+	MUNK_ASSERT_THROW(ci != m_string_indexes.end(),
+			  "MunkQDEventRecorder::putStringRef: string was not interned.");
+	putVarint(ci->second);
+}
 
 
-		if (bUseCacheMap) {
-			m_HTML_font_map.insert(std::make_pair(characteristic_string, pNewFont));
-		}
+void MunkQDEventRecorder::startElement(const std::string& tag, const MunkAttributeMap& attrs)
+{
+	// Intern the names first, since their definitions must
+	// precede the opcode which refers to them.
+	internString(tag);
+	MunkAttributeMap::const_iterator ci;
+	for (ci = attrs.begin(); ci != attrs.end(); ++ci) {
+		internString(ci->first);
+	}
 
-		pResult = pNewFont;
+	putOpcode(kCPStartElement);
+	putStringRef(tag);
+	putVarint(attrs.size());
+	for (ci = attrs.begin(); ci != attrs.end(); ++ci) {
+		putStringRef(ci->first);
+		putBytes(ci->second);
 	}
 
-	return pResult;
+	if (m_pForward != 0) {
+		m_pForward->startElement(tag, attrs);
+	}
 }
 
 
-MunkStringMetricsCache *MunkHtmlParsingStructure::getMunkStringMetricsCache(const std::string& font_characteristic_string)
+void MunkQDEventRecorder::endElement(const std::string& tag)
 {
-	CharacteristicString2MunkStringMetricsCacheMap::iterator it = m_MunkStringMetricsCacheCache.find(font_characteristic_string);
-	if (it == m_MunkStringMetricsCacheCache.end()) {
-		MunkStringMetricsCache *pNewCache = new MunkStringMetricsCache();
-		m_MunkStringMetricsCacheCache.insert(std::make_pair(font_characteristic_string, pNewCache));
-		return pNewCache;
-	} else {
-		return it->second;
+	// When recording a segment, the start tag may have been
+	// recorded elsewhere.
+	internString(tag);
+	putOpcode(kCPEndElement);
+	putStringRef(tag);
+
+	if (m_pForward != 0) {
+		m_pForward->endElement(tag);
 	}
 }
 
 
-void MunkHtmlParsingStructure::SetHTMLBackgroundColour(const wxColour& bgcol)
+void MunkQDEventRecorder::startDocument(void)
 {
-	m_backgroundColour = bgcol;
+	m_string_indexes.clear();
+	m_payload.erase();
+	m_bComplete = false;
+
+	if (m_pForward != 0) {
+		m_pForward->startDocument();
+	}
 }
 
 
-wxColour MunkHtmlParsingStructure::GetHTMLBackgroundColour() const
+void MunkQDEventRecorder::endDocument(void)
 {
-	return m_backgroundColour;
-	
-}
+	putOpcode(kCPEndDocument);
+	m_bComplete = true;
 
-MunkHtmlFormContainer *MunkHtmlParsingStructure::TakeOverForms()
-{
-	MunkHtmlFormContainer *pResult = m_pForms;
-	m_pForms = 0;
-	return pResult;
+	if (m_pForward != 0) {
+		m_pForward->endDocument();
+	}
 }
 
 
-bool MunkHtmlParsingStructure::Parse(const wxString& text, int nMagnification, std::string& error_message)
+void MunkQDEventRecorder::text(const std::string& str)
 {
-	bool bResult = true;
-	error_message = "";
-	ChangeMagnification(nMagnification);
-	try {
-	    
-		std::istringstream istr(std::string((const char*)text.mb_str(wxConvUTF8)));
+	putOpcode(kCPText);
+	putBytes(str);
 
-		MunkQDHTMLHandler dh(this);
-	    
-		MunkQDParser parser;
-		parser.parse(&dh, &istr);
-	} catch (MunkQDException e) {
-		bResult = false;
-		error_message = e.what();
-	} catch (...) {
-		bResult = false;
-		error_message = "An unknown exception occurred while parsing HTML.";
+	if (m_pForward != 0) {
+		m_pForward->text(str);
 	}
-	return bResult;
 }
 
 
-void MunkHtmlParsingStructure::ChangeMagnification(int nNewMagnification)
+void MunkQDEventRecorder::comment(const std::string& str)
 {
-	if (m_nMagnification == nNewMagnification) {
-		// Nothing to do
-	} else {
-		m_nMagnification = nNewMagnification;
-		
-		m_FontSpaceCache.clear();
+	putOpcode(kCPComment);
+	putBytes(str);
 
-		clearMunkStringMetricsCacheCache();
-		
-		// magnification is a percentage
-		//int pointSize = (int) ((DEFAULT_FONT_SIZE * magnification) / 100);
-		
-		// now round size to a multiple of 10
-		//pointSize = ((pointSize + 5) / 10) * 10;
-		
-		String2PFontMap::iterator it 
-			= m_HTML_font_map.begin();
-		while (it != m_HTML_font_map.end()) {
-			std::string characteristic_string = it->first;
-			MunkHTMLFontAttributes font_attr = MunkHTMLFontAttributes::fromString(characteristic_string);
-			wxFont *pNewFont = getFontFromMunkHTMLFontAttributes(font_attr,
-									     false, // Use cache? No: We are going to replace it...
-									     ""); 
-			delete it->second;
-			it->second = pNewFont;
-			++it;
-		}
+	if (m_pForward != 0) {
+		m_pForward->comment(str);
 	}
 }
 
 
-
-//////////////////////////////////////////////////////////////////
-//
-// MunkHTMLFontAttributes
-//
-//////////////////////////////////////////////////////////////////
+std::string MunkQDEventRecorder::getCompiledPage(wxUint64 source_hash) const
+{
+	MUNK_ASSERT_THROW(m_bComplete,
+			  "MunkQDEventRecorder::getCompiledPage: the document has not ended.");
+	std::string result;
+	result.reserve(MUNK_COMPILED_PAGE_HEADER_SIZE + m_payload.length());
+	result.append(MUNK_COMPILED_PAGE_MAGIC, sizeof(MUNK_COMPILED_PAGE_MAGIC));
+	munk_put_le(result, MUNK_COMPILED_PAGE_VERSION, 4);
+	munk_put_le(result, 0, 4);
+	munk_put_le(result, source_hash, 8);
+	munk_put_le(result, munk_hash_bytes(m_payload.data(), m_payload.length()), 8);
+	result += m_payload;
+	return result;
+}
 
 
-MunkHTMLFontAttributes::MunkHTMLFontAttributes()
-	: m_bBold(false),
-	  m_bItalic(false),
-	  m_bUnderline(false),
-	  m_scriptBaseLine(0),
-	  m_scriptMode(MunkHTML_SCRIPT_NORMAL),
-	  m_sizeFactor(100),
-	  m_color(*wxBLACK)
+void MunkQDEventRecorder::compile(const char *pUTF8, size_t nLength, std::string& result)
 {
-	setFace(wxT("Arial"));
+	MunkQDEventRecorder recorder;
+	MunkQDParser parser;
+	parser.parse(&recorder, pUTF8, nLength);
+	result = recorder.getCompiledPage(munk_hash_bytes(pUTF8, nLength));
 }
 
-MunkHTMLFontAttributes::MunkHTMLFontAttributes(bool bBold, bool bItalic, bool bUnderline, long scriptBaseline, MunkHtmlScriptMode scriptMode, unsigned int sizeFactor, const wxColour& color, const wxString& face)
-	: m_bBold(bBold),
-	  m_bItalic(bItalic),
-	  m_bUnderline(bUnderline),
-	  m_scriptBaseLine(scriptBaseline),
-	  m_scriptMode(scriptMode),
-	  m_sizeFactor(sizeFactor),
-	  m_color(color)
+
+bool MunkQDEventReplayer::getSourceHash(const char *pData, size_t nLength, wxUint64& source_hash)
 {
-	setFace(face);
+	if (nLength < MUNK_COMPILED_PAGE_HEADER_SIZE
+	    || memcmp(pData, MUNK_COMPILED_PAGE_MAGIC, sizeof(MUNK_COMPILED_PAGE_MAGIC)) != 0
+	    || munk_get_le(pData + 8, 4) != MUNK_COMPILED_PAGE_VERSION) {
+		return false;
+	}
+	source_hash = munk_get_le(pData + 16, 8);
+	return true;
 }
 
 
-MunkHTMLFontAttributes::MunkHTMLFontAttributes(const MunkHTMLFontAttributes& other)
+unsigned long MunkQDEventReplayer::getVarint()
 {
-	copy_to_self(other);
+	unsigned long value = 0;
+	int shift = 0;
+	while (true) {
+		if (m_pCur == m_pEnd || shift >= (int) (sizeof(unsigned long) * 8)) {
+			throw MunkQDException("Compiled page is damaged: bad number.");
+		}
+		unsigned char c = (unsigned char) *m_pCur++;
+		value |= ((unsigned long) (c & 0x7F)) << shift;
+		if ((c & 0x80) == 0) {
+			return value;
+		}
+		shift += 7;
+	}
 }
 
 
-MunkHTMLFontAttributes::~MunkHTMLFontAttributes()
+void MunkQDEventReplayer::getBytes(std::string& dest)
 {
+	unsigned long length = getVarint();
+	if (length > (unsigned long) (m_pEnd - m_pCur)) {
+		throw MunkQDException("Compiled page is damaged: string runs past the end.");
+	}
+	dest.assign(m_pCur, length);
+	m_pCur += length;
 }
 
-MunkHTMLFontAttributes MunkHTMLFontAttributes::fromString(const std::string& s)
+
+const std::string& MunkQDEventReplayer::getStringRef()
 {
-	bool bBold = false;
-	if (s[0] == 'B') {
-		bBold = true;
+	unsigned long index = getVarint();
+	if (index >= m_strings.size()) {
+		throw MunkQDException("Compiled page is damaged: bad string index.");
 	}
+	return m_strings[index];
+}
 
-	bool bItalic = false;
-	if (s[1] == 'I') {
-		bItalic = true;
-	}
 
-	bool bUnderline = false;
-	if (s[2] == 'U') {
-		bUnderline = true;
+void MunkQDEventReplayer::replay(MunkQDDocHandler *pDH, const char *pData, size_t nLength)
+{
+	wxUint64 source_hash;
+	if (!getSourceHash(pData, nLength, source_hash)) {
+		throw MunkQDException("Not a compiled page, or compiled by a different version.");
 	}
-
-	MunkHtmlScriptMode scriptMode = MunkHTML_SCRIPT_NORMAL;
-	switch (s[3]) {
-	case 'N':
-		scriptMode = MunkHTML_SCRIPT_NORMAL;
-		break;
-	case 'B':
-		scriptMode = MunkHTML_SCRIPT_SUB;
-		break;
-	case 'P':
-		scriptMode = MunkHTML_SCRIPT_SUP;
-		break;
+	const char *pPayload = pData + MUNK_COMPILED_PAGE_HEADER_SIZE;
+	size_t nPayloadLength = nLength - MUNK_COMPILED_PAGE_HEADER_SIZE;
+	if (munk_hash_bytes(pPayload, nPayloadLength) != munk_get_le(pData + 24, 8)) {
+		throw MunkQDException("Compiled page is damaged: content hash does not match.");
 	}
 
-	std::string number;
-	std::string::size_type index = 4;
-	while (s[index] != '|') {
-		number += s[index];
-		++index;
+	pDH->startDocument();
+	if (!replayEvents(pDH, pPayload, nPayloadLength)) {
+		throw MunkQDException("Compiled page is damaged: it ends before the document does.");
 	}
+}
 
-	long scriptBaseLine = munk_string2long(number);
 
-	number = "";
-	++index; // Skip '|'
+bool MunkQDEventReplayer::replayEvents(MunkQDDocHandler *pDH, const char *pData, size_t nLength)
+{
+	m_pCur = pData;
+	m_pEnd = pData + nLength;
 
-	while (s[index] != '#') {
-		number += s[index];
-		++index;
+	m_strings.clear();
+	while (m_pCur != m_pEnd) {
+		char opcode = *m_pCur++;
+		switch (opcode) {
+		case kCPString:
+			m_strings.push_back(std::string());
+			getBytes(m_strings.back());
+			break;
+		case kCPStartElement: {
+			const std::string& tag = getStringRef();
+			unsigned long nAttributes = getVarint();
+			m_attributes.clear();
+			for (unsigned long i = 0; i < nAttributes; ++i) {
+				const std::string& name = getStringRef();
+				getBytes(m_text);
+				m_attributes.insert(name, m_text);
+			}
+			pDH->startElement(tag, m_attributes);
+			break;
+		}
+		case kCPEndElement:
+			pDH->endElement(getStringRef());
+			break;
+		case kCPText:
+			getBytes(m_text);
+			pDH->text(m_text);
+			break;
+		case kCPComment:
+			getBytes(m_text);
+			pDH->comment(m_text);
+			break;
+		case kCPEndDocument:
+			if (m_pCur != m_pEnd) {
+				throw MunkQDException("Compiled page is damaged: data after the end of the document.");
+			}
+			pDH->endDocument();
+			return true;
+		default:
+			throw MunkQDException("Compiled page is damaged: unknown opcode.");
+		}
 	}
+	return false;
+}
 
-	long sizeFactor = munk_string2long(number);
 
-	++index; // Skip '#'
 
-	std::string face_name = s.substr(index, std::string::npos);
-	wxString strFace = wxString(face_name.c_str(), wxConvUTF8);
+///////////////////////////////////////////////////////////////
+//
+// Segmenting documents for parallel parsing
+//
+///////////////////////////////////////////////////////////////
 
-	MunkHTMLFontAttributes attr(bBold, bItalic, bUnderline, scriptBaseLine, scriptMode, sizeFactor, *wxBLACK, strFace);
+static const char *munk_find_string(const char *p, const char *end, const char *str)
+{
+	size_t len = strlen(str);
+	while (p + len <= end) {
+		p = (const char*) memchr(p, str[0], (end - p) - len + 1);
+		if (p == 0) {
+			return 0;
+		} else if (memcmp(p, str, len) == 0) {
+			return p;
+		}
+		++p;
+	}
+	return 0;
+}
+
+// Finds the places where a document can be cut into segments for
+// MunkQDParser::parseSegment(): The first boundary is just after
+// the <body> start tag, the rest are just before a start tag which
+// is a child of <body>, roughly evenly spaced.  This is only a
+// quick scan, not a parse; it gives up (returning false) on
+// anything it does not fully understand, and the parser checks
+// that each segment really does end where it should.
+static bool munk_find_segment_boundaries(const char *pData, size_t nLength, size_t nSegments, std::vector<size_t>& boundaries, int& nBodyDepth)
+{
+	const char *p = pData;
+	const char *end = pData + nLength;
+	const char *pNextTarget = 0;
+	size_t nStep = 0;
+	int depth = 0;
+	nBodyDepth = -1;
+	boundaries.clear();
+
+	while (true) {
+		p = (const char*) memchr(p, '<', end - p);
+		if (p == 0) {
+			return false; // Unterminated <body>
+		}
+		const char *pTag = p;
+		if (end - p >= 4 && memcmp(p, "<!--", 4) == 0) {
+			p = munk_find_string(p + 4, end, "-->");
+			if (p == 0) {
+				return false;
+			}
+			p += 3;
+		} else if (end - p >= 9 && memcmp(p, "<![CDATA[", 9) == 0) {
+			p = munk_find_string(p + 9, end, "]]>");
+			if (p == 0) {
+				return false;
+			}
+			p += 3;
+		} else if (end - p >= 2 && p[1] == '!') {
+			// DOCTYPE; MunkQDParser has its own ideas about
+			// where that ends, so we leave it alone.
+			return false;
+		} else if (end - p >= 2 && p[1] == '?') {
+			// XML declaration
+			if (depth > 0) {
+				return false;
+			}
+			p = munk_find_string(p + 2, end, "?>");
+			if (p == 0) {
+				return false;
+			}
+			p += 2;
+		} else if (end - p >= 2 && p[1] == '/') {
+			p = (const char*) memchr(p, '>', end - p);
+			if (p == 0) {
+				return false;
+			}
+			++p;
+			--depth;
+			if (depth < nBodyDepth) {
+				// </body>
+				break;
+			}
+		} else {
+			// Start tag or empty-element tag
+			const char *pName = p + 1;
+			++p;
+			while (p != end && *p != '>' && *p != '/' && *p != ' '
+			       && *p != '\t' && *p != '\n' && *p != '\r') {
+				++p;
+			}
+			size_t nNameLength = p - pName;
+			char quote = 0;
+			while (p != end) {
+				if (quote != 0) {
+					if (*p == quote) {
+						quote = 0;
+					}
+				} else if (*p == '"' || *p == '\'') {
+					quote = *p;
+				} else if (*p == '>') {
+					break;
+				}
+				++p;
+			}
+			if (p == end) {
+				return false;
+			}
+			bool bEmpty = p[-1] == '/';
+			++p;
+
+			if (nBodyDepth >= 0
+			    && depth == nBodyDepth
+			    && pTag >= pNextTarget) {
+				boundaries.push_back(pTag - pData);
+				if (boundaries.size() == nSegments) {
+					break;
+				}
+				pNextTarget = pTag + nStep;
+			}
 
-	return attr;
+			if (!bEmpty) {
+				++depth;
+				if (nBodyDepth < 0
+				    && nNameLength == 4
+				    && memcmp(pName, "body", 4) == 0) {
+					nBodyDepth = depth;
+					boundaries.push_back(p - pData);
+					nStep = (end - p) / nSegments;
+					pNextTarget = p + nStep;
+				}
+			}
+		}
+	}
+
+	// We need the head and at least two segments of the body.
+	return boundaries.size() >= 2;
 }
 
-void MunkHTMLFontAttributes::setFace(const wxString& face)
+
+
+///////////////////////////////////////////////////////////////
+//
+// MunkHtmlPageBuffer
+//
+///////////////////////////////////////////////////////////////
+
+MunkHtmlPageBuffer::MunkHtmlPageBuffer()
+	: m_pMapped(0),
+	  m_nMappedLength(0),
+	  m_nMappedFD(-1)
 {
-	m_face = face;
-	m_stdstring_face = (const char*) m_face.ToUTF8();
 }
 
+MunkHtmlPageBuffer::~MunkHtmlPageBuffer()
+{
+	Clear();
+}
 
-std::string MunkHTMLFontAttributes::toString() const
+void MunkHtmlPageBuffer::Clear()
 {
-	std::string result = "---.";
-	if (m_bBold) {
-		result[0] = 'B';
-	} 
+#ifdef MUNK_HAVE_MMAP
+	if (m_pMapped != 0) {
+		munmap((void*) m_pMapped, m_nMappedLength);
+	}
+	if (m_nMappedFD != -1) {
+		close(m_nMappedFD);
+	}
+#endif
+	m_pMapped = 0;
+	m_nMappedLength = 0;
+	m_nMappedFD = -1;
 
-	if (m_bItalic) {
-		result[1] = 'I';
-	} 
+	// Make sure we actually give the memory back.
+	std::string empty;
+	m_strOwned.swap(empty);
+}
 
-	if (m_bUnderline) {
-		result[2] = 'U';
-	} 
+void MunkHtmlPageBuffer::Assign(const char *pData, size_t nLength)
+{
+	// pData may point into our own bytes
+	std::string strNew(pData, nLength);
+	Clear();
+	m_strOwned.swap(strNew);
+}
 
-	switch (m_scriptMode) {
-	case MunkHTML_SCRIPT_NORMAL:
-		result[3] = 'N';
+void MunkHtmlPageBuffer::Assign(const wxString& source)
+{
+	Clear();
+	const wxCharBuffer buf(source.mb_str(wxConvUTF8));
+	if (buf.data() != 0) {
+		m_strOwned.assign(buf.data());
+	}
+}
+
+void MunkHtmlPageBuffer::Append(const char *pData, size_t nLength)
+{
+	if (m_pMapped != 0) {
+		// We cannot grow a mapping, so we need our own copy.
+		std::string strMapped(m_pMapped, m_nMappedLength);
+		Clear();
+		m_strOwned.swap(strMapped);
+	}
+	m_strOwned.append(pData, nLength);
+}
+
+bool MunkHtmlPageBuffer::ReadFromStream(wxInputStream *s)
+{
+	Clear();
+	if (s == NULL) {
+		return false;
+	}
+
+	wxFileOffset nSize = s->GetLength();
+	if (nSize != wxInvalidOffset && nSize > 0) {
+		m_strOwned.reserve((size_t) nSize);
+	}
+
+	char buf[65536];
+	while (s->CanRead()) {
+		s->Read(buf, sizeof(buf));
+		size_t nRead = s->LastRead();
+		if (nRead == 0) {
+			break;
+		}
+		m_strOwned.append(buf, nRead);
+	}
+	return true;
+}
+
+bool MunkHtmlPageBuffer::LoadFile(const wxString& filename)
+{
+	Clear();
+
+#ifdef MUNK_HAVE_MMAP
+	// Only regular files are mapped; pipes, devices and the
+	// like are read.  We keep the descriptor, so that
+	// CheckMapping() can see whether the file has shrunk.
+	int fd = open((const char*) filename.fn_str(), O_RDONLY);
+	if (fd != -1) {
+		struct stat st;
+		if (fstat(fd, &st) == 0
+		    && S_ISREG(st.st_mode)
+		    && st.st_size > 0) {
+			void *p = mmap(0, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED) {
+				m_pMapped = (const char*) p;
+				m_nMappedLength = (size_t) st.st_size;
+				m_nMappedFD = fd;
+				return true;
+			}
+		}
+		close(fd);
+	}
+#endif
+
+	// Fall back to reading it.
+	wxFile file;
+	if (!file.Open(filename, wxFile::read)) {
+		return false;
+	}
+	wxFileOffset nLength = file.Length();
+	if (nLength == wxInvalidOffset) {
+		return false;
+	}
+	m_strOwned.resize((size_t) nLength);
+	if (nLength > 0
+	    && file.Read(&m_strOwned[0], (size_t) nLength) != (ssize_t) nLength) {
+		Clear();
+		return false;
+	}
+	return true;
+}
+
+bool MunkHtmlPageBuffer::CheckMapping()
+{
+#ifdef MUNK_HAVE_MMAP
+	if (m_pMapped == 0) {
+		return true;
+	}
+
+	struct stat st;
+	if (fstat(m_nMappedFD, &st) == 0
+	    && st.st_size >= (off_t) m_nMappedLength) {
+		return true;
+	}
+
+	// The file has shrunk, so some of our pages are gone.  Read
+	// what is in it now through the descriptor we kept.
+	int fd = m_nMappedFD;
+	m_nMappedFD = -1;
+	Clear();
+	bool bResult = false;
+	if (lseek(fd, 0, SEEK_SET) == 0) {
+		char buf[65536];
+		ssize_t nRead;
+		while ((nRead = read(fd, buf, sizeof(buf))) > 0) {
+			m_strOwned.append(buf, (size_t) nRead);
+		}
+		bResult = nRead == 0;
+	}
+	close(fd);
+	if (!bResult) {
+		Clear();
+	}
+	return bResult;
+#else
+	return true;
+#endif
+}
+
+void MunkHtmlPageBuffer::Swap(MunkHtmlPageBuffer& other)
+{
+	m_strOwned.swap(other.m_strOwned);
+	std::swap(m_pMapped, other.m_pMapped);
+	std::swap(m_nMappedLength, other.m_nMappedLength);
+	std::swap(m_nMappedFD, other.m_nMappedFD);
+}
+
+const char *MunkHtmlPageBuffer::GetData() const
+{
+	if (m_pMapped != 0) {
+		return m_pMapped;
+	} else {
+		return m_strOwned.data();
+	}
+}
+
+size_t MunkHtmlPageBuffer::GetLength() const
+{
+	if (m_pMapped != 0) {
+		return m_nMappedLength;
+	} else {
+		return m_strOwned.length();
+	}
+}
+
+wxString MunkHtmlPageBuffer::ToString() const
+{
+	return wxString(GetData(), wxConvUTF8, GetLength());
+}
+
+
+
+
+
+
+
+MunkHtmlPendingMetrics::MunkHtmlPendingMetrics()
+{
+}
+
+
+MunkHtmlPendingMetrics::~MunkHtmlPendingMetrics()
+{
+}
+
+
+void MunkHtmlPendingMetrics::Add(MunkFontKey font_key, const wxFont& font, MunkHtmlCell *pCell, const char *pUTF8, size_t nLength, bool bTrailingSpace)
+{
+	Group& group = m_Groups[font_key];
+	if (group.m_Items.empty()) {
+		group.m_Font = font;
+	}
+	group.m_Items.push_back(Item(pCell, pUTF8, nLength, bTrailingSpace));
+}
+
+
+void MunkHtmlPendingMetrics::Resolve(wxDC *pDC, int nMagnification)
+{
+	int nPPI = pDC->GetPPI().y;
+	const wxClassInfo *pDCClass = pDC->GetClassInfo();
+	MunkFontRegistry& registry = MunkFontRegistry::Get();
+	for (FontKey2GroupMap::iterator it = m_Groups.begin(); it != m_Groups.end(); ++it) {
+		MunkFontRegistryKey key(it->first, nMagnification, nPPI, pDCClass);
+		pDC->SetFont(it->second.m_Font);
+		std::vector<Item>::iterator iit = it->second.m_Items.begin();
+		for (; iit != it->second.m_Items.end(); ++iit) {
+			// Text that occurs more than once is only measured
+			// the first time.
+			wxCoord Width, Height, Descent;
+			registry.GetTextExtent(key, wxString(iit->m_pUTF8, wxConvUTF8, iit->m_nLength), pDC, &Width, &Height, &Descent);
+			if (iit->m_bTrailingSpace) {
+				((MunkHtmlWordCell*) iit->m_pCell)->SetTrailingSpaceWidth(Width);
+			} else {
+				iit->m_pCell->SetTextExtent(Width, Height, Descent);
+			}
+		}
+	}
+	Clear();
+}
+
+
+void MunkHtmlPendingMetrics::Clear()
+{
+	m_Groups.clear();
+}
+
+
+
+MunkHtmlParsingStructure::MunkHtmlParsingStructure(MunkHtmlWindow *pParent)
+{
+	m_pParentMunkHtmlWindow = pParent;
+	m_Cell = 0;
+	m_pFS = 0;
+	m_pDC = 0;
+	m_DCFontKey = MunkFONT_KEY_NONE;
+	m_nDeferredCharWidth = 0;
+	m_nDeferredCharHeight = 0;
+	m_pForms = 0;
+	m_nMagnification = pParent->GetMagnification();
+	m_pPushHandler = 0;
+	m_pPushParser = 0;
+	m_bParallelParsing = false;
+	m_bCaptureMiniDOM = true;
+}
+
+
+MunkHtmlParsingStructure::~MunkHtmlParsingStructure()
+{
+	delete AbortParse();
+	clear();
+}
+
+void MunkHtmlParsingStructure::clear()
+{
+	delete m_Cell;
+	m_Cell = 0;
+	m_PendingMetrics.Clear();
+	m_BodyState.Clear();
+	delete m_pForms;
+	m_pForms = 0;
+
+	// Clear the m_HTML_font_map
+	FontKey2PFontMap::iterator it 
+		= m_HTML_font_map.begin();
+	while (it != m_HTML_font_map.end()) {
+		delete it->second;
+		++it;
+	}
+	m_HTML_font_map.clear();
+
+
+	// Clear the m_MunkStringMetricsCacheCache
+	clearMunkStringMetricsCacheCache();
+}
+
+void MunkHtmlParsingStructure::clearMunkStringMetricsCacheCache()
+{
+	FontKey2MunkStringMetricsCacheMap::iterator it = m_MunkStringMetricsCacheCache.begin();
+	FontKey2MunkStringMetricsCacheMap::iterator itend = m_MunkStringMetricsCacheCache.end();
+	while (it != itend) {
+		delete it->second;
+		++it;
+	}
+	m_MunkStringMetricsCacheCache.clear();
+}
+
+
+wxFont *MunkHtmlParsingStructure::getFontFromMunkHTMLFontAttributes(const MunkHTMLFontAttributes& font_attributes, bool bUseCacheMap, MunkFontKey font_key)
+{
+	wxFont *pResult = 0;
+
+	if (bUseCacheMap) {
+		FontKey2PFontMap::iterator it = m_HTML_font_map.find(font_key);
+		if (it != m_HTML_font_map.end()) {
+			pResult = it->second;
+		}
+	}
+
+	if (pResult == 0) {
+		// A copy of the shared font, so that the registry may
+		// drop its own whenever it likes.
+		wxFont *pNewFont = new wxFont(MunkFontRegistry::Get().GetFont(font_attributes, font_key, m_nMagnification));
+
+		if (bUseCacheMap) {
+			m_HTML_font_map[font_key] = pNewFont;
+		}
+
+		pResult = pNewFont;
+	}
+
+	return pResult;
+}
+
+
+void MunkHtmlParsingStructure::SetDCFont(const wxFont& font, MunkFontKey font_key)
+{
+	if (m_DCFontKey != font_key) {
+		m_pDC->SetFont(font);
+		m_DCFontKey = font_key;
+	}
+}
+
+
+void MunkHtmlParsingStructure::PrepareDeferredMetrics(wxDC *pDC)
+{
+	// What MunkQDHTMLHandler::SetCharWidthHeight() would measure
+	MunkHTMLFontAttributes font_attributes = MunkQDHTMLHandler::GetDefaultFontAttributes();
+	MunkFontKey font_key = font_attributes.toKey();
+	wxFont *pFont = getFontFromMunkHTMLFontAttributes(font_attributes, true, font_key);
+	pDC->SetFont(*pFont);
+	wxCoord nWidth, nHeight;
+	pDC->GetTextExtent(wxT("A"), &nWidth, &nHeight);
+	m_nDeferredCharWidth = nWidth;
+	m_nDeferredCharHeight = nHeight;
+	if (m_FontSpaceCache.find(font_key) == m_FontSpaceCache.end()) {
+		wxCoord nDescent;
+		pDC->GetTextExtent(wxT(" "), &nWidth, &nHeight, &nDescent);
+		m_FontSpaceCache[font_key] = MunkFontStringMetrics(nWidth, nHeight, nDescent);
+	}
+	pDC->SetFont(wxNullFont);
+	if (pDC == m_pDC) {
+		m_DCFontKey = MunkFONT_KEY_NONE;
+	}
+}
+
+
+void MunkHtmlParsingStructure::GetDeferredCharSize(int *pCharWidth, int *pCharHeight) const
+{
+	wxASSERT_MSG(m_nDeferredCharHeight != 0, wxT("parsing without a DC, but PrepareDeferredMetrics() has not been called since the magnification changed"));
+	*pCharWidth = m_nDeferredCharWidth;
+	*pCharHeight = m_nDeferredCharHeight;
+}
+
+
+void MunkHtmlParsingStructure::ResolveMetrics(wxDC *pDC)
+{
+	if (!m_PendingMetrics.IsEmpty()) {
+		m_PendingMetrics.Resolve(pDC, m_nMagnification);
+		if (pDC == m_pDC) {
+			m_DCFontKey = MunkFONT_KEY_NONE;
+		}
+	}
+}
+
+
+void MunkHtmlParsingStructure::SetDC(wxDC *pDC, double pixel_scale)
+{
+	m_pDC = pDC;
+	m_dblPixel_scale = pixel_scale;
+	m_DCFontKey = MunkFONT_KEY_NONE;
+
+	// The previous DC may have been deleted, and pDC may be a new
+	// one at the same address, so the caches must ask again.
+	FontKey2MunkStringMetricsCacheMap::iterator it = m_MunkStringMetricsCacheCache.begin();
+	FontKey2MunkStringMetricsCacheMap::iterator itend = m_MunkStringMetricsCacheCache.end();
+	while (it != itend) {
+		it->second->ForgetDC();
+		++it;
+	}
+}
+
+MunkStringMetricsCache *MunkHtmlParsingStructure::getMunkStringMetricsCache(MunkFontKey font_key)
+{
+	FontKey2MunkStringMetricsCacheMap::iterator it = m_MunkStringMetricsCacheCache.find(font_key);
+	if (it == m_MunkStringMetricsCacheCache.end()) {
+		MunkStringMetricsCache *pNewCache = new MunkStringMetricsCache(font_key, m_nMagnification);
+		m_MunkStringMetricsCacheCache[font_key] = pNewCache;
+		return pNewCache;
+	} else {
+		return it->second;
+	}
+}
+
+
+void MunkHtmlParsingStructure::SetHTMLBackgroundColour(const wxColour& bgcol)
+{
+	m_backgroundColour = bgcol;
+}
+
+
+wxColour MunkHtmlParsingStructure::GetHTMLBackgroundColour() const
+{
+	return m_backgroundColour;
+	
+}
+
+MunkHtmlWindow *MunkHtmlParsingStructure::GetWidgetParent()
+{
+	if (!munk_is_gui_thread()) {
+		return NULL;
+	}
+	return m_pParentMunkHtmlWindow;
+}
+
+
+MunkHtmlFormContainer *MunkHtmlParsingStructure::TakeOverForms()
+{
+	MunkHtmlFormContainer *pResult = m_pForms;
+	m_pForms = 0;
+	return pResult;
+}
+
+
+bool MunkHtmlParsingStructure::Parse(const wxString& text, int nMagnification, std::string& error_message)
+{
+	const wxCharBuffer buf(text.mb_str(wxConvUTF8));
+	const char *pData = buf.data();
+	if (pData == 0) {
+		pData = "";
+	}
+	return Parse(pData, strlen(pData), nMagnification, error_message);
+}
+
+
+bool MunkHtmlParsingStructure::Parse(const char *pUTF8, size_t nLength, int nMagnification, std::string& error_message)
+{
+	bool bResult = true;
+	error_message = "";
+	m_PendingMetrics.Clear();
+	m_BodyState.Clear();
+	ChangeMagnification(nMagnification);
+	try {
+		MunkQDHTMLHandler dh(this);
+
+		bool bParsed = false;
+#if wxUSE_THREADS
+		if (m_bParallelParsing && nLength >= MunkHTML_PARALLEL_PARSE_MIN_SIZE) {
+			bParsed = ParseInParallel(&dh, pUTF8, nLength);
+		}
+#endif
+		if (!bParsed) {
+			MunkQDParser parser;
+			parser.parse(&dh, pUTF8, nLength);
+		}
+	} catch (MunkQDException e) {
+		bResult = false;
+		error_message = e.what();
+	} catch (...) {
+		bResult = false;
+		error_message = "An unknown exception occurred while parsing HTML.";
+	}
+	return bResult;
+}
+
+
+#if wxUSE_THREADS
+// Tokenizes one segment of a document into events.
+class MunkQDSegmentParser {
+public:
+	MunkQDSegmentParser(const char *pData, size_t nLength, bool bLast, int nTagDepth, eMunkCharsets encoding)
+		: m_pData(pData),
+		  m_nLength(nLength),
+		  m_bLast(bLast),
+		  m_nTagDepth(nTagDepth),
+		  m_encoding(encoding),
+		  m_bSucceeded(false) {};
+
+	void Process() {
+		try {
+			MunkQDParser parser;
+			// Line numbers don't matter: If anything goes
+			// wrong, the document is parsed again serially,
+			// which reports the error properly.
+			parser.parseSegment(&m_recorder, m_pData, m_nLength, false, m_bLast, m_nTagDepth, m_encoding, 1);
+			m_bSucceeded = true;
+		} catch (...) {
+			m_bSucceeded = false;
+		}
+	};
+
+	bool Succeeded() const { return m_bSucceeded; };
+	const std::string& GetPayload() const { return m_recorder.getPayload(); };
+protected:
+	const char *m_pData;
+	size_t m_nLength;
+	bool m_bLast;
+	int m_nTagDepth;
+	eMunkCharsets m_encoding;
+	bool m_bSucceeded;
+	MunkQDEventRecorder m_recorder;
+};
+
+
+class MunkQDSegmentParserThread : public wxThread {
+public:
+	MunkQDSegmentParserThread(MunkQDSegmentParser *pParser)
+		: wxThread(wxTHREAD_JOINABLE),
+		  m_pParser(pParser) {};
+protected:
+	virtual ExitCode Entry() { m_pParser->Process(); return 0; };
+
+	MunkQDSegmentParser *m_pParser;
+};
+
+
+bool MunkHtmlParsingStructure::ParseInParallel(MunkQDHTMLHandler *pDH, const char *pUTF8, size_t nLength)
+{
+	int nCPUs = wxThread::GetCPUCount();
+	if (nCPUs < 2) {
+		return false;
+	}
+
+	std::vector<size_t> boundaries;
+	int nBodyDepth;
+	if (!munk_find_segment_boundaries(pUTF8, nLength, nCPUs, boundaries, nBodyDepth)) {
+		return false;
+	}
+
+	// Everything up to and including <body> is small; we
+	// tokenize it here, since it tells us the encoding.
+	MunkQDEventRecorder head;
+	eMunkCharsets encoding;
+	try {
+		MunkQDParser parser;
+		parser.parseSegment(&head, pUTF8, boundaries[0], true, false, nBodyDepth, kMCSUTF8, 1);
+		encoding = parser.getEncoding();
+	} catch (...) {
+		return false;
+	}
+
+	std::vector<MunkQDSegmentParser*> parsers;
+	std::vector<MunkQDSegmentParserThread*> threads; // NULL where we parsed it ourselves
+	for (size_t i = 0; i < boundaries.size(); ++i) {
+		size_t nStart = boundaries[i];
+		size_t nEnd = (i + 1 < boundaries.size()) ? boundaries[i + 1] : nLength;
+		MunkQDSegmentParser *pParser = new MunkQDSegmentParser(pUTF8 + nStart, nEnd - nStart, nEnd == nLength, nBodyDepth, encoding);
+		MunkQDSegmentParserThread *pThread = new MunkQDSegmentParserThread(pParser);
+		if (pThread->Create() != wxTHREAD_NO_ERROR) {
+			delete pThread;
+			pThread = NULL;
+		} else if (pThread->Run() != wxTHREAD_NO_ERROR) {
+			// Created, so it must be stopped and joined
+			// before it is deleted; Entry() is not called.
+			pThread->Delete();
+			delete pThread;
+			pThread = NULL;
+		}
+		if (pThread == NULL) {
+			// Out of threads; do it ourselves.
+			pParser->Process();
+		}
+		parsers.push_back(pParser);
+		threads.push_back(pThread);
+	}
+
+	bool bSucceeded = true;
+	for (size_t i = 0; i < parsers.size(); ++i) {
+		if (threads[i] != NULL) {
+			threads[i]->Wait();
+			delete threads[i];
+		}
+		if (!parsers[i]->Succeeded()) {
+			bSucceeded = false;
+		}
+	}
+
+	try {
+		if (bSucceeded) {
+			MunkQDEventReplayer replayer;
+			pDH->startDocument();
+			replayer.replayEvents(pDH, head.getPayload().data(), head.getPayload().length());
+			for (size_t i = 0; i < parsers.size(); ++i) {
+				replayer.replayEvents(pDH, parsers[i]->GetPayload().data(), parsers[i]->GetPayload().length());
+			}
+		}
+	} catch (...) {
+		for (size_t i = 0; i < parsers.size(); ++i) {
+			delete parsers[i];
+		}
+		throw;
+	}
+
+	for (size_t i = 0; i < parsers.size(); ++i) {
+		delete parsers[i];
+	}
+	return bSucceeded;
+}
+#endif // wxUSE_THREADS
+
+
+bool MunkHtmlParsingStructure::ParseCompiled(const char *pData, size_t nLength, int nMagnification, std::string& error_message)
+{
+	bool bResult = true;
+	error_message = "";
+	m_PendingMetrics.Clear();
+	m_BodyState.Clear();
+	ChangeMagnification(nMagnification);
+	try {
+		MunkQDHTMLHandler dh(this);
+	    
+		MunkQDEventReplayer replayer;
+		replayer.replay(&dh, pData, nLength);
+	} catch (MunkQDException e) {
+		bResult = false;
+		error_message = e.what();
+	} catch (...) {
+		bResult = false;
+		error_message = "An unknown exception occurred while parsing HTML.";
+	}
+	return bResult;
+}
+
+
+bool MunkHtmlParsingStructure::BeginParse(int nMagnification, std::string& error_message)
+{
+	delete AbortParse();
+
+	bool bResult = true;
+	error_message = "";
+	m_BodyState.Clear();
+	ChangeMagnification(nMagnification);
+	try {
+		m_pPushHandler = new MunkQDHTMLHandler(this);
+		m_pPushParser = new MunkQDParser();
+		m_pPushParser->beginPush(m_pPushHandler);
+	} catch (MunkQDException e) {
+		bResult = false;
+		error_message = e.what();
+	} catch (...) {
+		bResult = false;
+		error_message = "An unknown exception occurred while parsing HTML.";
+	}
+	if (!bResult) {
+		delete AbortParse();
+	}
+	return bResult;
+}
+
+
+bool MunkHtmlParsingStructure::ParseChunk(const char *pUTF8, size_t nLength, std::string& error_message)
+{
+	if (m_pPushParser == 0) {
+		error_message = "ParseChunk() called without BeginParse().";
+		return false;
+	}
+
+	bool bResult = true;
+	error_message = "";
+	try {
+		m_pPushParser->push(pUTF8, nLength);
+	} catch (MunkQDException e) {
+		bResult = false;
+		error_message = e.what();
+	} catch (...) {
+		bResult = false;
+		error_message = "An unknown exception occurred while parsing HTML.";
+	}
+	return bResult;
+}
+
+
+bool MunkHtmlParsingStructure::EndParse(std::string& error_message)
+{
+	if (m_pPushParser == 0) {
+		error_message = "EndParse() called without BeginParse().";
+		return false;
+	}
+
+	bool bResult = true;
+	error_message = "";
+	try {
+		// On success, endDocument() calls SetTopCell() for us.
+		m_pPushParser->endPush();
+	} catch (MunkQDException e) {
+		bResult = false;
+		error_message = e.what();
+	} catch (...) {
+		bResult = false;
+		error_message = "An unknown exception occurred while parsing HTML.";
+	}
+	if (bResult) {
+		delete m_pPushParser;
+		m_pPushParser = 0;
+		delete m_pPushHandler;
+		m_pPushHandler = 0;
+	}
+	return bResult;
+}
+
+
+MunkHtmlContainerCell *MunkHtmlParsingStructure::AbortParse()
+{
+	MunkHtmlContainerCell *pTop = 0;
+	if (m_pPushHandler != 0) {
+		pTop = m_pPushHandler->GetTopContainer();
+	}
+	delete m_pPushParser;
+	m_pPushParser = 0;
+	delete m_pPushHandler;
+	m_pPushHandler = 0;
+
+	// The cells are the caller's to delete.
+	m_PendingMetrics.Clear();
+
+	// The forms of a half-parsed page are of no use to anyone.
+	delete m_pForms;
+	m_pForms = 0;
+
+	return pTop;
+}
+
+
+void MunkHtmlParsingStructure::RegisterCustomTag(const std::string& tag, MunkHtmlCustomTagHandler *pHandler)
+{
+	if (pHandler == 0) {
+		m_custom_tag_handlers.erase(tag);
+	} else {
+		m_custom_tag_handlers[tag] = pHandler;
+	}
+}
+
+
+MunkHtmlCustomTagHandler *MunkHtmlParsingStructure::GetCustomTagHandler(const std::string& tag) const
+{
+	String2PCustomTagHandlerMap::const_iterator ci = m_custom_tag_handlers.find(tag);
+	if (ci == m_custom_tag_handlers.end()) {
+		return 0;
+	} else {
+		return ci->second;
+	}
+}
+
+
+MunkHtmlContainerCell *MunkHtmlParsingStructure::GetPartialRepresentation() const
+{
+	if (m_pPushHandler == 0) {
+		return 0;
+	} else {
+		return m_pPushHandler->GetTopContainer();
+	}
+}
+
+
+bool MunkHtmlParsingStructure::CanLayoutPartialRepresentation() const
+{
+	// Tables and lists compute (and cache) their column widths
+	// the first time they are laid out, so they must not be laid
+	// out until they are complete.
+	return m_pPushHandler != 0
+		&& !m_pPushHandler->IsInsideGrowingTableOrList();
+}
+
+
+void MunkHtmlParsingStructure::InvalidateOpenContainers()
+{
+	if (m_pPushHandler != 0) {
+		m_pPushHandler->InvalidateOpenContainers();
+	}
+}
+
+
+
+void MunkHtmlParsingStructure::ChangeMagnification(int nNewMagnification)
+{
+	if (m_nMagnification == nNewMagnification) {
+		// Nothing to do
+	} else {
+		m_nMagnification = nNewMagnification;
+		
+		m_FontSpaceCache.clear();
+		m_nDeferredCharWidth = 0;
+		m_nDeferredCharHeight = 0;
+
+		clearMunkStringMetricsCacheCache();
+		
+		// magnification is a percentage
+		//int pointSize = (int) ((DEFAULT_FONT_SIZE * magnification) / 100);
+		
+		// now round size to a multiple of 10
+		//pointSize = ((pointSize + 5) / 10) * 10;
+		
+		FontKey2PFontMap::iterator it 
+			= m_HTML_font_map.begin();
+		while (it != m_HTML_font_map.end()) {
+			MunkHTMLFontAttributes font_attr = MunkHTMLFontAttributes::fromKey(it->first);
+			wxFont *pNewFont = getFontFromMunkHTMLFontAttributes(font_attr,
+									     false, // Use cache? No: We are going to replace it...
+									     it->first); 
+			delete it->second;
+			it->second = pNewFont;
+			++it;
+		}
+	}
+}
+
+
+
+//////////////////////////////////////////////////////////////////
+//
+// MunkHTMLFontAttributes
+//
+//////////////////////////////////////////////////////////////////
+
+
+MunkHTMLFontAttributes::MunkHTMLFontAttributes()
+	: m_bBold(false),
+	  m_bItalic(false),
+	  m_bUnderline(false),
+	  m_scriptBaseLine(0),
+	  m_scriptMode(MunkHTML_SCRIPT_NORMAL),
+	  m_sizeFactor(100),
+	  m_color(*wxBLACK)
+{
+	setFace(wxT("Arial"));
+}
+
+MunkHTMLFontAttributes::MunkHTMLFontAttributes(bool bBold, bool bItalic, bool bUnderline, long scriptBaseline, MunkHtmlScriptMode scriptMode, unsigned int sizeFactor, const wxColour& color, const wxString& face)
+	: m_bBold(bBold),
+	  m_bItalic(bItalic),
+	  m_bUnderline(bUnderline),
+	  m_scriptBaseLine(scriptBaseline),
+	  m_scriptMode(scriptMode),
+	  m_sizeFactor(sizeFactor),
+	  m_color(color)
+{
+	setFace(face);
+}
+
+
+MunkHTMLFontAttributes::MunkHTMLFontAttributes(const MunkHTMLFontAttributes& other)
+{
+	copy_to_self(other);
+}
+
+
+MunkHTMLFontAttributes::~MunkHTMLFontAttributes()
+{
+}
+
+MunkHTMLFontAttributes MunkHTMLFontAttributes::fromString(const std::string& s)
+{
+	bool bBold = false;
+	if (s[0] == 'B') {
+		bBold = true;
+	}
+
+	bool bItalic = false;
+	if (s[1] == 'I') {
+		bItalic = true;
+	}
+
+	bool bUnderline = false;
+	if (s[2] == 'U') {
+		bUnderline = true;
+	}
+
+	MunkHtmlScriptMode scriptMode = MunkHTML_SCRIPT_NORMAL;
+	switch (s[3]) {
+	case 'N':
+		scriptMode = MunkHTML_SCRIPT_NORMAL;
+		break;
+	case 'B':
+		scriptMode = MunkHTML_SCRIPT_SUB;
+		break;
+	case 'P':
+		scriptMode = MunkHTML_SCRIPT_SUP;
+		break;
+	}
+
+	std::string number;
+	std::string::size_type index = 4;
+	while (s[index] != '|') {
+		number += s[index];
+		++index;
+	}
+
+	long scriptBaseLine = munk_string2long(number);
+
+	number = "";
+	++index; // Skip '|'
+
+	while (s[index] != '#') {
+		number += s[index];
+		++index;
+	}
+
+	long sizeFactor = munk_string2long(number);
+
+	++index; // Skip '#'
+
+	std::string face_name = s.substr(index, std::string::npos);
+	wxString strFace = wxString(face_name.c_str(), wxConvUTF8);
+
+	MunkHTMLFontAttributes attr(bBold, bItalic, bUnderline, scriptBaseLine, scriptMode, sizeFactor, *wxBLACK, strFace);
+
+	return attr;
+}
+
+void MunkHTMLFontAttributes::setFace(const wxString& face)
+{
+	m_face = face;
+	m_stdstring_face = (const char*) m_face.ToUTF8();
+	m_nFaceId = internFace(m_stdstring_face);
+}
+
+
+// Only ever touched from the thread that builds the cells.
+static std::map<std::string, unsigned int> g_FaceIds;
+static std::vector<std::string> g_Faces;
+
+unsigned int MunkHTMLFontAttributes::internFace(const std::string& face)
+{
+	std::map<std::string, unsigned int>::const_iterator ci = g_FaceIds.find(face);
+	if (ci != g_FaceIds.end()) {
+		return ci->second;
+	}
+	unsigned int nFaceId = (unsigned int) g_Faces.size();
+	wxASSERT_MSG(nFaceId <= 0xFFFF, wxT("too many font faces for a MunkFontKey"));
+	g_Faces.push_back(face);
+	g_FaceIds.insert(std::make_pair(face, nFaceId));
+	return nFaceId;
+}
+
+
+// From the least significant bit up: bold (1 bit), italic (1),
+// underline (1), script mode (2), script baseline + 2^23 (24),
+// size factor (16) and face id (16).
+MunkFontKey MunkHTMLFontAttributes::toKey() const
+{
+	wxASSERT_MSG(m_scriptBaseLine >= -0x800000 && m_scriptBaseLine < 0x800000,
+		     wxT("script baseline does not fit in a MunkFontKey"));
+	MunkFontKey key = m_nFaceId & 0xFFFF;
+	key = (key << 16) | (m_sizeFactor & 0xFFFF);
+	key = (key << 24) | ((m_scriptBaseLine + 0x800000) & 0xFFFFFF);
+	key = (key << 2) | (m_scriptMode & 0x3);
+	key = (key << 1) | (m_bUnderline ? 1 : 0);
+	key = (key << 1) | (m_bItalic ? 1 : 0);
+	key = (key << 1) | (m_bBold ? 1 : 0);
+	return key;
+}
+
+
+MunkHTMLFontAttributes MunkHTMLFontAttributes::fromKey(MunkFontKey key)
+{
+	bool bBold = (key & 1) != 0;
+	key >>= 1;
+	bool bItalic = (key & 1) != 0;
+	key >>= 1;
+	bool bUnderline = (key & 1) != 0;
+	key >>= 1;
+	MunkHtmlScriptMode scriptMode = (MunkHtmlScriptMode) (key & 0x3);
+	key >>= 2;
+	long scriptBaseLine = ((long) (key & 0xFFFFFF)) - 0x800000;
+	key >>= 24;
+	unsigned int sizeFactor = (unsigned int) (key & 0xFFFF);
+	key >>= 16;
+	unsigned int nFaceId = (unsigned int) (key & 0xFFFF);
+
+	wxString strFace = wxString(g_Faces[nFaceId].c_str(), wxConvUTF8);
+
+	MunkHTMLFontAttributes attr(bBold, bItalic, bUnderline, scriptBaseLine, scriptMode, sizeFactor, *wxBLACK, strFace);
+
+	return attr;
+}
+
+
+std::string MunkHTMLFontAttributes::toString() const
+{
+	std::string result = "---.";
+	if (m_bBold) {
+		result[0] = 'B';
+	} 
+
+	if (m_bItalic) {
+		result[1] = 'I';
+	} 
+
+	if (m_bUnderline) {
+		result[2] = 'U';
+	} 
+
+	switch (m_scriptMode) {
+	case MunkHTML_SCRIPT_NORMAL:
+		result[3] = 'N';
 		break;
 	case MunkHTML_SCRIPT_SUB:
 		result[3] = 'B';
@@ -1383,137 +3053,1004 @@ std::string MunkHTMLFontAttributes::toString() const
 		break;
 	}
 
-	result += munk_long2string(m_scriptBaseLine);
-	result += '|';
-	result += munk_long2string(m_sizeFactor);
-	
-	result += "#";
-	result += m_stdstring_face;
+	result += munk_long2string(m_scriptBaseLine);
+	result += '|';
+	result += munk_long2string(m_sizeFactor);
+	
+	result += "#";
+	result += m_stdstring_face;
+
+	return result;
+}
+
+
+long MunkHTMLFontAttributes::toLong() const
+{
+	long result = m_sizeFactor;
+
+	result *= 1024;
+	if (m_bBold) {
+		result += 1;
+	}
+
+	result *= 2;
+	if (m_bItalic) {
+		result += 1;
+	}
+
+	// This is not reflected in the fonts in String2PFontTrie,
+	// so it should also be left out here...
+	result *= 2;
+	if (m_bUnderline) {
+		result += 1;
+	}
+
+	result *= 4;
+	switch (m_scriptMode) {
+	case MunkHTML_SCRIPT_NORMAL:
+		result += 0;
+		break;
+	case MunkHTML_SCRIPT_SUB:
+		result += 1;
+		break;
+	case MunkHTML_SCRIPT_SUP:
+		result += 2;
+		break;
+	}
+	
+	// baseline
+	result *= 1024;
+	result += (m_scriptBaseLine + 512) % 1024;
+
+	return result;
+}
+
+
+
+MunkHTMLFontAttributes& MunkHTMLFontAttributes::operator=(const MunkHTMLFontAttributes& other)
+{
+	copy_to_self(other);
+	return *this;
+}
+
+
+void MunkHTMLFontAttributes::copy_to_self(const MunkHTMLFontAttributes& other)
+{
+	m_bBold = other.m_bBold;
+	m_bItalic = other.m_bItalic;
+	m_bUnderline = other.m_bUnderline;
+	m_scriptBaseLine = other.m_scriptBaseLine;
+	m_scriptMode = other.m_scriptMode;
+	m_sizeFactor = other.m_sizeFactor;
+	m_color = other.m_color;
+	m_face = other.m_face;
+	m_stdstring_face = other.m_stdstring_face;
+	m_nFaceId = other.m_nFaceId;
+}
+
+
+
+
+//-----------------------------------------------------------------------------
+// MunkStringMetricsCache
+//-----------------------------------------------------------------------------
+
+MunkStringMetricsCache::MunkStringMetricsCache(MunkFontKey font_key, int nMagnification)
+	: m_FontKey(font_key),
+	  m_nMagnification(nMagnification),
+	  m_pLastDC(NULL),
+	  m_nLastPPI(0),
+	  m_pLastDCClass(NULL)
+{
+}
+
+MunkStringMetricsCache::~MunkStringMetricsCache()
+{
+}
+
+MunkFontRegistryKey MunkStringMetricsCache::GetRegistryKey(wxDC *pDC)
+{
+	if (pDC != m_pLastDC) {
+		m_pLastDC = pDC;
+		m_nLastPPI = pDC->GetPPI().y;
+		m_pLastDCClass = pDC->GetClassInfo();
+	}
+	return MunkFontRegistryKey(m_FontKey, m_nMagnification, m_nLastPPI, m_pLastDCClass);
+}
+
+void MunkStringMetricsCache::GetTextExtent(const wxString& strInput, wxDC *pDC, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent)
+{
+	MunkFontRegistry::Get().GetTextExtent(GetRegistryKey(pDC), strInput, pDC, pWidth, pHeight, pDescent);
+}
+
+bool MunkStringMetricsCache::FindTextExtent(const wxString& strInput, wxDC *pDC, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent)
+{
+	return MunkFontRegistry::Get().FindTextExtent(GetRegistryKey(pDC), strInput, pWidth, pHeight, pDescent);
+}
+
+
+
+//-----------------------------------------------------------------------------
+// MunkStringMetricsTable
+//-----------------------------------------------------------------------------
+
+MunkStringView::MunkStringView(const wxString& str)
+{
+	m_pChars = str.wx_str();
+#if wxUSE_UNICODE_UTF8
+	m_nLength = strlen(m_pChars);
+#else
+	m_nLength = str.length();
+#endif
+	m_Hash = munk_hash_bytes((const char*) m_pChars, m_nLength * sizeof(wxStringCharType));
+}
+
+
+MunkStringMetricsTable::MunkStringMetricsTable()
+	: m_Slots(16),
+	  m_nCount(0)
+{
+}
+
+MunkStringMetricsTable::~MunkStringMetricsTable()
+{
+}
+
+// The slot of view, or the empty slot where it would go.
+size_t MunkStringMetricsTable::FindSlot(const MunkStringView& view) const
+{
+	size_t nMask = m_Slots.size() - 1;
+	size_t nSlot = (size_t) view.m_Hash & nMask;
+	while (true) {
+		const Slot& slot = m_Slots[nSlot];
+		if (!slot.m_bUsed) {
+			return nSlot;
+		}
+		if (slot.m_Hash == view.m_Hash
+		    && slot.m_nLength == view.m_nLength
+		    && (view.m_nLength == 0
+			|| memcmp(&m_Chars[slot.m_nOffset], view.m_pChars, view.m_nLength * sizeof(wxStringCharType)) == 0)) {
+			return nSlot;
+		}
+		nSlot = (nSlot + 1) & nMask;
+	}
+}
+
+const MunkFontStringMetrics *MunkStringMetricsTable::Find(const MunkStringView& view) const
+{
+	const Slot& slot = m_Slots[FindSlot(view)];
+	return slot.m_bUsed ? &slot.m_Metrics : NULL;
+}
+
+bool MunkStringMetricsTable::Insert(const MunkStringView& view, const MunkFontStringMetrics& metrics)
+{
+	// Keep the table at most half full, so that probe runs stay short.
+	if (2 * (m_nCount + 1) > m_Slots.size()) {
+		Grow();
+	}
+	Slot& slot = m_Slots[FindSlot(view)];
+	if (slot.m_bUsed) {
+		return false;
+	}
+	slot.m_bUsed = true;
+	slot.m_Hash = view.m_Hash;
+	slot.m_nOffset = m_Chars.size();
+	slot.m_nLength = view.m_nLength;
+	slot.m_Metrics = metrics;
+	m_Chars.insert(m_Chars.end(), view.m_pChars, view.m_pChars + view.m_nLength);
+	++m_nCount;
+	return true;
+}
+
+bool MunkStringMetricsTable::GetSlot(size_t nSlot, const wxStringCharType **ppChars, size_t *pnLength, const MunkFontStringMetrics **ppMetrics) const
+{
+	const Slot& slot = m_Slots[nSlot];
+	if (!slot.m_bUsed) {
+		return false;
+	}
+	*ppChars = slot.m_nLength == 0 ? (const wxStringCharType*) wxT("") : &m_Chars[slot.m_nOffset];
+	*pnLength = slot.m_nLength;
+	*ppMetrics = &slot.m_Metrics;
+	return true;
+}
+
+void MunkStringMetricsTable::Grow()
+{
+	std::vector<Slot> oldSlots(2 * m_Slots.size());
+	oldSlots.swap(m_Slots);
+	size_t nMask = m_Slots.size() - 1;
+	for (size_t i = 0; i < oldSlots.size(); ++i) {
+		if (oldSlots[i].m_bUsed) {
+			size_t nSlot = (size_t) oldSlots[i].m_Hash & nMask;
+			while (m_Slots[nSlot].m_bUsed) {
+				nSlot = (nSlot + 1) & nMask;
+			}
+			m_Slots[nSlot] = oldSlots[i];
+		}
+	}
+}
+
+
+
+//-----------------------------------------------------------------------------
+// MunkFontRegistry
+//-----------------------------------------------------------------------------
+
+bool MunkFontRegistryKey::operator<(const MunkFontRegistryKey& other) const
+{
+	if (m_FontKey != other.m_FontKey) {
+		return m_FontKey < other.m_FontKey;
+	} else if (m_nMagnification != other.m_nMagnification) {
+		return m_nMagnification < other.m_nMagnification;
+	} else if (m_nPPI != other.m_nPPI) {
+		return m_nPPI < other.m_nPPI;
+	} else {
+		return m_pDCClass < other.m_pDCClass;
+	}
+}
+
+
+MunkFontRegistry *MunkFontRegistry::m_pInstance = NULL;
+
+MunkFontRegistry& MunkFontRegistry::Get()
+{
+	// Created before any other thread can get here, by the first
+	// document to be parsed.
+	if (m_pInstance == NULL) {
+		m_pInstance = new MunkFontRegistry();
+	}
+	return *m_pInstance;
+}
+
+void MunkFontRegistry::CleanUp()
+{
+	wxDELETE(m_pInstance);
+}
+
+MunkFontRegistry::MunkFontRegistry()
+	: m_MeasureMode(kMunkMeasureExact),
+	  m_nMaxFonts(256),
+	  m_nMaxMetrics(256*1024)
+{
+}
+
+MunkFontRegistry::~MunkFontRegistry()
+{
+}
+
+void MunkFontRegistry::SetLimits(size_t nMaxFonts, size_t nMaxMetrics)
+{
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	m_nMaxFonts = nMaxFonts;
+	m_nMaxMetrics = nMaxMetrics;
+	EvictFonts();
+	EvictMetrics();
+}
+
+wxFont MunkFontRegistry::GetFont(const MunkHTMLFontAttributes& font_attributes, MunkFontKey font_key, int nMagnification)
+{
+	MunkFontRegistryKey key(font_key, nMagnification);
+
+	int nPointSize = ((int)(((nMagnification * DEFAULT_FONT_SIZE * font_attributes.m_sizeFactor)))) / 10000;
+
+	wxFontInfo fontInfo(nPointSize);
+	if (font_attributes.m_bItalic) {
+		fontInfo.Italic(true);
+	}
+	if (font_attributes.m_bBold) {
+		fontInfo.Bold(true);
+	}
+	fontInfo.FaceName(font_attributes.m_face);
+
+	if (!munk_is_gui_thread()) {
+		// The reference count of a wxFont is not thread-safe,
+		// so a font for another thread must not share its data
+		// with ours.
+		return wxFont(fontInfo);
+	}
 
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	FontMap::iterator it = m_Fonts.find(key);
+	if (it != m_Fonts.end()) {
+		++m_Stats.m_nFontHits;
+		m_FontsLRU.splice(m_FontsLRU.begin(), m_FontsLRU, it->second.m_itLRU);
+		return it->second.m_Font;
+	}
+	++m_Stats.m_nFontMisses;
+
+	FontEntry& entry = m_Fonts[key];
+	entry.m_Font = wxFont(fontInfo);
+	m_FontsLRU.push_front(key);
+	entry.m_itLRU = m_FontsLRU.begin();
+
+	wxFont result = entry.m_Font;
+	EvictFonts();
 	return result;
 }
 
+void MunkFontRegistry::GetTextExtent(const MunkFontRegistryKey& key, const wxString& strInput, wxDC *pDC, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent)
+{
+	// Hashed before taking the lock.
+	MunkStringView view(strInput);
 
-long MunkHTMLFontAttributes::toLong() const
+	eMunkMeasureMode mode;
+	{
+#if wxUSE_THREADS
+		wxCriticalSectionLocker locker(m_CS);
+#endif
+		if (DoFindTextExtent(key, view, pWidth, pHeight, pDescent)) {
+			return;
+		}
+		++m_Stats.m_nMetricsMisses;
+		mode = m_MeasureMode;
+	}
+
+	// Measure without holding the lock, so that other threads
+	// are not kept waiting for the DC.
+	int Width;
+	int Height;
+	int Descent;
+	wxCoord GlyphWidth = 0;
+	wxCoord GlyphHeight = 0;
+	wxCoord GlyphDescent = 0;
+	bool bSynthesized = false;
+	wxStopWatch sw;
+	if (mode != kMunkMeasureExact) {
+		bSynthesized = SynthesizeTextExtent(key, strInput, pDC, &GlyphWidth, &GlyphHeight, &GlyphDescent);
+	}
+	if (mode == kMunkMeasureGlyphs && bSynthesized) {
+		Width = GlyphWidth;
+		Height = GlyphHeight;
+		Descent = GlyphDescent;
+	} else {
+		pDC->GetTextExtent(strInput, &Width, &Height, &Descent);
+	}
+	wxLongLong measureMicroseconds = sw.TimeInMicro();
+
+	if (pWidth != NULL) {
+		*pWidth = Width;
+	}
+	if (pHeight != NULL) {
+		*pHeight = Height;
+	}
+	if (pDescent != NULL) {
+		*pDescent = Descent;
+	}
+
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	m_Stats.m_nMeasureMicroseconds += (wxUint64) measureMicroseconds.GetValue();
+	if (mode != kMunkMeasureExact) {
+		if (!bSynthesized) {
+			++m_Stats.m_nGlyphFallbacks;
+		} else {
+			++m_Stats.m_nGlyphStrings;
+			if (mode == kMunkMeasureValidate
+			    && (GlyphWidth != Width
+				|| GlyphHeight != Height
+				|| GlyphDescent != Descent)) {
+				wxCoord nError = GlyphWidth > Width ? GlyphWidth - Width : Width - GlyphWidth;
+				++m_Stats.m_nValidationMismatches;
+				m_Stats.m_nValidationErrorPixels += nError;
+				if (nError > m_Stats.m_nValidationMaxError) {
+					m_Stats.m_nValidationMaxError = nError;
+				}
+			}
+		}
+	}
+	MetricsEntry& entry = GetMetricsEntry(key);
+	MunkStringMetricsTable& table = mode == kMunkMeasureGlyphs && bSynthesized ? entry.m_SummedTable : entry.m_Table;
+	if (table.Insert(view, MunkFontStringMetrics(Width, Height, Descent))) {
+		++m_Stats.m_nMetrics;
+	}
+	EvictMetrics();
+}
+
+// m_CS must be held.
+MunkFontRegistry::MetricsEntry& MunkFontRegistry::GetMetricsEntry(const MunkFontRegistryKey& key)
 {
-	long result = m_sizeFactor;
+	MetricsMap::iterator it = m_Metrics.find(key);
+	if (it == m_Metrics.end()) {
+		it = m_Metrics.insert(std::make_pair(key, MetricsEntry())).first;
+		m_MetricsLRU.push_front(key);
+		it->second.m_itLRU = m_MetricsLRU.begin();
+	}
+	return it->second;
+}
 
-	result *= 1024;
-	if (m_bBold) {
-		result += 1;
+bool MunkFontRegistry::FindTextExtent(const MunkFontRegistryKey& key, const wxString& strInput, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent)
+{
+	MunkStringView view(strInput);
+
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	return DoFindTextExtent(key, view, pWidth, pHeight, pDescent);
+}
+
+// m_CS must be held.
+bool MunkFontRegistry::DoFindTextExtent(const MunkFontRegistryKey& key, const MunkStringView& view, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent)
+{
+	MetricsMap::iterator it = m_Metrics.find(key);
+	if (it == m_Metrics.end()) {
+		return false;
 	}
+	m_MetricsLRU.splice(m_MetricsLRU.begin(), m_MetricsLRU, it->second.m_itLRU);
+	const MunkFontStringMetrics *pMetrics = it->second.m_Table.Find(view);
+	if (pMetrics == NULL && m_MeasureMode == kMunkMeasureGlyphs) {
+		pMetrics = it->second.m_SummedTable.Find(view);
+	}
+	if (pMetrics == NULL) {
+		return false;
+	}
+	++m_Stats.m_nMetricsHits;
+	if (pWidth != NULL) {
+		*pWidth = pMetrics->m_StringWidth;
+	}
+	if (pHeight != NULL) {
+		*pHeight = pMetrics->m_StringHeight;
+	}
+	if (pDescent != NULL) {
+		*pDescent = pMetrics->m_StringDescent;
+	}
+	return true;
+}
 
-	result *= 2;
-	if (m_bItalic) {
-		result += 1;
+void MunkFontRegistry::SetMeasureMode(eMunkMeasureMode mode)
+{
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	m_MeasureMode = mode;
+}
+
+eMunkMeasureMode MunkFontRegistry::GetMeasureMode() const
+{
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	return m_MeasureMode;
+}
+
+// Advances are kept for the code points below this, which take in
+// the alphabetic scripts of Europe, and Hebrew.
+#define MUNK_GLYPH_ADVANCE_LIMIT (0x2000)
+
+void MunkFontRegistry::GlyphEntry::SetAdvance(wxUint32 ch, wxCoord advance)
+{
+	if (ch >= MUNK_GLYPH_ADVANCE_LIMIT) {
+		return;
+	}
+	if (ch >= m_Advances.size()) {
+		// By blocks of 256, as most documents stay within a few
+		m_Advances.resize((ch | 0xFF) + 1, -1);
+	}
+	m_Advances[ch] = advance;
+}
+
+// Whether the width of ch does not depend on its neighbours, once
+// the font has passed CheckGlyphs().
+bool MunkFontRegistry::IsSummableChar(wxUint32 ch)
+{
+	if (ch < 0x20 || ch >= MUNK_GLYPH_ADVANCE_LIMIT) {
+		return false;
 	}
+	return !((ch >= 0x0300 && ch <= 0x036F)     // Combining diacritical marks
+		 || (ch >= 0x0483 && ch <= 0x0489)  // Cyrillic combining marks
+		 || (ch >= 0x0591 && ch <= 0x05C7)  // Hebrew points and accents
+		 || (ch >= 0x0600 && ch <= 0x08FF)  // Arabic, Syriac, Thaana, ...
+		 || (ch >= 0x0900 && ch <= 0x0DFF)  // Indic
+		 || (ch >= 0x0E00 && ch <= 0x109F)  // Thai, Lao, Tibetan, Myanmar
+		 || (ch >= 0x1100 && ch <= 0x11FF)  // Hangul Jamo
+		 || (ch >= 0x1700 && ch <= 0x18AF)  // Philippine, Khmer, Mongolian
+		 || (ch >= 0x1A00 && ch <= 0x1CFF)  // Buginese to Vedic
+		 || (ch >= 0x1DC0 && ch <= 0x1DFF)); // Combining marks supplement
+}
 
-	// This is not reflected in the fonts in String2PFontTrie,
-	// so it should also be left out here...
-	result *= 2;
-	if (m_bUnderline) {
-		result += 1;
+// Measures, the first time key is seen, whether the font kerns,
+// forms ligatures, or has advances of fractions of pixels, any of
+// which makes summing them wrong.  Returns whether it does not.
+bool MunkFontRegistry::CheckGlyphs(const MunkFontRegistryKey& key, const wxDC *pDC)
+{
+	{
+#if wxUSE_THREADS
+		wxCriticalSectionLocker locker(m_CS);
+#endif
+		GlyphMap::const_iterator it = m_Glyphs.find(key);
+		if (it != m_Glyphs.end() && it->second.m_bChecked) {
+			return it->second.m_bSummable;
+		}
+	}
+
+	// Pairs which fonts commonly kern or join, and runs which show
+	// fractional advances.
+	static const char *probes[] = {
+		"AV", "To", "Wa", "Yo", "LT", "fi", "fl", "ff",
+		"iiiiiiiiii", "mmmmmmmmmm", "1111111111",
+		NULL
+	};
+
+	std::map<wxUint32, wxCoord> advances;
+	bool bSummable = true;
+	wxCoord Height = 0;
+	wxCoord Descent = 0;
+	for (int nProbe = 0; probes[nProbe] != NULL; ++nProbe) {
+		wxString strProbe(probes[nProbe], wxConvUTF8);
+		wxCoord Sum = 0;
+		for (wxString::const_iterator ci = strProbe.begin(); ci != strProbe.end(); ++ci) {
+			wxUint32 ch = (wxUint32) *ci;
+			std::map<wxUint32, wxCoord>::const_iterator ai = advances.find(ch);
+			if (ai == advances.end()) {
+				wxCoord CharWidth;
+				pDC->GetTextExtent(wxString(*ci), &CharWidth, NULL);
+				ai = advances.insert(std::make_pair(ch, CharWidth)).first;
+			}
+			Sum += ai->second;
+		}
+		wxCoord Width;
+		pDC->GetTextExtent(strProbe, &Width, &Height, &Descent);
+		if (Width != Sum) {
+			bSummable = false;
+		}
 	}
 
-	result *= 4;
-	switch (m_scriptMode) {
-	case MunkHTML_SCRIPT_NORMAL:
-		result += 0;
-		break;
-	case MunkHTML_SCRIPT_SUB:
-		result += 1;
-	case MunkHTML_SCRIPT_SUP:
-		result += 2;
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	GlyphEntry& entry = m_Glyphs[key];
+	if (!entry.m_bChecked) {
+		entry.m_bChecked = true;
+		entry.m_bSummable = bSummable;
+		entry.m_Height = Height;
+		entry.m_Descent = Descent;
+		for (std::map<wxUint32, wxCoord>::const_iterator ai = advances.begin(); ai != advances.end(); ++ai) {
+			entry.SetAdvance(ai->first, ai->second);
+		}
+	}
+	return entry.m_bSummable;
+}
+
+// Returns false if strInput must be measured as a whole.
+bool MunkFontRegistry::SynthesizeTextExtent(const MunkFontRegistryKey& key, const wxString& strInput, const wxDC *pDC, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent)
+{
+	if (strInput.IsEmpty()) {
+		return false;
+	}
+	for (wxString::const_iterator ci = strInput.begin(); ci != strInput.end(); ++ci) {
+		if (!IsSummableChar((wxUint32) *ci)) {
+			return false;
+		}
+	}
+	if (!CheckGlyphs(key, pDC)) {
+		return false;
+	}
+
+	wxCoord Width = 0;
+	std::vector<wxUint32> missing;
+	{
+#if wxUSE_THREADS
+		wxCriticalSectionLocker locker(m_CS);
+#endif
+		GlyphMap::const_iterator it = m_Glyphs.find(key);
+		if (it == m_Glyphs.end()) {
+			// Cleared by another thread since
+			return false;
+		}
+		const GlyphEntry& entry = it->second;
+		*pHeight = entry.m_Height;
+		*pDescent = entry.m_Descent;
+		for (wxString::const_iterator ci = strInput.begin(); ci != strInput.end(); ++ci) {
+			wxCoord advance = entry.GetAdvance((wxUint32) *ci);
+			if (advance < 0) {
+				missing.push_back((wxUint32) *ci);
+			} else {
+				Width += advance;
+			}
+		}
+	}
+
+	if (!missing.empty()) {
+		std::vector<wxCoord> advances;
+		for (size_t nIndex = 0; nIndex < missing.size(); ++nIndex) {
+			wxCoord CharWidth;
+			pDC->GetTextExtent(wxString(wxUniChar(missing[nIndex])), &CharWidth, NULL);
+			advances.push_back(CharWidth);
+			Width += CharWidth;
+		}
+
+#if wxUSE_THREADS
+		wxCriticalSectionLocker locker(m_CS);
+#endif
+		GlyphMap::iterator it = m_Glyphs.find(key);
+		if (it != m_Glyphs.end()) {
+			for (size_t nIndex = 0; nIndex < missing.size(); ++nIndex) {
+				it->second.SetAdvance(missing[nIndex], advances[nIndex]);
+			}
+		}
+	}
+
+	*pWidth = Width;
+	return true;
+}
+
+wxCoord MunkFontRegistry::GetCharWidth(const MunkFontRegistryKey& key, wxUniChar ch, const wxDC *pDC)
+{
+	bool bCached;
+	{
+#if wxUSE_THREADS
+		wxCriticalSectionLocker locker(m_CS);
+#endif
+		bCached = m_MeasureMode != kMunkMeasureExact;
+		if (bCached) {
+			GlyphMap::const_iterator it = m_Glyphs.find(key);
+			if (it != m_Glyphs.end()) {
+				wxCoord advance = it->second.GetAdvance((wxUint32) ch);
+				if (advance >= 0) {
+					return advance;
+				}
+			}
+		}
 	}
-	
-	// baseline
-	result *= 1024;
-	result += (m_scriptBaseLine + 512) % 1024;
 
-	return result;
-}
+	wxCoord CharWidth;
+	pDC->GetTextExtent(wxString(ch), &CharWidth, NULL);
 
+	if (bCached) {
+#if wxUSE_THREADS
+		wxCriticalSectionLocker locker(m_CS);
+#endif
+		m_Glyphs[key].SetAdvance((wxUint32) ch, CharWidth);
+	}
+	return CharWidth;
+}
 
+// m_CS must be held.
+void MunkFontRegistry::EvictFonts()
+{
+	// Never the font just made, which is first.
+	while (m_nMaxFonts != 0
+	       && m_Fonts.size() > m_nMaxFonts
+	       && m_FontsLRU.size() > 1) {
+		m_Fonts.erase(m_FontsLRU.back());
+		m_FontsLRU.pop_back();
+		++m_Stats.m_nFontEvictions;
+	}
+}
 
-MunkHTMLFontAttributes& MunkHTMLFontAttributes::operator=(const MunkHTMLFontAttributes& other)
+// m_CS must be held.
+void MunkFontRegistry::EvictMetrics()
 {
-	copy_to_self(other);
-	return *this;
+	// Never the strings of the font just used, which is first.
+	while (m_nMaxMetrics != 0
+	       && m_Stats.m_nMetrics > m_nMaxMetrics
+	       && m_MetricsLRU.size() > 1) {
+		MetricsMap::iterator it = m_Metrics.find(m_MetricsLRU.back());
+		size_t nStrings = it->second.m_Table.GetCount() + it->second.m_SummedTable.GetCount();
+		m_Stats.m_nMetrics -= nStrings;
+		m_Stats.m_nMetricsEvictions += nStrings;
+		m_Glyphs.erase(it->first);
+		m_Metrics.erase(it);
+		m_MetricsLRU.pop_back();
+	}
 }
 
+MunkFontRegistryStats MunkFontRegistry::GetStats() const
+{
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	MunkFontRegistryStats stats = m_Stats;
+	stats.m_nFonts = m_Fonts.size();
+	return stats;
+}
 
-void MunkHTMLFontAttributes::copy_to_self(const MunkHTMLFontAttributes& other)
+void MunkFontRegistry::ResetStats()
 {
-	m_bBold = other.m_bBold;
-	m_bItalic = other.m_bItalic;
-	m_bUnderline = other.m_bUnderline;
-	m_scriptBaseLine = other.m_scriptBaseLine;
-	m_scriptMode = other.m_scriptMode;
-	m_sizeFactor = other.m_sizeFactor;
-	m_color = other.m_color;
-	m_face = other.m_face;
-	m_stdstring_face = other.m_stdstring_face;
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	size_t nMetrics = m_Stats.m_nMetrics;
+	m_Stats = MunkFontRegistryStats();
+	m_Stats.m_nMetrics = nMetrics;
 }
 
+void MunkFontRegistry::Clear()
+{
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	m_Fonts.clear();
+	m_FontsLRU.clear();
+	m_Metrics.clear();
+	m_MetricsLRU.clear();
+	m_Glyphs.clear();
+	m_Stats.m_nMetrics = 0;
+}
 
 
+// The file of MunkFontRegistry::SaveMetrics() starts with the magic,
+// the version (4 bytes), 4 bytes of 0, the fingerprint (8 bytes) and
+// the hash of the rest (8 bytes), all little-endian.  Then come, as
+// in compiled pages, varints and varint-prefixed UTF-8 strings:
+//
+//   count, face*          The faces of the font keys
+//   count, DC class name*
+//   count, table*
+//
+// Only the exact widths are saved, not those summed from advances.
+// A table is the font key with its face id set to 0 (8 bytes),
+// the index of its face, the magnification, the PPI, the index of
+// its DC class, and a count of (string, width, height, descent).
+static const char MUNK_METRICS_FILE_MAGIC[8] = { 'M', 'U', 'N', 'K', 'M', 'E', 'T', 'R' };
+#define MUNK_METRICS_FILE_VERSION 1
+#define MUNK_METRICS_FILE_HEADER_SIZE 32
 
-//-----------------------------------------------------------------------------
-// MunkStringMetricsCache
-//-----------------------------------------------------------------------------
+// See MunkHTMLFontAttributes::toKey()
+#define MUNK_FONT_KEY_FACE_SHIFT 45
 
-MunkStringMetricsCache::MunkStringMetricsCache()
+static void munk_put_varint(std::string& dest, unsigned long value)
 {
+	while (value >= 0x80) {
+		dest += (char) ((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	dest += (char) value;
 }
 
-MunkStringMetricsCache::~MunkStringMetricsCache()
+static void munk_put_bytes(std::string& dest, const std::string& str)
 {
+	munk_put_varint(dest, str.length());
+	dest += str;
 }
 
-void MunkStringMetricsCache::GetTextExtent(const wxString& strInput, wxDC *pDC, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent)
+// Reads what munk_put_varint() and munk_put_bytes() wrote; once
+// anything runs past the end, IsOK() is false and the rest reads as 0.
+class MunkMetricsFileReader {
+public:
+	MunkMetricsFileReader(const char *pData, size_t nLength)
+		: m_pCur(pData), m_pEnd(pData + nLength), m_bOK(true) {};
+
+	bool IsOK() const { return m_bOK; }
+
+	unsigned long GetVarint() {
+		unsigned long value = 0;
+		int shift = 0;
+		while (m_bOK) {
+			if (m_pCur == m_pEnd || shift >= (int) (sizeof(unsigned long) * 8)) {
+				m_bOK = false;
+				break;
+			}
+			unsigned char c = (unsigned char) *m_pCur++;
+			value |= ((unsigned long) (c & 0x7F)) << shift;
+			if ((c & 0x80) == 0) {
+				return value;
+			}
+			shift += 7;
+		}
+		return 0;
+	}
+
+	wxUint64 GetLE(int nBytes) {
+		if (!m_bOK || m_pEnd - m_pCur < nBytes) {
+			m_bOK = false;
+			return 0;
+		}
+		wxUint64 value = munk_get_le(m_pCur, nBytes);
+		m_pCur += nBytes;
+		return value;
+	}
+
+	void GetBytes(std::string& dest) {
+		unsigned long length = GetVarint();
+		if (!m_bOK || length > (unsigned long) (m_pEnd - m_pCur)) {
+			m_bOK = false;
+			dest.erase();
+			return;
+		}
+		dest.assign(m_pCur, length);
+		m_pCur += length;
+	}
+
+private:
+	const char *m_pCur;
+	const char *m_pEnd;
+	bool m_bOK;
+};
+
+bool MunkFontRegistry::LoadMetrics(const wxString& filename, wxUint64 fingerprint)
 {
-	std::map<wxString, MunkFontStringMetrics>::iterator it = m_String2FontStringMetricsMap.find(strInput);
-	if (it == m_String2FontStringMetricsMap.end()) {
-		int Width;
-		int Height;
-		int Descent;
+	// Mapped, where we can.
+	MunkHtmlPageBuffer buffer;
+	if (!buffer.LoadFile(filename)) {
+		return false;
+	}
+	const char *pData = buffer.GetData();
+	size_t nLength = buffer.GetLength();
+	if (nLength < MUNK_METRICS_FILE_HEADER_SIZE
+	    || memcmp(pData, MUNK_METRICS_FILE_MAGIC, sizeof(MUNK_METRICS_FILE_MAGIC)) != 0
+	    || munk_get_le(pData + 8, 4) != MUNK_METRICS_FILE_VERSION
+	    || munk_get_le(pData + 16, 8) != fingerprint) {
+		return false;
+	}
+	const char *pPayload = pData + MUNK_METRICS_FILE_HEADER_SIZE;
+	size_t nPayloadLength = nLength - MUNK_METRICS_FILE_HEADER_SIZE;
+	if (munk_hash_bytes(pPayload, nPayloadLength) != munk_get_le(pData + 24, 8)) {
+		return false;
+	}
 
-		pDC->GetTextExtent(strInput, &Width, &Height, &Descent);
+	MunkMetricsFileReader reader(pPayload, nPayloadLength);
+	std::string str;
 
-		MunkFontStringMetrics fontStringMetrics(Width, Height, Descent);
-		wxString myString = strInput;
+	// The face ids of this run, by index in the file.
+	std::vector<unsigned int> faceIds;
+	unsigned long nFaces = reader.GetVarint();
+	for (unsigned long i = 0; i < nFaces && reader.IsOK(); ++i) {
+		reader.GetBytes(str);
+		faceIds.push_back(MunkHTMLFontAttributes::internFace(str));
+	}
 
-		m_String2FontStringMetricsMap.insert(std::make_pair(myString, fontStringMetrics));
-	        
-		if (pWidth != NULL) {
-			*pWidth = Width;
-		}
-		
-		if (pHeight != NULL) {
-			*pHeight = Height;
-		}
-		
-		if (pDescent != NULL) {
-			*pDescent = Descent;
+	// NULL for the classes this build of wx does not have.
+	std::vector<const wxClassInfo*> classes;
+	unsigned long nClasses = reader.GetVarint();
+	for (unsigned long i = 0; i < nClasses && reader.IsOK(); ++i) {
+		reader.GetBytes(str);
+		classes.push_back(wxClassInfo::FindClass(wxString::FromUTF8(str.data(), str.length())));
+	}
+
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_CS);
+#endif
+	unsigned long nTables = reader.GetVarint();
+	for (unsigned long i = 0; i < nTables && reader.IsOK(); ++i) {
+		MunkFontKey font_key = reader.GetLE(8);
+		unsigned long nFace = reader.GetVarint();
+		int nMagnification = (int) reader.GetVarint();
+		int nPPI = (int) reader.GetVarint();
+		unsigned long nClass = reader.GetVarint();
+		unsigned long nStrings = reader.GetVarint();
+		if (!reader.IsOK() || nFace >= faceIds.size() || nClass >= classes.size()) {
+			return false;
 		}
-		
-	} else {
-		if (pWidth != NULL) {
-			*pWidth = it->second.m_StringWidth;
+
+		// The strings of a DC class we do not have are read, but
+		// not kept.
+		MunkStringMetricsTable *pTable = NULL;
+		if (classes[nClass] != NULL) {
+			MunkFontRegistryKey key(font_key | ((MunkFontKey) faceIds[nFace] << MUNK_FONT_KEY_FACE_SHIFT),
+						nMagnification, nPPI, classes[nClass]);
+			pTable = &GetMetricsEntry(key).m_Table;
+		}
+		for (unsigned long j = 0; j < nStrings && reader.IsOK(); ++j) {
+			reader.GetBytes(str);
+			int Width = (int) reader.GetVarint();
+			int Height = (int) reader.GetVarint();
+			int Descent = (int) reader.GetVarint();
+			if (reader.IsOK() && pTable != NULL) {
+				wxString strWord = wxString::FromUTF8(str.data(), str.length());
+				if (pTable->Insert(MunkStringView(strWord), MunkFontStringMetrics(Width, Height, Descent))) {
+					++m_Stats.m_nMetrics;
+				}
+			}
 		}
-		
-		if (pHeight != NULL) {
-			*pHeight = it->second.m_StringHeight;
+	}
+	EvictMetrics();
+	return reader.IsOK();
+}
+
+bool MunkFontRegistry::SaveMetrics(const wxString& filename, wxUint64 fingerprint)
+{
+	std::string payload;
+	{
+#if wxUSE_THREADS
+		wxCriticalSectionLocker locker(m_CS);
+#endif
+		// Faces and DC classes are numbered in the order met.
+		std::map<unsigned int, unsigned long> faceIndexes;
+		std::string faces;
+		std::map<const wxClassInfo*, unsigned long> classIndexes;
+		std::string classes;
+		std::string tables;
+		for (MetricsMap::const_iterator it = m_Metrics.begin(); it != m_Metrics.end(); ++it) {
+			const MunkFontRegistryKey& key = it->first;
+			const MunkStringMetricsTable& table = it->second.m_Table;
+			unsigned int nFaceId = (unsigned int) (key.m_FontKey >> MUNK_FONT_KEY_FACE_SHIFT) & 0xFFFF;
+			if (faceIndexes.find(nFaceId) == faceIndexes.end()) {
+				faceIndexes.insert(std::make_pair(nFaceId, faceIndexes.size()));
+				munk_put_bytes(faces, g_Faces[nFaceId]);
+			}
+			if (classIndexes.find(key.m_pDCClass) == classIndexes.end()) {
+				classIndexes.insert(std::make_pair(key.m_pDCClass, classIndexes.size()));
+				munk_put_bytes(classes, (const char*) wxString(key.m_pDCClass->GetClassName()).ToUTF8());
+			}
+
+			munk_put_le(tables, key.m_FontKey & ~((MunkFontKey) 0xFFFF << MUNK_FONT_KEY_FACE_SHIFT), 8);
+			munk_put_varint(tables, faceIndexes[nFaceId]);
+			munk_put_varint(tables, key.m_nMagnification);
+			munk_put_varint(tables, key.m_nPPI);
+			munk_put_varint(tables, classIndexes[key.m_pDCClass]);
+			munk_put_varint(tables, table.GetCount());
+			for (size_t nSlot = 0; nSlot < table.GetSlotCount(); ++nSlot) {
+				const wxStringCharType *pChars;
+				size_t nCharLength;
+				const MunkFontStringMetrics *pMetrics;
+				if (!table.GetSlot(nSlot, &pChars, &nCharLength, &pMetrics)) {
+					continue;
+				}
+#if wxUSE_UNICODE_UTF8
+				munk_put_bytes(tables, std::string(pChars, nCharLength));
+#else
+				const wxScopedCharBuffer buf(wxString(pChars, nCharLength).ToUTF8());
+				munk_put_bytes(tables, std::string(buf.data(), buf.length()));
+#endif
+				munk_put_varint(tables, pMetrics->m_StringWidth);
+				munk_put_varint(tables, pMetrics->m_StringHeight);
+				munk_put_varint(tables, pMetrics->m_StringDescent);
+			}
 		}
-		
-		if (pDescent != NULL) {
-			*pDescent = it->second.m_StringDescent;
+
+		munk_put_varint(payload, faceIndexes.size());
+		payload += faces;
+		munk_put_varint(payload, classIndexes.size());
+		payload += classes;
+		munk_put_varint(payload, m_Metrics.size());
+		payload += tables;
+	}
+
+	std::string header;
+	header.append(MUNK_METRICS_FILE_MAGIC, sizeof(MUNK_METRICS_FILE_MAGIC));
+	munk_put_le(header, MUNK_METRICS_FILE_VERSION, 4);
+	munk_put_le(header, 0, 4);
+	munk_put_le(header, fingerprint, 8);
+	munk_put_le(header, munk_hash_bytes(payload.data(), payload.length()), 8);
+
+	// Written next to it and renamed, so that another instance of
+	// the application never loads half a file.
+	wxString tmpFilename = filename + wxT(".tmp");
+	{
+		wxFile file;
+		if (!file.Create(tmpFilename, true)
+		    || !file.Write(header.data(), header.length())
+		    || !file.Write(payload.data(), payload.length())) {
+			return false;
 		}
-		
 	}
+	return wxRenameFile(tmpFilename, filename, true);
+}
+
+wxUint64 MunkFontRegistry::GetFontConfigFingerprint()
+{
+	wxArrayString faces = wxFontEnumerator::GetFacenames();
+	faces.Sort();
+	std::string str = (const char*) wxString(wxVERSION_STRING).ToUTF8();
+	for (size_t i = 0; i < faces.GetCount(); ++i) {
+		str += '\n';
+		str += (const char*) faces[i].ToUTF8();
+	}
+	return munk_hash_bytes(str.data(), str.length());
 }
 
 
+// Drops the fonts before wx shuts down, rather than at static
+// destruction time.
+class MunkFontRegistryModule : public wxModule
+{
+public:
+	MunkFontRegistryModule() {}
+	virtual bool OnInit() { return true; }
+	virtual void OnExit() { MunkFontRegistry::CleanUp(); }
+
+private:
+	DECLARE_DYNAMIC_CLASS(MunkFontRegistryModule)
+};
+
+IMPLEMENT_DYNAMIC_CLASS(MunkFontRegistryModule, wxModule)
+
+
 
 //-----------------------------------------------------------------------------
 // MunkHtmlTag
@@ -1521,50 +4058,59 @@ void MunkStringMetricsCache::GetTextExtent(const wxString& strInput, wxDC *pDC,
 
 IMPLEMENT_CLASS(MunkHtmlTag,wxObject)
 
-MunkHtmlTag::MunkHtmlTag(const wxString& source, const MunkAttributeMap& attrs) : wxObject()
+MunkHtmlTag::MunkHtmlTag(const wxString& source, const MunkAttributeMap& attrs)
+	: wxObject(),
+	  m_Attrs(attrs)
 {
 	m_Name = source;
 	m_Name.MakeUpper();
-
-	MunkAttributeMap::const_iterator ci = attrs.begin();
-	while (ci != attrs.end()) {
-		std::string attrname = ci->first;
-		std::string attrvalue = ci->second;
-
-		wxString strAttrName = wxString(attrname.c_str(), wxConvUTF8);
-		strAttrName.MakeUpper();
-		wxString strAttrValue = wxString(attrvalue.c_str(), wxConvUTF8);
-		strAttrValue.MakeUpper();
-
-
-		m_ParamNames.Add(strAttrName);
-		m_ParamValues.Add(strAttrValue);
-
-		++ci;
-	}
 }
 
 MunkHtmlTag::~MunkHtmlTag()
 {
 }
 
+const std::string *MunkHtmlTag::FindParam(const wxString& par) const
+{
+	// Parameter names are plain ASCII, so narrow them on the stack
+	// rather than going through a conversion.
+	char szName[64];
+	size_t len = par.length();
+	if (len >= sizeof(szName))
+		return NULL;
+	for (size_t i = 0; i < len; ++i) {
+		wxChar c = par[i];
+		if (c > 0x7F)
+			return NULL;
+		szName[i] = (char) c;
+	}
+	szName[len] = '\0';
+
+	MunkAttributeMap::const_iterator ci = m_Attrs.findNoCase(szName);
+	if (ci == m_Attrs.end())
+		return NULL;
+	return &ci->second;
+}
+
 bool MunkHtmlTag::HasParam(const wxString& par) const
 {
-    return (m_ParamNames.Index(par, false) != wxNOT_FOUND);
+    return FindParam(par) != NULL;
 }
 
 wxString MunkHtmlTag::GetParam(const wxString& par, bool with_commas) const
 {
-	int index = m_ParamNames.Index(par, false);
-	if (index == wxNOT_FOUND)
+	const std::string *pValue = FindParam(par);
+	if (pValue == NULL)
 		return wxEmptyString;
+	wxString strValue(pValue->c_str(), wxConvUTF8);
+	strValue.MakeUpper();
 	if (with_commas) {
 	    // VS: backward compatibility, seems to be never used by MunkHTML...
 		wxString s;
-		s << wxT('"') << m_ParamValues[index] << wxT('"');
+		s << wxT('"') << strValue << wxT('"');
 		return s;
 	} else {
-		return m_ParamValues[index];
+		return strValue;
 	}
 }
 
@@ -1619,18 +4165,49 @@ bool MunkHtmlTag::GetParamAsColour(const wxString& par, wxColour *clr) const
     return GetStringAsColour(str, clr);
 }
 
+// Returns true if the first len bytes of value spell a decimal integer,
+// like wxString::ToLong() would on the converted value.  As with
+// ToLong(), a value which does not fit in a long is rejected.
+static bool munk_attr_to_long(const std::string& value, size_t len, long *pResult)
+{
+	if (len == 0)
+		return false;
+	const char *pStart = value.c_str();
+	char *pEnd = NULL;
+	errno = 0;
+	long l = strtol(pStart, &pEnd, 10);
+	if (errno != 0 || pEnd != pStart + len)
+		return false;
+	*pResult = l;
+	return true;
+}
+
+static bool munk_attr_has_suffix(const std::string& value, const char *suffix)
+{
+	size_t suffix_len = strlen(suffix);
+	if (value.length() < suffix_len)
+		return false;
+	size_t offset = value.length() - suffix_len;
+	for (size_t i = 0; i < suffix_len; ++i) {
+		if (tolower((unsigned char) value[offset + i]) != suffix[i])
+			return false;
+	}
+	return true;
+}
+
 bool MunkHtmlTag::GetParamAsInt(const wxString& par, int *clr) const
 {
-	if ( !HasParam(par) )
+	const std::string *pValue = FindParam(par);
+	if (pValue == NULL)
 		return false;
-	wxString strPar = GetParam(par);
-	
-	if (strPar.Right(2).Upper() == wxT("PX")) {
-		strPar = strPar.Left(strPar.Length()-2);
+
+	size_t len = pValue->length();
+	if (munk_attr_has_suffix(*pValue, "px")) {
+		len -= 2;
 	}
 
 	long i;
-	if ( !strPar.ToLong(&i) )
+	if (!munk_attr_to_long(*pValue, len, &i))
 		return false;
 	
 	*clr = (int)i;
@@ -1639,21 +4216,22 @@ bool MunkHtmlTag::GetParamAsInt(const wxString& par, int *clr) const
 
 bool MunkHtmlTag::GetParamAsIntOrPercent(const wxString& par, int *clr, bool *isPercent) const
 {
-	if ( !HasParam(par) )
+	const std::string *pValue = FindParam(par);
+	if (pValue == NULL)
 		return false;
 
-	wxString strPar = GetParam(par);
-	if (strPar.Right(1) == wxT("%")) {
+	size_t len = pValue->length();
+	if (munk_attr_has_suffix(*pValue, "%")) {
 		*isPercent = true;
-		strPar = strPar.Left(strPar.Length()-1);
-	} else if (strPar.Right(2).Upper() == wxT("PX")) {
+		len -= 1;
+	} else if (munk_attr_has_suffix(*pValue, "px")) {
 		*isPercent = false;
-		strPar = strPar.Left(strPar.Length()-2);
+		len -= 2;
 	} else {
 		*isPercent = false;
 	}
 	long i;
-	if ( !strPar.ToLong(&i) )
+	if (!munk_attr_to_long(*pValue, len, &i))
 		return false;
 	
 	*clr = (int)i;
@@ -1662,10 +4240,12 @@ bool MunkHtmlTag::GetParamAsIntOrPercent(const wxString& par, int *clr, bool *is
 
 bool MunkHtmlTag::GetParamAsLengthInInches(const wxString& par, double *inches) const
 {
-	if (!HasParam(par)) {
+	const std::string *pValue = FindParam(par);
+	if (pValue == NULL) {
 		return false;
 	}
-	wxString parStr = GetParam(par);
+	wxString parStr(pValue->c_str(), wxConvUTF8);
+	parStr.MakeUpper();
 	bool succ;
 	if (parStr.Right(2).Upper() == wxT("IN")) {
 		wxString doubleString = parStr.Left(parStr.Len() - 2);
@@ -1685,10 +4265,12 @@ bool MunkHtmlTag::GetParamAsLength(const wxString& par, int *pixels, double inch
 {
 	// We only do in, px, and no unit at the moment
 	// (no unit == pixels)
-	if (!HasParam(par)){
+	const std::string *pValue = FindParam(par);
+	if (pValue == NULL) {
 		return false;
 	}
-	wxString parStr = GetParam(par);
+	wxString parStr(pValue->c_str(), wxConvUTF8);
+	parStr.MakeUpper();
 	bool succ = false;
 	if (parStr.Right(2).Upper() == wxT("IN")) {
 		wxString doubleString = parStr.Left(parStr.Len() - 2);
@@ -1758,15 +4340,17 @@ wxString MunkHtmlTag::GetAllParams() const
     // VS: this function is for backward compatibility only,
     //     never used by MunkHTML
     wxString s;
-    size_t cnt = m_ParamNames.GetCount();
-    for (size_t i = 0; i < cnt; i++)
+    MunkAttributeMap::const_iterator ci = m_Attrs.begin();
+    for (; ci != m_Attrs.end(); ++ci)
     {
-        s << m_ParamNames[i];
+        wxString name(ci->first.c_str(), wxConvUTF8);
+        wxString value(ci->second.c_str(), wxConvUTF8);
+        s << name.Upper();
         s << wxT('=');
-        if (m_ParamValues[i].Find(wxT('"')) != wxNOT_FOUND)
-            s << wxT('\'') << m_ParamValues[i] << wxT('\'');
+        if (value.Find(wxT('"')) != wxNOT_FOUND)
+            s << wxT('\'') << value.Upper() << wxT('\'');
         else
-            s << wxT('"') << m_ParamValues[i] << wxT('"');
+            s << wxT('"') << value.Upper() << wxT('"');
     }
     return s;
 }
@@ -1799,6 +4383,9 @@ class MunkHtmlListmarkCell : public MunkHtmlCell
         wxBrush m_Brush;
     public:
         MunkHtmlListmarkCell(wxDC *dc, const wxColour& clr);
+        // Sized by SetTextExtent(), with the extent of a space
+        MunkHtmlListmarkCell(const wxColour& clr);
+        virtual void SetTextExtent(wxCoord Width, wxCoord Height, wxCoord Descent);
         void Draw(wxDC& dc, int x, int y, int view_y1, int view_y2,
                   MunkHtmlRenderingInfo& info);
 	virtual bool IsTerminalCell() const { return true; }
@@ -1815,6 +4402,17 @@ MunkHtmlListmarkCell::MunkHtmlListmarkCell(wxDC* dc, const wxColour& clr) : Munk
     m_Descent = m_Height / 3;
 }
 
+MunkHtmlListmarkCell::MunkHtmlListmarkCell(const wxColour& clr) : MunkHtmlCell(), m_Brush(clr, wxBRUSHSTYLE_SOLID)
+{
+}
+
+void MunkHtmlListmarkCell::SetTextExtent(wxCoord WXUNUSED(Width), wxCoord Height, wxCoord WXUNUSED(Descent))
+{
+    m_Width = Height;
+    m_Height = Height;
+    m_Descent = m_Height / 3;
+}
+
 
 
 void MunkHtmlListmarkCell::Draw(wxDC& dc, int x, int y,
@@ -1967,6 +4565,11 @@ MunkHtmlLineBreakCell::~MunkHtmlLineBreakCell()
 {
 }
 
+void MunkHtmlLineBreakCell::SetTextExtent(wxCoord WXUNUSED(Width), wxCoord Height, wxCoord WXUNUSED(Descent))
+{
+	m_Height = Height / 2;
+}
+
 void MunkHtmlLineBreakCell::Layout(int w)
 {
 	MunkHtmlCell::Layout(w);
@@ -2294,7 +4897,13 @@ public:
 
 
 private:
+	// Makes m_bitmap from m_image or m_bMissingImage, if it was
+	// put off because the cell was made off the GUI thread.
+	void RealizeBitmap();
+
 	wxBitmap           *m_bitmap;
+	wxImage             m_image;
+	bool                m_bMissingImage;
 	int                 m_bmpW, m_bmpH;
 	bool                m_showFrame:1;
 	MunkHtmlWindowInterface *m_windowIface;
@@ -2322,6 +4931,7 @@ MunkHtmlImageCell::MunkHtmlImageCell(MunkHtmlWindowInterface *windowIface,
     m_scale = scale;
     m_showFrame = false;
     m_bitmap = NULL;
+    m_bMissingImage = false;
     m_bmpW = w;
     m_bmpH = h;
     m_imageMap = NULL;
@@ -2356,8 +4966,9 @@ MunkHtmlImageCell::MunkHtmlImageCell(MunkHtmlWindowInterface *windowIface,
                 if ( m_bmpW == wxDefaultCoord ) m_bmpW = 31;
                 if ( m_bmpH == wxDefaultCoord ) m_bmpH = 33;
             }
-            m_bitmap =
-                new wxBitmap(wxArtProvider::GetBitmap(wxART_MISSING_IMAGE));
+            m_bMissingImage = true;
+            if ( munk_is_gui_thread() )
+                RealizeBitmap();
         }
     }
     //else: ignore the 0-sized images used sometimes on the Web pages
@@ -2410,8 +5021,28 @@ void MunkHtmlImageCell::SetImage(const wxImage& img, double scaleHDPI)
         }
         else
 */
-	m_bitmap = new wxBitmap(img);
+        m_bitmap = NULL;
+        m_image = img;
+        if ( munk_is_gui_thread() )
+            RealizeBitmap();
+    }
+}
+
+void MunkHtmlImageCell::RealizeBitmap()
+{
+    if ( m_image.Ok() )
+    {
+        delete m_bitmap;
+        m_bitmap = new wxBitmap(m_image);
+        m_image.Destroy();
     }
+    else if ( m_bMissingImage )
+    {
+        delete m_bitmap;
+        m_bitmap =
+            new wxBitmap(wxArtProvider::GetBitmap(wxART_MISSING_IMAGE));
+    }
+    m_bMissingImage = false;
 }
 
 
@@ -2426,6 +5057,9 @@ void MunkHtmlImageCell::Draw(wxDC& dc, int x, int y,
                            int WXUNUSED(view_y1), int WXUNUSED(view_y2),
                            MunkHtmlRenderingInfo& WXUNUSED(info))
 {
+    if ( m_image.Ok() || m_bMissingImage )
+        RealizeBitmap();
+
     if ( m_showFrame )
     {
         dc.SetBrush(*wxTRANSPARENT_BRUSH);
@@ -2591,12 +5225,85 @@ GetSelectedTextBgColour(const wxColour& WXUNUSED(clr))
 }
 
 
+//-----------------------------------------------------------------------------
+// MunkHtmlCellArena
+//-----------------------------------------------------------------------------
+
+#define MUNK_CELL_ARENA_BLOCK_SIZE (256*1024)
+
+// Every cell is preceded by a header saying which arena it is in
+// (NULL for the heap).  This is also the alignment of the cells.
+#define MUNK_CELL_HEADER_SIZE 16
+
+MunkHtmlCellArena::MunkHtmlCellArena()
+{
+    m_pFree = NULL;
+    m_nFree = 0;
+    m_nBytesAllocated = 0;
+}
+
+MunkHtmlCellArena::~MunkHtmlCellArena()
+{
+    for (size_t i = 0; i < m_Blocks.size(); ++i)
+        delete[] m_Blocks[i];
+}
+
+void *MunkHtmlCellArena::Allocate(size_t nSize)
+{
+    nSize = (nSize + MUNK_CELL_HEADER_SIZE - 1) & ~((size_t) MUNK_CELL_HEADER_SIZE - 1);
+    m_nBytesAllocated += nSize;
+    if (nSize > m_nFree)
+    {
+        if (nSize > MUNK_CELL_ARENA_BLOCK_SIZE / 4)
+        {
+            char *pBlock = new char[nSize];
+            m_Blocks.push_back(pBlock);
+            return pBlock;
+        }
+        m_pFree = new char[MUNK_CELL_ARENA_BLOCK_SIZE];
+        m_nFree = MUNK_CELL_ARENA_BLOCK_SIZE;
+        m_Blocks.push_back(m_pFree);
+    }
+    char *pResult = m_pFree;
+    m_pFree += nSize;
+    m_nFree -= nSize;
+    return pResult;
+}
+
+
 //-----------------------------------------------------------------------------
 // MunkHtmlCell
 //-----------------------------------------------------------------------------
 
 IMPLEMENT_ABSTRACT_CLASS(MunkHtmlCell, wxObject)
 
+void *MunkHtmlCell::operator new(size_t nSize, MunkHtmlCellArena *pArena)
+{
+    char *pHeader;
+    if (pArena != NULL)
+        pHeader = (char*) pArena->Allocate(MUNK_CELL_HEADER_SIZE + nSize);
+    else
+        pHeader = (char*) ::operator new(MUNK_CELL_HEADER_SIZE + nSize);
+    *(MunkHtmlCellArena**) pHeader = pArena;
+    return pHeader + MUNK_CELL_HEADER_SIZE;
+}
+
+void MunkHtmlCell::operator delete(void *p)
+{
+    if (p == NULL)
+        return;
+    char *pHeader = (char*) p - MUNK_CELL_HEADER_SIZE;
+    // The memory of a cell in an arena goes when the arena goes.
+    if (*(MunkHtmlCellArena**) pHeader == NULL)
+        ::operator delete(pHeader);
+}
+
+void MunkHtmlCell::operator delete(void *p, MunkHtmlCellArena *WXUNUSED(pArena))
+{
+    // Only called if a constructor throws.
+    MunkHtmlCell::operator delete(p);
+}
+
 MunkHtmlCell::MunkHtmlCell() : wxObject()
 {
     m_bIsVisible = true;
@@ -2608,16 +5315,80 @@ MunkHtmlCell::MunkHtmlCell() : wxObject()
     m_ScriptBaseline = 0;                       // <sub> or <sup> baseline
     m_Link = NULL;
     m_CanLiveOnPagebreak = true;
-    m_id = wxT("");
-    m_bmpBg = wxNullBitmap;
-    m_nBackgroundRepeat = 0;
+    m_bHasId = false;
+    m_bLayoutDirty = false;
+}
+
+// A cell starts right after the header that operator new put in
+// front of it, as the cells never have more than one base class.
+static MunkHtmlCellArena *munk_get_cell_arena(const MunkHtmlCell *pCell)
+{
+    return *(MunkHtmlCellArena* const*) ((const char*) pCell - MUNK_CELL_HEADER_SIZE);
+}
+
+// The ids of the cells on the heap.
+static MunkHtmlCellArena::CellIdMap g_HeapCellIds;
+
+static MunkHtmlCellArena::CellIdMap& munk_get_cell_ids(const MunkHtmlCell *pCell)
+{
+    MunkHtmlCellArena *pArena = munk_get_cell_arena(pCell);
+    return pArena != NULL ? pArena->GetCellIds() : g_HeapCellIds;
 }
 
 MunkHtmlCell::~MunkHtmlCell()
 {
-    delete m_Link;
+    if (m_bHasId)
+        munk_get_cell_ids(this).erase(this);
+}
+
+const wxString& MunkHtmlCell::GetId() const
+{
+    static const wxString emptyId;
+    if (!m_bHasId)
+        return emptyId;
+    return munk_get_cell_ids(this)[this];
+}
+
+void MunkHtmlCell::SetId(const wxString& id)
+{
+    if (id.IsEmpty()) {
+        if (m_bHasId)
+            munk_get_cell_ids(this).erase(this);
+        m_bHasId = false;
+    } else {
+        munk_get_cell_ids(this)[this] = id;
+        m_bHasId = true;
+    }
+}
+
+// Word cells, of which there are many, should fit in two cache
+// lines.  Define MUNK_REPORT_CELL_SIZES to have the sizes of all
+// the cells logged when the first window is created.
+wxCOMPILE_TIME_ASSERT(sizeof(MunkHtmlWordCell) + MUNK_CELL_HEADER_SIZE <= 128, MunkHtmlWordCellTooBig);
+
+#ifdef MUNK_REPORT_CELL_SIZES
+// The sizes include the header in front of each cell.
+#define MUNK_REPORT_CELL_SIZE(cls) \
+    wxLogDebug(wxT("%s: %u bytes"), wxT(#cls), (unsigned) (sizeof(cls) + MUNK_CELL_HEADER_SIZE))
+
+static void munk_report_cell_sizes()
+{
+    MUNK_REPORT_CELL_SIZE(MunkHtmlWordCell);
+    MUNK_REPORT_CELL_SIZE(MunkHtmlNegativeSpaceCell);
+    MUNK_REPORT_CELL_SIZE(MunkHtmlFontCell);
+    MUNK_REPORT_CELL_SIZE(MunkHtmlColourCell);
+    MUNK_REPORT_CELL_SIZE(MunkHtmlLineBreakCell);
+    MUNK_REPORT_CELL_SIZE(MunkHtmlTagCell);
+    MUNK_REPORT_CELL_SIZE(MunkHtmlAnchorCell);
+    MUNK_REPORT_CELL_SIZE(MunkHtmlImageCell);
+    MUNK_REPORT_CELL_SIZE(MunkHtmlListmarkCell);
+    MUNK_REPORT_CELL_SIZE(MunkHtmlContainerCell);
+    MUNK_REPORT_CELL_SIZE(MunkHtmlTableCell);
 }
 
+#undef MUNK_REPORT_CELL_SIZE
+#endif // MUNK_REPORT_CELL_SIZES
+
 // Update the descent value when whe are in a <sub> or <sup>.
 // prevbase is the parent base
 void MunkHtmlCell::SetScriptMode(MunkHtmlScriptMode mode, long previousBase)
@@ -2761,18 +5532,17 @@ bool MunkHtmlCell::AdjustPagebreak(int *pagebreak, int render_height,
 
 
 
-void MunkHtmlCell::SetLink(const MunkHtmlLinkInfo& link)
+void MunkHtmlCell::Layout(int WXUNUSED(w))
 {
-    if (m_Link) delete m_Link;
-    m_Link = NULL;
-    if (link.GetHref() != wxEmptyString)
-        m_Link = new MunkHtmlLinkInfo(link);
+    SetPos(0, 0);
 }
 
-
-void MunkHtmlCell::Layout(int WXUNUSED(w))
+void MunkHtmlCell::MarkLayoutDirty()
 {
-    SetPos(0, 0);
+    // All the way up, even past marked containers, as tables and
+    // lists leave the marks of their cells alone.
+    for (MunkHtmlCell *cell = this; cell; cell = cell->GetParent())
+        cell->m_bLayoutDirty = true;
 }
 
 
@@ -2786,17 +5556,19 @@ const MunkHtmlCell* MunkHtmlCell::Find(int WXUNUSED(condition), const void* WXUN
 MunkHtmlCell *MunkHtmlCell::FindCellByPos(wxCoord x, wxCoord y,
                                       unsigned flags) const
 {
-    if ( x >= 0 && x < m_Width && y >= 0 && y < m_Height )
+    wxCoord left, right;
+    GetHitExtent(&left, &right);
+    if ( x >= left && x < right && y >= 0 && y < m_Height )
     {
         return wxConstCast(this, MunkHtmlCell);
     }
     else
     {
         if ((flags & MunkHTML_FIND_NEAREST_AFTER) &&
-                (y < 0 || (y < 0+m_Height && x < 0+m_Width)))
+                (y < 0 || (y < 0+m_Height && x < right)))
             return wxConstCast(this, MunkHtmlCell);
         else if ((flags & MunkHTML_FIND_NEAREST_BEFORE) &&
-                (y >= 0+m_Height || (y >= 0 && x >= 0)))
+                (y >= 0+m_Height || (y >= 0 && x >= left)))
             return wxConstCast(this, MunkHtmlCell);
         else
             return NULL;
@@ -2863,13 +5635,145 @@ bool MunkHtmlCell::IsBefore(MunkHtmlCell *cell) const
         }
         else
         {
-            c1 = c1->m_Parent;
-            c2 = c2->m_Parent;
+            c1 = c1->m_Parent;
+            c2 = c2->m_Parent;
+        }
+    }
+
+    wxFAIL_MSG(_T("Cells are in different trees"));
+    return false;
+}
+
+
+//-----------------------------------------------------------------------------
+// MunkHtmlLinkTable
+//-----------------------------------------------------------------------------
+
+MunkHtmlLinkTable::~MunkHtmlLinkTable()
+{
+    for (LinkMap::iterator it = m_Links.begin(); it != m_Links.end(); ++it)
+        delete it->second;
+}
+
+MunkHtmlLinkInfo *MunkHtmlLinkTable::Intern(const MunkHtmlLinkInfo& link)
+{
+    if (link.GetHref() == wxEmptyString)
+        return NULL;
+
+    std::pair<wxString, wxString> key(link.GetHref(), link.GetTarget());
+    LinkMap::iterator it = m_Links.find(key);
+    if (it != m_Links.end())
+        return it->second;
+
+    MunkHtmlLinkInfo *pLink = new MunkHtmlLinkInfo(key.first, key.second);
+    m_Links.insert(std::make_pair(key, pLink));
+    return pLink;
+}
+
+
+//-----------------------------------------------------------------------------
+// MunkHtmlTextPool
+//-----------------------------------------------------------------------------
+
+#define MUNK_TEXT_POOL_BLOCK_SIZE (64*1024)
+
+MunkHtmlTextPool::MunkHtmlTextPool()
+{
+    m_nInternEntries = 0;
+    m_pFree = NULL;
+    m_nFree = 0;
+}
+
+MunkHtmlTextPool::~MunkHtmlTextPool()
+{
+    for (size_t i = 0; i < m_Blocks.size(); ++i)
+        delete[] m_Blocks[i];
+}
+
+char *MunkHtmlTextPool::Allocate(size_t nLength)
+{
+    if (nLength > m_nFree)
+    {
+        if (nLength > MUNK_TEXT_POOL_BLOCK_SIZE / 4)
+        {
+            // A long text gets a block of its own, so as not to
+            // waste what is left of the current one.
+            char *pBlock = new char[nLength];
+            m_Blocks.push_back(pBlock);
+            return pBlock;
         }
+        m_pFree = new char[MUNK_TEXT_POOL_BLOCK_SIZE];
+        m_nFree = MUNK_TEXT_POOL_BLOCK_SIZE;
+        m_Blocks.push_back(m_pFree);
     }
+    char *pResult = m_pFree;
+    m_pFree += nLength;
+    m_nFree -= nLength;
+    return pResult;
+}
 
-    wxFAIL_MSG(_T("Cells are in different trees"));
-    return false;
+void MunkHtmlTextPool::GrowInternTable()
+{
+    std::vector<InternEntry> oldTable;
+    oldTable.swap(m_InternTable);
+
+    InternEntry empty;
+    empty.m_pText = NULL;
+    empty.m_nLength = 0;
+    m_InternTable.resize(oldTable.empty() ? 1024 : oldTable.size() * 2, empty);
+
+    size_t mask = m_InternTable.size() - 1;
+    for (size_t i = 0; i < oldTable.size(); ++i)
+    {
+        if (oldTable[i].m_pText == NULL)
+            continue;
+        size_t slot = (size_t) munk_hash_bytes(oldTable[i].m_pText, oldTable[i].m_nLength) & mask;
+        while (m_InternTable[slot].m_pText != NULL)
+            slot = (slot + 1) & mask;
+        m_InternTable[slot] = oldTable[i];
+    }
+}
+
+const char *MunkHtmlTextPool::Intern(const char *pUTF8, size_t nLength)
+{
+    if (nLength == 0)
+        return "";
+
+    // Open addressing, kept at most three quarters full
+    if (m_nInternEntries * 4 >= m_InternTable.size() * 3)
+        GrowInternTable();
+
+    size_t mask = m_InternTable.size() - 1;
+    size_t slot = (size_t) munk_hash_bytes(pUTF8, nLength) & mask;
+    while (m_InternTable[slot].m_pText != NULL)
+    {
+        const InternEntry& entry = m_InternTable[slot];
+        if (entry.m_nLength == nLength && memcmp(entry.m_pText, pUTF8, nLength) == 0)
+            return entry.m_pText;
+        slot = (slot + 1) & mask;
+    }
+
+    char *pText = Allocate(nLength);
+    memcpy(pText, pUTF8, nLength);
+    m_InternTable[slot].m_pText = pText;
+    m_InternTable[slot].m_nLength = nLength;
+    ++m_nInternEntries;
+    return pText;
+}
+
+const char *MunkHtmlTextPool::Intern(const wxString& str, size_t *pLength)
+{
+    const wxCharBuffer buf(str.mb_str(wxConvUTF8));
+    const char *pData = buf.data();
+    size_t nLength = pData ? strlen(pData) : 0;
+    *pLength = nLength;
+    return Intern(pData, nLength);
+}
+
+void MunkHtmlTextPool::ReleaseInternTable()
+{
+    std::vector<InternEntry>().swap(m_InternTable);
+    m_nInternEntries = 0;
 }
 
 
@@ -2879,29 +5783,91 @@ bool MunkHtmlCell::IsBefore(MunkHtmlCell *cell) const
 
 IMPLEMENT_ABSTRACT_CLASS(MunkHtmlWordCell, MunkHtmlCell)
 
-MunkHtmlWordCell::MunkHtmlWordCell(const wxString& word, MunkStringMetricsCache *pStringMetricsCache, wxDC *pDC) : MunkHtmlCell()
+MunkHtmlWordCell::MunkHtmlWordCell(MunkHtmlTextPool *pPool, const wxString& word) : MunkHtmlCell()
 {
-    m_Word = word;
-    pStringMetricsCache->GetTextExtent(m_Word, pDC, &m_Width, &m_Height, &m_Descent);
+    if (word.IsEmpty()) {
+        m_pWord = "";
+        m_nWordLength = 0;
+    } else {
+        size_t nLength;
+        m_pWord = pPool->Intern(word, &nLength);
+        m_nWordLength = nLength;
+    }
     SetCanLiveOnPagebreak(false);
     m_allowLinebreak = true;
+    m_bHasTrailingSpace = false;
+    m_bTrailingSpaceVisible = true;
+    m_TrailingSpace = 0;
+    m_pTextStyle = NULL;
 }
 
 MunkHtmlWordCell::MunkHtmlWordCell(long SpaceWidth, long SpaceHeight, long SpaceDescent) : MunkHtmlCell()
 {
-	m_Word = wxT(" ");
+	m_pWord = " ";
+	m_nWordLength = 1;
 	m_Width = SpaceWidth;
 	m_Height = SpaceHeight;
 	m_Descent = SpaceDescent;
 	SetCanLiveOnPagebreak(false);
 	m_allowLinebreak = true;
+	m_bHasTrailingSpace = false;
+	m_bTrailingSpaceVisible = true;
+	m_TrailingSpace = 0;
+	m_pTextStyle = NULL;
+}
+
+void MunkHtmlWordCell::SetTextExtent(wxCoord Width, wxCoord Height, wxCoord Descent)
+{
+	m_Width = Width;
+	m_Height = Height;
+	m_Descent = Descent;
+}
+
+void MunkHtmlWordCell::GetHitExtent(wxCoord *pLeft, wxCoord *pRight) const
+{
+	// The space has no cell of its own, so pointing at it (say,
+	// at the gap in a link) must find the word.
+	*pLeft = 0;
+	*pRight = m_Width;
+	if (m_bTrailingSpaceVisible && m_TrailingSpace > 0 && m_Parent != NULL) {
+		if (m_Parent->GetDirection() == MunkHTML_RTL) {
+			*pLeft = -m_TrailingSpace;
+		} else {
+			*pRight = m_Width + m_TrailingSpace;
+		}
+	}
+}
+
+void MunkHtmlWordCell::AddTrailingSpace(wxCoord SpaceWidth)
+{
+	wxASSERT_MSG(!m_bHasTrailingSpace, wxT("word already has a trailing space"));
+	m_bHasTrailingSpace = true;
+	m_TrailingSpace = SpaceWidth;
+}
+
+// Is the first (or last) character of the UTF-8 text a space?
+static bool munk_utf8_is_space_at(const char *pUTF8, size_t nLength, bool bLast)
+{
+    if (nLength == 0)
+        return false;
+    unsigned char c = (unsigned char) (bLast ? pUTF8[nLength - 1] : pUTF8[0]);
+    if (c < 0x80)
+        return wxIsspace((wxChar) c) != 0;
+
+    // Rare enough that we may as well convert the lot.
+    wxString str(pUTF8, wxConvUTF8, nLength);
+    if (str.IsEmpty())
+        return false;
+    return wxIsspace(bLast ? str.Last() : str[0u]) != 0;
 }
 
 void MunkHtmlWordCell::SetPreviousWord(MunkHtmlWordCell *cell)
 {
     if ( cell && m_Parent == cell->m_Parent
-	 && !(cell->m_Word.IsEmpty())
-	 && !wxIsspace(cell->m_Word.Last()) && !wxIsspace(m_Word[0u]) )
+	 && !cell->m_bHasTrailingSpace
+	 && cell->m_nWordLength != 0
+	 && !munk_utf8_is_space_at(cell->m_pWord, cell->m_nWordLength, true)
+	 && !munk_utf8_is_space_at(m_pWord, m_nWordLength, false) )
     {
         m_allowLinebreak = false;
     }
@@ -2912,7 +5878,7 @@ eWhiteSpaceKind MunkHtmlWordCell::GetWhiteSpaceKind() const
 	return m_Parent->GetWhiteSpaceKind(); 
 }
 
-// Splits m_Word into up to three parts according to selection, returns
+// Splits the word into up to three parts according to selection, returns
 // substring before, in and after selection and the points (in relative coords)
 // where s2 and s3 start:
 void MunkHtmlWordCell::Split(const wxDC& dc,
@@ -2934,7 +5900,8 @@ void MunkHtmlWordCell::Split(const wxDC& dc,
         pt2 = tmp;
     }
 
-    unsigned len = m_Word.length();
+    const wxString word = GetWord();
+    unsigned len = word.length();
     unsigned i = 0;
     pos1 = 0;
 
@@ -2950,7 +5917,7 @@ void MunkHtmlWordCell::Split(const wxDC& dc,
 #ifdef __WXMAC__
     // implementation using PartialExtents to support fractional widths
     wxArrayInt widths ;
-    dc.GetPartialTextExtents(m_Word,widths) ;
+    dc.GetPartialTextExtents(word,widths) ;
     while( i < len && pt1.x >= widths[i] )
         i++ ;
     if ( i < len )
@@ -2960,10 +5927,10 @@ void MunkHtmlWordCell::Split(const wxDC& dc,
             i++;
     }
 #else // !__WXMAC__
-    wxCoord charW, charH;
+    wxCoord charW;
     while ( pt1.x > 0 && i < len )
     {
-        dc.GetTextExtent(m_Word[i], &charW, &charH);
+        charW = GetCharWidth(dc, word[i]);
         pt1.x -= charW;
         if ( pt1.x >= -charW/2 )
         {
@@ -2990,7 +5957,7 @@ void MunkHtmlWordCell::Split(const wxDC& dc,
     pt2.x -= pos2;
     while ( pt2.x > 0 && j < len )
     {
-        dc.GetTextExtent(m_Word[j], &charW, &charH);
+        charW = GetCharWidth(dc, word[j]);
         pt2.x -= charW;
         if ( pt2.x >= -charW/2 )
         {
@@ -3004,6 +5971,20 @@ void MunkHtmlWordCell::Split(const wxDC& dc,
     pos2 = j;
 }
 
+// dc must have the font of the cell.
+wxCoord MunkHtmlWordCell::GetCharWidth(const wxDC& dc, wxUniChar ch) const
+{
+    if (m_pTextStyle == NULL)
+    {
+        wxCoord charW;
+        dc.GetTextExtent(wxString(ch), &charW, NULL);
+        return charW;
+    }
+    MunkFontRegistryKey key(m_pTextStyle->m_FontKey, m_pTextStyle->m_nMagnification,
+                            dc.GetPPI().y, dc.GetClassInfo());
+    return MunkFontRegistry::Get().GetCharWidth(key, ch, &dc);
+}
+
 void MunkHtmlWordCell::SetSelectionPrivPos(const wxDC& dc, MunkHtmlSelection *s) const
 {
     unsigned p1, p2;
@@ -3013,7 +5994,7 @@ void MunkHtmlWordCell::SetSelectionPrivPos(const wxDC& dc, MunkHtmlSelection *s)
           this == s->GetToCell() ? s->GetToPos() : wxDefaultPosition,
           p1, p2);
 
-    wxPoint p(0, m_Word.length());
+    wxPoint p(0, GetWord().length());
 
     if ( this == s->GetFromCell() )
         p.x = p1; // selection starts here
@@ -3078,6 +6059,8 @@ void MunkHtmlWordCell::Draw(wxDC& dc, int x, int y,
 	if (!m_bIsVisible) 
 		return;
 
+	info.ApplyTextStyle(dc, m_pTextStyle);
+
 #if 0 // useful for debugging
     dc.SetPen(*wxBLACK_PEN);
     dc.DrawRectangle(x+m_PosX,y+m_PosY,m_Width /* VZ: +1? */ ,m_Height);
@@ -3089,6 +6072,7 @@ void MunkHtmlWordCell::Draw(wxDC& dc, int x, int y,
     {
         // Selection changing, we must draw the word piecewise:
         MunkHtmlSelection *s = info.GetSelection();
+        const wxString word = GetWord();
         wxString txt;
         int w, h;
         int ofs = 0;
@@ -3113,7 +6097,7 @@ void MunkHtmlWordCell::Draw(wxDC& dc, int x, int y,
 
         if ( part1 > 0 )
         {
-            txt = m_Word.Mid(0, part1);
+            txt = word.Mid(0, part1);
             dc.DrawText(txt, x + m_PosX, y + m_PosY);
             dc.GetTextExtent(txt, &w, &h);
             ofs += w;
@@ -3121,15 +6105,15 @@ void MunkHtmlWordCell::Draw(wxDC& dc, int x, int y,
 
         SwitchSelState(dc, info, true);
 
-        txt = m_Word.Mid(part1, part2-part1);
+        txt = word.Mid(part1, part2-part1);
         dc.DrawText(txt, ofs + x + m_PosX, y + m_PosY);
 
-        if ( (size_t)part2 < m_Word.length() )
+        if ( (size_t)part2 < word.length() )
         {
             dc.GetTextExtent(txt, &w, &h);
             ofs += w;
             SwitchSelState(dc, info, false);
-            txt = m_Word.Mid(part2);
+            txt = word.Mid(part2);
             dc.DrawText(txt, ofs + x + m_PosX, y + m_PosY);
         }
         else
@@ -3149,7 +6133,7 @@ void MunkHtmlWordCell::Draw(wxDC& dc, int x, int y,
         {
             SwitchSelState(dc, info, false);
         }
-        dc.DrawText(m_Word, x + m_PosX, y + m_PosY);
+        dc.DrawText(GetWord(), x + m_PosX, y + m_PosY);
         drawSelectionAfterCell = (selstate != MunkHTML_SEL_OUT);
     }
 
@@ -3161,7 +6145,18 @@ void MunkHtmlWordCell::Draw(wxDC& dc, int x, int y,
 	    dc.SetPen(wxPen(penColour,
 			    1, // width
 			    wxPENSTYLE_SOLID));
-	    dc.DrawLine(x + m_PosX, y + m_PosY + m_Height - m_Descent, x + m_PosX + m_Width + 1, y + m_PosY + m_Height - m_Descent);
+	    // The trailing space, if shown, is underlined as well, as
+	    // it was when it had a cell of its own.
+	    int nLineStart = x + m_PosX;
+	    int nLineEnd = x + m_PosX + m_Width + 1;
+	    if (m_bTrailingSpaceVisible) {
+		    if (m_Parent->GetDirection() == MunkHTML_RTL) {
+			    nLineStart -= m_TrailingSpace;
+		    } else {
+			    nLineEnd += m_TrailingSpace;
+		    }
+	    }
+	    dc.DrawLine(nLineStart, y + m_PosY + m_Height - m_Descent, nLineEnd, y + m_PosY + m_Height - m_Descent);
 	    dc.SetPen(wxNullPen);
     }
 
@@ -3188,6 +6183,16 @@ void MunkHtmlWordCell::Draw(wxDC& dc, int x, int y,
             }
         }
     }
+    else if ( drawSelectionAfterCell &&
+              m_bTrailingSpaceVisible && m_TrailingSpace > 0 )
+    {
+        // The trailing space is selected along with the word.
+        int spaceX = (m_Parent->GetDirection() == MunkHTML_RTL)
+                     ? m_PosX - m_TrailingSpace : m_PosX + m_Width;
+        dc.SetBrush(dc.GetBackground());
+        dc.SetPen(*wxTRANSPARENT_PEN);
+        dc.DrawRectangle(x + spaceX, y + m_PosY, m_TrailingSpace, m_Height);
+    }
 }
 
 
@@ -3211,12 +6216,18 @@ wxString MunkHtmlWordCell::ConvertToText(MunkHtmlSelection *s) const
             int part2 = priv.y;
 	    if ( part1 == part2 ) 
 		    return wxEmptyString;
-            return m_Word.Mid(part1, part2-part1);
+            wxString text = GetWord().Mid(part1, part2-part1);
+
+            // The trailing space is selected unless the selection
+            // ends in this word.
+            if ( m_bHasTrailingSpace && this != s->GetToCell() )
+                text += wxT(' ');
+            return text;
         }
         //else: return the whole word below
     }
 
-    return m_Word;
+    return toString();
 }
 
 wxCursor MunkHtmlWordCell::GetMouseCursor(MunkHtmlWindowInterface *window) const
@@ -3256,6 +6267,12 @@ MunkHtmlContainerCell::MunkHtmlContainerCell(MunkHtmlContainerCell *parent) : Mu
 	m_MinHeightAlign = MunkHTML_ALIGN_TOP;
 	m_LastLayout = -1;
 	m_pBgImg = 0;
+	m_pTextPool = 0;
+	m_pLinkTable = 0;
+	m_pTextStyleTable = 0;
+	m_pCellArena = 0;
+	m_bmpBg = wxNullBitmap;
+	m_nBackgroundRepeat = 0;
 	m_DeclaredHeight = -1; // Negative means: We haven't set the declared height
 	m_direction = MunkHTML_LTR;
 	m_BorderWidthTop = m_BorderWidthRight = m_BorderWidthBottom = m_BorderWidthLeft = 0;
@@ -3263,6 +6280,8 @@ MunkHtmlContainerCell::MunkHtmlContainerCell(MunkHtmlContainerCell *parent) : Mu
 	m_BorderStyleRight = MunkHTML_BORDER_STYLE_NONE;
 	m_BorderStyleBottom = MunkHTML_BORDER_STYLE_NONE;
 	m_BorderStyleLeft = MunkHTML_BORDER_STYLE_NONE;
+	m_bHasPagebreakCell = true;
+	m_ChildLayoutWidth = 0;
 	SetWhiteSpaceKind(kWSKNormal);
 }
 
@@ -3280,6 +6299,17 @@ void MunkHtmlContainerCell::SetBackgroundColour(const wxColour& clr)
 	}
 }
 
+void MunkHtmlContainerCell::SetBackgroundImage(const wxImage& imgBg)
+{
+	if (munk_is_gui_thread()) {
+		m_bmpBg = wxBitmap(imgBg, -1);
+		m_imgBg = wxNullImage;
+	} else {
+		m_bmpBg = wxNullBitmap;
+		m_imgBg = imgBg;
+	}
+}
+
 MunkHtmlContainerCell::~MunkHtmlContainerCell()
 {
     MunkHtmlCell *cell = m_Cells;
@@ -3289,6 +6319,30 @@ MunkHtmlContainerCell::~MunkHtmlContainerCell()
         delete cell;
         cell = cellNext;
     }
+    delete m_pTextPool;
+    delete m_pLinkTable;
+    delete m_pTextStyleTable;
+    // Last, as the cells above lived in it.
+    delete m_pCellArena;
+}
+
+void MunkHtmlContainerCell::AdoptLinkTable(MunkHtmlLinkTable *pLinkTable)
+{
+    delete m_pLinkTable;
+    m_pLinkTable = pLinkTable;
+}
+
+void MunkHtmlContainerCell::AdoptTextStyleTable(MunkHtmlTextStyleTable *pTextStyleTable)
+{
+    delete m_pTextStyleTable;
+    m_pTextStyleTable = pTextStyleTable;
+}
+
+void MunkHtmlContainerCell::AdoptCellArena(MunkHtmlCellArena *pArena)
+{
+    wxASSERT_MSG(m_Cells == NULL, wxT("the cell arena must be adopted before any cells are added"));
+    delete m_pCellArena;
+    m_pCellArena = pArena;
 }
 
 void MunkHtmlContainerCell::SetDirection(const MunkHtmlTag& tag)
@@ -3315,7 +6369,7 @@ void MunkHtmlContainerCell::SetDirection(const MunkHtmlTag& tag)
 }
 
 
-void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string& tag, const MunkHtmlTag& munkTag, wxString& css_style, int CurrentCharHeight)
+void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string& tag, const MunkHtmlTag& munkTag, wxString *pCssStyle, int CurrentCharHeight)
 {
 	int margin_top = 0;
 	int margin_right = 0;
@@ -3337,7 +6391,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 		}
 		
 		margin_top = margin_right = margin_bottom = margin_left = margin;
-		css_style += wxString::Format(wxT("margin : %dpx;"), margin_top);
+		if (pCssStyle != NULL) {
+			*pCssStyle += wxString::Format(wxT("margin : %dpx;"), margin_top);
+		}
 	} else {
 
 		// NONSTANDARD		
@@ -3352,7 +6408,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 
 			margin_top = marginTop;
 		
-			css_style += wxString::Format(wxT("margin-top : %dpx;"), margin_top);
+			if (pCssStyle != NULL) {
+				*pCssStyle += wxString::Format(wxT("margin-top : %dpx;"), margin_top);
+			}
 		} else {
 			if (tag == "p" 
 			    || tag == "center"
@@ -3381,7 +6439,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 			
 			margin_right = marginRight;
 			
-			css_style += wxString::Format(wxT("margin-right : %dpx;"), margin_right);
+			if (pCssStyle != NULL) {
+				*pCssStyle += wxString::Format(wxT("margin-right : %dpx;"), margin_right);
+			}
 		} else {
 			margin_right = 0;
 		}
@@ -3398,7 +6458,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 
 			margin_bottom = marginBottom;
 
-			css_style += wxString::Format(wxT("margin-bottom : %dpx;"), margin_bottom);
+			if (pCssStyle != NULL) {
+				*pCssStyle += wxString::Format(wxT("margin-bottom : %dpx;"), margin_bottom);
+			}
 		} else {
 			int indent_bottom = 0;
 			if (tag == "h1" || tag == "h2" || tag == "h3") {
@@ -3420,7 +6482,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 
 			margin_left = marginLeft;
 
-			css_style += wxString::Format(wxT("margin-left : %dpx;"), margin_left);
+			if (pCssStyle != NULL) {
+				*pCssStyle += wxString::Format(wxT("margin-left : %dpx;"), margin_left);
+			}
 		} else {
 			margin_left = 0;
 		}
@@ -3444,7 +6508,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 		}
 		
 		padding_top = padding_right = padding_bottom = padding_left = padding;
-		css_style += wxString::Format(wxT("padding : %dpx;"), padding_top);
+		if (pCssStyle != NULL) {
+			*pCssStyle += wxString::Format(wxT("padding : %dpx;"), padding_top);
+		}
 	} else {
 
 		// NONSTANDARD		
@@ -3459,7 +6525,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 
 			padding_top = paddingTop;
 		
-			css_style += wxString::Format(wxT("padding-top : %dpx;"), padding_top);
+			if (pCssStyle != NULL) {
+				*pCssStyle += wxString::Format(wxT("padding-top : %dpx;"), padding_top);
+			}
 		} else {
 			padding_top = 0;
 		}
@@ -3477,7 +6545,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 			
 			padding_right = paddingRight;
 			
-			css_style += wxString::Format(wxT("padding-right : %dpx;"), padding_right);
+			if (pCssStyle != NULL) {
+				*pCssStyle += wxString::Format(wxT("padding-right : %dpx;"), padding_right);
+			}
 		} else {
 			padding_right = 0;
 		}
@@ -3494,7 +6564,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 
 			padding_bottom = paddingBottom;
 
-			css_style += wxString::Format(wxT("padding-bottom : %dpx;"), padding_bottom);
+			if (pCssStyle != NULL) {
+				*pCssStyle += wxString::Format(wxT("padding-bottom : %dpx;"), padding_bottom);
+			}
 		} else {
 			padding_bottom = 0;
 		}
@@ -3511,7 +6583,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 
 			padding_left = paddingLeft;
 
-			css_style += wxString::Format(wxT("padding-left : %dpx;"), padding_left);
+			if (pCssStyle != NULL) {
+				*pCssStyle += wxString::Format(wxT("padding-left : %dpx;"), padding_left);
+			}
 		} else {
 			padding_left = 0;
 		}
@@ -3543,7 +6617,9 @@ void MunkHtmlContainerCell::SetMarginsAndPaddingAndTextIndent(const std::string&
 		int first_line_indent = firstLineIndent;
 
 		this->SetFirstLineIndent(first_line_indent);
-		css_style += wxString::Format(wxT("text-indent : %dpx;"), first_line_indent);
+		if (pCssStyle != NULL) {
+			*pCssStyle += wxString::Format(wxT("text-indent : %dpx;"), first_line_indent);
+		}
 	} else {
 		this->SetFirstLineIndent(0);
 	}
@@ -3593,14 +6669,35 @@ bool MunkHtmlContainerCell::AdjustPagebreak(int *pagebreak, int render_height,
     if (!m_CanLiveOnPagebreak)
 	    return MunkHtmlCell::AdjustPagebreak(pagebreak, render_height, known_pagebreaks);
 
-    MunkHtmlCell *c = GetFirstChild();
     bool rt = false;
     int pbrk = *pagebreak - m_PosY;
-    while (c)
+    if (!m_Lines.empty() && !m_bHasPagebreakCell)
+    {
+        // The lines which end above the pagebreak cannot move it, nor
+        // can those which start below it, as it only ever moves up.
+        for (size_t nLine = FindLineBelow(pbrk);
+             nLine < m_Lines.size() && m_Lines[nLine].m_PosY < pbrk;
+             ++nLine)
+        {
+            const MunkHtmlLineBox& box = m_Lines[nLine];
+            for (MunkHtmlCell *c = box.m_pFirst; ; c = c->GetNext())
+            {
+                if (c->AdjustPagebreak(&pbrk, render_height, known_pagebreaks))
+                    rt = true;
+                if (c == box.m_pLast)
+                    break;
+            }
+        }
+    }
+    else
     {
-	    if (c->AdjustPagebreak(&pbrk, render_height, known_pagebreaks))
-            rt = true;
-        c = c->GetNext();
+        MunkHtmlCell *c = GetFirstChild();
+        while (c)
+        {
+            if (c->AdjustPagebreak(&pbrk, render_height, known_pagebreaks))
+                rt = true;
+            c = c->GetNext();
+        }
     }
     if (rt)
         *pagebreak = pbrk + m_PosY;
@@ -3613,10 +6710,14 @@ void MunkHtmlContainerCell::Layout(int w)
 	MunkHtmlCell::Layout(w);
 	MunkHtmlCell::SetVisible(true);
 	
-	if (m_LastLayout == w) {
+	if (m_LastLayout == w
+	    && (!m_bLayoutDirty || RelayoutDirtyLines())) {
+		m_bLayoutDirty = false;
 		return;
 	}
 	m_LastLayout = w;
+	m_Lines.clear();
+	m_bLayoutDirty = false;
 
 	// VS: Any attempt to layout with negative or zero width leads to hell,
 	// but we can't ignore such attempts completely, since it sometimes
@@ -3626,6 +6727,7 @@ void MunkHtmlContainerCell::Layout(int w)
 		m_Width = 0;
 		for (MunkHtmlCell *cell = m_Cells; cell; cell = cell->GetNext()) {
 			cell->Layout(0);
+			cell->ClearLayoutDirty();
 		}
 		// this does two things: it recursively calls this code on all
 		// child contrainers and resets children's position to (0,0)
@@ -3673,11 +6775,17 @@ void MunkHtmlContainerCell::Layout(int w)
 		}
 	}
 	
+	m_bHasPagebreakCell = false;
 	if (m_Cells) {
 		int l = (m_IndentLeft < 0) ? (-m_IndentLeft * m_Width / 100) : m_IndentLeft;
 		int r = (m_IndentRight < 0) ? (-m_IndentRight * m_Width / 100) : m_IndentRight;
+		m_ChildLayoutWidth = m_Width - (l + r);
 		for (MunkHtmlCell *cell = m_Cells; cell; cell = cell->GetNext()) {
-			cell->Layout(m_Width - (l + r));
+			cell->Layout(m_ChildLayoutWidth);
+			cell->ClearLayoutDirty();
+			if (cell->HasPagebreakCell()) {
+				m_bHasPagebreakCell = true;
+			}
 		}
 	}
 	if (IsInlineBlock()) {
@@ -3727,7 +6835,9 @@ void MunkHtmlContainerCell::Layout(int w)
 
 	// my own layouting:
 	MunkHtmlCell *cell = m_Cells,
-		*line = m_Cells;
+		*line = m_Cells,
+		*lineLast = NULL;
+	bool bLineNeedsDrawInvisible = false;
 	while (cell != NULL) {
 		if (!bIsFirstLine && lineWidth == 0) {
 			// If we aren't on the first line,
@@ -3776,6 +6886,10 @@ void MunkHtmlContainerCell::Layout(int w)
 		// xpos is distinct from lineWidth
 		lineWidth += cell->GetWidth();
 
+		if (cell->NeedsDrawInvisible()) {
+			bLineNeedsDrawInvisible = true;
+		}
+
 
  		if (!cell->IsTerminalCell()
 		    && !cell->IsInlineBlock()) {
@@ -3793,6 +6907,29 @@ void MunkHtmlContainerCell::Layout(int w)
 			curLineWidth += cell->GetMaxTotalWidth();
 		}
 
+		// A trailing space is laid out as if it were a cell of
+		// its own: if it does not fit on the line, the line is
+		// broken at it, and it is not shown.
+		bool bBreakAtTrailingSpace = false;
+		wxCoord trailingSpace = cell->GetTrailingSpace();
+		if (trailingSpace > 0) {
+			curLineWidth += trailingSpace;
+			if (lineWidth + trailingSpace > s_width
+			    && this->GetWhiteSpaceKind() != kWSKNowrap) {
+				cell->SetTrailingSpaceVisible(false);
+				bBreakAtTrailingSpace = true;
+			} else {
+				cell->SetTrailingSpaceVisible(true);
+				if (m_direction == MunkHTML_RTL) {
+					xpos -= trailingSpace;
+				} else {
+					xpos += trailingSpace;
+				}
+				lineWidth += trailingSpace;
+			}
+		}
+
+		lineLast = cell;
 		cell = cell->GetNext();
 	
 		// compute length of the next word that would be added:
@@ -3807,7 +6944,8 @@ void MunkHtmlContainerCell::Layout(int w)
 
 		// force new line if occurred:
 		if ((cell == NULL) ||
-		    ((((lineWidth + nextWordWidth > s_width) && cell->IsLinebreakAllowed())
+		    ((bBreakAtTrailingSpace
+		     || ((lineWidth + nextWordWidth > s_width) && cell->IsLinebreakAllowed())
 		     || cell->ForceLineBreak())
 		     && (this->GetWhiteSpaceKind() != kWSKNowrap))) {
 			if (lineWidth > MaxLineWidth) {
@@ -3873,6 +7011,8 @@ void MunkHtmlContainerCell::Layout(int w)
 				xdelta = 0;
 			}
 
+			int lineTop = ypos;
+			MunkHtmlCell *lineFirst = line;
 			ypos += ysizeup;
 
 
@@ -3967,6 +7107,16 @@ void MunkHtmlContainerCell::Layout(int w)
 			}
 				
 			ypos += ysizedown;
+			m_Lines.push_back(MunkHtmlLineBox());
+			MunkHtmlLineBox& box = m_Lines.back();
+			box.m_pFirst = lineFirst;
+			box.m_pLast = lineLast;
+			box.m_PosY = lineTop;
+			box.m_Height = ypos - lineTop;
+			box.m_Baseline = lineTop + ysizeup;
+			box.m_bNeedsDrawInvisible = bLineNeedsDrawInvisible;
+			bLineNeedsDrawInvisible = false;
+
 			lineWidth = 0;
 			if (m_direction == MunkHTML_RTL) {
 				xpos = m_Width - s_indent;
@@ -3979,6 +7129,11 @@ void MunkHtmlContainerCell::Layout(int w)
 		}
 	}
 
+	// Spaces skipped after the last break belong to the last line
+	if (line != NULL && !m_Lines.empty()) {
+		m_Lines.back().m_pLast = m_LastCell;
+	}
+
 	// setup height & width, depending on container layout:
 	if (m_DeclaredHeight >= 0) {
 		m_Height = m_DeclaredHeight;
@@ -3998,6 +7153,10 @@ void MunkHtmlContainerCell::Layout(int w)
 				cell->SetPos(cell->GetPosX(), cell->GetPosY() + diff);
 				cell = cell->GetNext();
 			}
+			for (size_t nLine = 0; nLine < m_Lines.size(); ++nLine) {
+				m_Lines[nLine].m_PosY += diff;
+				m_Lines[nLine].m_Baseline += diff;
+			}
 		}
 		m_Height = m_MinHeight;
 	}
@@ -4019,6 +7178,110 @@ void MunkHtmlContainerCell::Layout(int w)
 	m_LastLayout = w;
 }
 	
+bool MunkHtmlContainerCell::RelayoutDirtyLines()
+{
+	// Only a cell alone on its line, whose width stays the same, can
+	// be laid out again without breaking the lines anew; and only if
+	// the height of the container follows from those of the lines.
+	if (m_Lines.empty()
+	    || (m_AlignVer != MunkHTML_ALIGN_TOP && m_AlignVer != MunkHTML_ALIGN_BOTTOM)
+	    || m_DeclaredHeight >= 0
+	    || m_MinHeight != 0
+	    || IsInlineBlock()) {
+		return false;
+	}
+
+	int shift = 0;
+	for (size_t nLine = 0; nLine < m_Lines.size(); ++nLine) {
+		MunkHtmlLineBox& box = m_Lines[nLine];
+		box.m_PosY += shift;
+		box.m_Baseline += shift;
+
+		MunkHtmlCell *dirty = NULL;
+		for (MunkHtmlCell *cell = box.m_pFirst; ; cell = cell->GetNext()) {
+			if (shift != 0) {
+				cell->SetPos(cell->GetPosX(), cell->GetPosY() + shift);
+			}
+			if (cell->IsLayoutDirty()) {
+				if (dirty != NULL) {
+					return false;
+				}
+				dirty = cell;
+			}
+			if (cell == box.m_pLast) {
+				break;
+			}
+		}
+		if (dirty == NULL) {
+			continue;
+		}
+		for (MunkHtmlCell *cell = box.m_pFirst; ; cell = cell->GetNext()) {
+			if (cell != dirty && cell->IsVisible() && !cell->IsFormattingCell()) {
+				return false;
+			}
+			if (cell == box.m_pLast) {
+				break;
+			}
+		}
+
+		int x = dirty->GetPosX();
+		int width = dirty->GetWidth();
+		int maxTotalWidth = dirty->GetMaxTotalWidth();
+		dirty->Layout(m_ChildLayoutWidth);
+		dirty->ClearLayoutDirty();
+		if (dirty->GetWidth() != width
+		    || dirty->GetMaxTotalWidth() != maxTotalWidth) {
+			return false;
+		}
+
+		// As in Layout(), for a line of one cell
+		int ybasicpos = (m_AlignVer == MunkHTML_ALIGN_TOP) ? 0 : - dirty->GetHeight();
+		int ysizeup = wxMax(0, - (ybasicpos + dirty->GetDescent()));
+		int ysizedown = wxMax(0, dirty->GetDescent() + dirty->GetHeight() + ybasicpos);
+		dirty->SetPos(x, box.m_PosY + ysizeup + ybasicpos + dirty->GetDescent());
+
+		int height = ysizeup + ysizedown;
+		shift += height - box.m_Height;
+		box.m_Height = height;
+		box.m_Baseline = box.m_PosY + ysizeup;
+		for (MunkHtmlCell *cell = box.m_pFirst; ; cell = cell->GetNext()) {
+			// The formatting cells sit on the baseline
+			if (cell != dirty && cell->IsVisible()) {
+				cell->SetPos(cell->GetPosX(), box.m_Baseline);
+			}
+			if (cell == box.m_pLast) {
+				break;
+			}
+		}
+	}
+
+	m_Height += shift;
+	return true;
+}
+
+size_t MunkHtmlContainerCell::FindLineBelow(int y) const
+{
+    size_t nLow = 0;
+    size_t nHigh = m_Lines.size();
+    while (nLow < nHigh)
+    {
+        size_t nMiddle = nLow + (nHigh - nLow) / 2;
+        if (m_Lines[nMiddle].m_PosY + m_Lines[nMiddle].m_Height > y)
+            nHigh = nMiddle;
+        else
+            nLow = nMiddle + 1;
+    }
+    return nLow;
+}
+
+const MunkHtmlLineBox *MunkHtmlContainerCell::FindLine(int y) const
+{
+    size_t nLine = FindLineBelow(y);
+    if (nLine == m_Lines.size() || m_Lines[nLine].m_PosY > y)
+        return NULL;
+    return &m_Lines[nLine];
+}
+
 void MunkHtmlContainerCell::UpdateRenderingStatePre(MunkHtmlRenderingInfo& info,
                                                   MunkHtmlCell *cell) const
 {
@@ -4044,6 +7307,21 @@ void MunkHtmlContainerCell::UpdateRenderingStatePost(MunkHtmlRenderingInfo& info
 #define mMin(a, b) (((a) < (b)) ? (a) : (b))
 #define mMax(a, b) (((a) < (b)) ? (b) : (a))
 
+// The cells of box which are out of view, for MunkHtmlContainerCell::Draw().
+static void munk_draw_invisible_line(wxDC& dc, int x, int y,
+                                     MunkHtmlRenderingInfo& info,
+                                     const MunkHtmlLineBox& box)
+{
+    if (!box.m_bNeedsDrawInvisible)
+        return;
+    for (MunkHtmlCell *cell = box.m_pFirst; ; cell = cell->GetNext())
+    {
+        cell->DrawInvisible(dc, x, y, info);
+        if (cell == box.m_pLast)
+            break;
+    }
+}
+
 void MunkHtmlContainerCell::Draw(wxDC& dc, int x, int y, int view_y1, int view_y2,
                                MunkHtmlRenderingInfo& info)
 {
@@ -4055,6 +7333,12 @@ void MunkHtmlContainerCell::Draw(wxDC& dc, int x, int y, int view_y1, int view_y
     int xlocal = x + m_PosX;
     int ylocal = y + m_PosY;
 
+    if (m_imgBg.Ok())
+    {
+        m_bmpBg = wxBitmap(m_imgBg, -1);
+        m_imgBg.Destroy();
+    }
+
     if (m_UseBkColour || m_bmpBg.Ok())
     {
 	    wxColour colorToUse;
@@ -4240,7 +7524,36 @@ void MunkHtmlContainerCell::Draw(wxDC& dc, int x, int y, int view_y1, int view_y
 	    //dc.DrawLine(xlocal, ylocal + m_Height - 1, xlocal + m_Width, ylocal + m_Height - 1);
     }
 
-    if (m_Cells)
+    if (m_Cells && !m_Lines.empty())
+    {
+        // Only the lines in view are gone through cell by cell.
+        size_t nFirst = FindLineBelow(view_y1 - ylocal);
+        size_t nLine;
+        for (nLine = 0; nLine < nFirst; ++nLine)
+            munk_draw_invisible_line(dc, xlocal, ylocal, info, m_Lines[nLine]);
+        for (; nLine < m_Lines.size() && ylocal + m_Lines[nLine].m_PosY <= view_y2; ++nLine)
+        {
+            const MunkHtmlLineBox& box = m_Lines[nLine];
+            for (MunkHtmlCell *cell = box.m_pFirst; ; cell = cell->GetNext())
+            {
+                if ((ylocal + cell->GetPosY() <= view_y2) &&
+                    (ylocal + cell->GetPosY() + cell->GetHeight() > view_y1)) {
+                    UpdateRenderingStatePre(info, cell);
+                    cell->Draw(dc,
+                               xlocal, ylocal, view_y1, view_y2,
+                               info);
+                    UpdateRenderingStatePost(info, cell);
+                } else {
+                    cell->DrawInvisible(dc, xlocal, ylocal, info);
+                }
+                if (cell == box.m_pLast)
+                    break;
+            }
+        }
+        for (; nLine < m_Lines.size(); ++nLine)
+            munk_draw_invisible_line(dc, xlocal, ylocal, info, m_Lines[nLine]);
+    }
+    else if (m_Cells)
     {
         // draw container's contents:
         for (MunkHtmlCell *cell = m_Cells; cell; cell = cell->GetNext())
@@ -4323,6 +7636,7 @@ void MunkHtmlContainerCell::InsertCell(MunkHtmlCell *f)
     }
     f->SetParent(this);
     m_LastLayout = -1;
+    m_Lines.clear();
 }
 
 
@@ -4513,14 +7827,27 @@ const MunkHtmlCell* MunkHtmlContainerCell::Find(int condition, const void* param
 MunkHtmlCell *MunkHtmlContainerCell::FindCellByPos(wxCoord x, wxCoord y,
                                                unsigned flags) const
 {
+    // The lines which end above y hold no cell at y, nor after it.
+    size_t nLine = FindLineBelow(y);
     if ( flags & MunkHTML_FIND_EXACT )
     {
-        for ( const MunkHtmlCell *cell = m_Cells; cell; cell = cell->GetNext() )
+        const MunkHtmlCell *cell = m_Cells;
+        const MunkHtmlCell *last = NULL;
+        if ( !m_Lines.empty() )
+        {
+            if ( nLine == m_Lines.size() || m_Lines[nLine].m_PosY > y )
+                return NULL;
+            cell = m_Lines[nLine].m_pFirst;
+            last = m_Lines[nLine].m_pLast;
+        }
+        for ( ; cell; cell = (cell == last) ? NULL : cell->GetNext() )
         {
             int cx = cell->GetPosX(),
                 cy = cell->GetPosY();
+            wxCoord left, right;
+            cell->GetHitExtent(&left, &right);
 
-            if ( (cx <= x) && (cx + cell->GetWidth() > x) &&
+            if ( (cx + left <= x) && (cx + right > x) &&
                  (cy <= y) && (cy + cell->GetHeight() > y) )
             {
                 return cell->FindCellByPos(x - cx, y - cy, flags);
@@ -4530,7 +7857,14 @@ MunkHtmlCell *MunkHtmlContainerCell::FindCellByPos(wxCoord x, wxCoord y,
     else if ( flags & MunkHTML_FIND_NEAREST_AFTER )
     {
         MunkHtmlCell *c;
-        for ( const MunkHtmlCell *cell = m_Cells; cell; cell = cell->GetNext() )
+        const MunkHtmlCell *first = m_Cells;
+        if ( !m_Lines.empty() )
+        {
+            if ( nLine == m_Lines.size() )
+                return NULL;
+            first = m_Lines[nLine].m_pFirst;
+        }
+        for ( const MunkHtmlCell *cell = first; cell; cell = cell->GetNext() )
         {
             if ( cell->IsFormattingCell() )
                 continue;
@@ -4546,7 +7880,10 @@ MunkHtmlCell *MunkHtmlContainerCell::FindCellByPos(wxCoord x, wxCoord y,
     else if ( flags & MunkHTML_FIND_NEAREST_BEFORE )
     {
         MunkHtmlCell *c2, *c = NULL;
-        for ( const MunkHtmlCell *cell = m_Cells; cell; cell = cell->GetNext() )
+        const MunkHtmlCell *first = m_Cells;
+        if ( !m_Lines.empty() )
+            first = (nLine < m_Lines.size()) ? m_Lines[nLine].m_pFirst : NULL;
+        for ( const MunkHtmlCell *cell = first; cell; cell = cell->GetNext() )
         {
             if ( cell->IsFormattingCell() )
                 continue;
@@ -4559,6 +7896,25 @@ MunkHtmlCell *MunkHtmlContainerCell::FindCellByPos(wxCoord x, wxCoord y,
                 c = c2;
         }
         if (c) return c;
+
+        // All the cells of the lines above are before (x, y), so the
+        // nearest is the last one found on the closest of them.
+        while ( !m_Lines.empty() && nLine > 0 )
+        {
+            const MunkHtmlLineBox& box = m_Lines[--nLine];
+            for ( const MunkHtmlCell *cell = box.m_pFirst; ; cell = cell->GetNext() )
+            {
+                if ( !cell->IsFormattingCell() )
+                {
+                    c2 = cell->FindCellByPos(x - cell->GetPosX(), y - cell->GetPosY(), flags);
+                    if (c2)
+                        c = c2;
+                }
+                if ( cell == box.m_pLast )
+                    break;
+            }
+            if (c) return c;
+        }
     }
 
     return NULL;
@@ -4719,13 +8075,19 @@ void MunkHtmlContainerCell::RemoveExtraSpacing(bool top, bool bottom)
 
 IMPLEMENT_ABSTRACT_CLASS(MunkHtmlNegativeSpaceCell, MunkHtmlCell)
 
-MunkHtmlNegativeSpaceCell::MunkHtmlNegativeSpaceCell(int pixels, MunkStringMetricsCache *pStringMetricsCache, wxDC *pDC) : MunkHtmlWordCell(wxT(""), pStringMetricsCache, pDC)
+MunkHtmlNegativeSpaceCell::MunkHtmlNegativeSpaceCell(int pixels) : MunkHtmlWordCell(NULL, wxT(""))
 {
 	SetCanLiveOnPagebreak(false);
 	m_allowLinebreak = false;
 	m_Width = -pixels;
 }
 
+void MunkHtmlNegativeSpaceCell::SetTextExtent(wxCoord WXUNUSED(Width), wxCoord Height, wxCoord Descent)
+{
+	m_Height = Height;
+	m_Descent = Descent;
+}
+
 
 void MunkHtmlNegativeSpaceCell::Draw(wxDC& dc, int x, int y,
 				     int WXUNUSED(view_y1), int WXUNUSED(view_y2),
@@ -4751,42 +8113,111 @@ void MunkHtmlColourCell::Draw(wxDC& dc,
     DrawInvisible(dc, x, y, info);
 }
 
+// Shared by MunkHtmlColourCell and MunkHtmlRenderingInfo::ApplyTextStyle.
+static void munk_apply_fg_colour(wxDC& dc, MunkHtmlRenderingInfo& info, const wxColour& colour)
+{
+    MunkHtmlRenderingState& state = info.GetState();
+    if (colour != state.GetFgColour()) {
+	    state.SetFgColour(colour);
+    } 
+    if (state.GetSelectionState() != MunkHTML_SEL_IN) {
+	    dc.SetTextForeground(colour);
+    } else {
+	    dc.SetTextForeground(info.GetStyle().GetSelectedTextColour(colour));
+    }
+}
+
+static void munk_apply_bg_colour(wxDC& dc, MunkHtmlRenderingInfo& info, const wxColour& colour, const wxBrush& brush)
+{
+    MunkHtmlRenderingState& state = info.GetState();
+    if (state.GetBgColour() != colour) {
+	    state.SetBgColour(colour);
+    }
+
+    if (state.GetSelectionState() != MunkHTML_SEL_IN) {
+	    if (colour != wxNullColour) {
+		    dc.SetTextBackground(colour);
+		    dc.SetBackground(brush);
+		    dc.SetBackgroundMode(wxSOLID);
+	    }
+    } else {
+	    wxColour c = info.GetStyle().GetSelectedTextBgColour(colour);
+	    if (c != wxNullColour) {
+		    dc.SetTextBackground(c);
+		    dc.SetBackground(wxBrush(c, wxBRUSHSTYLE_SOLID));
+	    }
+    }
+}
+
 void MunkHtmlColourCell::DrawInvisible(wxDC& dc,
                                      int WXUNUSED(x), int WXUNUSED(y),
                                      MunkHtmlRenderingInfo& info)
 {
-    MunkHtmlRenderingState& state = info.GetState();
+    info.ForgetTextStyle();
     if (m_Flags & MunkHTML_CLR_FOREGROUND)
-    {
-	    if (m_Colour != state.GetFgColour()) {
-		    state.SetFgColour(m_Colour);
-	    } 
-	    if (state.GetSelectionState() != MunkHTML_SEL_IN) {
-		    dc.SetTextForeground(m_Colour);
-	    } else {
-		    dc.SetTextForeground(info.GetStyle().GetSelectedTextColour(m_Colour));
-	    }
-    }
+        munk_apply_fg_colour(dc, info, m_Colour);
     if (m_Flags & MunkHTML_CLR_BACKGROUND)
-    {
-	    if (state.GetBgColour() != m_Colour) {
-		    state.SetBgColour(m_Colour);
-	    }
+        munk_apply_bg_colour(dc, info, m_Colour, m_Brush);
+}
 
-	    if (state.GetSelectionState() != MunkHTML_SEL_IN) {
-		    if (m_Colour != wxNullColour) {
-			    dc.SetTextBackground(m_Colour);
-			    dc.SetBackground(m_Brush);
-			    dc.SetBackgroundMode(wxSOLID);
-		    }
-	    } else {
-		    wxColour c = info.GetStyle().GetSelectedTextBgColour(m_Colour);
-		    if (c != wxNullColour) {
-			    dc.SetTextBackground(c);
-			    dc.SetBackground(wxBrush(c, wxBRUSHSTYLE_SOLID));
-		    }
-	    }
-    }
+
+void MunkHtmlRenderingInfo::ApplyTextStyle(wxDC& dc, const MunkHtmlTextStyle *pStyle)
+{
+    if (pStyle == NULL || pStyle == m_pTextStyle)
+        return;
+    m_pTextStyle = pStyle;
+    munk_apply_fg_colour(dc, *this, pStyle->m_FgColour);
+    munk_apply_bg_colour(dc, *this, pStyle->m_BgColour, pStyle->m_BgBrush);
+    dc.SetFont(pStyle->m_Font);
+    m_bUnderline = pStyle->m_bUnderline;
+}
+
+
+//-----------------------------------------------------------------------------
+// MunkHtmlTextStyleTable
+//-----------------------------------------------------------------------------
+
+MunkHtmlTextStyleTable::~MunkHtmlTextStyleTable()
+{
+    for (StyleMap::iterator it = m_Styles.begin(); it != m_Styles.end(); ++it)
+        delete it->second;
+}
+
+// RGBA in the low 32 bits, or bit 32 alone for no colour.
+static wxUint64 munk_colour_key(const wxColour& colour)
+{
+    if (!colour.Ok())
+        return ((wxUint64) 1) << 32;
+    return (((wxUint64) colour.Red()) << 24)
+        | (((wxUint64) colour.Green()) << 16)
+        | (((wxUint64) colour.Blue()) << 8)
+        | ((wxUint64) colour.Alpha());
+}
+
+const MunkHtmlTextStyle *MunkHtmlTextStyleTable::Intern(MunkFontKey font_key, int nMagnification,
+                                                        const wxFont& font, bool bUnderline,
+                                                        const wxColour& fgColour, const wxColour& bgColour)
+{
+    wxUint64 fg = munk_colour_key(fgColour);
+    if (bUnderline)
+        fg |= ((wxUint64) 1) << 33;
+    StyleKey key(font_key, std::make_pair(fg, munk_colour_key(bgColour)));
+
+    StyleMap::iterator it = m_Styles.find(key);
+    if (it != m_Styles.end())
+        return it->second;
+
+    MunkHtmlTextStyle *pStyle = new MunkHtmlTextStyle;
+    pStyle->m_Font = font;
+    pStyle->m_FontKey = font_key;
+    pStyle->m_nMagnification = nMagnification;
+    pStyle->m_bUnderline = bUnderline;
+    pStyle->m_FgColour = fgColour;
+    pStyle->m_BgColour = bgColour;
+    if (bgColour.Ok())
+        pStyle->m_BgBrush = wxBrush(bgColour, wxBRUSHSTYLE_SOLID);
+    m_Styles.insert(std::make_pair(key, pStyle));
+    return pStyle;
 }
 
 
@@ -4803,13 +8234,13 @@ void MunkHtmlFontCell::Draw(wxDC& dc,
                           int WXUNUSED(view_y1), int WXUNUSED(view_y2),
                           MunkHtmlRenderingInfo& info)
 {
-    dc.SetFont(m_Font);
-    info.SetUnderline(m_bUnderline);
+    DrawInvisible(dc, 0, 0, info);
 }
 
 void MunkHtmlFontCell::DrawInvisible(wxDC& dc, int WXUNUSED(x), int WXUNUSED(y),
                                    MunkHtmlRenderingInfo& info)
 {
+    info.ForgetTextStyle();
     dc.SetFont(m_Font);
     info.SetUnderline(m_bUnderline);
 }
@@ -5016,12 +8447,19 @@ IMPLEMENT_ABSTRACT_CLASS(MunkHtmlWidgetCell, MunkHtmlCell)
 
 MunkHtmlWidgetCell::MunkHtmlWidgetCell(wxWindow *wnd, int w)
 {
-    int sx, sy;
+    m_Wnd = NULL;
+    m_WidthFloat = w;
+    SetWindow(wnd);
+}
+
+void MunkHtmlWidgetCell::SetWindow(wxWindow *wnd)
+{
+    int sx = 0, sy = 0;
     m_Wnd = wnd;
-    m_Wnd->GetSize(&sx, &sy);
+    if (m_Wnd)
+        m_Wnd->GetSize(&sx, &sy);
     m_Width = sx;
     m_Height = sy;
-    m_WidthFloat = w;
 }
 
 
@@ -5030,6 +8468,9 @@ void MunkHtmlWidgetCell::Draw(wxDC& WXUNUSED(dc),
                             int WXUNUSED(view_y1), int WXUNUSED(view_y2),
                             MunkHtmlRenderingInfo& WXUNUSED(info))
 {
+    if (!m_Wnd)
+        return;
+
     int absx = 0, absy = 0, stx, sty;
     MunkHtmlCell *c = this;
 
@@ -5065,6 +8506,9 @@ void MunkHtmlWidgetCell::DrawInvisible(wxDC& WXUNUSED(dc),
                                      int WXUNUSED(x), int WXUNUSED(y),
                                      MunkHtmlRenderingInfo& WXUNUSED(info))
 {
+    if (!m_Wnd)
+        return;
+
     int absx = 0, absy = 0, stx, sty;
     MunkHtmlCell *c = this;
 
@@ -5091,6 +8535,11 @@ void MunkHtmlWidgetCell::DrawInvisible(wxDC& WXUNUSED(dc),
 
 void MunkHtmlWidgetCell::Layout(int w)
 {
+	if (!m_Wnd) {
+		MunkHtmlCell::Layout(w);
+		return;
+	}
+
 	int sx, sy;
 	m_Wnd->Fit();
 	m_Wnd->GetSize(&sx, &sy);
@@ -5255,6 +8704,13 @@ DEFINE_EVENT_TYPE(MunkEVT_COMMAND_HTML_CELL_CLICKED)
 DEFINE_EVENT_TYPE(MunkEVT_COMMAND_HTML_CELL_HOVER)
 DEFINE_EVENT_TYPE(MunkEVT_COMMAND_HTML_LINK_CLICKED)
 DEFINE_EVENT_TYPE(MunkEVT_COMMAND_HTML_FORM_SUBMITTED)
+DEFINE_EVENT_TYPE(MunkEVT_COMMAND_HTML_PAGE_LOADED)
+
+// Sent by the thread of a MunkHtmlAsyncPage to its window
+BEGIN_DECLARE_EVENT_TYPES()
+    DECLARE_LOCAL_EVENT_TYPE(MunkEVT_HTML_ASYNC_PAGE_TOKENIZED, 1005)
+END_DECLARE_EVENT_TYPES()
+DEFINE_LOCAL_EVENT_TYPE(MunkEVT_HTML_ASYNC_PAGE_TOKENIZED)
 
 
 #if wxUSE_CLIPBOARD
@@ -5503,6 +8959,13 @@ void MunkHtmlWindow::Init(int nInitialMagnification)
     m_TitleFormat = wxT("%s");
     m_OpenedPage = m_OpenedAnchor = m_OpenedPageTitle = wxEmptyString;
     m_Cell = NULL;
+#ifdef MUNK_REPORT_CELL_SIZES
+    static bool bCellSizesReported = false;
+    if (!bCellSizesReported) {
+        munk_report_cell_sizes();
+        bCellSizesReported = true;
+    }
+#endif
     //m_Parser = new MunkHtmlWinParser(this);
     //m_Parser->SetFS(m_FS);
     m_HistoryPos = -1;
@@ -5519,6 +8982,12 @@ void MunkHtmlWindow::Init(int nInitialMagnification)
     m_eraseBgInOnPaint = false;
     m_tmpSelFromCell = NULL;
     m_pForms = 0;
+    m_pPushDC = NULL;
+    m_pAsyncPage = NULL;
+    m_pAsyncCompiled = NULL;
+    m_pAsyncBuilt = NULL;
+    m_bPageSourceIsCompiled = false;
+    m_bPageHasMiniDOM = true;
     m_pParsingStructure = new MunkHtmlParsingStructure(this);
 }
 
@@ -5545,6 +9014,9 @@ MunkHtmlWindow::~MunkHtmlWindow()
 #endif // wxUSE_CLIPBOARD
     HistoryClear();
 
+    AbortPage();
+    CancelAsyncPage();
+
     delete m_selection;
 
     delete m_Cell;
@@ -5608,10 +9080,23 @@ void MunkHtmlWindow::SetRelatedStatusBar(int bar)
 
 bool MunkHtmlWindow::SetPage(const wxString& source, std::string& error_message)
 {
+    CancelAsyncPage();
     m_OpenedPage = m_OpenedAnchor = m_OpenedPageTitle = wxEmptyString;
     return DoSetPage(source, error_message);
 }
 
+bool MunkHtmlWindow::SetPage(const char *pUTF8, size_t nLength, std::string& error_message)
+{
+    CancelAsyncPage();
+    m_OpenedPage = m_OpenedAnchor = m_OpenedPageTitle = wxEmptyString;
+    if (pUTF8 != m_PageSource.GetData() || nLength != m_PageSource.GetLength()) {
+        // LoadPage() has put the page there already
+        m_PageSource.Assign(pUTF8, nLength);
+    }
+    m_bPageSourceIsCompiled = false;
+    return DoSetPage(error_message);
+}
+
 void MunkHtmlWindow::SetForms(MunkHtmlFormContainer *pForms)
 { 
 	delete m_pForms;
@@ -5626,17 +9111,27 @@ bool MunkHtmlWindow::ChangeMagnification(int nNewMagnification, std::string& err
 	} else {
 		m_nMagnification = nNewMagnification;
 
+		AbortPage();
+
 		m_pParsingStructure->ChangeMagnification(m_nMagnification);
 	
-		return DoSetPage(m_strPageSource, error_message);
+		return DoSetPage(error_message);
 	}
 }
 
-bool MunkHtmlWindow::DoSetPage(const wxString& source, std::string& error_message)
+bool MunkHtmlWindow::DoSetPage(const wxString& source, std::string& error_message)
+{
+	m_PageSource.Assign(source);
+	m_bPageSourceIsCompiled = false;
+
+	return DoSetPage(error_message);
+}
+
+bool MunkHtmlWindow::DoSetPage(std::string& error_message)
 {
-	MunkHtmlFormElement::ResetNextID();
+	AbortPage();
 
-	m_strPageSource = source;
+	MunkHtmlFormElement::ResetNextID();
 
 	wxDELETE(m_selection);
 
@@ -5650,20 +9145,7 @@ bool MunkHtmlWindow::DoSetPage(const wxString& source, std::string& error_messag
 	} 
 	
 	// ...and run the parser on it:
-#if wxCHECK_VERSION(3,0,0)
-#if __WXMSW__
-	// Windows doesn't like to change font face when we use a
-	// wxGCDC...
-	wxClientDC *dc = new wxClientDC(this);
-#else
-	wxGCDC *dc = new wxGCDC(this);
-#endif
-
-	// wxWidgets version < 3.0.0
-#else
-	wxClientDC *dc = new wxClientDC(this);
-#endif
-	dc->SetMapMode(wxMM_TEXT);
+	wxDC *dc = CreateParsingDC();
 	SetHTMLBackgroundColour(wxNullColour);
 	SetHTMLBackgroundImage(wxNullBitmap, MunkHTML_BACKGROUND_REPEAT_REPEAT);
 
@@ -5689,11 +9171,30 @@ bool MunkHtmlWindow::DoSetPage(const wxString& source, std::string& error_messag
 	m_pParsingStructure->SetDC(dc, pixel_scale);
 	m_pParsingStructure->SetFS(GetFS());
 	m_pParsingStructure->SetHTMLBackgroundColour(this->GetHTMLBackgroundColour());
+	MunkHtmlParsingStructure *pPS = m_pParsingStructure;
 	try {
-		bResult = m_pParsingStructure->Parse(m_strPageSource, m_nMagnification, error_message);
-		SetTopCell(m_pParsingStructure->GetInternalRepresentation());
-		SetForms(m_pParsingStructure->TakeOverForms());
-		m_pParsingStructure->SetTopCell(0); // Make sure we don't delete the cells in the ps destructor
+		if (m_pAsyncBuilt != NULL) {
+			// Parsed by the thread; only the metrics are left.
+			pPS = m_pAsyncBuilt;
+			pPS->ResolveMetrics(dc);
+		} else if (m_pAsyncCompiled != NULL) {
+			bResult = m_pParsingStructure->ParseCompiled(m_pAsyncCompiled->data(), m_pAsyncCompiled->length(), m_nMagnification, error_message);
+		} else if (!m_PageSource.CheckMapping()) {
+			bResult = false;
+			error_message = "Could not read the page source again after it shrank.";
+		} else if (m_bPageSourceIsCompiled) {
+			bResult = m_pParsingStructure->ParseCompiled(m_PageSource.GetData(), m_PageSource.GetLength(), m_nMagnification, error_message);
+		} else {
+			bResult = m_pParsingStructure->Parse(m_PageSource.GetData(), m_PageSource.GetLength(), m_nMagnification, error_message);
+		}
+		SetTopCell(pPS->GetInternalRepresentation());
+		SetForms(pPS->TakeOverForms());
+		pPS->SetTopCell(0); // Make sure we don't delete the cells in the ps destructor
+		if (m_pForms != 0) {
+			m_pForms->realizeWidgets(this);
+		}
+		ApplyBodyState(pPS->GetBodyState());
+		m_bPageHasMiniDOM = pPS->GetCaptureMiniDOM();
 		
 		Scroll(0,0);
 		
@@ -5728,6 +9229,203 @@ bool MunkHtmlWindow::DoSetPage(const wxString& source, std::string& error_messag
 	}
 }
 
+wxDC *MunkHtmlWindow::CreateParsingDC()
+{
+#if wxCHECK_VERSION(3,0,0)
+#if __WXMSW__
+	// Windows doesn't like to change font face when we use a
+	// wxGCDC...
+	wxClientDC *dc = new wxClientDC(this);
+#else
+	wxGCDC *dc = new wxGCDC(this);
+#endif
+
+	// wxWidgets version < 3.0.0
+#else
+	wxClientDC *dc = new wxClientDC(this);
+#endif
+	dc->SetMapMode(wxMM_TEXT);
+	return dc;
+}
+
+
+bool MunkHtmlWindow::BeginPage(std::string& error_message)
+{
+	AbortPage();
+	CancelAsyncPage();
+
+	m_OpenedPage = m_OpenedAnchor = m_OpenedPageTitle = wxEmptyString;
+	m_PageSource.Clear();
+	m_bPageSourceIsCompiled = false;
+
+	MunkHtmlFormElement::ResetNextID();
+
+	wxDELETE(m_selection);
+
+	// we will soon delete all the cells, so clear pointers to them:
+	m_tmpSelFromCell = NULL;
+
+	if (!m_bCreated) {
+		error_message = "Window not yet created. BeginPage() cannot be used until it has been created.";
+		return false;
+	}
+
+	SetHTMLBackgroundColour(wxNullColour);
+	SetHTMLBackgroundImage(wxNullBitmap, MunkHTML_BACKGROUND_REPEAT_REPEAT);
+
+	if (m_Cell) {
+		delete m_Cell;
+		m_Cell = NULL;
+	}
+
+	double pixel_scale = 1.0;
+#if wxCHECK_VERSION(3,0,0)
+	pixel_scale = this->GetContentScaleFactor();
+#else
+	pixel_scale = 1.0;
+#endif
+
+	// The DC must live until EndPage(), since the handler
+	// measures text with it as the chunks arrive.
+	m_pPushDC = CreateParsingDC();
+	m_pParsingStructure->SetDC(m_pPushDC, pixel_scale);
+	m_pParsingStructure->SetFS(GetFS());
+	m_pParsingStructure->SetHTMLBackgroundColour(this->GetHTMLBackgroundColour());
+
+	if (!m_pParsingStructure->BeginParse(m_nMagnification, error_message)) {
+		wxDELETE(m_pPushDC);
+		return false;
+	}
+	m_bPageHasMiniDOM = m_pParsingStructure->GetCaptureMiniDOM();
+
+	Scroll(0,0);
+	m_PushRepaintStopWatch.Start();
+	return true;
+}
+
+
+bool MunkHtmlWindow::FeedChunk(const char *pUTF8, size_t nLength, std::string& error_message)
+{
+	if (m_pPushDC == NULL) {
+		error_message = "FeedChunk() called without BeginPage().";
+		return false;
+	}
+
+	m_PageSource.Append(pUTF8, nLength);
+
+	if (!m_pParsingStructure->ParseChunk(pUTF8, nLength, error_message)) {
+		AbortPage();
+		return false;
+	}
+
+	if (m_PushRepaintStopWatch.Time() >= MunkHTML_PUSH_REPAINT_INTERVAL
+	    && m_pParsingStructure->CanLayoutPartialRepresentation()) {
+		ShowPartialPage();
+		m_PushRepaintStopWatch.Start();
+	}
+	return true;
+}
+
+
+bool MunkHtmlWindow::EndPage(std::string& error_message)
+{
+	if (m_pPushDC == NULL) {
+		error_message = "EndPage() called without BeginPage().";
+		return false;
+	}
+
+	if (!m_pParsingStructure->EndParse(error_message)) {
+		AbortPage();
+		return false;
+	}
+
+	// The cells are the same as those we may already have shown;
+	// they are now complete.
+	SetTopCell(m_pParsingStructure->GetInternalRepresentation());
+	SetForms(m_pParsingStructure->TakeOverForms());
+	m_pParsingStructure->SetTopCell(0); // Make sure we don't delete the cells in the ps destructor
+	ApplyBodyState(m_pParsingStructure->GetBodyState());
+
+	wxDELETE(m_pPushDC);
+
+	if (m_Cell) {
+		m_Cell->SetIndent(m_Borders, MunkHTML_INDENT_ALL, MunkHTML_UNITS_PIXELS);
+		m_Cell->SetAlignHor(MunkHTML_ALIGN_CENTER);
+		CreateLayout();
+	}
+	if (m_tmpCanDrawLocks == 0) {
+		Refresh();
+		Update();
+	}
+	return true;
+}
+
+
+void MunkHtmlWindow::AbortPage()
+{
+	if (m_pPushDC == NULL) {
+		return;
+	}
+
+	MunkHtmlContainerCell *pPartialTop = m_pParsingStructure->AbortParse();
+	if (m_Cell == pPartialTop) {
+		m_Cell = NULL;
+	}
+	delete pPartialTop;
+
+	wxDELETE(m_selection);
+	m_tmpSelFromCell = NULL;
+
+	wxDELETE(m_pPushDC);
+}
+
+
+void MunkHtmlWindow::RegisterCustomTag(const std::string& tag, MunkHtmlCustomTagHandler *pHandler)
+{
+	m_pParsingStructure->RegisterCustomTag(tag, pHandler);
+}
+
+void MunkHtmlWindow::SetParallelParsing(bool bParallel)
+{
+	m_pParsingStructure->SetParallelParsing(bParallel);
+}
+
+void MunkHtmlWindow::SetCaptureMiniDOM(bool bCapture)
+{
+	m_pParsingStructure->SetCaptureMiniDOM(bCapture);
+}
+
+bool MunkHtmlWindow::GetCaptureMiniDOM() const
+{
+	return m_pParsingStructure->GetCaptureMiniDOM();
+}
+
+
+void MunkHtmlWindow::ShowPartialPage()
+{
+	MunkHtmlContainerCell *pTop = m_pParsingStructure->GetPartialRepresentation();
+	if (pTop == NULL) {
+		return;
+	}
+
+	m_pParsingStructure->ResolveMetrics(m_pPushDC);
+	ApplyBodyState(m_pParsingStructure->GetBodyState());
+
+	m_Cell = pTop;
+	m_Cell->SetIndent(m_Borders, MunkHTML_INDENT_ALL, MunkHTML_UNITS_PIXELS);
+	m_Cell->SetAlignHor(MunkHTML_ALIGN_CENTER);
+	CreateLayout();
+
+	// The open containers will grow before the next time.
+	m_pParsingStructure->InvalidateOpenContainers();
+
+	if (m_tmpCanDrawLocks == 0) {
+		Refresh();
+		Update();
+	}
+}
+
+
 // utility function: read a wxString from a wxInputStream
 bool ReadString(wxString& str, wxInputStream* s, wxMBConv& conv)
 {
@@ -5738,7 +9436,6 @@ bool ReadString(wxString& str, wxInputStream* s, wxMBConv& conv)
 
 	str = strContents;
 	
-	std::string strHTML = std::string((const char*) strContents.mb_str(wxConvUTF8));
 	return true;
 }
 
@@ -5788,6 +9485,7 @@ bool MunkHtmlWindow::LoadPage(const wxString& location, std::string& error_messa
 
     else
     {
+        CancelAsyncPage();
         needs_refresh = true;
 #if wxUSE_STATUSBAR
         // load&display it:
@@ -5834,9 +9532,21 @@ bool MunkHtmlWindow::LoadPage(const wxString& location, std::string& error_messa
 	    //     do it as it is done by MunkHtmlParser (for this reason, we add <meta>
 	    //     tag if we used Content-Type header).
 #if wxUSE_UNICODE
-		wxString tmpdoc;
-		ReadString(tmpdoc, s, wxConvUTF8); // Assume UTF-8
-		src = tmpdoc;
+		// Keep the document as UTF-8 bytes (assume UTF-8), and
+		// let the parser work on them in place.  Local files
+		// are mapped rather than read, where possible.
+		wxString strLocalFile;
+		if (f->GetLocation().StartsWith(wxT("file:"))) {
+			strLocalFile = wxFileSystem::URLToFileName(f->GetLocation()).GetFullPath();
+		}
+		bool bGotSource = false;
+		m_bPageSourceIsCompiled = false;
+		if (!strLocalFile.IsEmpty()) {
+			bGotSource = m_PageSource.LoadFile(strLocalFile);
+		}
+		if (!bGotSource) {
+			m_PageSource.ReadFromStream(s);
+		}
 #else // !wxUSE_UNICODE
 		ReadString(doc, s, wxConvLibc);
 		// add meta tag if we obtained this through http:
@@ -5848,59 +9558,503 @@ bool MunkHtmlWindow::LoadPage(const wxString& location, std::string& error_messa
 		}
 #endif
 
-	    
+	    
+
+            m_FS->ChangePathTo(f->GetLocation());
+#if wxUSE_UNICODE
+            rt_val = SetPage(m_PageSource.GetData(), m_PageSource.GetLength(), error_message);
+#else
+            rt_val = SetPage(src, error_message);
+#endif
+            m_OpenedPage = f->GetLocation();
+            if (rt_val && f->GetAnchor() != wxEmptyString)
+            {
+                ScrollToAnchor(f->GetAnchor());
+            }
+
+            delete f;
+
+#if wxUSE_STATUSBAR
+            if (m_RelatedStatusBar != -1)
+                m_RelatedFrame->SetStatusText(_("Done"), m_RelatedStatusBar);
+#endif // wxUSE_STATUSBAR
+        }
+    }
+
+    AddCurrentPageToHistory();
+
+    if (m_OpenedPageTitle == wxEmptyString)
+        OnSetTitle(wxFileNameFromPath(m_OpenedPage));
+
+    if (needs_refresh) {
+	    m_tmpCanDrawLocks--;
+	    Refresh();
+	    Update();
+    } else {
+	    m_tmpCanDrawLocks--;
+    }
+
+    return rt_val;
+}
+
+
+void MunkHtmlWindow::AddCurrentPageToHistory()
+{
+    if (m_HistoryOn) // add this page to history there:
+    {
+        int c = m_History->GetCount() - (m_HistoryPos + 1);
+
+        if (m_HistoryPos < 0 ||
+            (*m_History)[m_HistoryPos].GetPage() != m_OpenedPage ||
+            (*m_History)[m_HistoryPos].GetAnchor() != m_OpenedAnchor)
+        {
+            m_HistoryPos++;
+            for (int i = 0; i < c; i++)
+                m_History->RemoveAt(m_HistoryPos);
+            m_History->Add(new MunkHtmlHistoryItem(m_OpenedPage, m_OpenedAnchor));
+        }
+    }
+}
+
+
+bool MunkHtmlWindow::LoadFile(const wxFileName& filename, std::string& error_message)
+{
+    wxString url = wxFileSystem::FileNameToURL(filename);
+    return LoadPage(url, error_message);
+}
+
+
+bool MunkHtmlWindow::LoadCompiledPage(const wxString& filename, std::string& error_message)
+{
+    wxBusyCursor busyCursor;
+
+    CancelAsyncPage();
+    m_OpenedPage = m_OpenedAnchor = m_OpenedPageTitle = wxEmptyString;
+    if (!m_PageSource.LoadFile(filename)) {
+        m_PageSource.Clear();
+        m_bPageSourceIsCompiled = false;
+        error_message = (const char*) (wxString(wxT("Could not read compiled page:")) + filename).mb_str(wxConvUTF8);
+        return false;
+    }
+    m_bPageSourceIsCompiled = true;
+
+    bool rt_val = DoSetPage(error_message);
+    m_OpenedPage = wxFileSystem::FileNameToURL(wxFileName(filename));
+    if (m_OpenedPageTitle == wxEmptyString)
+        OnSetTitle(wxFileNameFromPath(filename));
+    return rt_val;
+}
+
+
+bool MunkHtmlWindow::LoadCompiledPage(const wxString& filename, const wxString& sourceFilename, std::string& error_message)
+{
+    // Hashing the source is still much cheaper than parsing it.
+    MunkHtmlPageBuffer compiled;
+    MunkHtmlPageBuffer source;
+    wxUint64 source_hash;
+    if (compiled.LoadFile(filename)
+        && MunkQDEventReplayer::getSourceHash(compiled.GetData(), compiled.GetLength(), source_hash)
+        && source.LoadFile(sourceFilename)
+        && munk_hash_bytes(source.GetData(), source.GetLength()) == source_hash) {
+        return LoadCompiledPage(filename, error_message);
+    }
+    return LoadFile(wxFileName(sourceFilename), error_message);
+}
+
+
+//--------------------------------------------------------------------------------
+// MunkHtmlAsyncPage
+//--------------------------------------------------------------------------------
+
+// One request of SetPageAsync() or LoadPageAsync().  It is shared by
+// the window and the thread processing it, and deleted when all have
+// released it.
+class MunkHtmlAsyncPage {
+ public:
+	MunkHtmlAsyncPage(MunkHtmlWindow *pWindow)
+		: m_pParsingStructure(NULL),
+		  m_nMagnification(100),
+		  m_bSucceeded(false),
+		  m_pWindow(pWindow),
+		  m_nRefs(2) {};
+
+	// Run by the thread.  Reads m_strLocalFile, if any, into
+	// m_Source.  Then, if there is an m_pParsingStructure, parses
+	// m_Source with it, without a DC; otherwise compiles it into
+	// m_Compiled.
+	void Tokenize();
+
+	// Called by the window when it no longer wants the page.
+	void Detach();
+
+	void AddRef();
+	void Release();
+
+	// Deletes m_pParsingStructure.  Only on the GUI thread: its
+	// fonts share their data with fonts in use there.
+	void DeleteParsingStructure();
+
+	MunkHtmlPageBuffer m_Source;
+	wxString m_strLocalFile; // Read by the thread if not empty
+	wxString m_strLocation;
+	wxString m_strAnchor;
+	// Set up by the window; see MunkHtmlWindow::StartAsyncPage()
+	MunkHtmlParsingStructure *m_pParsingStructure;
+	wxFileSystem m_FS;
+	int m_nMagnification;
+	std::string m_Compiled;
+	std::string m_ErrorMessage;
+	bool m_bSucceeded;
+ private:
+	// The parsing structure is normally gone by now; see
+	// MunkHtmlAsyncPageEvent.
+	~MunkHtmlAsyncPage() { delete m_pParsingStructure; };
+
+#if wxUSE_THREADS
+	wxCriticalSection m_CS; // Protects m_pWindow
+	wxCriticalSection m_RefsCS; // Protects m_nRefs; may be taken while holding m_CS
+#endif
+	MunkHtmlWindow *m_pWindow;
+	int m_nRefs;
+
+	DECLARE_NO_COPY_CLASS(MunkHtmlAsyncPage)
+};
+
+
+// Sent by the thread when it is done with a MunkHtmlAsyncPage.  Each
+// copy holds a reference to the page, so that the page is released
+// even if the window is destroyed while the event is still pending.
+//
+// The queued copy (the one made by Clone()) is always deleted on the
+// GUI thread, whether it was handled or not, so it deletes the
+// page's parsing structure there.  The worker may then drop the last
+// reference to the page without touching any fonts.
+class MunkHtmlAsyncPageEvent : public wxCommandEvent {
+ public:
+	MunkHtmlAsyncPageEvent(int id, MunkHtmlAsyncPage *pPage)
+		: wxCommandEvent(MunkEVT_HTML_ASYNC_PAGE_TOKENIZED, id),
+		  m_pPage(pPage),
+		  m_bQueued(false) { m_pPage->AddRef(); };
+	MunkHtmlAsyncPageEvent(const MunkHtmlAsyncPageEvent& other)
+		: wxCommandEvent(other),
+		  m_pPage(other.m_pPage),
+		  m_bQueued(false) { m_pPage->AddRef(); };
+	virtual ~MunkHtmlAsyncPageEvent() {
+		if (m_bQueued) {
+			m_pPage->DeleteParsingStructure();
+		}
+		m_pPage->Release();
+	};
+
+	virtual wxEvent *Clone() const {
+		MunkHtmlAsyncPageEvent *pEvent = new MunkHtmlAsyncPageEvent(*this);
+		pEvent->m_bQueued = true;
+		return pEvent;
+	};
+
+	MunkHtmlAsyncPage *GetPage() const { return m_pPage; };
+ private:
+	MunkHtmlAsyncPage *m_pPage;
+	bool m_bQueued;
+};
+
+
+void MunkHtmlAsyncPage::Tokenize()
+{
+	if (!m_strLocalFile.IsEmpty()
+	    && !m_Source.LoadFile(m_strLocalFile)) {
+		m_ErrorMessage = (const char*) (wxString(wxT("Could not open file:")) + m_strLocalFile).mb_str(wxConvUTF8);
+	} else if (m_pParsingStructure != NULL) {
+		m_bSucceeded = m_pParsingStructure->Parse(m_Source.GetData(), m_Source.GetLength(), m_nMagnification, m_ErrorMessage);
+	} else {
+		try {
+			MunkQDEventRecorder::compile(m_Source.GetData(), m_Source.GetLength(), m_Compiled);
+			m_bSucceeded = true;
+		} catch (MunkQDException& e) {
+			m_ErrorMessage = e.what();
+		} catch (...) {
+			m_ErrorMessage = "Unknown exception while tokenizing page.";
+		}
+	}
+
+	{
+#if wxUSE_THREADS
+		wxCriticalSectionLocker locker(m_CS);
+#endif
+		if (m_pWindow != NULL) {
+			MunkHtmlAsyncPageEvent event(m_pWindow->GetId(), this);
+			m_pWindow->AddPendingEvent(event);
+		} else if (m_pParsingStructure != NULL && wxTheApp != NULL) {
+			// Cancelled.  Nobody handles the event, but
+			// the application deletes it on the GUI thread,
+			// and the parsing structure with it.
+			MunkHtmlAsyncPageEvent event(wxID_ANY, this);
+			wxTheApp->AddPendingEvent(event);
+		}
+	}
+
+	// The pending event has its own reference
+	Release();
+}
+
+
+void MunkHtmlAsyncPage::Detach()
+{
+	{
+#if wxUSE_THREADS
+		wxCriticalSectionLocker locker(m_CS);
+#endif
+		m_pWindow = NULL;
+	}
+	Release();
+}
+
+
+void MunkHtmlAsyncPage::AddRef()
+{
+#if wxUSE_THREADS
+	wxCriticalSectionLocker locker(m_RefsCS);
+#endif
+	++m_nRefs;
+}
+
 
-            m_FS->ChangePathTo(f->GetLocation());
-            rt_val = SetPage(src, error_message);
-            m_OpenedPage = f->GetLocation();
-            if (rt_val && f->GetAnchor() != wxEmptyString)
-            {
-                ScrollToAnchor(f->GetAnchor());
-            }
+void MunkHtmlAsyncPage::DeleteParsingStructure()
+{
+	delete m_pParsingStructure;
+	m_pParsingStructure = NULL;
+}
 
-            delete f;
 
-#if wxUSE_STATUSBAR
-            if (m_RelatedStatusBar != -1)
-                m_RelatedFrame->SetStatusText(_("Done"), m_RelatedStatusBar);
-#endif // wxUSE_STATUSBAR
-        }
+void MunkHtmlAsyncPage::Release()
+{
+	bool bDelete;
+	{
+#if wxUSE_THREADS
+		wxCriticalSectionLocker locker(m_RefsCS);
+#endif
+		bDelete = --m_nRefs == 0;
+	}
+	if (bDelete) {
+		delete this;
+	}
+}
+
+
+#if wxUSE_THREADS
+class MunkHtmlAsyncPageThread : public wxThread {
+ public:
+	MunkHtmlAsyncPageThread(MunkHtmlAsyncPage *pPage)
+		: wxThread(wxTHREAD_DETACHED),
+		  m_pPage(pPage) {};
+ protected:
+	virtual ExitCode Entry() { m_pPage->Tokenize(); return 0; };
+ private:
+	MunkHtmlAsyncPage *m_pPage;
+};
+#endif // wxUSE_THREADS
+
+
+bool MunkHtmlWindow::SetPageAsync(const wxString& source, std::string& error_message)
+{
+    CancelAsyncPage();
+    MunkHtmlAsyncPage *pPage = new MunkHtmlAsyncPage(this);
+    pPage->m_Source.Assign(source);
+    return StartAsyncPage(pPage, error_message);
+}
+
+
+bool MunkHtmlWindow::LoadPageAsync(const wxString& location, std::string& error_message)
+{
+    // Anchors on the current page need no loading
+    if (location[0] == wxT('#')
+        || (location.Find(wxT('#')) != wxNOT_FOUND
+            && (location.BeforeFirst(wxT('#')) == m_OpenedPage
+                || (m_FS->GetPath() + location.BeforeFirst(wxT('#'))) == m_OpenedPage)))
+    {
+        return LoadPage(location, error_message);
     }
 
-    if (m_HistoryOn) // add this page to history there:
+    CancelAsyncPage();
+
+    wxFSFile *f = m_FS->OpenFile(location);
+    if (f == NULL) {
+        error_message = (const char*) (wxString(wxT("Could not open file with URL:")) + location).mb_str(wxConvUTF8);
+        return false;
+    }
+
+    MunkHtmlAsyncPage *pPage = new MunkHtmlAsyncPage(this);
+    // Local files are read by the thread; anything else is read
+    // here, since wxFSFile streams are not ours to hand over.
+    if (f->GetLocation().StartsWith(wxT("file:"))) {
+        pPage->m_strLocalFile = wxFileSystem::URLToFileName(f->GetLocation()).GetFullPath();
+    } else if (f->GetStream() != NULL) {
+        pPage->m_Source.ReadFromStream(f->GetStream());
+    }
+    pPage->m_strLocation = f->GetLocation();
+    pPage->m_strAnchor = f->GetAnchor();
+    delete f;
+
+    return StartAsyncPage(pPage, error_message);
+}
+
+
+bool MunkHtmlWindow::StartAsyncPage(MunkHtmlAsyncPage *pPage, std::string& WXUNUSED(error_message))
+{
+    m_pAsyncPage = pPage;
+
+    // The thread builds the cells as well, without a DC, unless
+    // there are custom tag handlers, which need not be able to run
+    // on another thread.  Then it only tokenizes the page, and
+    // DoSetPage() builds the cells from the tokens.
+    if (m_bCreated && !m_pParsingStructure->HasCustomTagHandlers())
     {
-        int c = m_History->GetCount() - (m_HistoryPos + 1);
+        double pixel_scale = 1.0;
+#if wxCHECK_VERSION(3,0,0)
+        pixel_scale = this->GetContentScaleFactor();
+#endif
 
-        if (m_HistoryPos < 0 ||
-            (*m_History)[m_HistoryPos].GetPage() != m_OpenedPage ||
-            (*m_History)[m_HistoryPos].GetAnchor() != m_OpenedAnchor)
+        MunkHtmlParsingStructure *pPS = new MunkHtmlParsingStructure(this);
+        pPS->SetParallelParsing(m_pParsingStructure->GetParallelParsing());
+        pPS->SetCaptureMiniDOM(m_pParsingStructure->GetCaptureMiniDOM());
+        pPS->SetHTMLBackgroundColour(wxNullColour);
+
+        wxDC *dc = CreateParsingDC();
+        pPS->PrepareDeferredMetrics(dc);
+        delete dc;
+        pPS->SetDC(NULL, pixel_scale);
+
+        // Our own m_FS is in use here meanwhile
+        if (pPage->m_strLocation.IsEmpty())
+            pPage->m_FS.ChangePathTo(m_FS->GetPath(), true);
+        else
+            pPage->m_FS.ChangePathTo(pPage->m_strLocation);
+        pPS->SetFS(&pPage->m_FS);
+
+        pPage->m_pParsingStructure = pPS;
+        pPage->m_nMagnification = m_nMagnification;
+    }
+
+#if wxUSE_THREADS
+    MunkHtmlAsyncPageThread *pThread = new MunkHtmlAsyncPageThread(pPage);
+    if (pThread->Create() == wxTHREAD_NO_ERROR
+        && pThread->Run() == wxTHREAD_NO_ERROR) {
+        return true;
+    }
+    // A detached thread which never ran must be deleted by us
+    delete pThread;
+#endif // wxUSE_THREADS
+
+    // No thread: Tokenize here.  The result still arrives as an
+    // event, so callers see the same order of things either way.
+    pPage->Tokenize();
+    return true;
+}
+
+
+void MunkHtmlWindow::CancelAsyncPage()
+{
+    if (m_pAsyncPage != NULL) {
+        m_pAsyncPage->Detach();
+        m_pAsyncPage = NULL;
+    }
+}
+
+
+void MunkHtmlWindow::OnAsyncPageTokenized(wxCommandEvent& event)
+{
+    // The event holds a reference to the page until it is deleted
+    MunkHtmlAsyncPage *pPage = ((MunkHtmlAsyncPageEvent&) event).GetPage();
+    if (pPage != m_pAsyncPage) {
+        // Cancelled after the thread was done
+        return;
+    }
+
+    wxBusyCursor busyCursor;
+
+    bool rt_val = pPage->m_bSucceeded;
+    std::string error_message = pPage->m_ErrorMessage;
+    if (rt_val) {
+        m_tmpCanDrawLocks++;
+        if (m_HistoryOn && (m_HistoryPos != -1))
         {
-            m_HistoryPos++;
-            for (int i = 0; i < c; i++)
-                m_History->RemoveAt(m_HistoryPos);
-            m_History->Add(new MunkHtmlHistoryItem(m_OpenedPage, m_OpenedAnchor));
+            // store scroll position into history item:
+            int x, y;
+            GetViewStart(&x, &y);
+            (*m_History)[m_HistoryPos].SetPos(y);
         }
-    }
 
-    if (m_OpenedPageTitle == wxEmptyString)
-        OnSetTitle(wxFileNameFromPath(m_OpenedPage));
+        // Keep the source, for SaveCompiledPage() and the like
+        m_PageSource.Swap(pPage->m_Source);
+        m_bPageSourceIsCompiled = false;
+        if (!pPage->m_strLocation.IsEmpty())
+            m_FS->ChangePathTo(pPage->m_strLocation);
+
+        m_OpenedPage = m_OpenedAnchor = m_OpenedPageTitle = wxEmptyString;
+        if (pPage->m_pParsingStructure == NULL) {
+            m_pAsyncCompiled = &pPage->m_Compiled;
+        } else if (pPage->m_nMagnification == m_nMagnification) {
+            m_pAsyncBuilt = pPage->m_pParsingStructure;
+        }
+        // else the magnification has changed since, and the
+        // source is parsed again.
+        rt_val = DoSetPage(error_message);
+        m_pAsyncCompiled = NULL;
+        m_pAsyncBuilt = NULL;
+
+        // We have its cells now.  The thread may well drop the
+        // last reference to the page, so delete it here.
+        pPage->DeleteParsingStructure();
+
+        m_OpenedPage = pPage->m_strLocation;
+        if (rt_val && pPage->m_strAnchor != wxEmptyString)
+            ScrollToAnchor(pPage->m_strAnchor);
+
+        if (!m_OpenedPage.IsEmpty()) {
+            AddCurrentPageToHistory();
+            if (m_OpenedPageTitle == wxEmptyString)
+                OnSetTitle(wxFileNameFromPath(m_OpenedPage));
+        }
 
-    if (needs_refresh) {
-	    m_tmpCanDrawLocks--;
-	    Refresh();
-	    Update();
-    } else {
-	    m_tmpCanDrawLocks--;
+        m_tmpCanDrawLocks--;
+        Refresh();
     }
 
-    return rt_val;
+    m_pAsyncPage = NULL;
+    pPage->Release();
+
+    wxCommandEvent loaded(MunkEVT_COMMAND_HTML_PAGE_LOADED, GetId());
+    loaded.SetEventObject(this);
+    loaded.SetInt(rt_val ? 1 : 0);
+    loaded.SetString(wxString(error_message.c_str(), wxConvUTF8));
+    GetEventHandler()->ProcessEvent(loaded);
 }
 
 
-bool MunkHtmlWindow::LoadFile(const wxFileName& filename, std::string& error_message)
+bool MunkHtmlWindow::SaveCompiledPage(const wxString& filename, std::string& error_message)
 {
-    wxString url = wxFileSystem::FileNameToURL(filename);
-    return LoadPage(url, error_message);
+    std::string compiled;
+    if (!m_PageSource.CheckMapping()) {
+        error_message = "Could not read the page source again after it shrank.";
+        return false;
+    } else if (m_bPageSourceIsCompiled) {
+        compiled.assign(m_PageSource.GetData(), m_PageSource.GetLength());
+    } else {
+        try {
+            MunkQDEventRecorder::compile(m_PageSource.GetData(), m_PageSource.GetLength(), compiled);
+        } catch (MunkQDException e) {
+            error_message = e.what();
+            return false;
+        }
+    }
+
+    wxFile file;
+    if (!file.Create(filename, true)
+        || file.Write(compiled.data(), compiled.length()) != compiled.length()) {
+        error_message = (const char*) (wxString(wxT("Could not write compiled page:")) + filename).mb_str(wxConvUTF8);
+        return false;
+    }
+    return true;
 }
 
 
@@ -5993,6 +10147,40 @@ void MunkHtmlWindow::CreateLayout()
 
 
 
+void MunkHtmlWindow::InvalidateCellLayout(MunkHtmlCell *cell)
+{
+    if (!m_Cell || !cell) return;
+
+    cell->MarkLayoutDirty();
+
+    int ClientWidth, ClientHeight;
+    GetClientSize(&ClientWidth, &ClientHeight);
+    m_Cell->Layout(ClientWidth);
+
+    if ( !HasFlag(MunkHW_SCROLLBAR_NEVER) )
+    {
+        // As in CreateLayout(), but staying where we are.  If the
+        // scrollbar comes or goes, OnSize() lays it all out anew.
+        int x, y;
+        GetViewStart(&x, &y);
+        if (ClientHeight < m_Cell->GetHeight() + GetCharHeight())
+        {
+            SetScrollbars(
+                  MunkHTML_SCROLL_STEP, MunkHTML_SCROLL_STEP,
+                  m_Cell->GetWidth() / MunkHTML_SCROLL_STEP,
+                  (m_Cell->GetHeight() + GetCharHeight()) / MunkHTML_SCROLL_STEP,
+                  x, y);
+        }
+        else
+        {
+            SetScrollbars(MunkHTML_SCROLL_STEP, 1, m_Cell->GetWidth() / MunkHTML_SCROLL_STEP, 0, x, 0);
+        }
+    }
+
+    Refresh();
+}
+
+
 bool MunkHtmlWindow::HistoryBack()
 {
     wxString a, l;
@@ -6087,14 +10275,11 @@ bool MunkHtmlWindow::IsSelectionEnabled() const
 
 
 #if wxUSE_CLIPBOARD
-wxString MunkHtmlWindow::DoSelectionToHtml(MunkHtmlSelection *sel)
+static wxString munk_cells_to_html(const MunkHtmlCell *pFromCell, const MunkHtmlCell *pToCell)
 {
-	if ( !sel )
-		return wxEmptyString;
-	
 	wxString text;
 	
-	MunkHtmlCellsIterator i(sel->GetFromCell(), sel->GetToCell());
+	MunkHtmlCellsIterator i(pFromCell, pToCell);
 	
 	while ( i ) {
 		text << i->toString();
@@ -6103,6 +10288,110 @@ wxString MunkHtmlWindow::DoSelectionToHtml(MunkHtmlSelection *sel)
 	return text;
 }
 
+wxString MunkHtmlWindow::DoSelectionToHtml(MunkHtmlSelection *sel)
+{
+	if ( !sel )
+		return wxEmptyString;
+
+	if (!m_bPageHasMiniDOM) {
+		wxString html;
+		if (RecreateSelectionToHtml(sel, html)) {
+			return html;
+		}
+	}
+	
+	return munk_cells_to_html(sel->GetFromCell(), sel->GetToCell());
+}
+
+// The page was parsed without the MiniDOM, so parse it again with
+// it.  Both parses give the same cells, but for the MiniDOM cells, so
+// the cells of sel are found in the new tree by their position among
+// the terminal cells.
+bool MunkHtmlWindow::RecreateSelectionToHtml(MunkHtmlSelection *sel, wxString& html)
+{
+	// Forms would get their controls created a second time.
+	if (m_Cell == NULL
+	    || !m_PageSource.CheckMapping()
+	    || m_PageSource.GetLength() == 0
+	    || m_pForms != 0
+	    || m_pParsingStructure->IsPushParsing()) {
+		return false;
+	}
+
+	int nFrom = -1;
+	int nTo = -1;
+	int n = 0;
+	for (MunkHtmlTerminalCellsIterator i(m_Cell->GetFirstTerminal(), NULL); i; ++i, ++n) {
+		if (*i == sel->GetFromCell()) {
+			nFrom = n;
+		}
+		if (*i == sel->GetToCell()) {
+			nTo = n;
+			break;
+		}
+	}
+	if (nFrom < 0 || nTo < 0) {
+		return false;
+	}
+
+	double pixel_scale = 1.0;
+#if wxCHECK_VERSION(3,0,0)
+	pixel_scale = this->GetContentScaleFactor();
+#else
+	pixel_scale = 1.0;
+#endif
+
+	wxDC *dc = CreateParsingDC();
+	m_pParsingStructure->SetDC(dc, pixel_scale);
+	m_pParsingStructure->SetFS(GetFS());
+	// The handler only records what <body> asks of the window, so
+	// parsing the page again leaves us alone; the parsing
+	// structure's own colour we put back afterwards.
+	wxColour oldBackgroundColour = m_pParsingStructure->GetHTMLBackgroundColour();
+	m_pParsingStructure->SetHTMLBackgroundColour(wxNullColour);
+	bool bCaptureMiniDOM = m_pParsingStructure->GetCaptureMiniDOM();
+	m_pParsingStructure->SetCaptureMiniDOM(true);
+
+	std::string error_message;
+	bool bResult;
+	if (m_bPageSourceIsCompiled) {
+		bResult = m_pParsingStructure->ParseCompiled(m_PageSource.GetData(), m_PageSource.GetLength(), m_nMagnification, error_message);
+	} else {
+		bResult = m_pParsingStructure->Parse(m_PageSource.GetData(), m_PageSource.GetLength(), m_nMagnification, error_message);
+	}
+	MunkHtmlContainerCell *pCells = m_pParsingStructure->GetInternalRepresentation();
+	m_pParsingStructure->SetTopCell(0);
+	m_pParsingStructure->SetCaptureMiniDOM(bCaptureMiniDOM);
+	m_pParsingStructure->SetHTMLBackgroundColour(oldBackgroundColour);
+	delete dc;
+
+	const MunkHtmlCell *pFromCell = NULL;
+	const MunkHtmlCell *pToCell = NULL;
+	if (bResult && pCells != NULL) {
+		n = 0;
+		for (MunkHtmlTerminalCellsIterator i(pCells->GetFirstTerminal(), NULL); i; ++i) {
+			if (i->IsMiniDOMCell()) {
+				continue;
+			}
+			if (n == nFrom) {
+				pFromCell = *i;
+			}
+			if (n == nTo) {
+				pToCell = *i;
+				break;
+			}
+			++n;
+		}
+	}
+
+	bool bFound = pFromCell != NULL && pToCell != NULL;
+	if (bFound) {
+		html = munk_cells_to_html(pFromCell, pToCell);
+	}
+	delete pCells;
+	return bFound;
+}
+
 wxString MunkHtmlWindow::DoSelectionToText(MunkHtmlSelection *sel)
 {
 	if ( !sel )
@@ -6659,7 +10948,7 @@ void MunkHtmlWindow::OnWindowCreate(wxWindowCreateEvent& event)
 	if (m_bDoSetPageInWindowCreateEventHandle) {
 		m_bDoSetPageInWindowCreateEventHandle = false;
 		std::string error_message;
-		DoSetPage(m_strPageSource, error_message);
+		DoSetPage(error_message);
 	}
 }
 
@@ -6829,8 +11118,10 @@ void MunkHtmlWindow::SelectLine(const wxPoint& pos)
             if ( !after )
                 after = cell;
 
-            // find first cell of line:
-            for ( c = cell->GetParent()->GetFirstChild();
+            // find first cell of line (no cell of the lines above it
+            // can be on it):
+            const MunkHtmlLineBox *box = cell->GetParent()->FindLine(cell->GetPosY());
+            for ( c = box ? box->m_pFirst : cell->GetParent()->GetFirstChild();
                     c && c != cell; c = c->GetNext())
             {
                 y = c->GetAbsPos().y;
@@ -6880,6 +11171,7 @@ IMPLEMENT_DYNAMIC_CLASS(MunkHtmlWindow,wxScrolledWindow)
 
 BEGIN_EVENT_TABLE(MunkHtmlWindow, wxScrolledWindow)
     MUNK_EVT_HTML_FORM_SUBMITTED(wxID_ANY, MunkHtmlWindow::OnFormSubmitted)    
+    EVT_COMMAND(wxID_ANY, MunkEVT_HTML_ASYNC_PAGE_TOKENIZED, MunkHtmlWindow::OnAsyncPageTokenized)
     EVT_SIZE(MunkHtmlWindow::OnSize)
     EVT_LEFT_DOWN(MunkHtmlWindow::OnMouseDown)
     EVT_LEFT_UP(MunkHtmlWindow::OnMouseUp)
@@ -6951,6 +11243,17 @@ void MunkHtmlWindow::SetHTMLBackgroundImage(const wxBitmap& bmpBg, int backgroun
     SetBackgroundRepeat(background_repeat);
 }
 
+void MunkHtmlWindow::ApplyBodyState(const MunkHtmlBodyState& state)
+{
+    if (!state.m_bSeen)
+        return;
+
+    SetBorders(state.m_nBorders);
+    if (state.m_BackgroundImage.Ok())
+        SetHTMLBackgroundImage(wxBitmap(state.m_BackgroundImage, -1), state.m_nBackgroundRepeat);
+    SetHTMLBackgroundColour(state.m_BackgroundColour);
+}
+
 void MunkHtmlWindow::SetHTMLStatusText(const wxString& text)
 {
 #if wxUSE_STATUSBAR
@@ -7719,6 +12022,13 @@ MunkFontStringMetrics::MunkFontStringMetrics(int StringWidth, int StringHeight,
 {
 }
 
+MunkFontStringMetrics::MunkFontStringMetrics()
+	: m_StringWidth(0),
+	  m_StringHeight(0),
+	  m_StringDescent(0)
+{
+}
+
 MunkFontStringMetrics::~MunkFontStringMetrics()
 {
 }
@@ -7743,15 +12053,81 @@ void MunkFontStringMetrics::assign(const MunkFontStringMetrics& other)
 
 //////////////////////////////////////////////////////////
 //
-// MunkQDHTMLHandler
+// Tag IDs
 //
 //////////////////////////////////////////////////////////
 
-wxRegEx MunkQDHTMLHandler::m_regex_space_newline_space(wxT("[\x09\x0d\x20]?\x0a[\x09\x0d\x20]?"));
-wxRegEx MunkQDHTMLHandler::m_regex_space(wxT("\x20"));
-wxRegEx MunkQDHTMLHandler::m_regex_linefeed(wxT("\x0a"));
-wxRegEx MunkQDHTMLHandler::m_regex_tab(wxT("\x09"));
-wxRegEx MunkQDHTMLHandler::m_regex_space_spaces(wxT("\x20[\x20]+"));
+struct MunkHtmlTagIDEntry {
+	const char *name;
+	eMunkHtmlTagID id;
+};
+
+// Indexed by munk_html_tag_hash().  The hash is perfect for the
+// built-in tags, so each slot holds at most one of them.
+static const MunkHtmlTagIDEntry s_tag_id_table[128] = {
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { "em", kTagEm }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { "ul", kTagUl }, { "h2", kTagH2 }, { "pagebreak", kTagPagebreak },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ "dd", kTagDd }, { 0, kTagUnknown }, { "sc", kTagSc }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { "h3", kTagH3 },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { "meta", kTagMeta }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ "td", kTagTd }, { 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { "form", kTagForm }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { "u", kTagU },
+	{ "center", kTagCenter }, { "head", kTagHead }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { "table", kTagTable },
+	{ "html", kTagHtml }, { 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { "i", kTagI },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { "div", kTagDiv },
+	{ "br", kTagBr }, { 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { "hr", kTagHr }, { 0, kTagUnknown },
+	{ "select", kTagSelect }, { 0, kTagUnknown }, { 0, kTagUnknown }, { "option", kTagOption },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ "th", kTagTh }, { 0, kTagUnknown }, { "tr", kTagTr }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { "li", kTagLi }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ "tbody", kTagTbody }, { "font", kTagFont }, { "sup", kTagSup }, { "title", kTagTitle },
+	{ "dt", kTagDt }, { 0, kTagUnknown }, { 0, kTagUnknown }, { "negspace", kTagNegspace },
+	{ "img", kTagImg }, { "input", kTagInput }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { "radiobox", kTagRadiobox },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { "sub", kTagSub }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ "pre", kTagPre }, { 0, kTagUnknown }, { 0, kTagUnknown }, { "a", kTagA },
+	{ "dl", kTagDl }, { 0, kTagUnknown }, { 0, kTagUnknown }, { 0, kTagUnknown },
+	{ 0, kTagUnknown }, { "h1", kTagH1 }, { "p", kTagP }, { 0, kTagUnknown },
+	{ "b", kTagB }, { "body", kTagBody }, { 0, kTagUnknown }, { "ol", kTagOl }
+};
+
+static inline unsigned int munk_html_tag_hash(const std::string& tag)
+{
+	std::string::size_type length = tag.length();
+	unsigned char first = (unsigned char) tag[0];
+	unsigned char second = (length > 1) ? (unsigned char) tag[1] : 0;
+	unsigned char last = (unsigned char) tag[length - 1];
+	return (first + 5 * second + 8 * last + 10 * (unsigned int) length) & 127;
+}
+
+eMunkHtmlTagID munk_html_tag_id(const std::string& tag)
+{
+	if (tag.empty()) {
+		return kTagUnknown;
+	}
+	const MunkHtmlTagIDEntry& entry = s_tag_id_table[munk_html_tag_hash(tag)];
+	if (entry.name != 0 && tag == entry.name) {
+		return entry.id;
+	} else {
+		return kTagUnknown;
+	}
+}
+
+
+
+//////////////////////////////////////////////////////////
+//
+// MunkQDHTMLHandler
+//
+//////////////////////////////////////////////////////////
 
 MunkQDHTMLHandler::MunkQDHTMLHandler(MunkHtmlParsingStructure *pCanvas)
 	: m_chars(""),
@@ -7761,19 +12137,28 @@ MunkQDHTMLHandler::MunkQDHTMLHandler(MunkHtmlParsingStructure *pCanvas)
 	  m_CharWidth(0),
 	  m_UseLink(false)
 {
-	m_CurrentFontCharacteristicString = "";
+	m_CurrentFontKey = MunkFONT_KEY_NONE;
 	m_CurrentFontSpaceWidth = 0;
 	m_CurrentFontSpaceHeight = 0;
 	m_CurrentFontSpaceDescent = 0;
+	m_bCurrentFontSpacePending = false;
 	m_cur_form_id = 0;
 	m_pCanvas = pCanvas;
 	m_pDC = m_pCanvas->GetDC();
+	m_pPendingMetrics = m_pCanvas->GetPendingMetrics();
 	m_Align = MunkHTML_ALIGN_LEFT;
 	m_tmpStrBuf = NULL;
 	m_tmpStrBufSize = 0;
 	m_tmpLastWasSpace = false;
 	m_Numbering = 0;
 	m_lastWordCell = NULL;
+	m_pCurrentLink = NULL;
+	m_pCellArena = NULL; // The top container is not in it
+	m_CurrentTextFontKey = MunkFONT_KEY_NONE;
+	m_bCurrentTextUnderline = false;
+	m_pCurrentTextStyle = NULL;
+	m_pScriptRunEnd = NULL;
+	m_bCaptureMiniDOM = pCanvas->GetCaptureMiniDOM();
         m_tAlignStack.push(wxEmptyString);
 	m_rAlign = wxEmptyString;
 	startMunkHTMLFontAttributeStack();
@@ -7783,27 +12168,32 @@ MunkQDHTMLHandler::MunkQDHTMLHandler(MunkHtmlParsingStructure *pCanvas)
 
 	OpenContainer();
 
+	// The top container owns the text of the document
+	m_pTextPool = new MunkHtmlTextPool();
+	m_pCurrentContainer->AdoptTextPool(m_pTextPool);
+	m_pCellArena = new MunkHtmlCellArena();
+	m_pCurrentContainer->AdoptCellArena(m_pCellArena);
+	m_pLinkTable = new MunkHtmlLinkTable();
+	m_pCurrentContainer->AdoptLinkTable(m_pLinkTable);
+	m_pTextStyleTable = new MunkHtmlTextStyleTable();
+	m_pCurrentContainer->AdoptTextStyleTable(m_pTextStyleTable);
+
 	// Do it again, so that there always is a top
 	OpenContainer();
 
-	m_pCurrentContainer->InsertCell(new MunkHtmlColourCell(GetActualColor()));
+	SetCurrentTextColour(GetActualColor());
 	wxColour windowColour = wxSystemSettings::GetColour(wxSYS_COLOUR_WINDOW) ;
 
 
 	wxColour backgroundColour = m_pCanvas->GetHTMLBackgroundColour();
 	if (backgroundColour != wxNullColour) {
-		m_pCurrentContainer->InsertCell
-			(
-			 new MunkHtmlColourCell
-			 (m_pCanvas ? backgroundColour : windowColour,
-			  MunkHTML_CLR_BACKGROUND
-			  )
-			 );
+		SetCurrentTextColour(m_pCanvas ? backgroundColour : windowColour,
+				     MunkHTML_CLR_BACKGROUND);
 	} else {
 		// std::cerr << "UP261: background colour == wxNullColour " << std::endl;
 	}
 
-	m_pCurrentContainer->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), false));
+	SetCurrentTextFont(CreateCurrentFont(), false);
 }
 
 
@@ -7813,10 +12203,14 @@ MunkQDHTMLHandler::~MunkQDHTMLHandler()
 	delete[] m_tmpStrBuf;
 }
 
-void MunkQDHTMLHandler::AddHtmlTagCell(MunkMiniDOMTag *pMiniDOMTag)
+void MunkQDHTMLHandler::AddHtmlTagCell(const std::string& tag, eMunkMiniDOMTagKind kind, const wxString& css_style)
 {
-	if (GetContainer() != NULL) {
-		GetContainer()->InsertCell(new MunkHtmlTagCell(pMiniDOMTag));
+	if (m_bCaptureMiniDOM && GetContainer() != NULL) {
+		MunkMiniDOMTag *pMiniDOMTag = new MunkMiniDOMTag(tag, kind);
+		if (!css_style.IsEmpty()) {
+			pMiniDOMTag->setAttr("style", std::string((const char*)css_style.ToUTF8()));
+		}
+		GetContainer()->InsertCell(new (m_pCellArena) MunkHtmlTagCell(pMiniDOMTag));
 	}
 }
 
@@ -7958,30 +12352,31 @@ void MunkQDHTMLHandler::pushFontAttrs(const std::string& tag, const MunkAttribut
 		
 	m_HTML_font_attribute_stack.push(current_font_attributes);
 
-	GetContainer()->InsertCell(new MunkHtmlColourCell(GetActualColor()));
+	SetCurrentTextColour(GetActualColor());
 	if (newBackgroundColor != wxNullColour) {
-		GetContainer()->InsertCell(new MunkHtmlColourCell(newBackgroundColor, MunkHTML_CLR_BACKGROUND));
+		SetCurrentTextColour(newBackgroundColor, MunkHTML_CLR_BACKGROUND);
 	}
-	GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));  
+	SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());  
 }
 
 void MunkQDHTMLHandler::popFontAttrs(const std::string& tag)
 {
 	endTag();
-	GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	GetContainer()->InsertCell(new MunkHtmlColourCell(GetActualColor()));
-	GetContainer()->InsertCell(new MunkHtmlColourCell(GetContainer()->GetBackgroundColour(), MunkHTML_CLR_BACKGROUND));
+	SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+	SetCurrentTextColour(GetActualColor());
+	SetCurrentTextColour(GetContainer()->GetBackgroundColour(), MunkHTML_CLR_BACKGROUND);
 }
 
 void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttributeMap& attrs)
 {
 	handleChars();
 
-	if (tag == "a") {
+	switch (munk_html_tag_id(tag)) {
+	case kTagA: {
 		if (attrs.find("name") != attrs.end()) {
 			wxString name(getMunkAttribute(attrs, "name").c_str(), wxConvUTF8);
 			startAnchorNAME();
-			GetContainer()->InsertCell(new MunkHtmlAnchorCell(name));
+			GetContainer()->InsertCell(new (m_pCellArena) MunkHtmlAnchorCell(name));
 			m_anchor_type_stack.push(kATNAME);
 		} else if (attrs.find("href") != attrs.end()) {
 			wxString href(getMunkAttribute(attrs, "href").c_str(), wxConvUTF8);
@@ -8009,8 +12404,8 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 
 			startAnchorHREF(bVisible, linkColour);
 			
-			GetContainer()->InsertCell(new MunkHtmlColourCell(GetActualColor()));
-			GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
+			SetCurrentTextColour(GetActualColor());
+			SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
 
 
 			// Support BGCOLOR tag on <a> element.
@@ -8020,7 +12415,7 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 				wxColour clrBkg;
 				munkTag.GetParamAsColour(wxT("BGCOLOR"), &clrBkg);
 				if (clrBkg.Ok()) {
-					GetContainer()->InsertCell(new MunkHtmlColourCell(clrBkg, MunkHTML_CLR_BACKGROUND));
+					SetCurrentTextColour(clrBkg, MunkHTML_CLR_BACKGROUND);
 				}
 			}
 
@@ -8032,22 +12427,29 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 			throw MunkQDException(std::string("Anchor start-tag <a ....> without either href or name! Please add either href or name"));
 
 		}
-	} else if (tag == "p" || tag == "pre"
-		   || tag == "h1" || tag == "h2" || tag == "h3"
-		   || tag == "center") {
+		break;
+	}
+	case kTagP:
+	case kTagPre:
+	case kTagH1:
+	case kTagH2:
+	case kTagH3:
+	case kTagCenter: {
 		OpenContainer();
 
+		// Only needed for the MiniDOM
 		wxString css_style;
+		wxString *pCssStyle = m_bCaptureMiniDOM ? &css_style : NULL;
 		
 		MunkHtmlTag munkTag(wxString(tag.c_str(), wxConvUTF8), attrs);
 		
 		// Set margins and TextIndent and padding
 		// NONSTANDARD
-		GetContainer()->SetMarginsAndPaddingAndTextIndent(tag, munkTag, css_style, GetCharHeight());
+		GetContainer()->SetMarginsAndPaddingAndTextIndent(tag, munkTag, pCssStyle, GetCharHeight());
 		
 		if (tag == "p"
 		    || tag == "center") {
-			this->SetBackgroundImageAndBackgroundRepeat(tag, attrs, munkTag, css_style, GetContainer());
+			this->SetBackgroundImageAndBackgroundRepeat(tag, attrs, munkTag, pCssStyle, GetContainer());
 		}
 		
 		// NONSTANDARD: Borders
@@ -8078,20 +12480,20 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		GetContainer()->SetWhiteSpaceKind(m_white_space_stack.top());
 
 		
-		MunkMiniDOMTag *pMiniDOMTag = new MunkMiniDOMTag(tag, kStartTag);
-		if (!css_style.IsEmpty()) {
-			pMiniDOMTag->setAttr("style", std::string((const char*)css_style.ToUTF8()));
-		}
-
-		
-		AddHtmlTagCell(pMiniDOMTag);
+		AddHtmlTagCell(tag, kStartTag, css_style);
 		
 		SetAlign(GetContainer()->GetAlignHor());
 
 		pushFontAttrs(tag, attrs);
-	} else if (tag == "br") {
-		GetContainer()->InsertCell(new MunkHtmlLineBreakCell(m_CurrentFontSpaceHeight, GetContainer()->GetFirstChild()));
-	} else if (tag == "form") {
+		break;
+	}
+	case kTagBr: {
+		MunkHtmlCell *pBreakCell = new (m_pCellArena) MunkHtmlLineBreakCell(m_CurrentFontSpaceHeight, GetContainer()->GetFirstChild());
+		MeasureSpace(pBreakCell);
+		GetContainer()->InsertCell(pBreakCell);
+		break;
+	}
+	case kTagForm: {
 		if (m_pCanvas->m_pForms == 0) {
 			m_pCanvas->m_pForms = new MunkHtmlFormContainer();
 		}
@@ -8113,7 +12515,9 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 
 
 		m_pCanvas->m_pForms->addForm(m_cur_form_id, method, action);
-	} else if (tag == "input") {
+		break;
+	}
+	case kTagInput: {
 		std::string type;
 		eMunkHtmlFormElementKind fe_kind = kFEHidden;
 		
@@ -8196,13 +12600,18 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 			if (fe_kind != kFEHidden) {
 				MunkHtmlWidgetCell *pWidgetCell = 0;
 
-				pWidgetCell = pFormElement->realizeCell(m_pCanvas->GetParentMunkHtmlWindow());
+				pWidgetCell = pFormElement->realizeCell(m_pCanvas->GetWidgetParent());
 				if (pWidgetCell != 0) {
+					if (pWidgetCell->GetWindow() == 0) {
+						m_pCanvas->m_pForms->addUnrealizedElement(pFormElement);
+					}
 					GetContainer()->InsertCell(pWidgetCell);
 				}
 			}
 		}
-	} else if (tag == "option") {
+		break;
+	}
+	case kTagOption: {
 		std::string value;
 		if (attrs.find("value") != attrs.end()) {
 			value = getMunkAttribute(attrs, "value");
@@ -8232,7 +12641,9 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 			pFormElement->addValueLabelPair(value, label, bSelected);
 		}
 #if wxUSE_COMBOBOX
-	} else if (tag == "select") {
+		break;
+	}
+	case kTagSelect: {
 		eMunkHtmlFormElementKind fe_kind = kFESelect;
 		
 		std::string name;
@@ -8284,7 +12695,9 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		}
 #endif
 #if wxUSE_RADIOBOX
-	} else if (tag == "radiobox") {
+		break;
+	}
+	case kTagRadiobox: {
 		// NONSTANDARD:
 		// <radiobox name="{myname} disabled=\"true|false\"">
 		//   <option value="{myvalue}" label="{mylabel}" selected="true"/>
@@ -8327,7 +12740,9 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 			pRadioBox->setDisabled(bDisabled);
 		}
 #endif
-	} else if (tag == "div") {
+		break;
+	}
+	case kTagDiv: {
 		//CloseContainer();
 		//OpenContainer();
 
@@ -8340,12 +12755,14 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		MunkHtmlTag munkTag(wxString(tag.c_str(), wxConvUTF8), attrs);
 
 		// NONSTANDARD: background_image and background_repeat
+		// Only needed for the MiniDOM
 		wxString css_style; 
-		this->SetBackgroundImageAndBackgroundRepeat(tag, attrs, munkTag, css_style, GetContainer());
+		wxString *pCssStyle = m_bCaptureMiniDOM ? &css_style : NULL;
+		this->SetBackgroundImageAndBackgroundRepeat(tag, attrs, munkTag, pCssStyle, GetContainer());
 
 
 		// NONSTANDARD: Set margins and text_indent and padding
-		GetContainer()->SetMarginsAndPaddingAndTextIndent(tag, munkTag, css_style, GetCharHeight());
+		GetContainer()->SetMarginsAndPaddingAndTextIndent(tag, munkTag, pCssStyle, GetCharHeight());
 
 		// NONSTANDARD: Borders
 		this->SetBorders(tag, attrs, munkTag, css_style, GetContainer());
@@ -8363,13 +12780,7 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 
 
 
-		MunkMiniDOMTag *pMiniDOMTag = new MunkMiniDOMTag(tag, kStartTag);
-		if (!css_style.IsEmpty()) {
-			pMiniDOMTag->setAttr("style", std::string((const char*)css_style.ToUTF8()));
-		}
-
-		
-		AddHtmlTagCell(pMiniDOMTag);
+		AddHtmlTagCell(tag, kStartTag, css_style);
 
 
 		SetAlign(GetContainer()->GetAlignHor());
@@ -8377,13 +12788,19 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		
 		// OpenContainer();
 		// OpenContainer();
-	} else if (tag == "b") {
+		break;
+	}
+	case kTagB: {
 		startBold();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "em") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		break;
+	}
+	case kTagEm: {
 		startEm();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "negspace") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		break;
+	}
+	case kTagNegspace: {
 		MunkHtmlTag munkTag(wxString(tag.c_str(), wxConvUTF8), attrs);
 
 		// NONSTANDARD          
@@ -8405,36 +12822,58 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 			pixels = 0;
 		}
 
-		GetContainer()->InsertCell(new MunkHtmlNegativeSpaceCell(pixels, m_pCanvas->getMunkStringMetricsCache(m_CurrentFontCharacteristicString), m_pDC));
-	} else if (tag == "i") {
+		MunkHtmlNegativeSpaceCell *pSpaceCell = new (m_pCellArena) MunkHtmlNegativeSpaceCell(pixels);
+		MeasureWordCell(pSpaceCell, wxT(""));
+		GetContainer()->InsertCell(pSpaceCell);
+		break;
+	}
+	case kTagI: {
 		startEm();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "u") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		break;
+	}
+	case kTagU: {
 		startUnderline();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "sc") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		break;
+	}
+	case kTagSc: {
 		// NONSTANDARD
 		m_smallcaps_stack.push(true);
-	} else if (tag == "sup") {
+		break;
+	}
+	case kTagSup: {
 		int oldbase = GetScriptBaseline();
 
 
 		MunkHtmlContainerCell *cont = GetContainer();
 		MunkHtmlCell *c = cont->GetLastChild();
+		if (c == m_pScriptRunEnd) {
+			// Right after another script run, which has
+			// ended; we are back on the base line.
+			c = NULL;
+		}
 
 		startSuperscript(oldbase + (c ? c->GetScriptBaseline() : 0));
 
-		cont->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "sub") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		break;
+	}
+	case kTagSub: {
 		int oldbase = GetScriptBaseline();
 
 
 		MunkHtmlContainerCell *cont = GetContainer();
 		MunkHtmlCell *c = cont->GetLastChild();
+		if (c == m_pScriptRunEnd) {
+			// Right after another script run, which has
+			// ended; we are back on the base line.
+			c = NULL;
+		}
 
 		startSubscript(oldbase + (c ? c->GetScriptBaseline() : 0));
 
-		cont->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
 		/*
 	} else if (tag == "h1" || tag == "h2" || tag == "h3") {
 		if (tag == "h1") {
@@ -8455,11 +12894,13 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		MunkHtmlTag munkTag(wxString(tag.c_str(), wxConvUTF8), attrs);
 
 		c->SetAlign(munkTag);
-		c->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
 		c->SetIndent(GetCharHeight(), MunkHTML_INDENT_TOP);
 		SetAlign(c->GetAlignHor());
 		*/
-	} else if (tag == "img") {
+		break;
+	}
+	case kTagImg: {
 		if (attrs.find("src") != attrs.end()) {
 			int w = wxDefaultCoord, h = wxDefaultCoord;
 			int al;
@@ -8508,7 +12949,7 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 			}
 
 			
-			MunkHtmlImageCell *cel = new MunkHtmlImageCell(
+			MunkHtmlImageCell *cel = new (m_pCellArena) MunkHtmlImageCell(
                                           GetWindowInterface(),
                                           str, 
 					  scaleHDPI,
@@ -8529,9 +12970,13 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 				delete str;
 			}
 		}
-	} else if (tag == "font") {
+		break;
+	}
+	case kTagFont: {
 		pushFontAttrs(tag, attrs);
-	} else if (tag == "hr") {
+		break;
+	}
+	case kTagHr: {
 		MunkHtmlTag munkTag(wxString(tag.c_str(), wxConvUTF8), attrs);
 
 		MunkHtmlContainerCell *c;
@@ -8558,11 +13003,13 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		HasShading = !(munkTag.HasParam(wxT("NOSHADE")));
 		int myHeight = (int)((double)sz * 1.0);
 
-		c->InsertCell(new MunkHtmlLineCell(myHeight, myWidth, HasShading));
+		c->InsertCell(new (m_pCellArena) MunkHtmlLineCell(myHeight, myWidth, HasShading));
 		
 		CloseContainer();
 		//OpenContainer();
-	} else if (tag == "pagebreak") {
+		break;
+	}
+	case kTagPagebreak: {
 		int al = GetContainer()->GetAlignHor();
 		MunkHtmlContainerCell *c;
 
@@ -8570,16 +13017,23 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		c = OpenContainer();
 		c->SetAlignHor(al);
 
-		c->InsertCell(new MunkHtmlPagebreakCell());
+		c->InsertCell(new (m_pCellArena) MunkHtmlPagebreakCell());
 		
 		MunkHtmlTag munkTag(wxString(tag.c_str(), wxConvUTF8), attrs);
 		c->SetAlign(munkTag);
 		c->SetVAlign(munkTag);
 		c->SetMinHeight(GetCharHeight());
 		CloseContainer();
-	} else if (tag == "tbody") {
+		break;
+	}
+	case kTagTbody: {
 		// Simply ignore it.
-	} else if (tag == "table" || tag == "tr" || tag == "td" || tag == "th") {
+		break;
+	}
+	case kTagTable:
+	case kTagTr:
+	case kTagTd:
+	case kTagTh: {
 		MunkHtmlTag munkTag(wxString(tag.c_str(), wxConvUTF8), attrs);
 		MunkHtmlContainerCell *c;
 		wxString css_style; // Not used for these tags
@@ -8604,7 +13058,7 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 
 			m_table_cell_info_stack.push(std::make_pair(std::make_pair(oldAlign,bIsInline), oldcont));
 			
-			MunkHtmlTableCell *pTable = new MunkHtmlTableCell(c, munkTag, m_pCanvas->GetPixelScale());
+			MunkHtmlTableCell *pTable = new (m_pCellArena) MunkHtmlTableCell(c, munkTag, m_pCanvas->GetPixelScale());
 			m_tables_stack.push(pTable);
 			
 			// width:
@@ -8638,7 +13092,7 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 			}
 
 			// NONSTANDARD: Set margins and text_indent and padding
-			GetContainer()->SetMarginsAndPaddingAndTextIndent(tag, munkTag, css_style, GetCharHeight());
+			GetContainer()->SetMarginsAndPaddingAndTextIndent(tag, munkTag, NULL, GetCharHeight());
 
 			// NONSTANDARD: Set height
 			GetContainer()->SetHeight(munkTag, 1.0); // FIXME: What about printing?
@@ -8654,7 +13108,7 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 				if (munkTag.HasParam(wxT("ALIGN")))
 					m_rAlign = munkTag.GetParam(wxT("ALIGN"));
 			}  else { // new cell
-				c = SetContainer(new MunkHtmlContainerCell(m_tables_stack.top()));
+				c = SetContainer(new (m_pCellArena) MunkHtmlContainerCell(m_tables_stack.top()));
 
 				// NONSTANDARD: Set width: DON'T do it: It is done in AddCell below!
 				// c->SetWidthFloat(munkTag, 1.0); // FIXME: What about printing?
@@ -8664,7 +13118,7 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 
 				if (tag == "td" || tag == "th") {
 					// NONSTANDARD: background_image and background_repeat
-					this->SetBackgroundImageAndBackgroundRepeat(tag, attrs, munkTag, css_style, GetContainer());
+					this->SetBackgroundImageAndBackgroundRepeat(tag, attrs, munkTag, NULL, GetContainer());
 
 					// NONSTANDARD: Borders
 					this->SetBorders(tag, attrs, munkTag, css_style, GetContainer());
@@ -8710,11 +13164,13 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 
 
 				// NONSTANDARD: Set margins and text_indent and padding
-				GetContainer()->SetMarginsAndPaddingAndTextIndent(tag, munkTag, css_style, GetCharHeight());
+				GetContainer()->SetMarginsAndPaddingAndTextIndent(tag, munkTag, NULL, GetCharHeight());
 
 			}
 		}
-	} else if (tag == "dl") {
+		break;
+	}
+	case kTagDl: {
 		/*
 		if (GetContainer()->GetFirstChild() != NULL) {
 			CloseContainer();
@@ -8723,18 +13179,24 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		*/
 		OpenContainer();
 		GetContainer()->SetIndent(GetCharHeight(), MunkHTML_INDENT_TOP);
-	} else if (tag == "dt") {
+		break;
+	}
+	case kTagDt: {
 		MunkHtmlContainerCell *c;
 		//CloseContainer();
 		c = OpenContainer();
 		c->SetAlignHor(MunkHTML_ALIGN_LEFT);
 		c->SetMinHeight(GetCharHeight());
-        } else if (tag == "dd") {
+		break;
+	}
+	case kTagDd: {
 		MunkHtmlContainerCell *c;
 		//CloseContainer();
 		c = OpenContainer();
 		c->SetIndent(3 * GetCharWidth(), MunkHTML_INDENT_LEFT);
-	} else if (tag == "li") {
+		break;
+	}
+	case kTagLi: {
 		MunkHtmlTag munkTag(wxString(tag.c_str(), wxConvUTF8), attrs);
 		
 		MunkHtmlContainerCell *c;
@@ -8743,7 +13205,7 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		if (!m_list_cell_stack.empty()) {
 			MunkHtmlListCell *pList = m_list_cell_stack.top();
 
-			c = SetContainer(new MunkHtmlContainerCell(pList));
+			c = SetContainer(new (m_pCellArena) MunkHtmlContainerCell(pList));
 			//c = OpenContainer();
 			c->SetAlignVer(MunkHTML_ALIGN_TOP);
 
@@ -8754,12 +13216,22 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 			if (m_Numbering == 0) {
 				// Centering gives more space after the bullet
 				c->SetAlignHor(MunkHTML_ALIGN_CENTER);
-				c->InsertCell(new MunkHtmlListmarkCell(m_pDC, GetActualColor()));
+				if (m_pDC != NULL) {
+					m_pCanvas->SetDCFont(m_CurrentTextFont, m_CurrentTextFontKey);
+					c->InsertCell(new (m_pCellArena) MunkHtmlListmarkCell(m_pDC, GetActualColor()));
+				} else {
+					MunkHtmlListmarkCell *pMarkCell = new (m_pCellArena) MunkHtmlListmarkCell(GetActualColor());
+					m_pPendingMetrics->Add(m_CurrentTextFontKey, m_CurrentTextFont, pMarkCell, " ", 1);
+					c->InsertCell(pMarkCell);
+				}
 			} else {
 				c->SetAlignHor(MunkHTML_ALIGN_RIGHT);
 				wxString markStr;
 				markStr.Printf(wxT("%i. "), m_Numbering);
-				c->InsertCell(new MunkHtmlWordCell(markStr, m_pCanvas->getMunkStringMetricsCache(m_CurrentFontCharacteristicString), m_pDC));
+				MunkHtmlWordCell *pMarkCell = new (m_pCellArena) MunkHtmlWordCell(m_pTextPool, markStr);
+				MeasureWordCell(pMarkCell, markStr);
+				pMarkCell->SetTextStyle(GetCurrentTextStyle());
+				c->InsertCell(pMarkCell);
 			}
 			CloseContainer();
 
@@ -8769,13 +13241,16 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 
 			pList->AddRow(mark, c);
 			c = OpenContainer();
-			SetContainer(new MunkHtmlListcontentCell(c));
+			SetContainer(new (m_pCellArena) MunkHtmlListcontentCell(c));
 			
 			if (m_Numbering != 0) {
 				++m_Numbering;
 			}
 		}
-	} else if (tag == "ul" || tag == "ol") {
+		break;
+	}
+	case kTagUl:
+	case kTagOl: {
 		//CloseContainer();
 
 		MunkHtmlContainerCell *c;
@@ -8806,19 +13281,29 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 
 		m_list_cell_info_stack.push(std::make_pair(oldnum, oldcont));
 		
-		MunkHtmlListCell *pList = new MunkHtmlListCell(c);
+		MunkHtmlListCell *pList = new (m_pCellArena) MunkHtmlListCell(c);
 		pList->SetIndent(1 * GetCharWidth(), MunkHTML_INDENT_LEFT);
 		m_list_cell_stack.push(pList);
 		SetContainer(pList);
-	} else if (tag == "html") {
+		break;
+	}
+	case kTagHtml: {
 		; // Do nothing
-	} else if (tag == "head") {
+		break;
+	}
+	case kTagHead: {
 		; // Do nothing
-	} else if (tag == "title") {
+		break;
+	}
+	case kTagTitle: {
 		; // Do nothing
-	} else if (tag == "meta") {
+		break;
+	}
+	case kTagMeta: {
 		; // Do nothing
-	} else if (tag == "body") {
+		break;
+	}
+	case kTagBody: {
 		m_bInBody = true;
 		MunkHtmlTag munkTag(wxString(tag.c_str(), wxConvUTF8), attrs);
 		
@@ -8831,9 +13316,9 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		} else {
 			padding = 10;
 		}
-		if (m_pCanvas->GetParentMunkHtmlWindow() != NULL) {
-			m_pCanvas->GetParentMunkHtmlWindow()->SetBorders(padding);
-		}
+		MunkHtmlBodyState& body_state = m_pCanvas->GetBodyState();
+		body_state.m_bSeen = true;
+		body_state.m_nBorders = padding;
 
 		// NONSTANDARD          
 		wxString strFaceName;
@@ -8930,9 +13415,8 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 				if (s) {
 					wxImage image(*s, wxBITMAP_TYPE_ANY);
 					if (image.Ok()) {
-						if (m_pCanvas->GetParentMunkHtmlWindow() != NULL) {
-							m_pCanvas->GetParentMunkHtmlWindow()->SetHTMLBackgroundImage(wxBitmap(image, -1), background_repeat);
-						}
+						body_state.m_BackgroundImage = image;
+						body_state.m_nBackgroundRepeat = background_repeat;
 					} else {
 #ifdef __LINUX__
 						std::cerr << "UP257: image was not OK!" << std::endl;
@@ -8944,9 +13428,6 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 		} else {
 			// No background image. Set background to white.
 			m_pCanvas->SetHTMLBackgroundColour(*wxWHITE);
-			if (m_pCanvas->GetParentMunkHtmlWindow() != NULL) {
-				m_pCanvas->GetParentMunkHtmlWindow()->SetHTMLBackgroundColour(*wxWHITE);
-			}
 		}
 		
 		wxColour bgcolour = *wxWHITE;
@@ -8956,13 +13437,19 @@ void MunkQDHTMLHandler::startElement(const std::string& tag, const MunkAttribute
 			bgcolour = *wxWHITE;
 		}
 		m_pCanvas->SetHTMLBackgroundColour(bgcolour);
-		if (m_pCanvas->GetParentMunkHtmlWindow() != NULL) {
-			m_pCanvas->GetParentMunkHtmlWindow()->SetHTMLBackgroundColour(bgcolour);
-		}
+		body_state.m_BackgroundColour = bgcolour;
 		OpenContainer();
 		m_pCurrentContainer->SetBackgroundColour(m_pCanvas->GetHTMLBackgroundColour());
-	} else {
-		throw MunkQDException(std::string("Unknown start-tag: <") + tag + ">");
+		break;
+	}
+	default: {
+		MunkHtmlCustomTagHandler *pCustom = m_pCanvas->GetCustomTagHandler(tag);
+		if (pCustom == 0) {
+			throw MunkQDException(std::string("Unknown start-tag: <") + tag + ">");
+		}
+		pCustom->StartTag(this, tag, attrs);
+		break;
+	}
 	}
 }
 
@@ -8971,7 +13458,8 @@ void MunkQDHTMLHandler::endElement(const std::string& tag)
 {
 	handleChars();
 
-	if (tag == "a") {
+	switch (munk_html_tag_id(tag)) {
+	case kTagA: {
 		if (m_anchor_type_stack.empty()) {
 			throw MunkQDException("</a> encountered without start-tag <a>. Please inform the publisher of this software.");
 		}
@@ -8983,23 +13471,28 @@ void MunkQDHTMLHandler::endElement(const std::string& tag)
 			; // Nothing to do
 		}
 		endTag();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-		GetContainer()->InsertCell(new MunkHtmlColourCell(GetActualColor()));
-		GetContainer()->InsertCell(new MunkHtmlColourCell(GetContainer()->GetBackgroundColour(), MunkHTML_CLR_BACKGROUND));
-	} else if (tag == "p" || tag == "pre"
-		   || tag == "h1" || tag == "h2" || tag == "h3"
-		   || tag == "center") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		SetCurrentTextColour(GetActualColor());
+		SetCurrentTextColour(GetContainer()->GetBackgroundColour(), MunkHTML_CLR_BACKGROUND);
+		break;
+	}
+	case kTagP:
+	case kTagPre:
+	case kTagH1:
+	case kTagH2:
+	case kTagH3:
+	case kTagCenter: {
 		popFontAttrs(tag);
 		
 		//CloseContainer();
 		CloseContainer();
 
 		//endTag(); // ends startColor() from the start tag
-		GetContainer()->InsertCell(new MunkHtmlColourCell(GetActualColor()));
+		SetCurrentTextColour(GetActualColor());
 
 		
 		
-		AddHtmlTagCell(new MunkMiniDOMTag(tag, kEndTag));
+		AddHtmlTagCell(tag, kEndTag);
 
 		if (tag == "pre") {	
 			m_white_space_stack.pop();
@@ -9008,12 +13501,18 @@ void MunkQDHTMLHandler::endElement(const std::string& tag)
 			m_white_space_stack.pop();
 		}
 
-	} else if (tag == "br") {
+		break;
+	}
+	case kTagBr: {
 		; // Nothing to do
-	} else if (tag == "form") {
+		break;
+	}
+	case kTagForm: {
 		; // Nothing to do
-	} else if (tag == "radiobox"
-		   || tag == "select") {
+		break;
+	}
+	case kTagRadiobox:
+	case kTagSelect: {
 		// Realize radio box
 		MunkHtmlForm *pForm = m_pCanvas->m_pForms->getForm(m_cur_form_id);
 		MunkHtmlWidgetCell *pWidgetCell = 0;
@@ -9021,7 +13520,10 @@ void MunkQDHTMLHandler::endElement(const std::string& tag)
 		if (pForm != 0) {
 			MunkHtmlFormElement *pFormElement = pForm->getFormElement(m_cur_form_select_name);
 			if (pFormElement != 0) {
-				pWidgetCell = pFormElement->realizeCell(m_pCanvas->GetParentMunkHtmlWindow());
+				pWidgetCell = pFormElement->realizeCell(m_pCanvas->GetWidgetParent());
+				if (pWidgetCell != 0 && pWidgetCell->GetWindow() == 0) {
+					m_pCanvas->m_pForms->addUnrealizedElement(pFormElement);
+				}
 			}
 		}
 		if (pWidgetCell != 0) {
@@ -9030,54 +13532,79 @@ void MunkQDHTMLHandler::endElement(const std::string& tag)
 			MUNK_ASSERT_THROW(false,
 					  "pWidgetCell == 0");
 		}
-	} else if (tag == "input") {
+		break;
+	}
+	case kTagInput: {
 		; // Nothing to do
-	} else if (tag == "option") {
+		break;
+	}
+	case kTagOption: {
 		; // Nothing to do
-	} else if (tag == "div") {
-		AddHtmlTagCell(new MunkMiniDOMTag(tag, kEndTag));
+		break;
+	}
+	case kTagDiv: {
+		AddHtmlTagCell(tag, kEndTag);
 
 		CloseContainer();
 		CloseContainer();
-	} else if (tag == "b") {
+		break;
+	}
+	case kTagB: {
 		endTag();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "em") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		break;
+	}
+	case kTagEm: {
 		endTag();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "negspace") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		break;
+	}
+	case kTagNegspace: {
 		// NONSTANDARD TAG!!!
-	} else if (tag == "i") {
+		break;
+	}
+	case kTagI: {
 		endTag();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "u") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		break;
+	}
+	case kTagU: {
 		endTag();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "sc") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		break;
+	}
+	case kTagSc: {
 		// NONSTANDARD small caps
 		m_smallcaps_stack.pop();
-	} else if (tag == "sup") {
-		endTag();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "sub") {
+		break;
+	}
+	case kTagSup:
+	case kTagSub: {
+		m_pScriptRunEnd = GetContainer()->GetLastChild();
 		endTag();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
-	} else if (tag == "pagebreak") {
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
+		break;
+	}
+	case kTagPagebreak: {
 		// Nothing to do; all was done at the start of the tag.
 		/*
 	} else if (tag == "h1"
 		   || tag == "h2"
 		   || tag == "h3") {
 		endTag();
-		GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
+		SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
 		CloseContainer();
 		OpenContainer();
 		MunkHtmlContainerCell *c = GetContainer();
 		c->SetIndent(GetCharHeight(), MunkHTML_INDENT_TOP);
 		*/
-	} else if (tag == "tbody") {
+		break;
+	}
+	case kTagTbody: {
 		// Simply ignore it.
-	} else if (tag == "table") {
+		break;
+	}
+	case kTagTable: {
 		std::pair<std::pair<long,bool>, MunkHtmlContainerCell*> mypair = 
 			m_table_cell_info_stack.top();
 		m_table_cell_info_stack.pop();
@@ -9091,16 +13618,25 @@ void MunkQDHTMLHandler::endElement(const std::string& tag)
 		}
 		m_tables_stack.pop();
 		m_white_space_stack.pop();
-	} else if (tag == "td" || tag == "th") {
+		break;
+	}
+	case kTagTd:
+	case kTagTh: {
 		CloseContainer();
 		CloseContainer();
 		CloseContainer();
 		m_white_space_stack.pop();
-	} else if (tag == "tr") {
+		break;
+	}
+	case kTagTr: {
 		// Nothing to do
-	} else if (tag == "hr") {
+		break;
+	}
+	case kTagHr: {
 		; // Do nothing
-	} else if (tag == "dl") {
+		break;
+	}
+	case kTagDl: {
 		/*
 		if (GetContainer()->GetFirstChild() != NULL) {
 			CloseContainer();
@@ -9109,11 +13645,17 @@ void MunkQDHTMLHandler::endElement(const std::string& tag)
 		*/
 		CloseContainer();
 		//GetContainer()->SetIndent(GetCharHeight(), MunkHTML_INDENT_TOP);
-	} else if (tag == "dt") {
+		break;
+	}
+	case kTagDt: {
 		CloseContainer();
-        } else if (tag == "dd") {
+		break;
+	}
+	case kTagDd: {
 		CloseContainer();
-	} else if (tag == "li") {
+		break;
+	}
+	case kTagLi: {
 		if (!m_list_cell_stack.empty()) {
 			CloseContainer();
 			//CloseContainer();
@@ -9122,7 +13664,10 @@ void MunkQDHTMLHandler::endElement(const std::string& tag)
 			SetContainer(pList);
 
 		}
-	} else if (tag == "ol" || tag == "ul") {
+		break;
+	}
+	case kTagOl:
+	case kTagUl: {
 		SetContainer(m_list_cell_stack.top());
 		CloseContainer();
 
@@ -9142,22 +13687,44 @@ void MunkQDHTMLHandler::endElement(const std::string& tag)
 		OpenContainer();
 		*/
 		m_Numbering = mypair.first;
-	} else if (tag == "html") {
+		break;
+	}
+	case kTagHtml: {
 		; // Do nothing
-	} else if (tag == "head") {
+		break;
+	}
+	case kTagHead: {
 		; // Do nothing
-	} else if (tag == "title") {
+		break;
+	}
+	case kTagTitle: {
 		; // Do nothing
-	} else if (tag == "meta") {
+		break;
+	}
+	case kTagMeta: {
 		; // Do nothing
-	} else if (tag == "img") {
+		break;
+	}
+	case kTagImg: {
 		; // Do nothing
-	} else if (tag == "font") {
+		break;
+	}
+	case kTagFont: {
 		popFontAttrs(tag);
-	} else if (tag == "body") {
+		break;
+	}
+	case kTagBody: {
 		m_bInBody = false;
-	} else {
-		throw MunkQDException(std::string("Unknown end-tag: </") + tag + ">");
+		break;
+	}
+	default: {
+		MunkHtmlCustomTagHandler *pCustom = m_pCanvas->GetCustomTagHandler(tag);
+		if (pCustom == 0) {
+			throw MunkQDException(std::string("Unknown end-tag: </") + tag + ">");
+		}
+		pCustom->EndTag(this, tag);
+		break;
+	}
 	}
 }
 
@@ -9181,91 +13748,58 @@ void MunkQDHTMLHandler::endDocument(void)
 		top = top->GetParent();
 	}
 	top->RemoveExtraSpacing(true, true);
+
+	// Without a DC, it is up to whoever lays the cells out.
+	if (m_pDC != NULL) {
+		m_pCanvas->ResolveMetrics(m_pDC);
+	}
+
+	m_pTextPool->ReleaseInternTable();
 	
 	m_pCanvas->SetTopCell(top);
 }
 
-void MunkQDHTMLHandler::AddText(const std::string& str)
+#ifdef MUNK_CHECK_WHITE_SPACE
+// Define MUNK_CHECK_WHITE_SPACE to check munk_normalize_white_space()
+// against the (much slower) regex-based implementation it replaced,
+// on every run of text.
+static void munk_normalize_white_space_with_regexes(const std::string& str, eWhiteSpaceKind white_space_constant, bool bStripLeading, std::vector<wxString>& tokens, std::vector<bool>& line_breaks)
 {
-	size_t i = 0,
-		x,
-		lng = str.length();
-	wxChar d;
-	wxChar nbsp = 160;
-	
-	eWhiteSpaceKind white_space_constant = m_white_space_stack.top();
-	
+	static wxRegEx regex_space_newline_space(wxT("[\x09\x0d\x20]?\x0a[\x09\x0d\x20]?"));
+	static wxRegEx regex_linefeed(wxT("\x0a"));
+	static wxRegEx regex_tab(wxT("\x09"));
+	static wxRegEx regex_space_spaces(wxT("\x20[\x20]+"));
+
 	wxString strText = wxString(str.c_str(), wxConvUTF8);
 
-	// 1. Each tab (U+0009), carriage return (U+000D), or space
-	//    (U+0020) character surrounding a linefeed (U+000A)
-	//    character is removed if 'white-space' is set to
-	//    'normal', 'nowrap', or 'pre-line'.
 	if (white_space_constant == kWSKNormal
 	    || white_space_constant == kWSKNowrap
 	    || white_space_constant == kWSKPreLine) {
-		MunkQDHTMLHandler::m_regex_space_newline_space.ReplaceAll(&strText, wxT("\x0a"));
-	}
-
-	// 2. If 'white-space' is set to 'pre' or 'pre-wrap', any
-	//    sequence of spaces (U+0020) unbroken by an element
-	//    boundary is treated as a sequence of non-breaking
-	//    spaces. However, for 'pre-wrap', a line breaking
-	//    opportunity exists at the end of the sequence.
-	if (white_space_constant == kWSKPre
-	    || white_space_constant == kWSKPreWrap) {
-		MunkQDHTMLHandler::m_regex_space.ReplaceAll(&strText, wxT("\xa0"));
+		regex_space_newline_space.ReplaceAll(&strText, wxT("\x0a"));
 	}
-
-	// 3. If 'white-space' is set to 'normal' or 'nowrap',
-	//    linefeed characters are transformed for rendering
-	//    purpose into one of the following characters: a space
-	//    character, a zero width space character (U+200B), or no
-	//    character (i.e., not rendered), according to UA-specific
-	//    algorithms based on the content script.
 	if (white_space_constant == kWSKNormal
 	    || white_space_constant == kWSKNowrap) {
-		// We always simply make it into a space
-		MunkQDHTMLHandler::m_regex_linefeed.ReplaceAll(&strText, wxT("\x20"));
+		regex_linefeed.ReplaceAll(&strText, wxT("\x20"));
 	}
-
-	// 4. If 'white-space' is set to 'normal', 'nowrap', or
-	//    'pre-line',
-	//
-	//    1. every tab (U+0009) is converted to a space (U+0020)
-	//
-	//    2. any space (U+0020) following another space (U+0020) —
-	//    even a space before the inline, if that space also has
-	//    'white-space' set to 'normal', 'nowrap' or 'pre-line' —
-	//    is removed.
 	if (white_space_constant == kWSKNormal
 	    || white_space_constant == kWSKNowrap
 	    || white_space_constant == kWSKPreLine) {
-		MunkQDHTMLHandler::m_regex_tab.ReplaceAll(&strText, wxT("\x20"));
-
-		MunkQDHTMLHandler::m_regex_space_spaces.ReplaceAll(&strText, wxT("\x20"));
+		regex_tab.ReplaceAll(&strText, wxT("\x20"));
+		regex_space_spaces.ReplaceAll(&strText, wxT("\x20"));
 	}
 
-	// std::cerr << "UP316: str = '" << str << "' strText = '" << std::string((const char*) strText.mb_str(wxConvUTF8)) << "'\n";
-
 	if (white_space_constant == kWSKPre
 	    || white_space_constant == kWSKPreWrap
 	    || white_space_constant == kWSKPreLine) {
 		wxString strLine;
 		int text_length = strText.Length();
-		for (int index = 0;
-		     index < text_length;
-		     ++index) {
+		for (int index = 0; index < text_length; ++index) {
 			wxChar c = strText[index];
 			bool bCIsNewline = c == wxT('\n');
-			bool bEndLine = (bCIsNewline || index == text_length - 1);
 			if (!bCIsNewline) {
 				strLine += c;
 			}
-
-			// FIXME: We here ignore the fact that \x09
-			// (TAB) should be treated specially!
-			if (bEndLine) {
+			if (bCIsNewline || index == text_length - 1) {
 				if (white_space_constant == kWSKPreLine) {
 					while (strLine.Right(1) == wxT(' ')) {
 						strLine.RemoveLast();
@@ -9274,119 +13808,69 @@ void MunkQDHTMLHandler::AddText(const std::string& str)
 						strLine.Remove(0, 1);
 					}
 				}
-				DoAddText(strLine);
-				if (bCIsNewline) {
-					GetContainer()->InsertCell(new MunkHtmlLineBreakCell(m_CurrentFontSpaceHeight, GetContainer()->GetFirstChild()));
-				}
+				tokens.push_back(strLine);
+				line_breaks.push_back(bCIsNewline);
 				strLine = wxT("");
 			}
 		}
-	} else if (white_space_constant == kWSKNormal
-		   || white_space_constant == kWSKNowrap) {
-		wxString strWhiteSpacePrefix;
-		wxString strStringToBeTokenized;
+	} else {
 		unsigned int index = 0;
 		unsigned int text_length = strText.Length();
-
-		// Determine if we had seen some space before
-		// (or had just opened a Container)
-		if (m_tmpLastWasSpace) {
-			// Remove whitespace at the beginning
-			while ((index < text_length) &&
-			       IsWhiteSpace(strText[index])) {
+		if (bStripLeading) {
+			while (index < text_length && IsWhiteSpace(strText[index])) {
 				index++;
 			}
-
-			if (index > 0) {
-				strText = strText.Right(text_length - index);
-				index = 0;
-				text_length = strText.Length();
-			}
 		}
-		
-		bool bInWhiteSpace = false;
 		wxString strToken;
-		if (text_length > 0) {
-			bInWhiteSpace = IsWhiteSpace(strText[0]);
-		}
-		while (index < text_length)  {
+		bool bInWhiteSpace = false;
+		for (; index < text_length; ++index) {
 			wxChar c = strText[index];
-			if (IsWhiteSpace(c)) {
-				if (bInWhiteSpace) {
-					strToken += c;
-				} else {
-					if (!strToken.IsEmpty()) {
-						DoAddText(strToken);
-						strToken = wxT("");
-					}
-					strToken += c;
-				}
-				bInWhiteSpace = true;
-			} else {
-				if (bInWhiteSpace) {
-					if (!strToken.IsEmpty()) {
-						DoAddText(strToken);
-						strToken = wxT("");
-					}
-					strToken += c;
-				} else {
-					strToken += c;
-				}
-				bInWhiteSpace = false;
+			if (IsWhiteSpace(c) != bInWhiteSpace && !strToken.IsEmpty()) {
+				tokens.push_back(strToken);
+				line_breaks.push_back(false);
+				strToken = wxT("");
 			}
-
-			++index;
+			bInWhiteSpace = IsWhiteSpace(c);
+			strToken += c;
 		}
 		if (!strToken.IsEmpty()) {
-			DoAddText(strToken);
+			tokens.push_back(strToken);
+			line_breaks.push_back(false);
 		}
 	}
-	
+}
+#endif
 
-	/*	
-	if (m_tmpLastWasSpace) {
-		while ((i < lng) &&
-		       ((txt[i] == wxT('\n')) || (txt[i] == wxT('\r')) || (txt[i] == wxT(' ')) ||
-			(txt[i] == wxT('\t')))) i++;
-	}
-	
-	while (i < lng) {
-		x = 0;
-		d = temp[templen++] = txt[i];
-		if ((d == wxT('\n')) || (d == wxT('\r')) || (d == wxT(' ')) || (d == wxT('\t'))) {
-			i++, x++;
-			while ((i < lng) && ((txt[i] == wxT('\n')) || (txt[i] == wxT('\r')) ||
-					     (txt[i] == wxT(' ')) || (txt[i] == wxT('\t')))) i++, x++;
-		}
-		else i++;
-		
-		if (x) {
-			temp[templen-1] = wxT(' ');
-			DoAddText(temp, templen, nbsp);
-			m_tmpLastWasSpace = true;
-		}
-	}
+void MunkQDHTMLHandler::AddText(const std::string& str)
+{
+	eWhiteSpaceKind white_space_constant = m_white_space_stack.top();
 
-	wxString txt(str.c_str(), wxConvUTF8);
-	size_t i = 0,
-		x,
-		lng = wxStrlen(txt);
-	wxChar d;
-	int templen = 0;
-	wxChar nbsp = 160;
-	
-	if (lng+1 > m_tmpStrBufSize) {
-		delete[] m_tmpStrBuf;
-		m_tmpStrBuf = new wxChar[lng+1];
-		m_tmpStrBufSize = lng+1;
+	munk_normalize_white_space(str.data(), str.length(), white_space_constant, m_tmpLastWasSpace, m_tmpNormalizedText, m_tmpTextTokens);
+
+#ifdef MUNK_CHECK_WHITE_SPACE
+	std::vector<wxString> expected_tokens;
+	std::vector<bool> expected_line_breaks;
+	munk_normalize_white_space_with_regexes(str, white_space_constant, m_tmpLastWasSpace, expected_tokens, expected_line_breaks);
+	wxASSERT_MSG(expected_tokens.size() == m_tmpTextTokens.size(),
+		     wxT("munk_normalize_white_space: wrong number of tokens"));
+	for (size_t i = 0; i < expected_tokens.size() && i < m_tmpTextTokens.size(); ++i) {
+		const MunkTextToken& token = m_tmpTextTokens[i];
+		wxASSERT_MSG(expected_tokens[i] == wxString(m_tmpNormalizedText.data() + token.m_nStart, wxConvUTF8, token.m_nLength)
+			     && expected_line_breaks[i] == token.m_bLineBreakAfter,
+			     wxT("munk_normalize_white_space: token differs"));
 	}
-	wxChar *temp = m_tmpStrBuf;
+#endif
 
-	if (templen && (templen > 1 || temp[0] != wxT(' '))) {
-		DoAddText(temp, templen, nbsp);
-		m_tmpLastWasSpace = false;
+	const char *pText = m_tmpNormalizedText.data();
+	MunkTextTokenVector::const_iterator ci = m_tmpTextTokens.begin();
+	for (; ci != m_tmpTextTokens.end(); ++ci) {
+		DoAddText(wxString(pText + ci->m_nStart, wxConvUTF8, ci->m_nLength));
+		if (ci->m_bLineBreakAfter) {
+			MunkHtmlCell *pBreakCell = new (m_pCellArena) MunkHtmlLineBreakCell(m_CurrentFontSpaceHeight, GetContainer()->GetFirstChild());
+			MeasureSpace(pBreakCell);
+			GetContainer()->InsertCell(pBreakCell);
+		}
 	}
-	*/
 }
 
 
@@ -9405,26 +13889,44 @@ void MunkQDHTMLHandler::DoAddText(wxChar *temp, int& templen, wxChar nbsp)
             temp[j] = wxT(' ');
     }
 
-    MunkHtmlCell *c = new MunkHtmlWordCell(temp, m_pCanvas->getMunkStringMetricsCache(m_CurrentFontCharacteristicString), m_pDC);
+    MunkHtmlWordCell *c = new (m_pCellArena) MunkHtmlWordCell(m_pTextPool, temp);
+    MeasureWordCell(c, temp);
 
     ApplyStateToCell(c);
 
     m_pCurrentContainer->InsertCell(c);
-    ((MunkHtmlWordCell*)c)->SetPreviousWord(m_lastWordCell);
-    m_lastWordCell = (MunkHtmlWordCell*)c;
+    c->SetPreviousWord(m_lastWordCell);
+    m_lastWordCell = c;
 }
 
 void MunkQDHTMLHandler::DoAddText(const wxString& txt)
 {
-	MunkHtmlCell *c = 0;
+	MunkHtmlWordCell *c = 0;
 	wxString mytxt = txt;
 
 	// Replace nbsp (U+00A0) with space
 	mytxt.Replace(wxString::FromUTF8("\xc2\xa0"), wxT(" "));
 	if (mytxt == wxT(" ")) {
-		c = new MunkHtmlWordCell(m_CurrentFontSpaceWidth, m_CurrentFontSpaceHeight, m_CurrentFontSpaceDescent);
+		// A space right after a word becomes the word's trailing
+		// space rather than a cell of its own, as long as the
+		// space would have looked just like the word.
+		if (m_lastWordCell != NULL
+		    && m_lastWordCell == m_pCurrentContainer->GetLastChild()
+		    && !m_lastWordCell->HasTrailingSpace()
+		    && !m_lastWordCell->IsWordSpace()
+		    && m_lastWordCell->GetTextStyle() == GetCurrentTextStyle()
+		    && m_lastWordCell->GetLink() == m_pCurrentLink
+		    && m_lastWordCell->GetScriptMode() == GetScriptMode()) {
+			m_lastWordCell->AddTrailingSpace(m_CurrentFontSpaceWidth);
+			MeasureSpace(m_lastWordCell, true);
+			m_tmpLastWasSpace = true;
+			return;
+		}
+		c = new (m_pCellArena) MunkHtmlWordCell(m_CurrentFontSpaceWidth, m_CurrentFontSpaceHeight, m_CurrentFontSpaceDescent);
+		MeasureSpace(c);
 	} else {
-		c = new MunkHtmlWordCell(mytxt, m_pCanvas->getMunkStringMetricsCache(m_CurrentFontCharacteristicString), m_pDC);
+		c = new (m_pCellArena) MunkHtmlWordCell(m_pTextPool, mytxt);
+		MeasureWordCell(c, mytxt);
 	}
 
 	if (!mytxt.IsEmpty() && mytxt.Right(1) == wxT(' ')) {
@@ -9436,8 +13938,8 @@ void MunkQDHTMLHandler::DoAddText(const wxString& txt)
 	ApplyStateToCell(c);
 	
 	m_pCurrentContainer->InsertCell(c);
-	((MunkHtmlWordCell*)c)->SetPreviousWord(m_lastWordCell);
-	m_lastWordCell = (MunkHtmlWordCell*)c;
+	c->SetPreviousWord(m_lastWordCell);
+	m_lastWordCell = c;
 }
 
 
@@ -9467,7 +13969,7 @@ void MunkQDHTMLHandler::handleChars(void)
 							tmp = "";
 						}
 						endTag();
-						GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
+						SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
 						bSmallCapsTagOn = false;
 						tmp += c;
 					} else {
@@ -9484,7 +13986,7 @@ void MunkQDHTMLHandler::handleChars(void)
 							tmp = "";
 						}	
 						startSmallCaps();
-						GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
+						SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
 						bSmallCapsTagOn = true;
 						tmp += toupper(c);
 					}
@@ -9499,7 +14001,7 @@ void MunkQDHTMLHandler::handleChars(void)
 						tmp = "";
 					}
 					startSmallCaps();
-					GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
+					SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
 					bSmallCapsTagOn = true;
 					tmp += c;
 				}
@@ -9510,7 +14012,7 @@ void MunkQDHTMLHandler::handleChars(void)
 		}
 		if (bSmallCapsTagOn) {
 			endTag();
-			GetContainer()->InsertCell(new MunkHtmlFontCell(CreateCurrentFont(), GetFontUnderline()));
+			SetCurrentTextFont(CreateCurrentFont(), GetFontUnderline());
 		}
 		m_chars = "";
 		return;
@@ -9564,7 +14066,7 @@ void MunkQDHTMLHandler::text(const std::string& str)
 void MunkQDHTMLHandler::SetBackgroundImageAndBackgroundRepeat(const std::string& tag, 
 							      const MunkAttributeMap& attrs,
 							      const MunkHtmlTag& munkTag, 
-							      wxString& css_style,
+							      wxString *pCssStyle,
 							      MunkHtmlContainerCell *pContainer)
 {
 	if (munkTag.HasParam(wxT("BACKGROUND_IMAGE"))) {
@@ -9606,7 +14108,7 @@ void MunkQDHTMLHandler::SetBackgroundImageAndBackgroundRepeat(const std::string&
 				wxImage image(*s, wxBITMAP_TYPE_ANY);
 				if (image.Ok()) {
 					if (m_pCanvas->GetParentMunkHtmlWindow() != NULL) {
-						pContainer->SetBackgroundImage(wxBitmap(image, -1));
+						pContainer->SetBackgroundImage(image);
 						pContainer->SetBackgroundRepeat(background_repeat);
 					}
 				} else {
@@ -9616,8 +14118,10 @@ void MunkQDHTMLHandler::SetBackgroundImageAndBackgroundRepeat(const std::string&
 				}
 			}
 			delete str;
-			css_style += wxT(" background_image=\"") + bgimgurl + wxT("\";")
-				+ wxT(" background_repeat = ") + css_background_repeat + wxT(";");
+			if (pCssStyle != NULL) {
+				*pCssStyle += wxT(" background_image=\"") + bgimgurl + wxT("\";")
+					+ wxT(" background_repeat = ") + css_background_repeat + wxT(";");
+			}
 		} else {
 #ifdef __LINUX__
 			std::cerr << "UP259: stream was not OK while getting background_image = " << (std::string((const char*) bgimgurl.ToUTF8())) << std::endl;
@@ -9799,7 +14303,7 @@ void MunkQDHTMLHandler::SetBorders(const std::string& tag,
 
 MunkHtmlContainerCell *MunkQDHTMLHandler::OpenContainer()
 {
-	m_pCurrentContainer = new MunkHtmlContainerCell(m_pCurrentContainer);
+	m_pCurrentContainer = new (m_pCellArena) MunkHtmlContainerCell(m_pCurrentContainer);
 	m_pCurrentContainer->SetWhiteSpaceKind(m_white_space_stack.top());
 	m_pCurrentContainer->SetAlignHor(m_Align);
 	m_tmpLastWasSpace = true;
@@ -9823,6 +14327,39 @@ MunkHtmlContainerCell *MunkQDHTMLHandler::CloseContainer()
 }
 
 
+void MunkQDHTMLHandler::AddCell(MunkHtmlCell *pCell)
+{
+	ApplyStateToCell(pCell);
+	GetContainer()->InsertCell(pCell);
+}
+
+
+MunkHtmlContainerCell *MunkQDHTMLHandler::GetTopContainer() const
+{
+	MunkHtmlContainerCell *top = m_pCurrentContainer;
+	if (top != 0) {
+		while (top->GetParent()) {
+			top = top->GetParent();
+		}
+	}
+	return top;
+}
+
+
+// Containers which are still open will get more cells, so they
+// must be laid out again next time, even if the width is the same.
+// Containers which have been closed are complete, and keep their
+// layout.
+void MunkQDHTMLHandler::InvalidateOpenContainers()
+{
+	MunkHtmlContainerCell *pContainer = m_pCurrentContainer;
+	while (pContainer != 0) {
+		pContainer->InvalidateLayout();
+		pContainer = pContainer->GetParent();
+	}
+}
+
+
 MunkHtmlPagebreakCell::MunkHtmlPagebreakCell()
 {
 	m_Width = 1;
@@ -9879,21 +14416,40 @@ void MunkHtmlPagebreakCell::Draw(wxDC& dc, int x, int y, int view_y1, int view_y
 
 void MunkQDHTMLHandler::SetCharWidthHeight()
 {
+	wxFont *pFont = CreateCurrentFont();
+	if (m_pDC == NULL) {
+		m_pCanvas->GetDeferredCharSize(&m_CharWidth, &m_CharHeight);
+		return;
+	}
+
 	// Get extent
 	wxCoord nWidth, nHeight;
 	wxCoord nDescent, nExternalLeading;
-	m_pDC->SetFont(*(CreateCurrentFont()));
+	m_pCanvas->SetDCFont(*pFont, m_CurrentFontKey);
 	m_pDC->GetTextExtent(wxT("A"),
 			     &nWidth, &nHeight,
 			     &nDescent, &nExternalLeading);
 	m_CharWidth = nWidth;
 	m_CharHeight = nHeight;
-	
-	m_pDC->SetFont(wxNullFont);
+}
+
+void MunkQDHTMLHandler::MeasureWordCell(MunkHtmlWordCell *pCell, const wxString& word)
+{
+	if (m_pDC != NULL) {
+		wxCoord Width, Height, Descent;
+		if (m_pCanvas->getMunkStringMetricsCache(m_CurrentTextFontKey)->FindTextExtent(word, m_pDC, &Width, &Height, &Descent)) {
+			pCell->SetTextExtent(Width, Height, Descent);
+			return;
+		}
+	}
+	m_pPendingMetrics->Add(m_CurrentTextFontKey, m_CurrentTextFont, pCell, pCell->GetWordUTF8(), pCell->GetWordUTF8Length());
+}
 
-	// This is necessary, so as to re-set the DC's font 
-	// next time CreateCurrentFont is called.
-	m_CurrentFontCharacteristicString = "";
+void MunkQDHTMLHandler::MeasureSpace(MunkHtmlCell *pCell, bool bTrailingSpace)
+{
+	if (m_bCurrentFontSpacePending) {
+		m_pPendingMetrics->Add(m_CurrentTextFontKey, m_CurrentTextFont, pCell, " ", 1, bTrailingSpace);
+	}
 }
 
 
@@ -9901,11 +14457,47 @@ void MunkQDHTMLHandler::ApplyStateToCell(MunkHtmlCell *cell)
 {
 	// set the link:
 	if (m_UseLink) {
-		cell->SetLink(m_link_info_stack.top());
+		cell->SetLink(m_pCurrentLink);
 	}
 		
 	// apply current script mode settings:
 	cell->SetScriptMode(GetScriptMode(), GetScriptBaseline());
+
+	cell->SetTextStyle(GetCurrentTextStyle());
+}
+
+void MunkQDHTMLHandler::SetCurrentTextFont(wxFont *pFont, bool bUnderline)
+{
+	// pFont comes from CreateCurrentFont(), so
+	// m_CurrentFontKey describes it.
+	m_CurrentTextFont = *pFont;
+	m_CurrentTextFontKey = m_CurrentFontKey;
+	m_bCurrentTextUnderline = bUnderline;
+	m_pCurrentTextStyle = NULL;
+}
+
+void MunkQDHTMLHandler::SetCurrentTextColour(const wxColour& colour, int flags)
+{
+	if (flags & MunkHTML_CLR_FOREGROUND) {
+		m_CurrentTextFgColour = colour;
+	}
+	if (flags & MunkHTML_CLR_BACKGROUND) {
+		m_CurrentTextBgColour = colour;
+	}
+	m_pCurrentTextStyle = NULL;
+}
+
+const MunkHtmlTextStyle *MunkQDHTMLHandler::GetCurrentTextStyle()
+{
+	if (m_pCurrentTextStyle == NULL) {
+		m_pCurrentTextStyle = m_pTextStyleTable->Intern(m_CurrentTextFontKey,
+								m_pCanvas->GetMagnification(),
+								m_CurrentTextFont,
+								m_bCurrentTextUnderline,
+								m_CurrentTextFgColour,
+								m_CurrentTextBgColour);
+	}
+	return m_pCurrentTextStyle;
 }
 
 int MunkQDHTMLHandler::GetActualFontSizeFactor() const
@@ -9928,8 +14520,10 @@ MunkHtmlLinkInfo MunkQDHTMLHandler::PopLink()
 		m_link_info_stack.pop();
 		if (m_link_info_stack.empty()) {
 			m_UseLink = false;
+			m_pCurrentLink = NULL;
 		} else {
 			m_UseLink = (m_link_info_stack.top().GetHref() != wxEmptyString);
+			m_pCurrentLink = m_pLinkTable->Intern(m_link_info_stack.top());
 		}
 		return mytop;
 	}
@@ -9939,6 +14533,7 @@ void MunkQDHTMLHandler::PushLink(const MunkHtmlLinkInfo& link)
 {
 	m_link_info_stack.push(link);
 	m_UseLink = (link.GetHref() != wxEmptyString);
+	m_pCurrentLink = m_pLinkTable->Intern(link);
 }
 
 
@@ -9950,14 +14545,19 @@ void MunkQDHTMLHandler::startMunkHTMLFontAttributeStack(void)
 	}
 	
 	// Then push back a normal, non-decorated, black MunkHTMLFontAttributes object.
-	m_HTML_font_attribute_stack.push(MunkHTMLFontAttributes(false, // bold
-								false, // italic
-								false, // underline
-								0, // baseline
-								MunkHTML_SCRIPT_NORMAL, // scriptMode
-								100,  // sizeFactor
-								*wxBLACK,
-								wxT("Arial"))); // color
+	m_HTML_font_attribute_stack.push(GetDefaultFontAttributes());
+}
+
+MunkHTMLFontAttributes MunkQDHTMLHandler::GetDefaultFontAttributes()
+{
+	return MunkHTMLFontAttributes(false, // bold
+				      false, // italic
+				      false, // underline
+				      0, // baseline
+				      MunkHTML_SCRIPT_NORMAL, // scriptMode
+				      100,  // sizeFactor
+				      *wxBLACK, // color
+				      wxT("Arial"));
 }
 
 
@@ -10103,34 +14703,38 @@ bool MunkQDHTMLHandler::GetFontSmallCaps() const
 wxFont *MunkQDHTMLHandler::CreateCurrentFont()
 {
 	const MunkHTMLFontAttributes& font_attributes = m_HTML_font_attribute_stack.top();
-	std::string characteristic_string = font_attributes.toString();
+	MunkFontKey font_key = font_attributes.toKey();
 
 	wxFont *pResult = m_pCanvas->getFontFromMunkHTMLFontAttributes(font_attributes,
 								       true, // Use map
-								       characteristic_string);
+								       font_key);
 
-	if (m_CurrentFontCharacteristicString != characteristic_string) {
+	if (m_CurrentFontKey != font_key) {
 		// In addition, if we aren't using the same font as last time,
-		// set the font and the m_CurrentFontSpace{Width,Height,Descent}
-
-		// First, set the font of the DC
-		m_pDC->SetFont(*pResult);
-
-		// Then, set m_CurrentFontSpace{Width,Height,Descent}
-		String2MunkFontStringMetrics::iterator it = m_pCanvas->m_FontSpaceCache.find(characteristic_string);
-		if (it == m_pCanvas->m_FontSpaceCache.end()) {
-			m_pDC->GetTextExtent(wxT(" "), &m_CurrentFontSpaceWidth, &m_CurrentFontSpaceHeight, &m_CurrentFontSpaceDescent);
-			
-			m_pCanvas->m_FontSpaceCache.insert(std::make_pair(characteristic_string, MunkFontStringMetrics(m_CurrentFontSpaceWidth, m_CurrentFontSpaceHeight, m_CurrentFontSpaceDescent)));
-		} else {
+		// set m_CurrentFontSpace{Width,Height,Descent}.  The font
+		// of the DC is only changed if the space must be measured.
+		FontKey2MunkFontStringMetrics::iterator it = m_pCanvas->m_FontSpaceCache.find(font_key);
+		m_bCurrentFontSpacePending = false;
+		if (it != m_pCanvas->m_FontSpaceCache.end()) {
 			m_CurrentFontSpaceWidth = it->second.m_StringWidth;
 			m_CurrentFontSpaceHeight = it->second.m_StringHeight;
 			m_CurrentFontSpaceDescent = it->second.m_StringDescent;
+		} else if (m_pDC == NULL) {
+			// See MeasureSpace()
+			m_CurrentFontSpaceWidth = 0;
+			m_CurrentFontSpaceHeight = 0;
+			m_CurrentFontSpaceDescent = 0;
+			m_bCurrentFontSpacePending = true;
+		} else {
+			m_pCanvas->SetDCFont(*pResult, font_key);
+			m_pDC->GetTextExtent(wxT(" "), &m_CurrentFontSpaceWidth, &m_CurrentFontSpaceHeight, &m_CurrentFontSpaceDescent);
+			
+			m_pCanvas->m_FontSpaceCache[font_key] = MunkFontStringMetrics(m_CurrentFontSpaceWidth, m_CurrentFontSpaceHeight, m_CurrentFontSpaceDescent);
 		}
 
 		// Finally, make sure we don't do it again until we
 		// actually change the font.
-		m_CurrentFontCharacteristicString = characteristic_string;
+		m_CurrentFontKey = font_key;
 	}
 
 
@@ -10189,6 +14793,16 @@ std::list<MunkHtmlForm*> MunkHtmlFormContainer::getFormList()
 	
 	return result;
 }
+
+void MunkHtmlFormContainer::realizeWidgets(MunkHtmlWindow *pParent)
+{
+	std::list<MunkHtmlFormElement*>::iterator it = m_unrealized_elements.begin();
+	while (it != m_unrealized_elements.end()) {
+		(*it)->realizeWidget(pParent);
+		++it;
+	}
+	m_unrealized_elements.clear();
+}
  
 
 
@@ -10292,6 +14906,7 @@ MunkHtmlFormElement::MunkHtmlFormElement(form_id_t form_id, eMunkHtmlFormElement
 	m_form_id = form_id;
 	m_kind = kind;
 	m_selected_index = 0;
+	m_pWidgetCell = 0;
 	m_pButtonPanel = 0;
 #if wxUSE_RADIOBOX
 	m_pRadioBoxPanel = 0;
@@ -10374,11 +14989,11 @@ void MunkHtmlFormElement::addValueLabelPair(const std::string& value, const std:
 }
 
 
-MunkHtmlWidgetCell *MunkHtmlFormElement::realizeCell(MunkHtmlWindow *pParent)
+wxWindow *MunkHtmlFormElement::createWidget(MunkHtmlWindow *pParent)
 {
 
 	MUNK_ASSERT_THROW(pParent != 0,
-			  "realizeCell(0)");
+			  "createWidget(0)");
 
 	if (m_kind == kFESubmit) {
 		std::string str_label;
@@ -10394,8 +15009,7 @@ MunkHtmlWidgetCell *MunkHtmlFormElement::realizeCell(MunkHtmlWindow *pParent)
 
 		// pButtonPanel->Show(true);
 
-		m_pWidgetCell = new MunkHtmlWidgetCell(pButtonPanel, 0);
-		return m_pWidgetCell;
+		return pButtonPanel;
 	} else if (m_kind == kFEHidden) {
 		return 0; // Nothing to create.
 #if wxUSE_RADIOBOX
@@ -10427,8 +15041,7 @@ MunkHtmlWidgetCell *MunkHtmlFormElement::realizeCell(MunkHtmlWindow *pParent)
 
 		//m_pRadioBoxPanel->Show(true);
 
-		m_pWidgetCell = new MunkHtmlWidgetCell(m_pRadioBoxPanel, 0);
-		return m_pWidgetCell;
+		return m_pRadioBoxPanel;
 #endif
 #if wxUSE_COMBOBOX
 	} else if (m_kind == kFESelect) {
@@ -10460,8 +15073,7 @@ MunkHtmlWidgetCell *MunkHtmlFormElement::realizeCell(MunkHtmlWindow *pParent)
 
 		// m_pComboBoxPanel->Show(true);
 
-		m_pWidgetCell = new MunkHtmlWidgetCell(m_pComboBoxPanel, 0);
-		return m_pWidgetCell;
+		return m_pComboBoxPanel;
 #endif
 	} else if (m_kind == kFEText) {
 	  std::string str_value = m_value_label_pair_list.begin()->first;
@@ -10483,10 +15095,39 @@ MunkHtmlWidgetCell *MunkHtmlFormElement::realizeCell(MunkHtmlWindow *pParent)
 	  
 	  // m_pTextInputPanel->Show(true);
 
-		m_pWidgetCell = new MunkHtmlWidgetCell(m_pTextInputPanel, 0);
-		return m_pWidgetCell;
+		return m_pTextInputPanel;
 	} else {
 		return 0;
 	}
 }
 
+
+MunkHtmlWidgetCell *MunkHtmlFormElement::realizeCell(MunkHtmlWindow *pParent)
+{
+	if (m_kind == kFEHidden) {
+		return 0; // Nothing to create.
+	}
+
+	if (pParent == 0) {
+		// Off the GUI thread: realizeWidget() makes the widget
+		// later.
+		m_pWidgetCell = new MunkHtmlWidgetCell(0, 0);
+		return m_pWidgetCell;
+	}
+
+	wxWindow *pWidget = createWidget(pParent);
+	if (pWidget == 0) {
+		return 0;
+	}
+	m_pWidgetCell = new MunkHtmlWidgetCell(pWidget, 0);
+	return m_pWidgetCell;
+}
+
+
+void MunkHtmlFormElement::realizeWidget(MunkHtmlWindow *pParent)
+{
+	if (m_pWidgetCell != 0 && m_pWidgetCell->GetWindow() == 0) {
+		m_pWidgetCell->SetWindow(createWidget(pParent));
+	}
+}
+
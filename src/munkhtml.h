@@ -17,6 +17,7 @@
 #include <istream>
 #include <string>
 #include <map>
+#include <vector>
 #include <list>
 #include <stack>
 #include <sstream>
@@ -34,6 +35,9 @@
 #include "wx/combobox.h"
 #include "wx/panel.h"
 #include "wx/regex.h"
+#include "wx/hashmap.h"
+#include "wx/thread.h"
+#include "wx/image.h"
 
 
 
@@ -52,6 +56,7 @@ class MunkFontStringMetrics {
 	int m_StringHeight;
 	int m_StringDescent;
 	MunkFontStringMetrics(int StringWidth, int StringHeight, int StringDescent);
+	MunkFontStringMetrics(); // For the hash maps; all 0
 	~MunkFontStringMetrics();
 	MunkFontStringMetrics(const MunkFontStringMetrics& other);
 	MunkFontStringMetrics& operator=(const MunkFontStringMetrics& other);
@@ -60,7 +65,31 @@ class MunkFontStringMetrics {
 };
 
 
-typedef std::map<std::string, MunkFontStringMetrics> String2MunkFontStringMetrics;
+// A MunkHTMLFontAttributes packed into 64 bits by its toKey().  The
+// font and metrics caches are keyed on these rather than on the
+// characteristic strings of toString(), so looking up a font is a
+// hash of an integer rather than the building and comparing of a
+// string.
+typedef wxUint64 MunkFontKey;
+
+// No font.  toKey() never returns this, as it leaves the top bits 0.
+#define MunkFONT_KEY_NONE ((MunkFontKey) -1)
+
+class MunkFontKeyHash {
+public:
+	MunkFontKeyHash() {}
+	unsigned long operator()(MunkFontKey key) const { return (unsigned long) (key ^ (key >> 32)); }
+	MunkFontKeyHash& operator=(const MunkFontKeyHash&) { return *this; }
+};
+
+class MunkFontKeyEqual {
+public:
+	MunkFontKeyEqual() {}
+	bool operator()(MunkFontKey a, MunkFontKey b) const { return a == b; }
+	MunkFontKeyEqual& operator=(const MunkFontKeyEqual&) { return *this; }
+};
+
+WX_DECLARE_HASH_MAP(MunkFontKey, MunkFontStringMetrics, MunkFontKeyHash, MunkFontKeyEqual, FontKey2MunkFontStringMetrics);
 
 
 
@@ -69,18 +98,92 @@ typedef std::map<std::string, MunkFontStringMetrics> String2MunkFontStringMetric
 // MunkStringMetricsCache
 //
 ///////////////////////////////////////////////////////////////
+// A view of the characters of a wxString, in its own encoding,
+// and their hash, for looking strings up in a MunkStringMetricsTable
+// without copying them.
+class MunkStringView {
+public:
+	explicit MunkStringView(const wxString& str);
+
+	const wxStringCharType *m_pChars;
+	size_t m_nLength;
+	wxUint64 m_Hash;
+};
+
+// The measurements of strings, in an open addressing hash table.  The
+// characters of the strings are kept in one buffer, rather than in a
+// wxString each.
+class MunkStringMetricsTable {
+public:
+	MunkStringMetricsTable();
+	~MunkStringMetricsTable();
+
+	// NULL if view has not been measured.
+	const MunkFontStringMetrics *Find(const MunkStringView& view) const;
+
+	// Returns false if view was already there.
+	bool Insert(const MunkStringView& view, const MunkFontStringMetrics& metrics);
+
+	size_t GetCount() const { return m_nCount; }
+
+	// For going through the table: returns false if slot nSlot,
+	// from 0 up to GetSlotCount(), is empty.
+	size_t GetSlotCount() const { return m_Slots.size(); }
+	bool GetSlot(size_t nSlot, const wxStringCharType **ppChars, size_t *pnLength, const MunkFontStringMetrics **ppMetrics) const;
+
+private:
+	class Slot {
+	public:
+		Slot() : m_nOffset(0), m_nLength(0), m_bUsed(false) {};
+		wxUint64 m_Hash;
+		size_t m_nOffset; // In m_Chars
+		size_t m_nLength;
+		MunkFontStringMetrics m_Metrics;
+		bool m_bUsed;
+	};
+
+	size_t FindSlot(const MunkStringView& view) const;
+	void Grow();
+
+	std::vector<Slot> m_Slots; // Size is a power of 2
+	std::vector<wxStringCharType> m_Chars;
+	size_t m_nCount;
+};
+
+class MunkFontRegistryKey; // Forward declaration
+
+// The measurements of the strings of one font at one magnification.
+// They are kept in the MunkFontRegistry, so that other documents
+// and windows can use them as well.
 class MunkStringMetricsCache {
 protected:
-	std::map<wxString, MunkFontStringMetrics> m_String2FontStringMetricsMap;
+	MunkFontKey m_FontKey;
+	int m_nMagnification;
+	// The DC of the last call, and what the registry needs to know
+	// about it.  Forgotten by ForgetDC(), since another DC may later
+	// be created at the same address.
+	wxDC *m_pLastDC;
+	int m_nLastPPI;
+	const wxClassInfo *m_pLastDCClass;
+
+	MunkFontRegistryKey GetRegistryKey(wxDC *pDC);
 public:
-	MunkStringMetricsCache();
+	MunkStringMetricsCache(MunkFontKey font_key, int nMagnification);
 	~MunkStringMetricsCache();
 
+	// pDC must have the font of font_key.
 	void GetTextExtent(const wxString& strInput, wxDC *pDC, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent);
+
+	// Only looks in the cache, so pDC may have any font.  Returns
+	// false if strInput has not been measured.
+	bool FindTextExtent(const wxString& strInput, wxDC *pDC, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent);
+
+	// Must be called when the DC of the previous calls goes away.
+	void ForgetDC() { m_pLastDC = NULL; };
 };
 
-typedef std::map<std::string, MunkStringMetricsCache*> CharacteristicString2MunkStringMetricsCacheMap;
-typedef std::map<std::string, wxFont*> String2PFontMap;
+WX_DECLARE_HASH_MAP(MunkFontKey, MunkStringMetricsCache*, MunkFontKeyHash, MunkFontKeyEqual, FontKey2MunkStringMetricsCacheMap);
+WX_DECLARE_HASH_MAP(MunkFontKey, wxFont*, MunkFontKeyHash, MunkFontKeyEqual, FontKey2PFontMap);
 
 
 
@@ -135,7 +238,51 @@ public:
 };
 
 
-typedef std::map<std::string, std::string> MunkAttributeMap;
+/*
+ * MunkAttributeMap
+ *
+ * The attributes of a single tag, kept as a flat array of name/value
+ * slots in document order.  Tags rarely carry more than a handful of
+ * attributes, so a linear scan beats a tree, and clear() only resets
+ * the count: the slots (and the capacity of their strings) are reused
+ * by the next tag, so the parser stops allocating once it has seen the
+ * widest tag in the document.
+ *
+ * The interface is the subset of std::map that the rest of the code
+ * uses; find() is case-sensitive like the map it replaces, findNoCase()
+ * does an ASCII case-insensitive lookup without copying.
+ */
+class MunkAttributeMap {
+ public:
+	typedef std::pair<std::string, std::string> value_type;
+	typedef const value_type *const_iterator;
+	typedef value_type *iterator;
+
+	MunkAttributeMap() : m_nCount(0) {};
+	MunkAttributeMap(const MunkAttributeMap& other);
+	MunkAttributeMap& operator=(const MunkAttributeMap& other);
+	~MunkAttributeMap() {};
+
+	const_iterator begin() const { return m_nCount ? &m_slots[0] : 0; };
+	const_iterator end() const { return m_nCount ? &m_slots[0] + m_nCount : 0; };
+	size_t size() const { return m_nCount; };
+	bool empty() const { return m_nCount == 0; };
+	void clear() { m_nCount = 0; };
+
+	const_iterator find(const std::string& key) const;
+	const_iterator findNoCase(const char *key) const;
+
+	// Like std::map::insert(), an existing value is not overwritten.
+	void insert(const std::string& key, const std::string& value);
+	void insert(const value_type& v) { insert(v.first, v.second); };
+
+	std::string& operator[](const std::string& key);
+ protected:
+	value_type& newSlot(const std::string& key);
+
+	std::vector<value_type> m_slots;
+	size_t m_nCount;
+};
 
 
 extern std::string getMunkAttribute(const MunkAttributeMap& attrs, const std::string& key);
@@ -190,6 +337,7 @@ class MunkQDParser {
 	std::string m_lvalue;
 	std::string m_rvalue;
 	bool m_end_of_line;
+	bool m_bEndOfInput;
 	char m_quote_char;
 	std::string m_entity;
 	std::string m_text;
@@ -219,18 +367,51 @@ class MunkQDParser {
 
 	typedef std::stack<eMunkQDStates> StateStack;
 	StateStack m_stack;
+	eMunkQDStates m_state;
+	bool m_bDone;
+	std::string m_push_buffer;
  public:
 	MunkQDParser();
 	~MunkQDParser();
 	void parse(MunkQDDocHandler *pDH, std::istream *pStream);
 
+	// Parses a read-only span of bytes in place.  The span is not
+	// copied, and it must stay alive until parse() returns.
+	void parse(MunkQDDocHandler *pDH, const char *pBuffer, size_t nLength);
+
+	// Push parsing: Call beginPush(), then push() with consecutive
+	// chunks of the document as they arrive, then endPush().  Each
+	// chunk is tokenized as far as possible before push() returns;
+	// only an unfinished token is kept until the next chunk.
+	void beginPush(MunkQDDocHandler *pDH);
+	void push(const char *pData, size_t nLength);
+	void endPush(void);
+
+	// Parses one of several consecutive segments of a document,
+	// so that the segments can be tokenized independently (e.g.,
+	// on different threads), each with its own parser and handler.
+	// Every segment except the last must end between two elements
+	// at nTagDepth, and every segment except the first starts
+	// there, in the given encoding, on line nLine.  Only the first
+	// segment calls startDocument(), and only the last calls
+	// endDocument().
+	void parseSegment(MunkQDDocHandler *pDH, const char *pBuffer, size_t nLength, bool bFirst, bool bLast, int nTagDepth, eMunkCharsets encoding, int nLine);
+
+	eMunkCharsets getEncoding(void) const { return m_encoding; };
+
  protected:
+	void doParse(void);
+	void beginParse(void);
+	void tokenize(void);
+	void endParse(void);
+
 	void cleanUp() 
 	{
 		if (bot) {
 			delete[] bot;
 			bot = 0;
 		}
+		m_pInStream = 0;
 	}
 	void eraseAttributes()
 	{
@@ -272,16 +453,170 @@ class MunkQDParser {
 
 	char getNextChar(void);
 
+	void appendSpan(std::string& dest, char c1, char c2, char c3, bool bStopAtControl);
+
 	void fillBuffer(void);
  protected:
-	bool hasMoreInput() { return eof == 0 || cur != eof; };
+	bool hasMoreInput() { return !m_bEndOfInput; };
 
  private:
+	// bot is only non-0 when we own the buffer (i.e., when
+	// reading from an istream).  When parsing a span, cur and
+	// lim point into the caller's bytes, which are never written.
 	char *bot, *tok, *ptr, *cur, *pos, *lim, *top, *eof;
 };
 
 
 
+//--------------------------------------------------------------------------------
+// MunkQDEventRecorder, MunkQDEventReplayer
+//                  A compiled page is the MunkQDDocHandler event stream
+//                  of a parsed document, stored in a compact binary
+//                  form.  Replaying it drives a handler exactly as
+//                  MunkQDParser would, without tokenizing, decoding
+//                  entities or checking encodings again.
+//
+//                  Layout (all integers little-endian):
+//                    "MUNKQDEV", u32 version, u32 reserved,
+//                    u64 hash of the source, u64 hash of the payload,
+//                  followed by the payload: a sequence of one-byte
+//                  opcodes with varint operands.  Tag and attribute
+//                  names are interned into a string table as they
+//                  are first seen, and referred to by index.
+//--------------------------------------------------------------------------------
+
+#define MUNK_COMPILED_PAGE_VERSION 1
+#define MUNK_COMPILED_PAGE_HEADER_SIZE 32
+
+// 64-bit FNV-1a; used for the hashes in the header.
+extern wxUint64 munk_hash_bytes(const char *pData, size_t nLength);
+
+class MunkQDEventRecorder : public MunkQDDocHandler {
+ public:
+	// Events are passed on to pForward (if not 0) as they are
+	// recorded, so a page can be displayed and compiled in one go.
+	MunkQDEventRecorder(MunkQDDocHandler *pForward = 0);
+	virtual ~MunkQDEventRecorder();
+
+	virtual void startElement(const std::string& tag, const MunkAttributeMap& attrs);
+	virtual void endElement(const std::string& tag);
+	virtual void startDocument(void);
+	virtual void endDocument(void);
+	virtual void text(const std::string& str);
+	virtual void comment(const std::string& str);
+
+	// Header plus payload.  Only complete once endDocument() has
+	// been seen.  The source hash ties the result to the bytes it
+	// was compiled from.
+	std::string getCompiledPage(wxUint64 source_hash) const;
+
+	// Just the events, without a header.
+	const std::string& getPayload() const { return m_payload; };
+
+	// Parses the UTF-8 bytes and returns the compiled page in
+	// result.  Throws MunkQDException on malformed input.
+	static void compile(const char *pUTF8, size_t nLength, std::string& result);
+ protected:
+	void putOpcode(char opcode) { m_payload += opcode; };
+	void putVarint(unsigned long value);
+	void putBytes(const std::string& str);
+	void internString(const std::string& str);
+	void putStringRef(const std::string& str);
+
+	typedef std::map<std::string, unsigned long> String2IndexMap;
+	String2IndexMap m_string_indexes;
+	std::string m_payload;
+	MunkQDDocHandler *m_pForward;
+	bool m_bComplete;
+};
+
+class MunkQDEventReplayer {
+ public:
+	MunkQDEventReplayer() {};
+	~MunkQDEventReplayer() {};
+
+	// Feeds the events in the compiled page to pDH, bracketed by
+	// startDocument() and endDocument().  Throws MunkQDException if
+	// the data is not a compiled page of this version, or has been
+	// damaged.
+	void replay(MunkQDDocHandler *pDH, const char *pData, size_t nLength);
+
+	// Feeds the events in a bare payload (see
+	// MunkQDEventRecorder::getPayload()) to pDH, without
+	// startDocument().  Returns true if the payload ended the
+	// document.
+	bool replayEvents(MunkQDDocHandler *pDH, const char *pData, size_t nLength);
+
+	// Returns false if the data does not start with a valid header.
+	static bool getSourceHash(const char *pData, size_t nLength, wxUint64& source_hash);
+ protected:
+	unsigned long getVarint();
+	void getBytes(std::string& dest);
+	const std::string& getStringRef();
+
+	std::vector<std::string> m_strings;
+	MunkAttributeMap m_attributes;
+	std::string m_text;
+	const char *m_pCur;
+	const char *m_pEnd;
+};
+
+
+
+//--------------------------------------------------------------------------------
+// MunkHtmlPageBuffer
+//                  Holds the source of a page as one read-only span of
+//                  UTF-8 bytes, which is handed to MunkQDParser as-is.
+//                  The bytes are either owned (copied from a wxString
+//                  or read from a stream), or mapped directly from a
+//                  local file where the platform allows it.
+//--------------------------------------------------------------------------------
+
+class wxInputStream;
+
+class MunkHtmlPageBuffer {
+ public:
+	MunkHtmlPageBuffer();
+	~MunkHtmlPageBuffer();
+
+	void Clear();
+
+	void Assign(const char *pData, size_t nLength);
+	void Assign(const wxString& source);
+	void Append(const char *pData, size_t nLength);
+	bool ReadFromStream(wxInputStream *s);
+
+	// Maps the file read-only if it is a regular file and the
+	// platform allows it; otherwise reads it into an owned buffer.
+	// Returns false if the file could not be read.
+	bool LoadFile(const wxString& filename);
+
+	// If another process truncates a mapped file, touching the
+	// lost pages raises SIGBUS.  This checks the size of the file,
+	// and if it has shrunk, reads it again into an owned buffer.
+	// Call it before each parse of the data.  Returns false if the
+	// file could not be read again, leaving the buffer empty.
+	bool CheckMapping();
+
+	// Exchanges the contents, mapped or not.
+	void Swap(MunkHtmlPageBuffer& other);
+
+	const char *GetData() const;
+	size_t GetLength() const;
+	bool IsMapped() const { return m_pMapped != 0; };
+
+	wxString ToString() const;
+ private:
+	std::string m_strOwned;
+	const char *m_pMapped;
+	size_t m_nMappedLength;
+	int m_nMappedFD; // Kept open while mapped, for CheckMapping()
+
+	DECLARE_NO_COPY_CLASS(MunkHtmlPageBuffer)
+};
+
+
+
 
 
 
@@ -365,6 +700,14 @@ class MunkQDParser {
     /* size of one scroll step of MunkHtmlWindow in pixels */
 #define MunkHTML_SCROLL_STEP               16
 
+    /* how often (in ms) MunkHtmlWindow repaints a page which is being fed
+       to it with FeedChunk() */
+#define MunkHTML_PUSH_REPAINT_INTERVAL     100
+
+    /* documents smaller than this (in bytes) are never parsed in
+       parallel; see MunkHtmlWindow::SetParallelParsing() */
+#define MunkHTML_PARALLEL_PARSE_MIN_SIZE   (256*1024)
+
     /* size of temporary buffer used during parsing */
 #define MunkHTML_BUFLEN                  1024
 
@@ -404,6 +747,10 @@ protected:
     // end_pos is position where parsing ends (usually end of document)
 	MunkHtmlTag(const wxString& tagname, const MunkAttributeMap& attrs);
 	friend class MunkQDHTMLHandler;
+
+	// Returns the raw (UTF-8, original case) value of the param,
+	// or NULL if the tag doesn't have it.
+	const std::string *FindParam(const wxString& par) const;
 public:
     virtual ~MunkHtmlTag();
 
@@ -434,7 +781,11 @@ public:
     wxString GetAllParams() const;
 private:
     wxString m_Name;
-    wxArrayString m_ParamNames, m_ParamValues;
+
+    // The tag only lives for the duration of the startElement() call
+    // that created it, so it can refer to the parser's attributes
+    // instead of converting them up front.
+    const MunkAttributeMap& m_Attrs;
 
     DECLARE_NO_COPY_CLASS(MunkHtmlTag)
 };
@@ -460,6 +811,8 @@ private:
 class MunkHtmlWindowInterface;
 class MunkHtmlWindow;
 class MunkHtmlLinkInfo;
+class MunkHtmlLinkTable;
+class MunkHtmlTextStyleTable;
 class MunkHtmlCell;
 class MunkHtmlContainerCell;
 
@@ -552,13 +905,29 @@ public:
 };
 
 
+// The font and colours of a run of text.  Each text cell points at
+// one of these, interned in the MunkHtmlTextStyleTable of its
+// document, so the renderer need only change the DC when the style
+// of the next cell differs from that of the previous one.
+struct MunkHtmlTextStyle
+{
+    wxFont m_Font;
+    MunkFontKey m_FontKey;
+    int m_nMagnification; // Of m_Font, for the MunkFontRegistry
+    bool m_bUnderline;
+    wxColour m_FgColour;
+    wxColour m_BgColour; // wxNullColour leaves the background alone
+    wxBrush m_BgBrush;
+};
+
+
 // Information given to cells when drawing them. Contains rendering state,
 // selection information and rendering style object that can be used to
 // customize the output.
 class MunkHtmlRenderingInfo
 {
 public:
- MunkHtmlRenderingInfo(const wxColour& WindowBackgroundColour) : m_selection(NULL), m_style(NULL), m_bUnderline(false), m_WindowBackgroundColour(WindowBackgroundColour) {}
+ MunkHtmlRenderingInfo(const wxColour& WindowBackgroundColour) : m_selection(NULL), m_style(NULL), m_bUnderline(false), m_WindowBackgroundColour(WindowBackgroundColour), m_pTextStyle(NULL) {}
 
     void SetSelection(MunkHtmlSelection *s) { m_selection = s; }
     MunkHtmlSelection *GetSelection() const { return m_selection; }
@@ -574,12 +943,20 @@ public:
     void SetUnderline(bool bUnderline) { m_bUnderline = bUnderline; };
     bool GetUnderline(void) const { return m_bUnderline; };
 
+    // Sets up dc for drawing text in pStyle, unless it already is.
+    void ApplyTextStyle(wxDC& dc, const MunkHtmlTextStyle *pStyle);
+
+    // Must be called when the font or colours of the DC have been
+    // changed behind ApplyTextStyle()'s back, as formatting cells do.
+    void ForgetTextStyle() { m_pTextStyle = NULL; }
+
 protected:
     MunkHtmlSelection      *m_selection;
     MunkHtmlRenderingStyle *m_style;
     MunkHtmlRenderingState m_state;
     bool m_bUnderline;
     wxColour m_WindowBackgroundColour;
+    const MunkHtmlTextStyle *m_pTextStyle; // last applied; NULL if none
 };
 
 
@@ -619,6 +996,7 @@ public:
 	wxColour m_color;
 	wxString m_face;
 	std::string m_stdstring_face;
+	unsigned int m_nFaceId; // See internFace()
 	MunkHTMLFontAttributes(bool bBold, bool bItalic, bool bUnderline, long scriptBaseline, MunkHtmlScriptMode scriptMode, unsigned int sizeFactor = 100, const wxColour& color = *wxBLACK, const wxString& face = wxT("Arial"));
 	MunkHTMLFontAttributes();
 	MunkHTMLFontAttributes(const MunkHTMLFontAttributes& other);
@@ -629,6 +1007,16 @@ public:
 	wxString getFace(void) const;
 	long toLong() const;
 	static MunkHTMLFontAttributes fromString(const std::string& s);
+
+	// Like toString() and fromString(), but packed into an
+	// integer.  m_color and m_bSmallCaps are left out, as they are
+	// of toString().
+	MunkFontKey toKey() const;
+	static MunkHTMLFontAttributes fromKey(MunkFontKey key);
+
+	// Faces are numbered in the order they are first seen, for all
+	// documents alike, so that the number can go in a MunkFontKey.
+	static unsigned int internFace(const std::string& face);
 	MunkHTMLFontAttributes& operator=(const MunkHTMLFontAttributes& other);
 protected:
 	void copy_to_self(const MunkHTMLFontAttributes& other);
@@ -638,6 +1026,194 @@ typedef std::stack<MunkHTMLFontAttributes>  MunkFontAttributeStack;
 
 
 
+///////////////////////////////////////////////////////////////
+//
+// MunkFontRegistry
+//
+///////////////////////////////////////////////////////////////
+
+// A font at a magnification and, for measurements, the kind and
+// resolution of the DC they were taken on.
+class MunkFontRegistryKey {
+public:
+	MunkFontRegistryKey(MunkFontKey font_key, int nMagnification, int nPPI = 0, const wxClassInfo *pDCClass = NULL)
+		: m_FontKey(font_key), m_nMagnification(nMagnification), m_nPPI(nPPI), m_pDCClass(pDCClass) {};
+	bool operator<(const MunkFontRegistryKey& other) const;
+
+	MunkFontKey m_FontKey;
+	int m_nMagnification;
+	int m_nPPI; // 0 for fonts, which do not depend on the DC
+	const wxClassInfo *m_pDCClass; // NULL for fonts
+};
+
+// How MunkFontRegistry measures the strings it has not seen before.
+enum eMunkMeasureMode {
+	kMunkMeasureExact,   // wxDC::GetTextExtent() on every string
+	kMunkMeasureGlyphs,  // The sum of the advances of the characters,
+	                     // where the font and script allow it
+	kMunkMeasureValidate // Both, keeping the exact width, and counting
+	                     // how far off the sum was
+};
+
+class MunkFontRegistryStats {
+public:
+	MunkFontRegistryStats()
+		: m_nFontHits(0), m_nFontMisses(0), m_nFontEvictions(0),
+		  m_nMetricsHits(0), m_nMetricsMisses(0), m_nMetricsEvictions(0),
+		  m_nMeasureMicroseconds(0),
+		  m_nGlyphStrings(0), m_nGlyphFallbacks(0),
+		  m_nValidationMismatches(0), m_nValidationErrorPixels(0),
+		  m_nValidationMaxError(0),
+		  m_nFonts(0), m_nMetrics(0) {};
+
+	unsigned long m_nFontHits;
+	unsigned long m_nFontMisses;
+	unsigned long m_nFontEvictions;
+	unsigned long m_nMetricsHits;
+	unsigned long m_nMetricsMisses;
+	unsigned long m_nMetricsEvictions; // Strings, not fonts
+	wxUint64 m_nMeasureMicroseconds; // Spent in wxDC::GetTextExtent() on misses
+
+	// Unless the mode is kMunkMeasureExact
+	unsigned long m_nGlyphStrings; // Misses summed from advances
+	unsigned long m_nGlyphFallbacks; // Misses measured exactly instead
+	// For kMunkMeasureValidate: The strings whose sum was off, by
+	// how many pixels of width in all, and at most.
+	unsigned long m_nValidationMismatches;
+	wxUint64 m_nValidationErrorPixels;
+	wxCoord m_nValidationMaxError;
+
+	// Currently held
+	size_t m_nFonts;
+	size_t m_nMetrics; // Strings
+};
+
+// The fonts and string measurements of all the documents of the
+// application, so that windows, printouts and new pages need not
+// create the same fonts and measure the same words over again.
+//
+// The methods may be called from any thread.  The fonts handed out
+// are, like all wx GDI objects, still only to be used on the GUI
+// thread.
+class MunkFontRegistry {
+public:
+	static MunkFontRegistry& Get();
+	// Called when wx shuts down
+	static void CleanUp();
+
+	// Bounds on the number of fonts and of measured strings held;
+	// 0 means no bound.  Beyond them, the least recently used fonts,
+	// or all the strings of the least recently used font, are
+	// dropped.
+	void SetLimits(size_t nMaxFonts, size_t nMaxMetrics);
+
+	wxFont GetFont(const MunkHTMLFontAttributes& font_attributes, MunkFontKey font_key, int nMagnification);
+
+	// pDC must have the font of key.
+	void GetTextExtent(const MunkFontRegistryKey& key, const wxString& strInput, wxDC *pDC, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent);
+
+	// Returns false, without measuring, if strInput has not been
+	// measured.
+	bool FindTextExtent(const MunkFontRegistryKey& key, const wxString& strInput, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent);
+
+	// kMunkMeasureExact by default.  In the other modes, the
+	// advance of each character is measured once per font, and a
+	// new string is given the sum, unless the font kerns or forms
+	// ligatures (which is checked the first time it is used), or
+	// the string has characters of scripts which are shaped, such
+	// as combining marks, Hebrew points, Arabic and Indic scripts.
+	// The sums are kept apart from the exact widths: they are only
+	// found in kMunkMeasureGlyphs, and SaveMetrics() leaves them
+	// out.  Exact widths are used in every mode.
+	void SetMeasureMode(eMunkMeasureMode mode);
+	eMunkMeasureMode GetMeasureMode() const;
+
+	// The advance of ch, from the glyph cache unless the mode is
+	// kMunkMeasureExact.  pDC must have the font of key.
+	wxCoord GetCharWidth(const MunkFontRegistryKey& key, wxUniChar ch, const wxDC *pDC);
+
+	// The measurements can be kept in a file from one run of the
+	// application to the next.  fingerprint must change whenever
+	// the fonts might have; GetFontConfigFingerprint() is meant for
+	// it.  LoadMetrics() returns false if the file is missing,
+	// damaged, or saved with another fingerprint.  Both are to be
+	// called from the thread that builds the cells, as they look up
+	// font faces.
+	bool LoadMetrics(const wxString& filename, wxUint64 fingerprint);
+	bool SaveMetrics(const wxString& filename, wxUint64 fingerprint);
+
+	// A hash of the wx version and of the font faces installed.
+	static wxUint64 GetFontConfigFingerprint();
+
+	MunkFontRegistryStats GetStats() const;
+	void ResetStats();
+	void Clear();
+
+private:
+	MunkFontRegistry();
+	~MunkFontRegistry();
+
+	typedef std::list<MunkFontRegistryKey> KeyList;
+
+	class FontEntry {
+	public:
+		wxFont m_Font;
+		KeyList::iterator m_itLRU;
+	};
+	typedef std::map<MunkFontRegistryKey, FontEntry> FontMap;
+
+	class MetricsEntry {
+	public:
+		MunkStringMetricsTable m_Table; // Measured by the DC
+		MunkStringMetricsTable m_SummedTable; // Summed from advances
+		KeyList::iterator m_itLRU;
+	};
+	typedef std::map<MunkFontRegistryKey, MetricsEntry> MetricsMap;
+
+	class GlyphEntry {
+	public:
+		GlyphEntry() : m_bChecked(false), m_bSummable(false), m_Height(0), m_Descent(0) {};
+		// -1 if ch has not been measured, or has no place here.
+		wxCoord GetAdvance(wxUint32 ch) const { return ch < m_Advances.size() ? m_Advances[ch] : -1; }
+		void SetAdvance(wxUint32 ch, wxCoord advance);
+
+		bool m_bChecked; // m_bSummable, m_Height and m_Descent are known
+		bool m_bSummable; // False if the font kerns or forms ligatures
+		wxCoord m_Height;
+		wxCoord m_Descent;
+		std::vector<wxCoord> m_Advances; // By code point
+	};
+	typedef std::map<MunkFontRegistryKey, GlyphEntry> GlyphMap;
+
+	static bool IsSummableChar(wxUint32 ch);
+	bool CheckGlyphs(const MunkFontRegistryKey& key, const wxDC *pDC);
+	bool SynthesizeTextExtent(const MunkFontRegistryKey& key, const wxString& strInput, const wxDC *pDC, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent);
+
+	bool DoFindTextExtent(const MunkFontRegistryKey& key, const MunkStringView& view, wxCoord *pWidth, wxCoord *pHeight, wxCoord *pDescent);
+	MetricsEntry& GetMetricsEntry(const MunkFontRegistryKey& key);
+	void EvictFonts();
+	void EvictMetrics();
+
+	FontMap m_Fonts;
+	KeyList m_FontsLRU; // Most recently used first
+	MetricsMap m_Metrics;
+	KeyList m_MetricsLRU; // Most recently used first
+	GlyphMap m_Glyphs; // Evicted along with m_Metrics
+	eMunkMeasureMode m_MeasureMode;
+	size_t m_nMaxFonts;
+	size_t m_nMaxMetrics;
+	MunkFontRegistryStats m_Stats;
+#if wxUSE_THREADS
+	mutable wxCriticalSection m_CS;
+#endif
+
+	static MunkFontRegistry *m_pInstance;
+
+	DECLARE_NO_COPY_CLASS(MunkFontRegistry)
+};
+
+
+
 enum eWhiteSpaceKind {
 	kWSKNormal,
 	kWSKNowrap,
@@ -647,6 +1223,60 @@ enum eWhiteSpaceKind {
 };
 
 
+// One token of text, as produced by munk_normalize_white_space().
+struct MunkTextToken {
+	size_t m_nStart;   // Offset into the normalized text
+	size_t m_nLength;
+	bool m_bLineBreakAfter;
+};
+
+typedef std::vector<MunkTextToken> MunkTextTokenVector;
+
+// Applies the CSS 'white-space' processing rules for kind to a run
+// of UTF-8 text in one pass, and cuts the result into the tokens
+// which become cells: For normal and nowrap, alternating runs of
+// words and white space (leading white space is dropped if
+// bStripLeading); for the pre kinds, one token per line, each but
+// the last followed by a line break.  The text of the tokens is
+// put into text, which (like tokens) is cleared first.
+extern void munk_normalize_white_space(const char *pUTF8, size_t nLength, eWhiteSpaceKind kind, bool bStripLeading, std::string& text, MunkTextTokenVector& tokens);
+
+
+
+// ---------------------------------------------------------------------------
+// MunkHtmlCellArena
+//                  The memory of the cells of one document.  Cells are
+//                  carved out of large blocks, and the blocks are all
+//                  freed at once when the arena is deleted, so that
+//                  deleting a cell only runs its destructor.  The
+//                  arena belongs to the top container of the document.
+// ---------------------------------------------------------------------------
+
+class MunkHtmlCellArena
+{
+public:
+    MunkHtmlCellArena();
+    ~MunkHtmlCellArena();
+
+    // Returns nSize bytes, aligned for any cell.
+    void *Allocate(size_t nSize);
+
+    size_t GetBytesAllocated() const { return m_nBytesAllocated; }
+
+    // The ids of the cells in the arena (see MunkHtmlCell::GetId()).
+    typedef std::map<const MunkHtmlCell*, wxString> CellIdMap;
+    CellIdMap& GetCellIds() { return m_CellIds; }
+
+private:
+    CellIdMap m_CellIds;
+    std::vector<char*> m_Blocks;
+    char *m_pFree;
+    size_t m_nFree;
+    size_t m_nBytesAllocated;
+
+    DECLARE_NO_COPY_CLASS(MunkHtmlCellArena)
+};
+
 
 // ---------------------------------------------------------------------------
 // MunkHtmlCell
@@ -663,6 +1293,14 @@ public:
     MunkHtmlCell();
     virtual ~MunkHtmlCell();
 
+    // A cell is allocated in pArena if it is not NULL, and on the
+    // heap otherwise.  Either way it is deleted with delete, which
+    // leaves the memory of a cell in an arena to the arena.
+    static void *operator new(size_t nSize) { return operator new(nSize, (MunkHtmlCellArena*) NULL); }
+    static void *operator new(size_t nSize, MunkHtmlCellArena *pArena);
+    static void operator delete(void *p);
+    static void operator delete(void *p, MunkHtmlCellArena *pArena);
+
     void SetParent(MunkHtmlContainerCell *p) {m_Parent = p;}
     MunkHtmlContainerCell *GetParent() const {return m_Parent;}
 
@@ -688,8 +1326,10 @@ public:
     virtual bool ForceLineBreak(void) { return false; };
     virtual bool IsInlineBlock(void) { return false; };
 
-    const wxString& GetId() const { return m_id; }
-    void SetId(const wxString& id) { m_id = id; }
+    // Few cells have an id, so ids are kept in a side table (see
+    // MunkHtmlCellArena::GetCellIds()) rather than in the cells.
+    const wxString& GetId() const;
+    void SetId(const wxString& id);
 
     virtual bool IsInlineBlock(void) const { return false; };
 
@@ -714,7 +1354,10 @@ public:
 
     // members writing methods
     virtual void SetPos(int x, int y) {m_PosX = x, m_PosY = y;}
-    void SetLink(const MunkHtmlLinkInfo& link);
+    // The link is not copied, so it must live as long as the cell
+    // does, as the links of a MunkHtmlLinkTable do.  Cells of the
+    // same anchor share one link.
+    void SetLink(MunkHtmlLinkInfo *pLink) { m_Link = pLink; }
     void SetNext(MunkHtmlCell *cell) {m_Next = cell;}
 
 
@@ -737,6 +1380,14 @@ public:
                                int WXUNUSED(x), int WXUNUSED(y),
                                MunkHtmlRenderingInfo& WXUNUSED(info)) {}
 
+    // true if DrawInvisible() does anything, so that containers can
+    // pass over the cells which are out of sight without calling it.
+    virtual bool NeedsDrawInvisible() const { return false; }
+
+    // true if AdjustPagebreak() of this cell, or of the cells below
+    // it, may move the pagebreak wherever the cell is.
+    virtual bool HasPagebreakCell() const { return false; }
+
     // This method returns pointer to the FIRST cell for that
     // the condition
     // is true. It first checks if the condition is true for this
@@ -844,39 +1495,73 @@ public:
     // Think of it as the difference between CSS "display : none;" and
     // "display : <somethingelse>;".
     virtual void SetVisible(bool bIsVisible) { m_bIsVisible = bIsVisible; };
+    bool IsVisible() const { return m_bIsVisible; }
+
+    // Marks the cell, and the containers above it, as needing to be
+    // laid out again after it has been changed.  The next Layout()
+    // at the same width then lays out only the marked containers,
+    // and moves the lines below them without laying them out (see
+    // MunkHtmlWindow::InvalidateCellLayout()).
+    void MarkLayoutDirty();
+    bool IsLayoutDirty() const { return m_bLayoutDirty; }
+    // Called by the container which has laid the cell out.
+    void ClearLayoutDirty() { m_bLayoutDirty = false; }
 
     virtual bool IsWordSpace() const { return false; };
 
+    // True of the cells which only record a tag for
+    // MunkHtmlWindow::SelectionToHtml() (see MunkHtmlTagCell).
+    virtual bool IsMiniDOMCell() const { return false; };
+
+    // Only text cells have a style; others ignore it.
+    virtual void SetTextStyle(const MunkHtmlTextStyle *WXUNUSED(pStyle)) {};
+
+    // For the cells whose size is that of some text, once the text
+    // has been measured (see MunkHtmlPendingMetrics).
+    virtual void SetTextExtent(wxCoord WXUNUSED(Width), wxCoord WXUNUSED(Height), wxCoord WXUNUSED(Descent)) {};
+
+    // Width of the space which follows the cell without having a
+    // cell of its own (see MunkHtmlWordCell::AddTrailingSpace).
+    // Layout moves the next cell along by this much, unless the line
+    // is broken at the space, in which case the space is not shown.
+    virtual wxCoord GetTrailingSpace() const { return 0; };
+    virtual void SetTrailingSpaceVisible(bool WXUNUSED(bIsVisible)) {};
+
+    // The range of x, relative to the cell's position, in which
+    // FindCellByPos() finds the cell: its width, plus any trailing
+    // space shown after it.
+    virtual void GetHitExtent(wxCoord *pLeft, wxCoord *pRight) const { *pLeft = 0; *pRight = m_Width; };
+
 protected:
-    bool m_bIsVisible;
+    // The members are ordered by size, so as to waste no space on
+    // padding: there is one of these for every word.
 
     // pointer to the next cell
     MunkHtmlCell *m_Next;
     // pointer to parent cell
     MunkHtmlContainerCell *m_Parent;
 
-    // dimensions of fragment (m_Descent is used to position text & images)
-    wxCoord m_Width, m_Height, m_Descent;
+    // destination address if this fragment is hypertext link, NULL otherwise
+    // (not owned; see SetLink())
+    MunkHtmlLinkInfo *m_Link;
+
     // position where the fragment is drawn:
     long m_PosX, m_PosY;
+    long m_ScriptBaseline;
+
+    // dimensions of fragment (m_Descent is used to position text & images)
+    wxCoord m_Width, m_Height, m_Descent;
 
     // superscript/subscript/normal:
     MunkHtmlScriptMode m_ScriptMode;
-    long m_ScriptBaseline;
 
-    // destination address if this fragment is hypertext link, NULL otherwise
-    MunkHtmlLinkInfo *m_Link;
+    bool m_bIsVisible;
     // true if this cell can be placed on pagebreak, false otherwise
     bool m_CanLiveOnPagebreak;
-    // unique identifier of the cell, generated from "id" property of tags
-    wxString m_id;
-
-    // background image, may be invalid
-    wxBitmap m_bmpBg;
-
-    // background image repeat (see enum with
-    // MunkHTML_BACKGROUND_REPEAT_... enum constants)
-    int m_nBackgroundRepeat;
+    // true if the cell has an entry in the id side table
+    bool m_bHasId;
+    // true if the cell, or a cell below it, must be laid out again
+    bool m_bLayoutDirty;
 
     DECLARE_ABSTRACT_CLASS(MunkHtmlCell)
     DECLARE_NO_COPY_CLASS(MunkHtmlCell)
@@ -890,6 +1575,82 @@ protected:
 // ----------------------------------------------------------------------------
 
 
+// ----------------------------------------------------------------------------
+// MunkHtmlTextPool
+//                  The text of the word cells of one document, as
+//                  UTF-8.  Each distinct word is stored only once,
+//                  in blocks which never move, so that the cells can
+//                  point straight at their text.  The pool belongs
+//                  to the top container of the document.
+// ----------------------------------------------------------------------------
+
+class MunkHtmlTextPool
+{
+public:
+    MunkHtmlTextPool();
+    ~MunkHtmlTextPool();
+
+    // Returns a copy of the nLength bytes at pUTF8 which lives as
+    // long as the pool.  Equal strings give the same pointer.
+    const char *Intern(const char *pUTF8, size_t nLength);
+    const char *Intern(const wxString& str, size_t *pLength);
+
+    // The table used to find repeated words is only needed while
+    // the document is being built.
+    void ReleaseInternTable();
+
+private:
+    char *Allocate(size_t nLength);
+    void GrowInternTable();
+
+    struct InternEntry {
+        const char *m_pText; // NULL if the slot is free
+        size_t m_nLength;
+    };
+    std::vector<InternEntry> m_InternTable;
+    size_t m_nInternEntries;
+
+    std::vector<char*> m_Blocks;
+    char *m_pFree;
+    size_t m_nFree;
+
+    DECLARE_NO_COPY_CLASS(MunkHtmlTextPool)
+};
+
+
+// ----------------------------------------------------------------------------
+// MunkHtmlTextStyleTable
+//                  The text styles of one document, each stored once.
+//                  The table belongs to the top container of the
+//                  document.
+// ----------------------------------------------------------------------------
+
+class MunkHtmlTextStyleTable
+{
+public:
+    MunkHtmlTextStyleTable() {}
+    ~MunkHtmlTextStyleTable();
+
+    // font_key must identify font, as the keys of the font cache
+    // of MunkHtmlParsingStructure do, at nMagnification, which is
+    // the same for all the styles of a document.
+    const MunkHtmlTextStyle *Intern(MunkFontKey font_key, int nMagnification,
+                                    const wxFont& font, bool bUnderline,
+                                    const wxColour& fgColour, const wxColour& bgColour);
+
+    size_t GetCount() const { return m_Styles.size(); }
+
+private:
+    // The font key, then the foreground colour (with the underline
+    // flag) and the background colour, packed by munk_colour_key().
+    typedef std::pair<MunkFontKey, std::pair<wxUint64, wxUint64> > StyleKey;
+    typedef std::map<StyleKey, MunkHtmlTextStyle*> StyleMap;
+    StyleMap m_Styles;
+
+    DECLARE_NO_COPY_CLASS(MunkHtmlTextStyleTable)
+};
+
+
 // ----------------------------------------------------------------------------
 // MunkHtmlWordCell
 //                  Single word in input stream.
@@ -898,8 +1659,14 @@ protected:
 class MunkHtmlWordCell : public MunkHtmlCell
 {
 public:
-    MunkHtmlWordCell(const wxString& word, MunkStringMetricsCache *pStringMetricsCache, wxDC *pDC);
+    // The word is interned in pPool, which may only be NULL if
+    // the word is empty.
+    // The size is 0 until SetTextExtent() is called.
+    MunkHtmlWordCell(MunkHtmlTextPool *pPool, const wxString& word);
     MunkHtmlWordCell(long SpaceWidth, long SpaceHeight, long SpaceDescent);
+
+    // The measurements of the word in its font.
+    virtual void SetTextExtent(wxCoord Width, wxCoord Height, wxCoord Descent);
     virtual void Draw(wxDC& dc, int x, int y, int view_y1, int view_y2,
               MunkHtmlRenderingInfo& info);
     virtual wxCursor GetMouseCursor(MunkHtmlWindowInterface *window) const;
@@ -908,9 +1675,28 @@ public:
 
     void SetPreviousWord(MunkHtmlWordCell *cell);
 
-    virtual wxString toString() const { return m_Word; };
+    virtual wxString toString() const { return m_bHasTrailingSpace ? GetWord() + wxT(' ') : GetWord(); };
+
+    virtual bool IsWordSpace() const { return m_nWordLength == 1 && m_pWord[0] == ' '; };
 
-    virtual bool IsWordSpace() const { return m_Word == wxT(" "); };
+    // Takes over the single space which follows the word, instead
+    // of giving it a cell of its own.  The space is still a line
+    // break opportunity, a gap for justification, and part of the
+    // text when it is copied.
+    void AddTrailingSpace(wxCoord SpaceWidth);
+    bool HasTrailingSpace() const { return m_bHasTrailingSpace; }
+    void SetTrailingSpaceWidth(wxCoord SpaceWidth) { m_TrailingSpace = SpaceWidth; }
+    virtual wxCoord GetTrailingSpace() const { return m_TrailingSpace; };
+    virtual void SetTrailingSpaceVisible(bool bIsVisible) { m_bTrailingSpaceVisible = bIsVisible; };
+    virtual void GetHitExtent(wxCoord *pLeft, wxCoord *pRight) const;
+
+    virtual void SetTextStyle(const MunkHtmlTextStyle *pStyle) { m_pTextStyle = pStyle; };
+    const MunkHtmlTextStyle *GetTextStyle() const { return m_pTextStyle; }
+
+    // The word is only converted to wxString when it is needed.
+    wxString GetWord() const { return wxString(m_pWord, wxConvUTF8, m_nWordLength); }
+    const char *GetWordUTF8() const { return m_pWord; }
+    unsigned GetWordUTF8Length() const { return m_nWordLength; }
 
     virtual eWhiteSpaceKind GetWhiteSpaceKind() const;
 
@@ -919,9 +1705,17 @@ protected:
     void Split(const wxDC& dc,
                const wxPoint& selFrom, const wxPoint& selTo,
                unsigned& pos1, unsigned& pos2) const;
+    wxCoord GetCharWidth(const wxDC& dc, wxUniChar ch) const;
 
-    wxString m_Word;
+    // The flags come first, so that they can share the padding at
+    // the end of MunkHtmlCell.
     bool     m_allowLinebreak;
+    bool     m_bHasTrailingSpace;
+    bool     m_bTrailingSpaceVisible; // false if the line breaks at it
+    unsigned m_nWordLength;
+    wxCoord  m_TrailingSpace;
+    const char *m_pWord; // UTF-8; in a MunkHtmlTextPool, or static
+    const MunkHtmlTextStyle *m_pTextStyle; // in a MunkHtmlTextStyleTable
 
     DECLARE_ABSTRACT_CLASS(MunkHtmlWordCell)
     DECLARE_NO_COPY_CLASS(MunkHtmlWordCell)
@@ -957,6 +1751,7 @@ public:
 	MunkHtmlTagCell(MunkMiniDOMTag *pTag);
 	virtual ~MunkHtmlTagCell();
 	virtual wxString toString() const;
+	virtual bool IsMiniDOMCell() const { return true; };
  protected:
 	MunkMiniDOMTag *m_pTag;
 	DECLARE_NO_COPY_CLASS(MunkHtmlTagCell)
@@ -975,7 +1770,9 @@ class MunkHtmlNegativeSpaceCell : public MunkHtmlWordCell
  protected:
 	int m_pixels;
  public:
-	MunkHtmlNegativeSpaceCell(int pixels, MunkStringMetricsCache *pStringMetricsCache, wxDC *pDC);
+	MunkHtmlNegativeSpaceCell(int pixels);
+	// Only takes the height and descent; the width stays -pixels.
+	virtual void SetTextExtent(wxCoord Width, wxCoord Height, wxCoord Descent);
 	virtual void Draw(wxDC& dc, int x, int y, int view_y1, int view_y2,
 			  MunkHtmlRenderingInfo& info);
 
@@ -999,6 +1796,7 @@ public:
 		  MunkHtmlRenderingInfo& info);
 	virtual bool AdjustPagebreak(int *pagebreak, int render_height,
 				     wxArrayInt& WXUNUSED(known_pagebreaks));
+	virtual bool HasPagebreakCell() const { return true; }
 	// 1. adjust cell's width according to the fact that maximal possible width
 	//    is w.  (this has sense when working with horizontal lines, tables
 	//    etc.)
@@ -1030,6 +1828,22 @@ enum MunkHtmlBorderStyle {
 };
 
 
+// One line of a laid out MunkHtmlContainerCell.  The cells of a
+// line lie between m_PosY and m_PosY + m_Height, and the lines come
+// one below the other, so they can be searched by y.
+class MunkHtmlLineBox
+{
+public:
+    MunkHtmlCell *m_pFirst;
+    MunkHtmlCell *m_pLast;
+    int m_PosY;
+    int m_Height;
+    int m_Baseline;
+    bool m_bNeedsDrawInvisible; // Of any cell on the line
+};
+
+typedef std::vector<MunkHtmlLineBox> MunkHtmlLineBoxArray;
+
 // Container contains other cells, thus forming tree structure of rendering
 // elements. Basic code of layout algorithm is contained in this class.
 class MunkHtmlContainerCell : public MunkHtmlCell
@@ -1043,8 +1857,18 @@ public:
                       MunkHtmlRenderingInfo& info);
     virtual void DrawInvisible(wxDC& dc, int x, int y,
                                MunkHtmlRenderingInfo& info);
+    virtual bool NeedsDrawInvisible() const { return m_Cells != NULL; }
 /*    virtual bool AdjustPagebreak(int *pagebreak, int *known_pagebreaks = NULL, int number_of_pages = 0);*/
     virtual bool AdjustPagebreak(int *pagebreak, int render_height, wxArrayInt& known_pagebreaks);
+    virtual bool HasPagebreakCell() const { return m_bHasPagebreakCell; }
+
+    // The lines of the last Layout(), top to bottom.  Empty if the
+    // cells have not been laid out in lines since they changed, as
+    // in tables and lists, which lay out their cells themselves.
+    const MunkHtmlLineBoxArray& GetLines() const { return m_Lines; }
+    // The line at y, relative to the container; NULL if there is
+    // none, or no lines.
+    const MunkHtmlLineBox *FindLine(int y) const;
 
     // insert cell at the end of m_Cells list
     void InsertCell(MunkHtmlCell *cell);
@@ -1096,6 +1920,23 @@ public:
     // sets minimal height of this container.
     void SetMinHeight(int h, int align = MunkHTML_ALIGN_TOP) {	m_MinHeight = h; m_MinHeightAlign = align; m_LastLayout = -1;  }
 
+    // Makes the next Layout() recompute this container even if the
+    // width has not changed, e.g., because cells were added below it.
+    void InvalidateLayout() { m_LastLayout = -1; }
+
+    // The top container owns the text of all the words below it.
+    void AdoptTextPool(MunkHtmlTextPool *pPool) { delete m_pTextPool; m_pTextPool = pPool; }
+
+    // ... and the links of all the cells below it.
+    void AdoptLinkTable(MunkHtmlLinkTable *pLinkTable);
+
+    // ... and the memory of all the cells below it, which is freed
+    // after they have been deleted.
+    void AdoptCellArena(MunkHtmlCellArena *pArena);
+
+    // ... and the styles of all the text below it.
+    void AdoptTextStyleTable(MunkHtmlTextStyleTable *pTable);
+
 
     // Gets minimal height of this container
     int GetMinHeight() const { return m_MinHeight; };
@@ -1103,6 +1944,8 @@ public:
 
     void SetBackgroundColour(const wxColour& clr);
     void SetBackgroundImage(const wxBitmap& bmpBg) { m_bmpBg = bmpBg; }
+    // Off the GUI thread, the bitmap is only made when first drawn.
+    void SetBackgroundImage(const wxImage& imgBg);
     void SetBackgroundRepeat(int background_repeat) { m_nBackgroundRepeat = background_repeat; };
 
     // returns background colour (of wxNullColour if none set), so that widgets can
@@ -1112,7 +1955,9 @@ public:
     virtual const MunkHtmlCell* Find(int condition, const void* param) const;
 
     void SetDirection(const MunkHtmlTag& tag);
-    void SetMarginsAndPaddingAndTextIndent(const std::string& tag, const MunkHtmlTag& munkTag, wxString& css_style, int CurrentCharHeight);
+    MunkHtmlDirection GetDirection() const { return m_direction; }
+    // If pCssStyle is not NULL, the CSS equivalent is appended to it.
+    void SetMarginsAndPaddingAndTextIndent(const std::string& tag, const MunkHtmlTag& munkTag, wxString *pCssStyle, int CurrentCharHeight);
 
 
 #if WXWIN_COMPATIBILITY_2_6
@@ -1163,6 +2008,16 @@ protected:
     void UpdateRenderingStatePost(MunkHtmlRenderingInfo& info,
                                   MunkHtmlCell *cell) const;
 
+    // The index of the first line which ends below y, or
+    // m_Lines.size() if there is none.
+    size_t FindLineBelow(int y) const;
+
+    // Lays out the marked cells again, and moves the lines below
+    // them.  Returns false, perhaps half way, if that does not do,
+    // e.g. because a cell changed its width; then all of Layout()
+    // must be done.
+    bool RelayoutDirtyLines();
+
 protected:
     int m_IndentLeft, m_IndentRight, m_IndentTop, m_IndentBottom;
 
@@ -1211,6 +2066,24 @@ protected:
 
     wxBitmap *m_pBgImg; // Background image
 
+    MunkHtmlTextPool *m_pTextPool; // Only set on the top container
+    MunkHtmlLinkTable *m_pLinkTable; // Only set on the top container
+    MunkHtmlCellArena *m_pCellArena; // Only set on the top container
+    MunkHtmlTextStyleTable *m_pTextStyleTable; // Only set on the top container
+
+    // background image, may be invalid
+    wxBitmap m_bmpBg;
+    // Not Ok() unless m_bmpBg is still to be made from it
+    wxImage m_imgBg;
+
+    // background image repeat (see enum with
+    // MunkHTML_BACKGROUND_REPEAT_... enum constants)
+    int m_nBackgroundRepeat;
+
+    MunkHtmlLineBoxArray m_Lines; // See GetLines()
+    int m_ChildLayoutWidth; // What the cells were last laid out at
+    bool m_bHasPagebreakCell; // Until Layout() knows, true
+
     DECLARE_ABSTRACT_CLASS(MunkHtmlContainerCell)
     DECLARE_NO_COPY_CLASS(MunkHtmlContainerCell)
 };
@@ -1267,6 +2140,8 @@ class MunkHtmlLineBreakCell : public MunkHtmlCell
         MunkHtmlLineBreakCell(long CurrentCharHeight, MunkHtmlCell *pPreviousCell);
         virtual ~MunkHtmlLineBreakCell();
         virtual void Layout(int w);
+	// Height is that of a space
+	virtual void SetTextExtent(wxCoord Width, wxCoord Height, wxCoord Descent);
 	virtual bool ForceLineBreak(void) { return true; };
 
 	virtual bool IsTerminalCell() const { return true; }
@@ -1290,6 +2165,7 @@ public:
                       MunkHtmlRenderingInfo& info);
     virtual void DrawInvisible(wxDC& dc, int x, int y,
                                MunkHtmlRenderingInfo& info);
+    virtual bool NeedsDrawInvisible() const { return true; }
 
 protected:
     wxColour m_Colour;
@@ -1316,6 +2192,7 @@ public:
                       MunkHtmlRenderingInfo& info);
     virtual void DrawInvisible(wxDC& dc, int x, int y,
                                MunkHtmlRenderingInfo& info);
+    virtual bool NeedsDrawInvisible() const { return true; }
 
 protected:
     wxFont m_Font;
@@ -1344,12 +2221,17 @@ public:
     // if w != 0 then the m_Wnd has 'floating' width - it adjust
     // it's width according to parent container's width
     // (w is percent of parent's width)
+    // wnd may be NULL while parsing off the GUI thread; see
+    // MunkHtmlFormElement::realizeCell().
     MunkHtmlWidgetCell(wxWindow *wnd, int w = 0);
-    virtual ~MunkHtmlWidgetCell() { m_Wnd->Destroy(); };
+    virtual ~MunkHtmlWidgetCell() { if (m_Wnd) m_Wnd->Destroy(); };
+    wxWindow *GetWindow() const { return m_Wnd; }
+    void SetWindow(wxWindow *wnd);
     virtual void Draw(wxDC& dc, int x, int y, int view_y1, int view_y2,
                       MunkHtmlRenderingInfo& info);
     virtual void DrawInvisible(wxDC& dc, int x, int y,
                                MunkHtmlRenderingInfo& info);
+    virtual bool NeedsDrawInvisible() const { return true; }
     virtual void Layout(int w);
 protected:
     wxWindow* m_Wnd;
@@ -1399,6 +2281,36 @@ private:
 };
 
 
+// ----------------------------------------------------------------------------
+// MunkHtmlLinkTable
+//                  The links of one document.  Each distinct href and
+//                  target is stored once, and all the cells which link
+//                  to it point at the same MunkHtmlLinkInfo, so that
+//                  an anchor of many words is one link when hovering
+//                  over it or clicking on it.  The table belongs to
+//                  the top container of the document.
+// ----------------------------------------------------------------------------
+
+class MunkHtmlLinkTable
+{
+public:
+    MunkHtmlLinkTable() {}
+    ~MunkHtmlLinkTable();
+
+    // Returns the link in the table with the href and target of
+    // link, adding it if need be, or NULL if the href is empty.
+    MunkHtmlLinkInfo *Intern(const MunkHtmlLinkInfo& link);
+
+    size_t GetCount() const { return m_Links.size(); }
+
+private:
+    typedef std::map<std::pair<wxString, wxString>, MunkHtmlLinkInfo*> LinkMap;
+    LinkMap m_Links;
+
+    DECLARE_NO_COPY_CLASS(MunkHtmlLinkTable)
+};
+
+
 
 // ----------------------------------------------------------------------------
 // MunkHtmlTerminalCellsIterator
@@ -1775,12 +2687,18 @@ class MunkHtmlFormElement {
 	int m_xMaxLength;
 	bool m_bSubmitOnSelect;
 	std::string m_name;
+
+	wxWindow *createWidget(MunkHtmlWindow *pParent);
  public:
 	MunkHtmlFormElement(form_id_t form_id, eMunkHtmlFormElementKind kind, int xSize, int xMaxLength, const std::string& name);
 	~MunkHtmlFormElement();
 	std::string getValue(); // Get selected value
 	void addValueLabelPair(const std::string& value, const std::string& label, bool bSelected = false);
+	// If pParent is 0, because we are not on the GUI thread, the
+	// cell is returned without its widget, which realizeWidget()
+	// must then make.
 	MunkHtmlWidgetCell *realizeCell(MunkHtmlWindow *pParent);
+	void realizeWidget(MunkHtmlWindow *pParent);
 	void setDisabled(bool bDisabled) { m_bDisabled = bDisabled; };
 
 	void setSubmitOnSelect(bool bSubmitOnSelect) { m_bSubmitOnSelect = bSubmitOnSelect; };
@@ -1812,16 +2730,26 @@ class MunkHtmlForm {
 class MunkHtmlFormContainer {
  private:
 	std::map<form_id_t, MunkHtmlForm*> m_forms;
+	// In document order, so that the tab order of the widgets
+	// is the same as if they had been made while parsing.
+	std::list<MunkHtmlFormElement*> m_unrealized_elements;
  public:
 	MunkHtmlFormContainer();
 	~MunkHtmlFormContainer();
 	void addForm(form_id_t new_form_id, const std::string& method, const std::string& action);
 	MunkHtmlForm *getForm(form_id_t form_id);
 	std::list<MunkHtmlForm*> getFormList();
+
+	// For elements whose realizeCell() had no parent window
+	void addUnrealizedElement(MunkHtmlFormElement *pElement) { m_unrealized_elements.push_back(pElement); };
+	void realizeWidgets(MunkHtmlWindow *pParent);
 };
 
 
 class MunkHtmlParsingStructure; // Forward declaration
+class MunkHtmlBodyState; // Forward declaration
+class MunkHtmlCustomTagHandler; // Forward declaration
+class MunkHtmlAsyncPage; // Forward declaration
 
 
 
@@ -1880,20 +2808,97 @@ public:
     // Return value : false if an error occurred, true otherwise
     virtual bool SetPage(const wxString& source, std::string& error_message);
 
+    // Same as above, but source is given as UTF-8 bytes, which are
+    // copied once and then parsed in place.  LoadPage() calls this
+    // one with the bytes it loaded (which are not copied again).
+    virtual bool SetPage(const char *pUTF8, size_t nLength, std::string& error_message);
+
     // Load HTML page from given location. Location can be either
     // a) /usr/wxGTK2/docs/html/wx.htm
     // b) http://www.somewhere.uk/document.htm
     // c) ftp://ftp.somesite.cz/pub/something.htm
     // In case there is no prefix (http:,ftp:), the method
     // will try to find it itself (1. local file, then http or ftp)
-    // After the page is loaded, the method calls SetPage() to display it.
+    // After the page is loaded, the method calls SetPage() to display it
+    // (the UTF-8 overload, in Unicode builds).
     // Note : you can also use path relative to previously loaded page
+    // Local files are mapped into memory rather than read.  If the
+    // file has shrunk when the page is parsed again (say, on a
+    // change of magnification), it is read again instead; but it
+    // must not be truncated while a parse is running.
     // Return value : same as SetPage
     virtual bool LoadPage(const wxString& location, std::string& error_message);
 
     // Loads HTML page from file
     bool LoadFile(const wxFileName& filename, std::string& error_message);
 
+    // Loads a page compiled from HTML source with SaveCompiledPage()
+    // (or MunkQDEventRecorder::compile()).  This skips parsing
+    // altogether, so it is much faster than loading the source.
+    // The file is mapped rather than read, where possible.  Whether
+    // the source has changed since is not checked; use the overload
+    // below for that, or see to it yourself.
+    bool LoadCompiledPage(const wxString& filename, std::string& error_message);
+
+    // Same as above, but only if the compiled page was compiled from
+    // what sourceFilename holds now (by the source hash in its
+    // header).  Otherwise, sourceFilename is loaded as by LoadFile(),
+    // and the caller may want to SaveCompiledPage() again.
+    bool LoadCompiledPage(const wxString& filename, const wxString& sourceFilename, std::string& error_message);
+
+    // Compiles the source of the current page and writes it to
+    // filename.
+    bool SaveCompiledPage(const wxString& filename, std::string& error_message);
+
+    // Show a page while it is still arriving: Call BeginPage(), then
+    // FeedChunk() with consecutive chunks of the (UTF-8) source as they
+    // come in, then EndPage().  What has been parsed so far is laid out
+    // and painted every MunkHTML_PUSH_REPAINT_INTERVAL ms.  If
+    // FeedChunk() or EndPage() fails, the page is abandoned.
+    bool BeginPage(std::string& error_message);
+    bool FeedChunk(const char *pUTF8, size_t nLength, std::string& error_message);
+    bool EndPage(std::string& error_message);
+    void AbortPage();
+    bool IsFeedingPage() const { return m_pPushDC != NULL; }
+
+    // Like SetPage() and LoadPage(), but the page is parsed into
+    // cells on a worker thread, without a DC, and the GUI thread only
+    // measures and lays out the cells, and makes the form widgets,
+    // once that is done.  (With custom tags registered, the thread
+    // only tokenizes the page, and the GUI thread builds the cells.)
+    // Then a
+    // MunkEVT_COMMAND_HTML_PAGE_LOADED event is sent, whose Int is 1
+    // on success, and whose String holds the error message if not.
+    // The old page stays until then.  Loading another page in any
+    // way cancels the request, and no event is sent for it.  A
+    // false return means the request failed before it was made, in
+    // which case there is no event either.  An anchor on the
+    // current page is scrolled to at once, as by LoadPage().
+    bool SetPageAsync(const wxString& source, std::string& error_message);
+    bool LoadPageAsync(const wxString& location, std::string& error_message);
+    void CancelAsyncPage();
+    bool IsLoadingPageAsync() const { return m_pAsyncPage != NULL; }
+
+    // Handle tags which MunkHtmlWindow does not know about.  The
+    // window does not own pHandler; registering 0 unregisters the tag.
+    void RegisterCustomTag(const std::string& tag, MunkHtmlCustomTagHandler *pHandler);
+
+    // If on, documents of at least MunkHTML_PARALLEL_PARSE_MIN_SIZE
+    // bytes are cut between the children of <body>, and the pieces
+    // are tokenized on one thread per CPU.  The cells are still
+    // built on the calling thread.  Off by default.
+    void SetParallelParsing(bool bParallel);
+
+    // If on (the default), the block tags of a page and their
+    // styles are kept among its cells, so that SelectionToHtml()
+    // can re-create them.  Turning it off makes parsing cheaper; the
+    // tags are then re-created on demand by parsing m_PageSource
+    // again, or left out if the page cannot be parsed again (it was
+    // fed with FeedChunk(), or it has forms).  Takes effect with the
+    // next page.
+    void SetCaptureMiniDOM(bool bCapture);
+    bool GetCaptureMiniDOM() const;
+
     // Returns full location of opened page
     wxString GetOpenedPage() const {return m_OpenedPage;}
     // Returns anchor within opened page
@@ -1992,6 +2997,14 @@ protected:
     // actual size of window. This method also setup scrollbars
     void CreateLayout();
 
+ public:
+    // To be called after changing the size of cell, or of what is
+    // in it, e.g. resizing the window of a widget cell.  Only the
+    // containers above cell are laid out again, and the page is
+    // refreshed, without scrolling it.
+    void InvalidateCellLayout(MunkHtmlCell *cell);
+ protected:
+
     void PaintBackground(wxDC& dc);
     void OnEraseBackground(wxEraseEvent& event);
     void OnPaint(wxPaintEvent& event);
@@ -2057,6 +3070,7 @@ protected:
 
     wxString DoSelectionToText(MunkHtmlSelection *sel);
     wxString DoSelectionToHtml(MunkHtmlSelection *sel);
+    bool RecreateSelectionToHtml(MunkHtmlSelection *sel, wxString& html);
  
 #endif // wxUSE_CLIPBOARD
 
@@ -2091,10 +3105,45 @@ public:
     // implementation of SetPage()
     bool DoSetPage(const wxString& source, std::string& error_message);
 
-    wxString GetPageSource(void) const { return m_strPageSource; };
+    // Parses and displays whatever is in m_PageSource
+    bool DoSetPage(std::string& error_message);
+
+    // Sets the borders and background which the <body> of the
+    // page that was just parsed asked for.
+    void ApplyBodyState(const MunkHtmlBodyState& state);
+
+    // Empty if the current page was loaded with LoadCompiledPage().
+    wxString GetPageSource(void) const { return m_bPageSourceIsCompiled ? wxString() : m_PageSource.ToString(); };
 
  protected:
-    wxString m_strPageSource; // The source of the current page.
+    MunkHtmlPageBuffer m_PageSource; // The source of the current page, as UTF-8.
+    bool m_bPageSourceIsCompiled; // If true, m_PageSource holds a compiled page.
+    bool m_bPageHasMiniDOM; // See SetCaptureMiniDOM()
+
+    // Creates the DC used for measuring text while parsing
+    wxDC *CreateParsingDC();
+
+    // Lays out and paints what has been fed so far
+    void ShowPartialPage();
+
+    // Adds m_OpenedPage to the history, unless it is already the
+    // current item.
+    void AddCurrentPageToHistory();
+
+    // Makes pPage the current async request, and starts tokenizing it
+    bool StartAsyncPage(MunkHtmlAsyncPage *pPage, std::string& error_message);
+    void OnAsyncPageTokenized(wxCommandEvent& event);
+
+    MunkHtmlAsyncPage *m_pAsyncPage; // The current async request, if any
+    // While DoSetPage() shows an async page: The page, tokenized,
+    // which is replayed instead of parsing m_PageSource.
+    const std::string *m_pAsyncCompiled;
+    // Or, if the thread has parsed the page: the parsing structure
+    // holding its cells, which only need their metrics resolved.
+    MunkHtmlParsingStructure *m_pAsyncBuilt;
+
+    wxDC *m_pPushDC; // Only non-NULL between BeginPage() and EndPage()
+    wxStopWatch m_PushRepaintStopWatch;
 
     MunkHtmlParsingStructure *m_pParsingStructure;
 	
@@ -2192,6 +3241,7 @@ BEGIN_DECLARE_EVENT_TYPES()
     DECLARE_EVENT_TYPE(MunkEVT_COMMAND_HTML_CELL_HOVER, 1001)
     DECLARE_EVENT_TYPE(MunkEVT_COMMAND_HTML_LINK_CLICKED, 1002)
     DECLARE_EVENT_TYPE(MunkEVT_COMMAND_HTML_FORM_SUBMITTED, 1003)
+    DECLARE_EVENT_TYPE(MunkEVT_COMMAND_HTML_PAGE_LOADED, 1004)
 END_DECLARE_EVENT_TYPES()
 
 
@@ -2285,6 +3335,12 @@ typedef void (wxEvtHandler::*MunkHtmlLinkEventFunction)(MunkHtmlLinkEvent&);
         (wxObjectEventFunction)(wxEventFunction) wxStaticCastEvent( wxCommandEventFunction, &fn ), \
         (wxObject *) NULL \
     ),
+#define MUNK_EVT_HTML_PAGE_LOADED(id, fn) \
+    DECLARE_EVENT_TABLE_ENTRY( \
+        MunkEVT_COMMAND_HTML_PAGE_LOADED, id, wxID_ANY, \
+        (wxObjectEventFunction)(wxEventFunction) wxStaticCastEvent( wxCommandEventFunction, &fn ), \
+        (wxObject *) NULL \
+    ),
 
 
 
@@ -2397,6 +3453,152 @@ private:
 
 
 
+//////////////////////////////////////////////////////////
+//
+// Tag IDs and custom tags
+//
+//////////////////////////////////////////////////////////
+
+// The tags which MunkQDHTMLHandler handles itself.
+enum eMunkHtmlTagID {
+	kTagUnknown, // Not built in (but may be a custom tag)
+	kTagA,
+	kTagP,
+	kTagPre,
+	kTagH1,
+	kTagH2,
+	kTagH3,
+	kTagCenter,
+	kTagBr,
+	kTagForm,
+	kTagInput,
+	kTagOption,
+	kTagSelect,
+	kTagRadiobox,
+	kTagDiv,
+	kTagB,
+	kTagEm,
+	kTagNegspace,
+	kTagI,
+	kTagU,
+	kTagSc,
+	kTagSup,
+	kTagSub,
+	kTagImg,
+	kTagFont,
+	kTagHr,
+	kTagPagebreak,
+	kTagTbody,
+	kTagTable,
+	kTagTr,
+	kTagTd,
+	kTagTh,
+	kTagDl,
+	kTagDt,
+	kTagDd,
+	kTagLi,
+	kTagUl,
+	kTagOl,
+	kTagHtml,
+	kTagHead,
+	kTagTitle,
+	kTagMeta,
+	kTagBody
+};
+
+// Maps a (lower-case) tag name to its ID with a perfect hash, so
+// unknown tags cost one table probe and one string compare.
+extern eMunkHtmlTagID munk_html_tag_id(const std::string& tag);
+
+
+// Applications can handle tags of their own by deriving from this,
+// and registering an instance with
+// MunkHtmlWindow::RegisterCustomTag().  Only tags which are not
+// built in are passed to custom handlers.
+class MunkHtmlCustomTagHandler {
+ public:
+	MunkHtmlCustomTagHandler() {};
+	virtual ~MunkHtmlCustomTagHandler() {};
+
+	// Use pHandler->GetContainer(), pHandler->AddCell() etc. to
+	// build cells.
+	virtual void StartTag(MunkQDHTMLHandler *pHandler, const std::string& tag, const MunkAttributeMap& attrs) = 0;
+	virtual void EndTag(MunkQDHTMLHandler *pHandler, const std::string& tag) {};
+};
+
+typedef std::map<std::string, MunkHtmlCustomTagHandler*> String2PCustomTagHandlerMap;
+
+
+
+// Text which is still to be measured, with the cells that are to be
+// given its size.  MunkQDHTMLHandler adds to it as it builds the
+// cells, and MunkHtmlParsingStructure::ResolveMetrics() measures it
+// all before layout, one font at a time, so that the font of the DC
+// changes once per font rather than at every change of font in the
+// text.
+class MunkHtmlPendingMetrics {
+public:
+	MunkHtmlPendingMetrics();
+	~MunkHtmlPendingMetrics();
+
+	// pUTF8 must live until Resolve().  pCell is given the size of
+	// the text through SetTextExtent(), or, if bTrailingSpace, its
+	// trailing space is given the width of the text.
+	void Add(MunkFontKey font_key, const wxFont& font, MunkHtmlCell *pCell, const char *pUTF8, size_t nLength, bool bTrailingSpace = false);
+
+	bool IsEmpty() const { return m_Groups.empty(); }
+
+	// Changes the font of pDC.
+	void Resolve(wxDC *pDC, int nMagnification);
+
+	// Forgets the cells, e.g., when they are deleted unmeasured.
+	void Clear();
+
+private:
+	class Item {
+	public:
+		Item(MunkHtmlCell *pCell, const char *pUTF8, size_t nLength, bool bTrailingSpace)
+			: m_pCell(pCell), m_pUTF8(pUTF8), m_nLength(nLength), m_bTrailingSpace(bTrailingSpace) {};
+		MunkHtmlCell *m_pCell;
+		const char *m_pUTF8;
+		size_t m_nLength;
+		bool m_bTrailingSpace;
+	};
+	class Group {
+	public:
+		wxFont m_Font;
+		std::vector<Item> m_Items;
+	};
+	typedef std::map<MunkFontKey, Group> FontKey2GroupMap;
+	FontKey2GroupMap m_Groups;
+
+	DECLARE_NO_COPY_CLASS(MunkHtmlPendingMetrics)
+};
+
+
+// What the <body> tag of a page asks of the window showing it.  The
+// handler only records it here, and the window applies it after the
+// parse (see MunkHtmlWindow::ApplyBodyState()), so that parsing a page
+// for some other purpose leaves the window alone.
+class MunkHtmlBodyState {
+ public:
+	MunkHtmlBodyState() { Clear(); };
+	void Clear() {
+		m_bSeen = false;
+		m_nBorders = 0;
+		m_BackgroundImage = wxNullImage;
+		m_nBackgroundRepeat = MunkHTML_BACKGROUND_REPEAT_REPEAT;
+		m_BackgroundColour = wxNullColour;
+	};
+
+	bool m_bSeen; // false until <body> has been seen; the rest is unset until then
+	int m_nBorders;
+	wxImage m_BackgroundImage; // Not Ok() if there is none
+	int m_nBackgroundRepeat;
+	wxColour m_BackgroundColour;
+};
+
+
 class MunkHtmlParsingStructure {
  public:
 	MunkHtmlParsingStructure(MunkHtmlWindow *pParent);
@@ -2409,13 +3611,41 @@ class MunkHtmlParsingStructure {
 	virtual wxFileSystem *GetFS() { return m_pFS; };
 	virtual void SetFS(wxFileSystem *pFS) { m_pFS = pFS; };
 
-	// We do not own the DC
+	// We do not own the DC.  It may be NULL, if
+	// PrepareDeferredMetrics() has been called; see below.
 	virtual wxDC *GetDC(void) { return m_pDC; };
-	virtual void SetDC(wxDC *pDC, double pixel_scale) { m_pDC = pDC; m_dblPixel_scale = pixel_scale; };
+	virtual void SetDC(wxDC *pDC, double pixel_scale);
+
+	// Sets the font of the DC, unless it already has it.
+	void SetDCFont(const wxFont& font, MunkFontKey font_key);
+
+	// The cells can be built without a DC: Call
+	// PrepareDeferredMetrics(), which measures with pDC the little
+	// that cannot wait, then SetDC() with a NULL DC, and parse.
+	// The text is then only measured by ResolveMetrics(), which must
+	// be called, with a DC of the kind that will draw the cells,
+	// before they are laid out.  With a DC, the parse calls
+	// ResolveMetrics() itself, and ShowPartialPage() does so while
+	// push parsing.
+	//
+	// Such a parse may run off the GUI thread.  It then makes no
+	// bitmaps (the cells make them when first drawn) and no form
+	// widgets (MunkHtmlFormContainer::realizeWidgets() makes them),
+	// and it leaves the window alone (see MunkHtmlBodyState).
+	// PrepareDeferredMetrics() and ResolveMetrics() must still be
+	// called on the GUI thread.
+	void PrepareDeferredMetrics(wxDC *pDC);
+	void GetDeferredCharSize(int *pCharWidth, int *pCharHeight) const;
+	MunkHtmlPendingMetrics *GetPendingMetrics() { return &m_PendingMetrics; };
+	void ResolveMetrics(wxDC *pDC);
 
 	virtual void SetHTMLBackgroundColour(const wxColour& bgcol);
 	virtual wxColour GetHTMLBackgroundColour() const;
 
+	// Cleared at the start of each parse
+	MunkHtmlBodyState& GetBodyState() { return m_BodyState; };
+	const MunkHtmlBodyState& GetBodyState() const { return m_BodyState; };
+
 	double GetImagePixelScale(void) const { return m_dblPixel_scale; };
 	double GetPixelScale(void) const { return 1.0; };
 
@@ -2424,19 +3654,61 @@ class MunkHtmlParsingStructure {
 	virtual MunkHtmlContainerCell* GetInternalRepresentation() const { return m_Cell; }
 	virtual void SetTopCell(MunkHtmlContainerCell *pCell) { m_Cell = pCell; };
 
+	// Converts the text to UTF-8 and calls the overload below.
 	virtual bool Parse(const wxString& text, int nMagnification, std::string& error_message);
 
+	// Parses the UTF-8 bytes in place; they are not copied.  Every
+	// page the window parses from source comes through here, so
+	// this is the overload to override.
+	virtual bool Parse(const char *pUTF8, size_t nLength, int nMagnification, std::string& error_message);
+
+	// Replays a page compiled by MunkQDEventRecorder, instead of
+	// parsing the source.
+	virtual bool ParseCompiled(const char *pData, size_t nLength, int nMagnification, std::string& error_message);
+
+	void SetParallelParsing(bool bParallel) { m_bParallelParsing = bParallel; };
+	bool GetParallelParsing() const { return m_bParallelParsing; };
+
+	// See MunkHtmlWindow::SetCaptureMiniDOM().
+	void SetCaptureMiniDOM(bool bCapture) { m_bCaptureMiniDOM = bCapture; };
+	bool GetCaptureMiniDOM() const { return m_bCaptureMiniDOM; };
+
+	// Push parsing: BeginParse(), then ParseChunk() any number of
+	// times, then EndParse().  If ParseChunk() or EndParse() returns
+	// false, the caller must call AbortParse().
+	virtual bool BeginParse(int nMagnification, std::string& error_message);
+	virtual bool ParseChunk(const char *pUTF8, size_t nLength, std::string& error_message);
+	virtual bool EndParse(std::string& error_message);
+
+	// Stops a push parse.  Returns the top of the partially built
+	// cell tree, which the caller must delete (unless it is 0).
+	virtual MunkHtmlContainerCell *AbortParse();
+	bool IsPushParsing() const { return m_pPushParser != 0; };
+
+	// While push parsing: the top of the cell tree built so far,
+	// whether it may be laid out now (i.e., we are not inside a
+	// table or list which is still growing), and a way to mark the
+	// containers which are still open as needing layout again.
+	MunkHtmlContainerCell *GetPartialRepresentation() const;
+	bool CanLayoutPartialRepresentation() const;
+	void InvalidateOpenContainers();
+
 	virtual void clear();
 
-	String2PFontMap m_HTML_font_map;
-	String2MunkFontStringMetrics m_FontSpaceCache; // Font characteristic string to MunkFontStringMetrics, currently only used for the string wxT(" ")
-	CharacteristicString2MunkStringMetricsCacheMap m_MunkStringMetricsCacheCache;
-	MunkStringMetricsCache *getMunkStringMetricsCache(const std::string& font_characteristic_string);
+	// We do not own the handlers.  Registering 0 unregisters the tag.
+	void RegisterCustomTag(const std::string& tag, MunkHtmlCustomTagHandler *pHandler);
+	MunkHtmlCustomTagHandler *GetCustomTagHandler(const std::string& tag) const;
+	bool HasCustomTagHandlers() const { return !m_custom_tag_handlers.empty(); };
+
+	FontKey2PFontMap m_HTML_font_map;
+	FontKey2MunkFontStringMetrics m_FontSpaceCache; // Font key to MunkFontStringMetrics, currently only used for the string wxT(" ")
+	FontKey2MunkStringMetricsCacheMap m_MunkStringMetricsCacheCache;
+	MunkStringMetricsCache *getMunkStringMetricsCache(MunkFontKey font_key);
 protected:
 	void clearMunkStringMetricsCacheCache();	
 public:
 
-	virtual wxFont *getFontFromMunkHTMLFontAttributes(const MunkHTMLFontAttributes& font_attributes, bool bUseCacheMap, const std::string& characteristic_string);
+	virtual wxFont *getFontFromMunkHTMLFontAttributes(const MunkHTMLFontAttributes& font_attributes, bool bUseCacheMap, MunkFontKey font_key);
 
  protected:
 	// This is pointer to the first cell in parsed data.  (Note: the first cell
@@ -2447,16 +3719,41 @@ public:
 	MunkHtmlFormContainer *TakeOverForms();
 	MunkHtmlFormContainer *m_pForms;
 	MunkHtmlWindow *GetParentMunkHtmlWindow() { return m_pParentMunkHtmlWindow; };
+
+	// The parent of form widgets; NULL while parsing off the GUI
+	// thread, where widgets cannot be made.
+	MunkHtmlWindow *GetWidgetParent();
  protected:
 	
 	
 	// class for opening files (file system)
 	wxFileSystem* m_pFS;
 	wxDC *m_pDC;
+	MunkFontKey m_DCFontKey; // The font last set on m_pDC
+	MunkHtmlPendingMetrics m_PendingMetrics;
+	MunkHtmlBodyState m_BodyState;
+	int m_nDeferredCharWidth; // 0 until PrepareDeferredMetrics()
+	int m_nDeferredCharHeight;
 	wxColour m_backgroundColour;
 	double m_dblPixel_scale;
 	MunkHtmlWindow *m_pParentMunkHtmlWindow;
 	int m_nMagnification;
+
+	// Only non-0 while push parsing
+	MunkQDHTMLHandler *m_pPushHandler;
+	MunkQDParser *m_pPushParser;
+
+	String2PCustomTagHandlerMap m_custom_tag_handlers;
+
+	bool m_bParallelParsing;
+	bool m_bCaptureMiniDOM;
+#if wxUSE_THREADS
+	// Tokenizes the segments of the document in parallel, then
+	// feeds the events to pDH in order.  Returns false, without
+	// having fed pDH anything, if the document could not be split,
+	// or if a segment did not tokenize cleanly.
+	bool ParseInParallel(MunkQDHTMLHandler *pDH, const char *pUTF8, size_t nLength);
+#endif
 };
 
 
@@ -2474,13 +3771,6 @@ enum eAnchorType {
 
 
 class MunkQDHTMLHandler : public MunkQDDocHandler {
-	static wxRegEx m_regex_space_newline_space;
-	static wxRegEx m_regex_space;
-	static wxRegEx m_regex_linefeed;
-	static wxRegEx m_regex_tab;
-	static wxRegEx m_regex_space_spaces;
-
-
 	MunkHtmlParsingStructure *m_pCanvas;
 	form_id_t m_cur_form_id;
 	std::string m_cur_form_select_name;
@@ -2497,6 +3787,9 @@ class MunkQDHTMLHandler : public MunkQDDocHandler {
 	// true if top of m_link_info_stack is not empty
 	typedef std::stack<MunkHtmlLinkInfo> LinkInfoStack;
 	LinkInfoStack m_link_info_stack;
+	// The top of m_link_info_stack, interned, if m_UseLink
+	MunkHtmlLinkInfo *m_pCurrentLink;
+	MunkHtmlLinkTable *m_pLinkTable; // Owned by the top container
 	typedef std::stack<eAnchorType> AnchorTypeStack;
 	AnchorTypeStack m_anchor_type_stack;
 	typedef std::stack<bool> SmallCapsStack;
@@ -2506,12 +3799,37 @@ class MunkQDHTMLHandler : public MunkQDDocHandler {
 	bool m_tmpLastWasSpace;
 	wxChar *m_tmpStrBuf;
 	size_t  m_tmpStrBufSize;
+	std::string m_tmpNormalizedText;
+	MunkTextTokenVector m_tmpTextTokens;
+	MunkHtmlTextPool *m_pTextPool; // Owned by the top container
+	MunkHtmlCellArena *m_pCellArena; // Owned by the top container
+	MunkHtmlTextStyleTable *m_pTextStyleTable; // Owned by the top container
+	bool m_bCaptureMiniDOM;
+	// The style of the text that follows; m_pCurrentTextStyle is
+	// NULL when it has changed since it was last interned.
+	wxFont m_CurrentTextFont;
+	MunkFontKey m_CurrentTextFontKey;
+	bool m_bCurrentTextUnderline;
+	wxColour m_CurrentTextFgColour;
+	wxColour m_CurrentTextBgColour;
+	const MunkHtmlTextStyle *m_pCurrentTextStyle;
+	// The last cell of the most recently closed <sup> or <sub>,
+	// if any.  The cell keeps the baseline of the run, so a
+	// script run starting right after it must not build on it.
+	MunkHtmlCell *m_pScriptRunEnd;
         // temporary variables used by AddText
 	MunkHtmlWordCell *m_lastWordCell;
-	std::string m_CurrentFontCharacteristicString;
+	MunkFontKey m_CurrentFontKey;
 	wxCoord m_CurrentFontSpaceWidth;
 	wxCoord m_CurrentFontSpaceHeight;
 	wxCoord m_CurrentFontSpaceDescent;
+	// true if there is no DC to measure the space with, in which
+	// case m_CurrentFontSpace{Width,Height,Descent} are 0, and the
+	// cells which use them are measured later (see MeasureSpace()).
+	bool m_bCurrentFontSpacePending;
+	// The words, and the spaces if m_pDC is NULL, which are still
+	// to be measured.  Owned by the canvas.
+	MunkHtmlPendingMetrics *m_pPendingMetrics;
 
 	// Table stuff
 	typedef std::stack<MunkHtmlTableCell*> TableCellStack;
@@ -2541,17 +3859,34 @@ class MunkQDHTMLHandler : public MunkQDDocHandler {
 	virtual void startDocument(void);
 	virtual void endDocument(void);
 	virtual void text(const std::string& str);
+
+	// For MunkHtmlCustomTagHandler
+	MunkHtmlContainerCell *GetContainer() const { return m_pCurrentContainer; };
+	MunkHtmlContainerCell *OpenContainer();
+	MunkHtmlContainerCell *CloseContainer();
+	void AddCell(MunkHtmlCell *pCell);
+	MunkHtmlParsingStructure *GetParsingStructure() { return m_pCanvas; };
+	// NULL if the text is measured later (see
+	// MunkHtmlParsingStructure::PrepareDeferredMetrics()).
+	wxDC *GetDC() { return m_pDC; };
+
+	// For showing a page while it is being push parsed
+	MunkHtmlContainerCell *GetTopContainer() const;
+	bool IsInsideGrowingTableOrList() const { return !m_tables_stack.empty() || !m_list_cell_stack.empty(); };
+	void InvalidateOpenContainers();
+
+	// The font of text outside any tag
+	static MunkHTMLFontAttributes GetDefaultFontAttributes();
  protected:
 	void pushFontAttrs(const std::string& tag, const MunkAttributeMap& attrs);
 	void popFontAttrs(const std::string& tag);
 	
-	MunkHtmlContainerCell *GetContainer() const { return m_pCurrentContainer; };
-	MunkHtmlContainerCell *OpenContainer();
-	MunkHtmlContainerCell *CloseContainer();
 	MunkHtmlContainerCell *SetContainer(MunkHtmlContainerCell *pNewContainer);
 	MunkHtmlWindowInterface *GetWindowInterface() { return (MunkHtmlWindowInterface*) m_pCanvas; };
 
-	void AddHtmlTagCell(MunkMiniDOMTag *pMiniDOMTag);
+	// Records a block tag in the MiniDOM, used when copying the
+	// selection as HTML.  Does nothing unless m_bCaptureMiniDOM.
+	void AddHtmlTagCell(const std::string& tag, eMunkMiniDOMTagKind kind, const wxString& css_style = wxEmptyString);
 
 	void handleChars(void);
 
@@ -2567,7 +3902,7 @@ class MunkQDHTMLHandler : public MunkQDDocHandler {
 
 	void SetBackgroundImageAndBackgroundRepeat(const std::string& tag, 
 						   const MunkAttributeMap& attrs,
-						   const MunkHtmlTag& munkTag, wxString& css_style,
+						   const MunkHtmlTag& munkTag, wxString *pCssStyle,
 						   MunkHtmlContainerCell *pContainer);
 	void SetBorders(const std::string& tag, 
 			const MunkAttributeMap& attrs,
@@ -2579,12 +3914,28 @@ class MunkQDHTMLHandler : public MunkQDDocHandler {
 	MunkHtmlLinkInfo PopLink();
 	void PushLink(const MunkHtmlLinkInfo& link);
 	
-	// applies current parser state (link, sub/supscript, ...) to given cell
+	// applies current parser state (link, sub/supscript, text
+	// style, ...) to given cell
 	void ApplyStateToCell(MunkHtmlCell *cell);
 
+	// Change the style of the text that follows.  These take the
+	// place of inserting MunkHtmlFontCell and MunkHtmlColourCell.
+	void SetCurrentTextFont(wxFont *pFont, bool bUnderline);
+	void SetCurrentTextColour(const wxColour& colour, int flags = MunkHTML_CLR_FOREGROUND);
+	const MunkHtmlTextStyle *GetCurrentTextStyle();
+
 	// creates font depending on m_font_attributes
 	virtual wxFont* CreateCurrentFont();
 
+	// Measures the word of pCell in the current text font, now if
+	// the measurements are cached, or else in
+	// MunkHtmlParsingStructure::ResolveMetrics().
+	void MeasureWordCell(MunkHtmlWordCell *pCell, const wxString& word);
+
+	// Has pCell, made with m_CurrentFontSpace{Width,Height,Descent},
+	// measured again later if they are not known yet.
+	void MeasureSpace(MunkHtmlCell *pCell, bool bTrailingSpace = false);
+
 	MunkHtmlScriptMode GetScriptMode() const;
 	long GetScriptBaseline() const;
 	bool GetFontUnderline(void) const;
@@ -2603,7 +3954,7 @@ class MunkQDHTMLHandler : public MunkQDDocHandler {
 	MunkHTMLFontAttributes startAnchorNAME(void);
 	MunkHTMLFontAttributes endTag(void);
 	MunkHTMLFontAttributes topFontAttributeStack(void);
-	wxFont *getFontFromMunkHTMLFontAttributes(const MunkHTMLFontAttributes& font_attributes, bool bUseCacheMap, const std::string& characteristic_string);
+	wxFont *getFontFromMunkHTMLFontAttributes(const MunkHTMLFontAttributes& font_attributes, bool bUseCacheMap, MunkFontKey font_key);
 	void startMunkHTMLFontAttributeStack(void);
 	void SetCharWidthHeight(void);
 	void ChangeMagnification(int magnification);
@@ -52,6 +52,8 @@ MunkHtmlDCRenderer::MunkHtmlDCRenderer() : wxObject()
     m_Parser = new MunkHtmlParsingStructure(NULL);
     m_Parser->SetHTMLBackgroundColour(*wxWHITE);
     m_Parser->SetFS(m_FS);
+    // Printed pages are never copied from
+    m_Parser->SetCaptureMiniDOM(false);
     SetStandardFonts(DEFAULT_PRINT_FONT_SIZE);
 }
 